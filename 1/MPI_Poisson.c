@@ -1,76 +1,403 @@
 /*
  * MPI_Poisson.c
  * 2D Poison equation solver
+ *
+ * Built with -fopenmp every rank runs OMP_NUM_THREADS threads over the
+ * rows of its subgrid (hybrid MPI+OpenMP, e.g. one rank per socket);
+ * only the master thread calls MPI (MPI_THREAD_FUNNELED).
+ *
+ * Built with -DLIBRARY there is no main(), see poisson.h: the caller
+ * initialises MPI, sets up once and then solves as often as it needs.
+ *
+ * Built with -DUSE_GPU and linked with poisson_gpu.cu, "backend: gpu"
+ * runs the CG on one CUDA device per rank, see Solve_GPU().
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include <time.h>
+#include <sys/mman.h>
 #include "mpi.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "poisson.h"
+#ifdef USE_GPU
+#include "poisson_gpu.h"
+#endif
 
 #define DEBUG 0
+#ifndef SOR		/* -DSOR builds the red-black SOR solver */
 #define CG 1
+#endif
 
 #define max(a,b) ((a)>(b)?a:b)
 
+#define MAX_LEVELS 32
+#define MAX_HALO_GRIDS 16
+#define MAX_PHASE_DEPTH 8
+#define ARENA_ALIGN 64		/* bytes, one cache line */
+#define ARENA_BLOCK (2 << 20)	/* bytes, one huge page, the smallest block */
+#define ROW_ALIGN ((int) (ARENA_ALIGN / sizeof(double)))
+#define OMEGA_WINDOW 10		/* adaptive omega: least iterations per estimate */
+#define OMEGA_F 0.75		/* adaptive omega: keep omega once lambda < (omega - 1)^F */
+#ifdef CG
+#define N_CKPT_GRIDS 3		/* phi, pCG, rCG */
+#else
+#define N_CKPT_GRIDS 1		/* phi */
+#endif
+
 enum
 {
   X_DIR, Y_DIR
 };
 
+enum
+{
+  KERNEL_PLAIN,		/* visit every point, test colour and source */
+  KERNEL_STRIDED,	/* active colour only, source mask, no branches */
+  KERNEL_FUSED		/* strided, both colours in one pass over the rows */
+};
+
+enum
+{
+  EXCHANGE_SENDRECV,	/* blocking MPI_Sendrecv per direction, MPI_Isend/Irecv when overlapped */
+  EXCHANGE_PERSISTENT,	/* persistent requests per grid, all directions at once */
+  EXCHANGE_NEIGHBOR	/* MPI_Ineighbor_alltoallw on the Cartesian grid_comm */
+};
+
+enum
+{
+  BACKEND_CPU,		/* the solvers of this file, OpenMP if built with it */
+  BACKEND_GPU		/* Solve_GPU(), CG built with -DUSE_GPU only */
+};
+
+enum
+{
+  OUTPUT_TEXT,		/* output<rank>.dat per process */
+  OUTPUT_BINARY		/* one output.bin, written with MPI-IO */
+};
+
+enum
+{
+  PHASE_SETUP,		/* settings, input, grids and datatypes */
+  PHASE_COMPUTE,	/* solver kernels */
+  PHASE_HALO,		/* border exchanges and multigrid gathers */
+  PHASE_REDUCE,		/* global reductions */
+  PHASE_OUTPUT,		/* writing the solution */
+  N_PHASES
+};
+
+enum
+{
+  PROFILE_NONE,		/* only the table printed by rank 0 */
+  PROFILE_CSV,		/* also profile.csv, one value per line */
+  PROFILE_JSON		/* also profile.json */
+};
+
+enum
+{
+  PC_NONE,		/* plain CG */
+  PC_JACOBI,		/* diagonal scaling */
+  PC_SSOR,		/* block Jacobi, one local SSOR sweep per rank */
+  PC_IC,		/* block Jacobi, local diagonal incomplete Cholesky */
+  PC_MG			/* one multigrid cycle */
+};
+
+enum
+{
+  OMEGA_FIXED,		/* omega as set, 1.95 by default */
+  OMEGA_ADAPTIVE,	/* omega_b of the estimated spectral radius, see Adapt_Omega() */
+  OMEGA_CHEBYSHEV	/* Chebyshev schedule per half step towards that omega_b */
+};
+
+/* one level of the multigrid hierarchy, see Setup_Multigrid() */
+typedef struct
+{
+  int gridsize[2];		/* global number of points */
+  int offset[2];		/* grid start (x, y) */
+  int dim[2];			/* local dimensions including the ghost ring */
+  int row_stride;
+  double **phi, **rhs, **res, **mask;
+  int **source;
+  MPI_Comm comm;		/* grid_comm, or MPI_COMM_SELF once agglomerated */
+  int top, right, bottom, left;	/* neighbours, MPI_PROC_NULL if agglomerated */
+  MPI_Datatype border_type[2], halo_type[2];
+  int gather;			/* continue on rank 0, at level + 1 */
+}
+Level;
+
+/* one block of the arena, the allocations follow the padded header */
+typedef struct Arena_Block
+{
+  struct Arena_Block *next;	/* the block before */
+  size_t size, used;		/* bytes, header included */
+  int mapped;			/* from mmap(), else posix_memalign() */
+}
+Arena_Block;
+
+/* one variable of the state of a solver, see solver_state[] */
+typedef struct
+{
+  void *addr;
+  size_t size;
+}
+State_Var;
+
+/* a solver of poisson.h, its copy of the variables in solver_state[] */
+struct Poisson_Solver
+{
+  char *state;
+};
+
 /* process specific variables */
 int proc_rank;		/* rank of current process */
 int proc_coord[2];	/* coordinates of current process in processgrid */
 int proc_top, proc_right, proc_bottom, proc_left; /* ranks of neighbouring procs */
 
 /* MPI global variables */
+MPI_Comm solver_comm = MPI_COMM_WORLD;	/* all processes of the solver */
 int P;				/* total number of processes */
 int P_grid[2];		/* processgrid dimensions */
 MPI_Comm grid_comm;	/* grid communicator */
 MPI_Status status;
 MPI_Datatype border_type[2];
+MPI_Datatype halo_type[2];	/* deep halos, only if halo > 1 */
+MPI_Request border_req[8];	/* outstanding halo requests (overlap mode) */
+MPI_Request *border_active;	/* requests completed by Exchange_Borders_Finish */
+int border_nreq = 0;
+double **border_grid[MAX_HALO_GRIDS];	/* persistent: grids with requests */
+MPI_Request border_preq[MAX_HALO_GRIDS][8];
+int N_border_grids = 0;
+char *border_buf = NULL;	/* neighbor: packed send borders */
+int border_buf_size = 0;
 
 /* global variables */
+const char *settings_file = "input.dat";	/* settings and sources, read by rank 0 */
 int gridsize[2];
 double precision_goal;		/* precision_goal of solution */
 int max_iter;			/* maximum number of iterations alowed */
+int overlap = 0;		/* overlap halo exchange with interior update */
+int kernel = KERNEL_PLAIN;	/* SOR kernel used by Do_Step */
+double omega = 1.95;		/* SOR relaxation parameter */
+int omega_mode = OMEGA_FIXED;	/* "omega: <value>", "omega: adaptive" or "omega: chebyshev" */
+double rho_jacobi = 0.0;	/* adaptive omega: estimated spectral radius of Jacobi */
+int omega_iter = -1;		/* adaptive omega: iteration of omega_delta, -1 if none */
+double omega_delta;		/* adaptive omega: global_delta the estimate starts from */
+int halo = 1;			/* ghost layers, SOR half steps per exchange */
+int check_interval = 1;		/* SOR iterations between convergence checks */
+int overlap_reduction = 0;	/* complete reductions one step later */
+int preconditioner = PC_NONE;	/* CG preconditioner */
+double pc_omega = 1.0;		/* relaxation of the SSOR preconditioner */
+int backend = BACKEND_CPU;	/* where the solve runs */
+int multigrid = 0;		/* SOR build: multigrid cycles instead of SOR */
+int mg_cycle = 1;		/* coarse cycles per level, 1 = V-cycle, 2 = W-cycle */
+int mg_smooth = 2;		/* red-black sweeps before and after the coarse correction */
+int mg_coarse_size = 4;		/* agglomerate once a subgrid gets smaller */
+int output_format = OUTPUT_TEXT;	/* format written by Write_Grid */
+int exchange = EXCHANGE_SENDRECV;	/* halo exchange engine */
+int profile_format = PROFILE_NONE;	/* export of the profile */
+int checkpoint_interval = 0;	/* iterations between checkpoints, 0: none */
+int restart = 0;		/* --restart: continue from checkpoint.bin */
+int N_sources = 0;		/* sources as read, kept for the checkpoint */
+double *sources = NULL;		/* (x, y, value) per source */
+int N_sets = 1;			/* source sets ("source set:"), solved as one batch if > 1 */
+int *set_first = NULL;		/* set s: sources set_first[s] up to set_first[s + 1] */
+int batch_set = -1;		/* set written by Write_Grid, -1 outside batch mode */
 
 /* benchmark related variables */
 clock_t ticks;			/* number of systemticks */
 int timer_on = 0;		/* is timer running? */
 double wtime;			/* wallclock time */
 
+/* instrumentation related variables */
+char *phase_name[N_PHASES] = { "setup", "compute", "halo", "reduce", "output" };
+double phase_time[N_PHASES];	/* wallclock time spent in each phase */
+int phase_stack[MAX_PHASE_DEPTH];	/* current phase on top, PHASE_SETUP below all */
+int phase_depth = 0;
+double phase_mark;		/* start of the current stretch of the current phase */
+int halo_nb[4];			/* grid_comm neighbours: left, right, top, bottom */
+long long halo_bytes[4];	/* bytes sent to each of them */
+int solve_iter = 0;		/* iterations done by the solver */
+
 /* local grid related variables */
 double **phi;			/* grid */
+double **rhs;			/* right hand side, NULL for the Laplace problem itself */
 int **source;			/* TRUE if subgrid element is a source */
+double **mask;			/* 0.0 on sources, 1.0 elsewhere (non-plain kernels) */
 int offset[2];		/* grid start (x, y) */
 int dim[2];			/* grid dimensions */
+int row_stride;			/* distance between rows in memory */
+Arena_Block *arena = NULL;	/* all grids, the newest block first */
+
+/* multigrid related variables */
+Level level[MAX_LEVELS];	/* level[0] is the grid above */
+int N_levels = 0;		/* levels held by this process */
+int *mg_layout;			/* rank 0: offset and dim of every process at the gather level */
+int *mg_counts, *mg_displs;	/* rank 0: Gatherv/Scatterv arguments */
+double *mg_buf, *mg_allbuf;	/* packing buffers of the gather level */
 
 /* local CG related variables */
 #ifdef CG
 double **pCG, **rCG, **vCG;
-double global_residue;
+double **zCG;			/* preconditioned residual, rCG itself if PC_NONE */
+double **dCG;			/* inverse diagonal of the preconditioner */
+double global_residue;		/* r' * r, used for the convergence test */
+double global_rdotz;		/* r' * z */
+#endif
+
+/* GPU related variables, device copies of the grids, see poisson_gpu.h */
+double *gpu_phi, *gpu_p, *gpu_r, *gpu_v;
+double *gpu_z, *gpu_d = NULL;	/* gpu_z: gpu_r without preconditioner */
+int *gpu_source;
+double *gpu_sbuf[2], *gpu_rbuf[2];	/* columns y = 1, dim - 2 and y = dim - 1, 0 */
+
+/* batch related variables, K = N_sets values per point, [x][y * K + k] */
+double **phiB, **maskB;		/* solutions, 0.0 on the sources of set k */
+double **pB, **rB, **vB;	/* CG vectors */
+MPI_Datatype batch_type[2];	/* K wide border_type */
+
+/* checkpoint related variables */
+MPI_File ckpt_fh;		/* checkpoint.tmp while it is written */
+int ckpt_open = 0;
+MPI_Request ckpt_req = MPI_REQUEST_NULL;
+double *ckpt_buf = NULL;	/* snapshot of the interior of the saved grids */
+int ckpt_last = 0;		/* iteration of the last checkpoint */
+int ckpt_count = 0, ckpt_step = 0;	/* restart: iterations and SOR half steps */
+double ckpt_scalar[2];		/* restart: global_residue and global_rdotz, SOR: delta */
+
+/* settings and omega estimate stored in the checkpoint header, in file order */
+int *ckpt_ints[] = { &gridsize[X_DIR], &gridsize[Y_DIR], &max_iter, &overlap,
+  &kernel, &halo, &check_interval, &overlap_reduction, &preconditioner,
+  &multigrid, &mg_cycle, &mg_smooth, &mg_coarse_size, &output_format,
+  &exchange, &profile_format, &checkpoint_interval, &N_sources, &omega_mode,
+  &omega_iter };
+double *ckpt_doubles[] = { &precision_goal, &pc_omega, &omega, &rho_jacobi,
+  &omega_delta };
+#define N_CKPT_INTS ((int) (sizeof(ckpt_ints) / sizeof(*ckpt_ints)))
+#define N_CKPT_DOUBLES ((int) (sizeof(ckpt_doubles) / sizeof(*ckpt_doubles)))
+
+/*
+ * Every variable above that belongs to one solver. A Poisson_Solver keeps
+ * its own copy of them; Use_Solver() makes it current, Save_Solver()
+ * stores it back, as Use_Level() does for a multigrid level.
+ */
+#define STATE(v) { &(v), sizeof(v) }
+State_Var solver_state[] = {
+  STATE(proc_rank), STATE(proc_coord), STATE(proc_top), STATE(proc_right),
+  STATE(proc_bottom), STATE(proc_left),
+  STATE(solver_comm), STATE(P), STATE(P_grid), STATE(grid_comm), STATE(status),
+  STATE(border_type), STATE(halo_type), STATE(border_req), STATE(border_active),
+  STATE(border_nreq), STATE(border_grid), STATE(border_preq),
+  STATE(N_border_grids), STATE(border_buf), STATE(border_buf_size),
+  STATE(settings_file), STATE(gridsize), STATE(precision_goal), STATE(max_iter),
+  STATE(overlap), STATE(kernel), STATE(omega), STATE(omega_mode),
+  STATE(rho_jacobi), STATE(omega_iter), STATE(omega_delta), STATE(halo),
+  STATE(check_interval), STATE(overlap_reduction), STATE(preconditioner),
+  STATE(pc_omega), STATE(backend), STATE(multigrid), STATE(mg_cycle),
+  STATE(mg_smooth), STATE(mg_coarse_size), STATE(output_format),
+  STATE(exchange), STATE(profile_format), STATE(checkpoint_interval),
+  STATE(restart), STATE(N_sources), STATE(sources), STATE(N_sets),
+  STATE(set_first), STATE(batch_set),
+  STATE(ticks), STATE(timer_on), STATE(wtime),
+  STATE(phase_time), STATE(phase_stack), STATE(phase_depth), STATE(phase_mark),
+  STATE(halo_nb), STATE(halo_bytes), STATE(solve_iter),
+  STATE(phi), STATE(rhs), STATE(source), STATE(mask), STATE(offset), STATE(dim),
+  STATE(row_stride), STATE(arena),
+  STATE(level), STATE(N_levels), STATE(mg_layout), STATE(mg_counts),
+  STATE(mg_displs), STATE(mg_buf), STATE(mg_allbuf),
+#ifdef CG
+  STATE(pCG), STATE(rCG), STATE(vCG), STATE(zCG), STATE(dCG),
+  STATE(global_residue), STATE(global_rdotz),
 #endif
+  STATE(gpu_phi), STATE(gpu_p), STATE(gpu_r), STATE(gpu_v), STATE(gpu_z),
+  STATE(gpu_d), STATE(gpu_source), STATE(gpu_sbuf), STATE(gpu_rbuf),
+  STATE(phiB), STATE(maskB), STATE(pB), STATE(rB), STATE(vB), STATE(batch_type),
+  STATE(ckpt_fh), STATE(ckpt_open), STATE(ckpt_req), STATE(ckpt_buf),
+  STATE(ckpt_last), STATE(ckpt_count), STATE(ckpt_step), STATE(ckpt_scalar)
+};
+#define N_STATE ((int) (sizeof(solver_state) / sizeof(*solver_state)))
+char *state_defaults = NULL;	/* the initial values, the start of every solver */
 
+void Setup_Topology();
 void Setup_Grid();
+void Arena_Reserve(size_t bytes, char *name);
+void *Arena_Alloc(size_t bytes, char *name);
+void Arena_Free();
+size_t Grid_Bytes();
+double **Alloc_Grid(char *name);
+int **Alloc_Source();
 double Do_Step(int parity);
+double Do_Step_Region(int parity, int x0, int x1, int y0, int y1);
+double Relax_Row(int x, int parity, int y0, int y1, double w);
+double Do_Sweep_Fused();
+double Do_Steps_Deep(int parity, int n);
+void Adapt_Omega(int iter, double delta);
+void Next_Omega();
+void Exchange_Halo(double **grid);
+int Strip_Bounds(int k, int *b);
+double Do_Strip(int parity);
+void Exchange_Borders_Start(double **grid);
+void Exchange_Borders_Post(double **grid);
+void Exchange_Borders_Finish();
+MPI_Request *Border_Requests(double **grid);
+void Exchange_Borders_Neighbor(double **grid);
+void Use_Level(Level *l);
+void Setup_Multigrid();
+void MG_Cycle(int n);
+void MG_Precondition(double **z, double **r);
+int MG_Solve();
+void Free_Multigrid();
 void Solve();
+void Setup_GPU();
+void Exchange_GPU(double *d_grid);
+void Solve_GPU();
+void Free_GPU();
+void Setup_Solver();
+int Run_Solver();
+size_t State_Size();
+void Use_Solver(Poisson_Solver *s);
+void Save_Solver(Poisson_Solver *s);
+double **Alloc_Batch_Grid(char *name);
+void Setup_Batch();
+void Exchange_Batch(double **grid);
+void Do_Step_Batch(int parity, double *err, int *active);
+void Solve_Batch();
+void Write_Batch();
+void Free_Batch();
 void Write_Grid();
+void Write_Grid_Binary();
+int Checkpoint_Grids(double ***grids);
+MPI_Offset Checkpoint_Header_Size();
+void Checkpoint_View(MPI_File fh);
+void Checkpoint(int count, int step, double delta);
+void Write_Checkpoint(int count, int step, double delta);
+void Finish_Checkpoint();
+void Read_Checkpoint_Header();
+int Read_Checkpoint();
 void Clean_Up();
 void Debug(char *mesg, int terminate);
 void start_timer();
 void resume_timer();
 void stop_timer();
 void print_timer();
+void Phase_Account();
+void Phase_Begin(int p);
+void Phase_End();
+void Count_Halo(MPI_Datatype *types);
+void Print_Profile();
+void Write_Profile(double *t, double rate, int *displs, int *nb, long long *bytes);
 
 void start_timer()
 {
   if (!timer_on)
   {
-    MPI_Barrier(MPI_COMM_WORLD);
+    MPI_Barrier(solver_comm);
     ticks = clock();
     wtime = MPI_Wtime();
+    phase_mark = wtime;
     timer_on = 1;
   }
 }
@@ -107,6 +434,210 @@ void print_timer()
     printf("(%i / %i) Elapsed processortime: %14.6f s (%5.1f%% CPU)\n", proc_rank, P, wtime, 100.0 * ticks * (1.0 / CLOCKS_PER_SEC) / wtime);
 }
 
+/* adds the time since phase_mark to the current phase */
+void Phase_Account()
+{
+  double now = MPI_Wtime();
+
+  phase_time[phase_stack[phase_depth]] += now - phase_mark;
+  phase_mark = now;
+}
+
+/* the time from here on counts for phase p, until Phase_End() */
+void Phase_Begin(int p)
+{
+  Phase_Account();
+  if (phase_depth == MAX_PHASE_DEPTH - 1)
+    Debug("Phase_Begin : phases nested too deep", 1);
+  phase_stack[++phase_depth] = p;
+}
+
+/* back to the phase that was current before the last Phase_Begin() */
+void Phase_End()
+{
+  Phase_Account();
+  if (phase_depth > 0)
+    phase_depth--;
+}
+
+/* adds one exchange of the borders described by types[] to halo_bytes */
+void Count_Halo(MPI_Datatype *types)
+{
+  int size[2];
+
+  MPI_Type_size(types[X_DIR], &size[X_DIR]);
+  MPI_Type_size(types[Y_DIR], &size[Y_DIR]);
+  if (proc_left != MPI_PROC_NULL)
+    halo_bytes[0] += size[X_DIR];
+  if (proc_right != MPI_PROC_NULL)
+    halo_bytes[1] += size[X_DIR];
+  if (proc_top != MPI_PROC_NULL)
+    halo_bytes[2] += size[Y_DIR];
+  if (proc_bottom != MPI_PROC_NULL)
+    halo_bytes[3] += size[Y_DIR];
+}
+
+/*
+ * Rank 0 prints the minimum, average and maximum over the processes of
+ * the time spent in each phase and of the border bytes sent, with the
+ * maximum over the average as a measure of load imbalance. With
+ * "profile: csv" or "profile: json" it also writes every rank's numbers,
+ * and the bytes sent to every neighbour, to profile.csv or profile.json.
+ */
+void Print_Profile()
+{
+  int i, j, n_nb = 0, nb[4];
+  long long bytes[4];
+  double t[N_PHASES + 2], *all = NULL;
+  double lo, sum, hi, solve_time = 0.0;
+  int *counts = NULL, *displs = NULL, *nb_all = NULL;
+  long long *bytes_all = NULL;
+
+  Debug("Print_Profile", 0);
+
+  Phase_Account();
+
+  for (i = 0; i < 4; i++)
+    if (halo_nb[i] != MPI_PROC_NULL)
+    {
+      nb[n_nb] = halo_nb[i];
+      bytes[n_nb++] = halo_bytes[i];
+    }
+
+  /* per rank: the phases, the total and the bytes sent */
+  t[N_PHASES] = 0.0;
+  t[N_PHASES + 1] = 0.0;
+  for (i = 0; i < N_PHASES; i++)
+  {
+    t[i] = phase_time[i];
+    t[N_PHASES] += phase_time[i];
+  }
+  for (i = 0; i < n_nb; i++)
+    t[N_PHASES + 1] += bytes[i];
+
+  if (proc_rank == 0)
+    if ((all = malloc(P * (N_PHASES + 2) * sizeof(double))) == NULL ||
+        (counts = malloc(P * sizeof(int))) == NULL ||
+        (displs = malloc((P + 1) * sizeof(int))) == NULL)
+      Debug("Print_Profile : malloc failed", 1);
+  MPI_Gather(t, N_PHASES + 2, MPI_DOUBLE, all, N_PHASES + 2, MPI_DOUBLE, 0,
+             grid_comm);
+
+  if (profile_format != PROFILE_NONE)
+  {
+    MPI_Gather(&n_nb, 1, MPI_INT, counts, 1, MPI_INT, 0, grid_comm);
+    if (proc_rank == 0)
+    {
+      displs[0] = 0;
+      for (i = 0; i < P; i++)
+        displs[i + 1] = displs[i] + counts[i];
+      if ((nb_all = malloc((displs[P] + 1) * sizeof(int))) == NULL ||
+          (bytes_all = malloc((displs[P] + 1) * sizeof(long long))) == NULL)
+        Debug("Print_Profile : malloc(nb_all) failed", 1);
+    }
+    MPI_Gatherv(nb, n_nb, MPI_INT, nb_all, counts, displs, MPI_INT,
+                0, grid_comm);
+    MPI_Gatherv(bytes, n_nb, MPI_LONG_LONG, bytes_all, counts, displs,
+                MPI_LONG_LONG, 0, grid_comm);
+  }
+
+  if (proc_rank != 0)
+    return;
+
+  for (i = 0; i < P; i++)
+  {
+    sum = all[i * (N_PHASES + 2) + PHASE_COMPUTE]
+      + all[i * (N_PHASES + 2) + PHASE_HALO]
+      + all[i * (N_PHASES + 2) + PHASE_REDUCE];
+    if (sum > solve_time)
+      solve_time = sum;
+  }
+  printf("Profile : %i iterations, %.1f iterations/s\n", solve_iter,
+         solve_time > 0.0 ? solve_iter / solve_time : 0.0);
+  printf("Profile : %-8s %14s %14s %14s %8s\n", "phase", "min", "avg", "max",
+         "max/avg");
+  for (j = 0; j < N_PHASES + 2; j++)
+  {
+    lo = hi = sum = all[j];
+    for (i = 1; i < P; i++)
+    {
+      sum += all[i * (N_PHASES + 2) + j];
+      if (all[i * (N_PHASES + 2) + j] < lo)
+        lo = all[i * (N_PHASES + 2) + j];
+      if (all[i * (N_PHASES + 2) + j] > hi)
+        hi = all[i * (N_PHASES + 2) + j];
+    }
+    if (j < N_PHASES + 1)
+      printf("Profile : %-8s %12.6f s %12.6f s %12.6f s %8.3f\n",
+             j < N_PHASES ? phase_name[j] : "total", lo, sum / P, hi,
+             sum > 0.0 ? hi * P / sum : 1.0);
+    else
+      printf("Profile : %-8s %12.0f B %12.0f B %12.0f B %8.3f\n", "sent",
+             lo, sum / P, hi, sum > 0.0 ? hi * P / sum : 1.0);
+  }
+
+  if (profile_format != PROFILE_NONE)
+    Write_Profile(all, solve_time > 0.0 ? solve_iter / solve_time : 0.0,
+                  displs, nb_all, bytes_all);
+
+  free(all);
+  free(counts);
+  free(displs);
+  free(nb_all);
+  free(bytes_all);
+}
+
+/*
+ * Rank 0: writes the gathered profile, rate being the iterations per
+ * second. The CSV has one value per line, "rank,metric,key,value"; the
+ * key of a byte count is the neighbour's rank, and the iteration counts
+ * belong to no rank.
+ */
+void Write_Profile(double *t, double rate, int *displs, int *nb, long long *bytes)
+{
+  int i, j;
+  char filename[25];
+  FILE *f;
+
+  sprintf(filename, "profile.%s", profile_format == PROFILE_CSV ? "csv" : "json");
+  if ((f = fopen(filename, "w")) == NULL)
+    Debug("Write_Profile : Can't open profile outputfile", 1);
+
+  if (profile_format == PROFILE_CSV)
+  {
+    fprintf(f, "rank,metric,key,value\n");
+    fprintf(f, ",iterations,,%i\n", solve_iter);
+    fprintf(f, ",iterations_per_second,,%.3f\n", rate);
+    for (i = 0; i < P; i++)
+    {
+      for (j = 0; j < N_PHASES; j++)
+        fprintf(f, "%i,time,%s,%.9f\n", i, phase_name[j], t[i * (N_PHASES + 2) + j]);
+      fprintf(f, "%i,time,total,%.9f\n", i, t[i * (N_PHASES + 2) + N_PHASES]);
+      for (j = displs[i]; j < displs[i + 1]; j++)
+        fprintf(f, "%i,bytes,%i,%lld\n", i, nb[j], bytes[j]);
+    }
+  }
+  else
+  {
+    fprintf(f, "{\n  \"processes\": %i,\n  \"iterations\": %i,\n"
+            "  \"iterations_per_second\": %.3f,\n  \"ranks\": [\n",
+            P, solve_iter, rate);
+    for (i = 0; i < P; i++)
+    {
+      fprintf(f, "    { \"rank\": %i, \"time\": {", i);
+      for (j = 0; j < N_PHASES; j++)
+        fprintf(f, " \"%s\": %.9f,", phase_name[j], t[i * (N_PHASES + 2) + j]);
+      fprintf(f, " \"total\": %.9f }, \"bytes_sent\": {", t[i * (N_PHASES + 2) + N_PHASES]);
+      for (j = displs[i]; j < displs[i + 1]; j++)
+        fprintf(f, "%s \"%i\": %lld", j > displs[i] ? "," : "", nb[j], bytes[j]);
+      fprintf(f, " } }%s\n", i < P - 1 ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+  }
+
+  fclose(f);
+}
+
 void Debug(char *mesg, int terminate)
 {
   if (DEBUG || terminate)
@@ -117,45 +648,60 @@ void Debug(char *mesg, int terminate)
 
 void Setup_Proc_Grid(int argc, char **argv)
 {
-  int wrap_around[2];
-  int reorder;
-  
   Debug("My_MPI_Init", 0);
   
-  /* Retrieve the number of processes */
-  MPI_Comm_size(MPI_COMM_WORLD, &P); /* find out how many processes there are */
-  
   /* Calculate the number of processes per column and per row for the grid */
-  if (argc > 2)
+  if (argc == 3 || (argc == 4 && strcmp(argv[3], "--restart") == 0))
   {
+    restart = (argc == 4);
     P_grid[X_DIR] = atoi(argv[1]);
     P_grid[Y_DIR] = atoi(argv[2]);
-    if (P_grid[X_DIR] * P_grid[Y_DIR] != P)
-    {
-      Debug("ERROR: Process grid dimensions do not match with P", 1);
-    }
   }
   else
   {
     Debug("ERROR: Wrong parameter input", 1);
   }
+
+  Setup_Topology();
+}
+
+/* the Cartesian grid_comm of P_grid over solver_comm and the neighbours */
+void Setup_Topology()
+{
+  int wrap_around[2];
+  int reorder;
+
+  /* Retrieve the number of processes */
+  MPI_Comm_size(solver_comm, &P); /* find out how many processes there are */
+  if (P_grid[X_DIR] * P_grid[Y_DIR] != P)
+  {
+    Debug("ERROR: Process grid dimensions do not match with P", 1);
+  }
   
   /* Create process topology (2D grid) */
   wrap_around[X_DIR] = 0;
   wrap_around[Y_DIR] = 0;	/* do not connect first and last process */
   reorder = 1;				/* reorder process ranks */
   
-  MPI_Cart_create(MPI_COMM_WORLD, 2, P_grid, wrap_around, reorder, &grid_comm); /* Creates a new communicator
+  MPI_Cart_create(solver_comm, 2, P_grid, wrap_around, reorder, &grid_comm); /* Creates a new communicator
   
   /* Retrieve new rank and cartesian coordinates of this process */
   MPI_Comm_rank(grid_comm, &proc_rank);	/* Rank of process in new communicator */
   MPI_Cart_coords(grid_comm, proc_rank, 2, proc_coord);		/* Coordinates of process in new communicator */
   
   printf("(%i) (x,y)=(%i,%i)\n", proc_rank, proc_coord[X_DIR], proc_coord[Y_DIR]);
+#ifdef _OPENMP
+  if (proc_rank == 0)
+    printf("(%i) %i OpenMP threads per process\n", proc_rank, omp_get_max_threads());
+#endif
   
   /* Calculate ranks of neighbouring processes */
   MPI_Cart_shift(grid_comm, Y_DIR, 1, &proc_top, &proc_bottom); /* Rank of processes proc_top and proc_bottom */
   MPI_Cart_shift(grid_comm, X_DIR, 1, &proc_left, &proc_right); /* Rank of processes proc_left and proc_right */
+  halo_nb[0] = proc_left;
+  halo_nb[1] = proc_right;
+  halo_nb[2] = proc_top;
+  halo_nb[3] = proc_bottom;
   
   if (DEBUG)
   {
@@ -168,26 +714,223 @@ void Setup_Proc_Grid(int argc, char **argv)
 
 void Setup_Grid()
 {
-  int x, y, s;
+  int x, y, s, n;
   int upper_offset[2];
-  double source_x, source_y, source_val;
+  int max_sources = 0;
+  char key[40], value[40];
   FILE *f;
 
   Debug("Setup_Subgrid", 0);
 
-  if (proc_rank == 0)
+  /* a restart takes all settings from the checkpoint instead */
+  if (proc_rank == 0 && restart)
+  {
+    Read_Checkpoint_Header();
+    if ((set_first = malloc(2 * sizeof(int))) == NULL)
+      Debug("Setup_Subgrid : malloc(set_first) failed", 1);
+    set_first[0] = 0;
+    set_first[1] = N_sources;
+  }
+  else if (proc_rank == 0)
   {
-    f = fopen("input.dat", "r");
+    if ((set_first = malloc(2 * sizeof(int))) == NULL)
+      Debug("Setup_Subgrid : malloc(set_first) failed", 1);
+    set_first[0] = 0;
+
+    f = fopen(settings_file, "r");
     if (f == NULL)
       Debug("Error opening input.dat", 1);
     fscanf(f, "nx: %i\n", &gridsize[X_DIR]);
     fscanf(f, "ny: %i\n", &gridsize[Y_DIR]);
     fscanf(f, "precision goal: %lf\n", &precision_goal);
     fscanf(f, "max iterations: %i\n", &max_iter);
+
+    /* the remaining lines are sources and optional settings, in any order */
+    while (fscanf(f, " %39[^:]:", key) == 1)
+    {
+      if (strcmp(key, "source") == 0)
+      {
+        if (N_sources == max_sources)
+        {
+          max_sources = 2 * max_sources + 4;
+          if ((sources = realloc(sources, 3 * max_sources * sizeof(*sources))) == NULL)
+            Debug("Setup_Subgrid : realloc(sources) failed", 1);
+        }
+        fscanf(f, "%lf %lf %lf", &sources[3 * N_sources],
+          &sources[3 * N_sources + 1], &sources[3 * N_sources + 2]);
+        N_sources++;
+      }
+      else if (strcmp(key, "source set") == 0)
+      {
+        /* the sources that follow form the next right hand side */
+        if (N_sources > set_first[N_sets - 1])
+        {
+          if ((set_first = realloc(set_first, (N_sets + 2) * sizeof(int))) == NULL)
+            Debug("Setup_Subgrid : realloc(set_first) failed", 1);
+          set_first[N_sets++] = N_sources;
+        }
+      }
+      else if (strcmp(key, "overlap") == 0)
+        fscanf(f, "%i", &overlap);
+      else if (strcmp(key, "halo width") == 0)
+        fscanf(f, "%i", &halo);
+      else if (strcmp(key, "check interval") == 0)
+        fscanf(f, "%i", &check_interval);
+      else if (strcmp(key, "overlap reduction") == 0)
+        fscanf(f, "%i", &overlap_reduction);
+      else if (strcmp(key, "preconditioner omega") == 0)
+        fscanf(f, "%lf", &pc_omega);
+      else if (strcmp(key, "omega") == 0)
+      {
+        fscanf(f, "%39s", value);
+        if (strcmp(value, "adaptive") == 0)
+          omega_mode = OMEGA_ADAPTIVE;
+        else if (strcmp(value, "chebyshev") == 0)
+          omega_mode = OMEGA_CHEBYSHEV;
+        else if (sscanf(value, "%lf", &omega) == 1 && omega > 0.0 && omega < 2.0)
+          omega_mode = OMEGA_FIXED;
+        else
+          Debug("Setup_Subgrid : unknown omega in input.dat", 1);
+        if (omega_mode != OMEGA_FIXED)
+        {
+          omega = 1.0;		/* Gauss-Seidel until the first estimate */
+          rho_jacobi = 0.0;
+        }
+      }
+      else if (strcmp(key, "preconditioner") == 0)
+      {
+        fscanf(f, "%39s", value);
+        if (strcmp(value, "none") == 0)
+          preconditioner = PC_NONE;
+        else if (strcmp(value, "jacobi") == 0)
+          preconditioner = PC_JACOBI;
+        else if (strcmp(value, "ssor") == 0)
+          preconditioner = PC_SSOR;
+        else if (strcmp(value, "ic") == 0)
+          preconditioner = PC_IC;
+        else if (strcmp(value, "mg") == 0)
+          preconditioner = PC_MG;
+        else
+          Debug("Setup_Subgrid : unknown preconditioner in input.dat", 1);
+      }
+      else if (strcmp(key, "multigrid") == 0)
+        fscanf(f, "%i", &multigrid);
+      else if (strcmp(key, "multigrid smoothing") == 0)
+        fscanf(f, "%i", &mg_smooth);
+      else if (strcmp(key, "multigrid coarse size") == 0)
+        fscanf(f, "%i", &mg_coarse_size);
+      else if (strcmp(key, "multigrid cycle") == 0)
+      {
+        fscanf(f, "%39s", value);
+        if (strcmp(value, "v") == 0)
+          mg_cycle = 1;
+        else if (strcmp(value, "w") == 0)
+          mg_cycle = 2;
+        else
+          Debug("Setup_Subgrid : unknown multigrid cycle in input.dat", 1);
+      }
+      else if (strcmp(key, "kernel") == 0)
+      {
+        fscanf(f, "%39s", value);
+        if (strcmp(value, "plain") == 0)
+          kernel = KERNEL_PLAIN;
+        else if (strcmp(value, "strided") == 0)
+          kernel = KERNEL_STRIDED;
+        else if (strcmp(value, "fused") == 0)
+          kernel = KERNEL_FUSED;
+        else
+          Debug("Setup_Subgrid : unknown kernel in input.dat", 1);
+      }
+      else if (strcmp(key, "exchange") == 0)
+      {
+        fscanf(f, "%39s", value);
+        if (strcmp(value, "sendrecv") == 0)
+          exchange = EXCHANGE_SENDRECV;
+        else if (strcmp(value, "persistent") == 0)
+          exchange = EXCHANGE_PERSISTENT;
+        else if (strcmp(value, "neighbor") == 0)
+          exchange = EXCHANGE_NEIGHBOR;
+        else
+          Debug("Setup_Subgrid : unknown exchange in input.dat", 1);
+      }
+      else if (strcmp(key, "profile") == 0)
+      {
+        fscanf(f, "%39s", value);
+        if (strcmp(value, "none") == 0)
+          profile_format = PROFILE_NONE;
+        else if (strcmp(value, "csv") == 0)
+          profile_format = PROFILE_CSV;
+        else if (strcmp(value, "json") == 0)
+          profile_format = PROFILE_JSON;
+        else
+          Debug("Setup_Subgrid : unknown profile in input.dat", 1);
+      }
+      else if (strcmp(key, "backend") == 0)
+      {
+        fscanf(f, "%39s", value);
+        if (strcmp(value, "cpu") == 0)
+          backend = BACKEND_CPU;
+        else if (strcmp(value, "gpu") == 0)
+          backend = BACKEND_GPU;
+        else
+          Debug("Setup_Subgrid : unknown backend in input.dat", 1);
+      }
+      else if (strcmp(key, "output format") == 0)
+      {
+        fscanf(f, "%39s", value);
+        if (strcmp(value, "text") == 0)
+          output_format = OUTPUT_TEXT;
+        else if (strcmp(value, "binary") == 0)
+          output_format = OUTPUT_BINARY;
+        else
+          Debug("Setup_Subgrid : unknown output format in input.dat", 1);
+      }
+      else if (strcmp(key, "checkpoint interval") == 0)
+        fscanf(f, "%i", &checkpoint_interval);
+      else
+        Debug("Setup_Subgrid : unknown setting in input.dat", 1);
+    }
+    fclose(f);
+    set_first[N_sets] = N_sources;
   }
-  MPI_Bcast(&gridsize, 2, MPI_INT, 0, MPI_COMM_WORLD);
-  MPI_Bcast(&precision_goal, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-  MPI_Bcast(&max_iter, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  MPI_Bcast(&gridsize, 2, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&precision_goal, 1, MPI_DOUBLE, 0, solver_comm);
+  MPI_Bcast(&max_iter, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&overlap, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&kernel, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&halo, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&check_interval, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&overlap_reduction, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&preconditioner, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&pc_omega, 1, MPI_DOUBLE, 0, solver_comm);
+  MPI_Bcast(&omega, 1, MPI_DOUBLE, 0, solver_comm);
+  MPI_Bcast(&omega_mode, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&rho_jacobi, 1, MPI_DOUBLE, 0, solver_comm);
+  MPI_Bcast(&omega_iter, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&omega_delta, 1, MPI_DOUBLE, 0, solver_comm);
+  MPI_Bcast(&backend, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&multigrid, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&mg_cycle, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&mg_smooth, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&mg_coarse_size, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&output_format, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&exchange, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&profile_format, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&checkpoint_interval, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&ckpt_count, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&ckpt_step, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(ckpt_scalar, 2, MPI_DOUBLE, 0, solver_comm);
+
+  MPI_Bcast(&N_sources, 1, MPI_INT, 0, solver_comm);
+  if (proc_rank != 0 && N_sources > 0)
+    if ((sources = malloc(3 * N_sources * sizeof(*sources))) == NULL)
+      Debug("Setup_Subgrid : malloc(sources) failed", 1);
+  MPI_Bcast(sources, 3 * N_sources, MPI_DOUBLE, 0, solver_comm);
+  MPI_Bcast(&N_sets, 1, MPI_INT, 0, solver_comm);
+  if (proc_rank != 0)
+    if ((set_first = malloc((N_sets + 1) * sizeof(int))) == NULL)
+      Debug("Setup_Subgrid : malloc(set_first) failed", 1);
+  MPI_Bcast(set_first, N_sets + 1, MPI_INT, 0, solver_comm);
   
   /* Calculate top left corner coordinates of local grid */
   offset[X_DIR] = gridsize[X_DIR] * proc_coord[X_DIR] / P_grid[X_DIR];
@@ -200,285 +943,2370 @@ void Setup_Grid()
   dim[X_DIR] = (upper_offset[X_DIR] - offset[X_DIR]) + 2;
   dim[Y_DIR] = (upper_offset[Y_DIR] - offset[Y_DIR]) + 2;
 
-  /* allocate memory */
-  if ((phi = malloc(dim[X_DIR] * sizeof(*phi))) == NULL)
-    Debug("Setup_Subgrid : malloc(phi) failed", 1);
-  if ((source = malloc(dim[X_DIR] * sizeof(*source))) == NULL)
-    Debug("Setup_Subgrid : malloc(source) failed", 1);
-  if ((phi[0] = malloc(dim[Y_DIR] * dim[X_DIR] * sizeof(**phi))) == NULL)
-    Debug("Setup_Subgrid : malloc(*phi) failed", 1);
-  if ((source[0] = malloc(dim[Y_DIR] * dim[X_DIR] * sizeof(**source))) == NULL)
-    Debug("Setup_Subgrid : malloc(*source) failed", 1);
-  for (x = 1; x < dim[X_DIR]; x++)
-  {
-    phi[x] = phi[0] + x * dim[Y_DIR];
-    source[x] = source[0] + x * dim[Y_DIR];
-  }
+  /* a deep halo can only be filled by the direct neighbours */
+  if (halo < 1 || halo > dim[X_DIR] - 2 || halo > dim[Y_DIR] - 2)
+    Debug("Setup_Subgrid : halo width must be between 1 and the subgrid size", 1);
+  /* rows padded to whole cache lines, see Alloc_Grid() */
+  row_stride = (dim[Y_DIR] - 2 + 2 * halo + ROW_ALIGN - 1) / ROW_ALIGN * ROW_ALIGN;
 
-  /* set all values to '0' */
-  for (x = 0; x < dim[X_DIR]; x++)
-    for (y = 0; y < dim[Y_DIR]; y++)
+  /* allocate memory, one arena block for all full size grids */
+  n = 2 + (kernel != KERNEL_PLAIN);
+  #ifdef CG
+  n += 3 + (preconditioner != PC_NONE) + (preconditioner != PC_NONE && preconditioner != PC_MG);
+  #endif
+  Arena_Reserve(n * Grid_Bytes(), "grids");
+  phi = Alloc_Grid("phi");
+  source = Alloc_Source();
+
+  /* set all values to '0', points outside the domain are kept fixed */
+  for (x = 1 - halo; x < dim[X_DIR] - 1 + halo; x++)
+    for (y = 1 - halo; y < dim[Y_DIR] - 1 + halo; y++)
     {
       phi[x][y] = 0.0;
       source[x][y] = 0;
+      if (x + offset[X_DIR] < 1 || x + offset[X_DIR] > gridsize[X_DIR] ||
+          y + offset[Y_DIR] < 1 || y + offset[Y_DIR] > gridsize[Y_DIR])
+        source[x][y] = 1;
     }
 
   /* put sources in field */
-  do
+  for (s = 0; s < N_sources; s++)
   {
-    if (proc_rank == 0)
+    x = sources[3 * s] * gridsize[X_DIR];
+    y = sources[3 * s + 1] * gridsize[Y_DIR];
+    x += 1;
+    y += 1;
+
+    x = x - offset[X_DIR];
+    y = y - offset[Y_DIR];
+    /* indices in domain of this process, including its deep halo */
+    if (x > -halo && x < dim[X_DIR] - 1 + halo
+      && y > -halo && y < dim[Y_DIR] - 1 + halo)
     {
-      s = fscanf(f, "source: %lf %lf %lf\n", &source_x, &source_y, &source_val);
-    }
-    
-    MPI_Bcast(&s, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    
-    if (s==3)
-    {
-      MPI_Bcast(&source_x, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-      MPI_Bcast(&source_y, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-      MPI_Bcast(&source_val, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-      x = source_x * gridsize[X_DIR];
-      y = source_y * gridsize[Y_DIR];
-      x += 1;
-      y += 1;
-
-      x = x - offset[X_DIR];
-      y = y - offset[Y_DIR];
-      /* indices in domain of this process */
-      if (x > 0 && x < dim[X_DIR] - 1
-        && y > 0 && y < dim[Y_DIR] - 1)
-      {
-        phi[x][y] = source_val;
-        source[x][y] = 1;
-      }
+      phi[x][y] = sources[3 * s + 2];
+      source[x][y] = 1;
     }
   }
-  while (s==3);
 
-  if (proc_rank == 0)
+  /* the branch free kernels multiply the update by a precomputed mask */
+  if (kernel != KERNEL_PLAIN)
   {
-    fclose(f);
+    mask = Alloc_Grid("mask");
+    for (x = 1 - halo; x < dim[X_DIR] - 1 + halo; x++)
+      for (y = 1 - halo; y < dim[Y_DIR] - 1 + halo; y++)
+        mask[x][y] = (source[x][y] == 1) ? 0.0 : 1.0;
   }
 }
 
-#ifdef CG
-void InitCG()
+/*
+ * Adds a block of at least 'bytes' to the arena. All grids come from the
+ * arena and are only released together by Arena_Free(), so setting up
+ * once and solving many times allocates nothing after the setup. Blocks
+ * are whole huge pages and, where the system has them, mapped with the
+ * hint for transparent huge pages.
+ */
+void Arena_Reserve(size_t bytes, char *name)
 {
-  int x, y;
-  double rdotr = 0;
-  
-  /* allocate memory for CG arrays */
-  pCG = malloc(dim[X_DIR] * sizeof(*pCG));
-  pCG[0] = malloc(dim[X_DIR] * dim[Y_DIR] * sizeof(**pCG));
-  for (x = 1; x < dim[X_DIR]; x++) pCG[x] = pCG[0] + x * dim[Y_DIR];
-  
-  rCG = malloc(dim[X_DIR] * sizeof(*rCG));
-  rCG[0] = malloc(dim[X_DIR] * dim[Y_DIR] * sizeof(**rCG));
-  for (x = 1; x < dim[X_DIR]; x++) rCG[x] = rCG[0] + x * dim[Y_DIR];
-  
-  vCG = malloc(dim[X_DIR] * sizeof(*vCG));
-  vCG[0] = malloc(dim[X_DIR] * dim[Y_DIR] * sizeof(**vCG));
-  for (x = 1; x < dim[X_DIR]; x++) vCG[x] = vCG[0] + x * dim[Y_DIR];
-  
-  /* initiate rCG and pCG */
-  for (x = 1; x < dim[X_DIR] - 1; x++)
-    for (y = 1; y < dim[Y_DIR] - 1; y++)
-    {
-      rCG[x][y] = 0;
-      if (source[x][y] != 1)
-        rCG[x][y] = (
-          phi[x + 1][y] + phi[x - 1][y] +
-          phi[x][y + 1] + phi[x][y - 1]
-        ) * 0.25;
-      
-      pCG[x][y] = rCG[x][y];
-      rdotr += rCG[x][y] * rCG[x][y];
-    }
-  
-  /* Obtain the global_residue also for the initial phi */
-  MPI_Allreduce(&rdotr, &global_residue, 1, MPI_DOUBLE, MPI_SUM, grid_comm);
-}
+  size_t head = (sizeof(Arena_Block) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+  size_t size = (head + bytes + ARENA_BLOCK - 1) / ARENA_BLOCK * ARENA_BLOCK;
+  Arena_Block *b = NULL;
+  int mapped = 0;
+  char mesg[80];
+
+#ifdef MAP_ANONYMOUS
+  b = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (b == MAP_FAILED)
+    b = NULL;
+  else
+  {
+    mapped = 1;
+#ifdef MADV_HUGEPAGE
+    madvise(b, size, MADV_HUGEPAGE);
+#endif
+  }
 #endif
+  if (b == NULL && posix_memalign((void **) &b, ARENA_ALIGN, size) != 0)
+  {
+    sprintf(mesg, "Arena_Reserve : allocation for %s failed", name);
+    Debug(mesg, 1);
+  }
 
-void Setup_MPI_Datatypes()
-{
-  Debug("Setup_MPI_Datatypes", 0);
-  
-  /* Datatype for vertical data exchange (Y_DIR) */
-  MPI_Type_vector(dim[X_DIR] - 2, 1, dim[Y_DIR], MPI_DOUBLE, &border_type[Y_DIR]);
-  MPI_Type_commit(&border_type[Y_DIR]);
-  
-  /* Datatype for horizontal data exchange (X_DIR) */
-  MPI_Type_vector(dim[Y_DIR] - 2, 1, 1, MPI_DOUBLE, &border_type[X_DIR]);
-  MPI_Type_commit(&border_type[X_DIR]);
+  b->next = arena;
+  b->size = size;
+  b->used = head;
+  b->mapped = mapped;
+  arena = b;
 }
 
-double Do_Step(int parity)
+/* 'bytes' from the arena, aligned to ARENA_ALIGN and not zeroed */
+void *Arena_Alloc(size_t bytes, char *name)
 {
-  int x, y;
-  double old_phi;
-  double c;
-  const double omega = 1.95;
-  double max_err = 0.0;
-  
-  int parity_offset = offset[X_DIR] + offset[Y_DIR];
+  void *p;
 
-  /* calculate interior of grid */
-  for (x = 1; x < dim[X_DIR] - 1; x++)
-    for (y = 1; y < dim[Y_DIR] - 1; y++)
-      if ((x + y + parity_offset) % 2 == parity && source[x][y] != 1)
-      {
-        old_phi = phi[x][y];
-        c = (
-          phi[x + 1][y] + phi[x - 1][y] +
-          phi[x][y + 1] + phi[x][y - 1]
-        ) * 0.25 - old_phi;
-        phi[x][y] = old_phi + omega * c;
-  
-        if (max_err < fabs(old_phi - phi[x][y]))
-          max_err = fabs(old_phi - phi[x][y]);
-      }
+  bytes = (bytes + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+  if (arena == NULL || arena->used + bytes > arena->size)
+    Arena_Reserve(bytes, name);
+  p = (char *) arena + arena->used;
+  arena->used += bytes;
 
-  return max_err;
+  return p;
+}
+
+void Arena_Free()
+{
+  Arena_Block *b;
+
+  while ((b = arena) != NULL)
+  {
+    arena = b->next;
+    if (b->mapped)
+      munmap(b, b->size);
+    else
+      free(b);
+  }
+}
+
+/* arena space taken by one Alloc_Grid() of the current level */
+size_t Grid_Bytes()
+{
+  size_t rows = dim[X_DIR] - 2 + 2 * halo;
+
+  return (rows * row_stride + ROW_ALIGN) * sizeof(double) +
+    rows * sizeof(double *) + 2 * ARENA_ALIGN;
+}
+
+/*
+ * Allocates a local grid with 'halo' ghost layers on every side. The row
+ * pointers are shifted so that [1, dim - 1) remains the interior and the
+ * deeper ghost layers are found at indices down to 1 - halo. The rows
+ * follow each other at row_stride, so grid[x] is grid[0] + x * row_stride,
+ * and the interior of the first row begins on a cache line, with the
+ * padded row_stride of Setup_Grid() that of every row. The rows
+ * are zeroed with the static schedule of the compute loops, so that each
+ * page is first touched by the thread (and NUMA node) that works on it.
+ */
+double **Alloc_Grid(char *name)
+{
+  int x, y;
+  int rows = dim[X_DIR] - 2 + 2 * halo;
+  int lead = (ROW_ALIGN - halo % ROW_ALIGN) % ROW_ALIGN;
+  double **grid;
+  double *base;
+
+  grid = Arena_Alloc(rows * sizeof(*grid), name);
+  base = Arena_Alloc((rows * row_stride + lead) * sizeof(*base), name);
+  for (x = 0; x < rows; x++)
+    grid[x] = base + lead + x * row_stride;
+  #pragma omp parallel for private(y) schedule(static)
+  for (x = 0; x < rows; x++)
+    for (y = 0; y < row_stride; y++)
+      grid[x][y] = 0.0;
+  for (x = 0; x < rows; x++)
+    grid[x] += halo - 1;
+
+  return grid + halo - 1;
+}
+
+/* Alloc_Grid() for the source flags */
+int **Alloc_Source()
+{
+  int x, y;
+  int rows = dim[X_DIR] - 2 + 2 * halo;
+  int **grid;
+  int *base;
+
+  grid = Arena_Alloc(rows * sizeof(*grid), "source");
+  base = Arena_Alloc(rows * row_stride * sizeof(*base), "source");
+  for (x = 0; x < rows; x++)
+    grid[x] = base + x * row_stride;
+  #pragma omp parallel for private(y) schedule(static)
+  for (x = 0; x < rows; x++)
+    for (y = 0; y < row_stride; y++)
+      grid[x][y] = 0;
+  for (x = 0; x < rows; x++)
+    grid[x] += halo - 1;
+
+  return grid + halo - 1;
 }
 
 #ifdef CG
-void Do_Step_CG()
+/*
+ * Sets up dCG for the preconditioner. The stencil has a unit diagonal, so
+ * Jacobi leaves the residual unchanged and is only there for symmetry
+ * with MPI_Fempois. SSOR and IC are applied to the local subgrid only
+ * (block Jacobi): couplings to ghost points and sources are dropped, so
+ * no communication is needed. IC keeps the off-diagonals of A and only
+ * modifies the diagonal, which is exact IC(0) for the 5-point stencil.
+ */
+void Init_Preconditioner()
+{
+  int x, y;
+
+  if (preconditioner == PC_NONE)
+  {
+    zCG = rCG;
+    return;
+  }
+
+  zCG = Alloc_Grid("zCG");
+  if (preconditioner == PC_MG)
+  {
+    Setup_Multigrid();
+    return;
+  }
+
+  dCG = Alloc_Grid("dCG");
+  for (x = 1 - halo; x < dim[X_DIR] - 1 + halo; x++)
+    for (y = 1 - halo; y < dim[Y_DIR] - 1 + halo; y++)
+    {
+      zCG[x][y] = 0.0;
+      dCG[x][y] = 0.0;
+    }
+
+  for (x = 1; x < dim[X_DIR] - 1; x++)
+    for (y = 1; y < dim[Y_DIR] - 1; y++)
+      if (source[x][y] != 1)
+      {
+        if (preconditioner == PC_IC)
+          dCG[x][y] = 1.0 / (1.0 - 0.0625 * (dCG[x - 1][y] + dCG[x][y - 1]));
+        else if (preconditioner == PC_SSOR)
+          dCG[x][y] = pc_omega;
+        else
+          dCG[x][y] = 1.0;
+      }
+}
+
+/*
+ * zCG = M^-1 * rCG. For SSOR and IC a forward and a backward sweep with
+ * the local part of the stencil, entries of zCG outside the free interior
+ * stay 0.
+ */
+void Precondition_CG()
+{
+  int x, y;
+
+  if (preconditioner == PC_NONE)
+    return;
+
+  if (preconditioner == PC_MG)
+  {
+    MG_Precondition(zCG, rCG);
+    return;
+  }
+
+  if (preconditioner == PC_JACOBI)
+  {
+  #pragma omp parallel for private(y) schedule(static)
+    for (x = 1; x < dim[X_DIR] - 1; x++)
+      for (y = 1; y < dim[Y_DIR] - 1; y++)
+        zCG[x][y] = dCG[x][y] * rCG[x][y];
+    return;
+  }
+
+  /* the SSOR and IC sweeps are recurrences and stay sequential */
+  for (x = 1; x < dim[X_DIR] - 1; x++)
+    for (y = 1; y < dim[Y_DIR] - 1; y++)
+      zCG[x][y] = dCG[x][y] * (rCG[x][y] +
+        0.25 * (zCG[x - 1][y] + zCG[x][y - 1]));
+
+  for (x = dim[X_DIR] - 2; x > 0; x--)
+    for (y = dim[Y_DIR] - 2; y > 0; y--)
+      zCG[x][y] += 0.25 * dCG[x][y] * (zCG[x + 1][y] + zCG[x][y + 1]);
+}
+
+/* the CG arrays, same layout as phi for border_type, once per setup */
+void Alloc_CG()
+{
+  pCG = Alloc_Grid("pCG");
+  rCG = Alloc_Grid("rCG");
+  vCG = Alloc_Grid("vCG");
+  Init_Preconditioner();
+}
+
+void InitCG()
+{
+  int x, y;
+  double dots[2] = { 0.0, 0.0 }, global_dots[2];	/* r' * r, r' * z */
+  
+  for (x = 1 - halo; x < dim[X_DIR] - 1 + halo; x++)
+    for (y = 1 - halo; y < dim[Y_DIR] - 1 + halo; y++)
+      pCG[x][y] = 0.0;
+  
+  /* CG only exchanges p, a solve after the first needs the ghosts of phi */
+  Exchange_Borders_Start(phi);
+  Exchange_Borders_Finish();
+  
+  /* initiate rCG = b - A * phi, phi need not be 0 off the sources */
+  #pragma omp parallel for private(y) schedule(static)
+  for (x = 1; x < dim[X_DIR] - 1; x++)
+    for (y = 1; y < dim[Y_DIR] - 1; y++)
+    {
+      rCG[x][y] = 0;
+      if (source[x][y] != 1)
+        rCG[x][y] = (
+          phi[x + 1][y] + phi[x - 1][y] +
+          phi[x][y + 1] + phi[x][y - 1]
+        ) * 0.25 - phi[x][y];
+    }
+  
+  /* initiate zCG and pCG */
+  Precondition_CG();
+  #pragma omp parallel for private(y) reduction(+:dots[:2]) schedule(static)
+  for (x = 1; x < dim[X_DIR] - 1; x++)
+    for (y = 1; y < dim[Y_DIR] - 1; y++)
+    {
+      pCG[x][y] = zCG[x][y];
+      dots[0] += rCG[x][y] * rCG[x][y];
+      dots[1] += rCG[x][y] * zCG[x][y];
+    }
+  
+  /* Obtain the global_residue also for the initial phi */
+  Phase_Begin(PHASE_REDUCE);
+  MPI_Allreduce(dots, global_dots, 2, MPI_DOUBLE, MPI_SUM, grid_comm);
+  Phase_End();
+  global_residue = global_dots[0];
+  global_rdotz = global_dots[1];
+}
+#endif
+
+void Setup_MPI_Datatypes()
+{
+  Debug("Setup_MPI_Datatypes", 0);
+  
+  /* Datatype for vertical data exchange (Y_DIR) */
+  MPI_Type_vector(dim[X_DIR] - 2, 1, row_stride, MPI_DOUBLE, &border_type[Y_DIR]);
+  MPI_Type_commit(&border_type[Y_DIR]);
+  
+  /* Datatype for horizontal data exchange (X_DIR) */
+  MPI_Type_vector(dim[Y_DIR] - 2, 1, 1, MPI_DOUBLE, &border_type[X_DIR]);
+  MPI_Type_commit(&border_type[X_DIR]);
+
+  if (halo > 1)
+  {
+    /* 'halo' interior rows, exchanged first */
+    MPI_Type_vector(halo, dim[Y_DIR] - 2, row_stride, MPI_DOUBLE, &halo_type[X_DIR]);
+    MPI_Type_commit(&halo_type[X_DIR]);
+
+    /* 'halo' columns over all rows including the ghosts, fills the corners */
+    MPI_Type_vector(dim[X_DIR] - 2 + 2 * halo, halo, row_stride, MPI_DOUBLE, &halo_type[Y_DIR]);
+    MPI_Type_commit(&halo_type[Y_DIR]);
+  }
+}
+
+double Do_Step(int parity)
+{
+  /* calculate interior of grid */
+  return Do_Step_Region(parity, 1, dim[X_DIR] - 1, 1, dim[Y_DIR] - 1);
+}
+
+/* SOR update of one colour on the block [x0, x1) x [y0, y1) */
+double Do_Step_Region(int parity, int x0, int x1, int y0, int y1)
+{
+  int x, y;
+  double old_phi;
+  double c;
+  double max_err = 0.0;
+  
+  int parity_offset = offset[X_DIR] + offset[Y_DIR];
+
+  /* the rows of one colour are independent */
+  if (kernel != KERNEL_PLAIN)
+  {
+    #pragma omp parallel for private(c) reduction(max:max_err) schedule(static)
+    for (x = x0; x < x1; x++)
+    {
+      c = Relax_Row(x, parity, y0, y1, omega);
+      max_err = max(max_err, c);
+    }
+    return max_err;
+  }
+
+  #pragma omp parallel for private(y, old_phi, c) reduction(max:max_err) schedule(static)
+  for (x = x0; x < x1; x++)
+    for (y = y0; y < y1; y++)
+      if ((x + y + parity_offset) % 2 == parity && source[x][y] != 1)
+      {
+        old_phi = phi[x][y];
+        c = (
+          phi[x + 1][y] + phi[x - 1][y] +
+          phi[x][y + 1] + phi[x][y - 1]
+        ) * 0.25 - old_phi;
+        if (rhs != NULL)
+          c += rhs[x][y];
+        phi[x][y] = old_phi + omega * c;
+  
+        if (max_err < fabs(old_phi - phi[x][y]))
+          max_err = fabs(old_phi - phi[x][y]);
+      }
+
+  return max_err;
+}
+
+/*
+ * Branch free SOR update of one colour on row x, y in [y0, y1), with
+ * relaxation w. Only points of the active colour are visited, sources are
+ * kept fixed by the mask.
+ */
+double Relax_Row(int x, int parity, int y0, int y1, double w)
+{
+  double *restrict p = phi[x];
+  const double *restrict p_left = phi[x - 1];
+  const double *restrict p_right = phi[x + 1];
+  const double *restrict m = mask[x];
+  double d, max_err = 0.0;
+  int y;
+  int y_start = y0 + ((x + y0 + offset[X_DIR] + offset[Y_DIR] + parity) & 1);
+
+  if (rhs != NULL)
+  {
+    const double *restrict b = rhs[x];
+
+    #pragma omp simd reduction(max:max_err) private(d)
+    for (y = y_start; y < y1; y += 2)
+    {
+      d = w * m[y] * (
+        (p_right[y] + p_left[y] + p[y + 1] + p[y - 1]) * 0.25 + b[y] - p[y]);
+      p[y] += d;
+      max_err = max(max_err, fabs(d));
+    }
+    return max_err;
+  }
+
+  #pragma omp simd reduction(max:max_err) private(d)
+  for (y = y_start; y < y1; y += 2)
+  {
+    d = w * m[y] * (
+      (p_right[y] + p_left[y] + p[y + 1] + p[y - 1]) * 0.25 - p[y]);
+    p[y] += d;
+    max_err = max(max_err, fabs(d));
+  }
+
+  return max_err;
+}
+
+/*
+ * One full red-black iteration including both halo exchanges, using a
+ * wavefront over the rows: black row x - 1 is updated right after red row
+ * x, while the three rows involved are still in cache. The red boundary
+ * strip goes first so its halo can travel during the interior pass.
+ * The result is identical to Do_Step(0), exchange, Do_Step(1), exchange,
+ * each colour with its own omega of the Chebyshev schedule.
+ * The wavefront is sequential in x, so only the strips use threads.
+ */
+double Do_Sweep_Fused()
+{
+  int x;
+  double err, max_err;
+  double w_red, w_black;
+
+  max_err = Do_Strip(0);
+  Exchange_Borders_Start(phi);
+
+  w_red = omega;
+  Next_Omega();
+  w_black = omega;
+  for (x = 2; x < dim[X_DIR] - 1; x++)
+  {
+    if (x < dim[X_DIR] - 2)
+    {
+      err = Relax_Row(x, 0, 2, dim[Y_DIR] - 2, w_red);
+      max_err = max(max_err, err);
+    }
+    if (x - 1 >= 2)
+    {
+      err = Relax_Row(x - 1, 1, 2, dim[Y_DIR] - 2, w_black);
+      max_err = max(max_err, err);
+    }
+  }
+
+  Exchange_Borders_Finish();
+  err = Do_Strip(1);
+  max_err = max(max_err, err);
+  Next_Omega();
+  Exchange_Borders_Start(phi);
+  Exchange_Borders_Finish();
+
+  return max_err;
+}
+
+/*
+ * Temporal blocking: one deep halo exchange followed by n <= 'halo' half
+ * steps on a region that shrinks by one layer per half step, ending on
+ * the interior after 'halo' of them. The ghost layers are recomputed
+ * redundantly, so the result is the same as exchanging after every half
+ * step. omega advances after every half step, as in Solve().
+ */
+double Do_Steps_Deep(int parity, int n)
+{
+  int j;
+  double err, max_err = 0.0;
+
+  Exchange_Halo(phi);
+
+  for (j = 0; j < n; j++)
+  {
+    err = Do_Step_Region((parity + j) % 2,
+      2 - halo + j, dim[X_DIR] - 2 + halo - j,
+      2 - halo + j, dim[Y_DIR] - 2 + halo - j);
+    max_err = max(max_err, err);
+    Next_Omega();
+  }
+
+  return max_err;
+}
+
+/*
+ * Bounds x0, x1, y0, y1 in b of strip k (0 .. 3) of the outermost ring of
+ * the interior, i.e. the points that depend on the halo, leaving
+ * [2, dim - 2) in both directions alone. Returns 0 if strip k is empty.
+ */
+int Strip_Bounds(int k, int *b)
+{
+  int x_last = max(dim[X_DIR] - 2, 2);
+  int y_last = max(dim[Y_DIR] - 2, 2);
+
+  switch (k)
+  {
+    case 0:
+      b[0] = 1; b[1] = 2; b[2] = 1; b[3] = dim[Y_DIR] - 1;
+      return 1;
+    case 1:
+      b[0] = dim[X_DIR] - 2; b[1] = dim[X_DIR] - 1; b[2] = 1; b[3] = dim[Y_DIR] - 1;
+      return dim[X_DIR] - 2 > 1;
+    case 2:
+      b[0] = 2; b[1] = x_last; b[2] = 1; b[3] = 2;
+      return 1;
+    default:
+      b[0] = 2; b[1] = x_last; b[2] = y_last; b[3] = dim[Y_DIR] - 1;
+      return dim[Y_DIR] - 2 > 1;
+  }
+}
+
+/* one half step on the four strips of Strip_Bounds() */
+double Do_Strip(int parity)
+{
+  int k, b[4];
+  double err, max_err = 0.0;
+
+  for (k = 0; k < 4; k++)
+    if (Strip_Bounds(k, b))
+    {
+      err = Do_Step_Region(parity, b[0], b[1], b[2], b[3]);
+      max_err = max(max_err, err);
+    }
+
+  return max_err;
+}
+
+/*
+ * Overlapped variant of Do_Step() followed by Exchange_Borders(): the halos
+ * of the previous half step are in flight while the deep interior is
+ * updated, the boundary strip follows once they have arrived.
+ */
+double Do_Step_Overlap(int parity)
+{
+  double err, max_err;
+
+  Exchange_Borders_Start(phi);
+  max_err = Do_Step_Region(parity, 2, dim[X_DIR] - 2, 2, dim[Y_DIR] - 2);
+  Exchange_Borders_Finish();
+  err = Do_Strip(parity);
+
+  return max(max_err, err);
+}
+
+#ifdef CG
+/*
+ * v = A * p on the block [x0, x1) x [y0, y1).
+ * Returns the block's part of p' * v, taken while v is still in register.
+ */
+double Compute_V_Region(int x0, int x1, int y0, int y1)
 {
   int x, y;
-  double a, g, global_pdotv, pdotv, global_new_rdotr, new_rdotr;
+  double pdotv = 0.0;
+
+  #pragma omp parallel for private(y) reduction(+:pdotv) schedule(static)
+  for (x = x0; x < x1; x++)
+    for (y = y0; y < y1; y++)
+    {
+      vCG[x][y] = pCG[x][y];
+      if (source[x][y] != 1) /* only if point is not fixed */
+        vCG[x][y] -= (
+          pCG[x + 1][y] + pCG[x - 1][y] +
+          pCG[x][y + 1] + pCG[x][y - 1]
+        ) * 0.25;
+      pdotv += pCG[x][y] * vCG[x][y];
+    }
+
+  return pdotv;
+}
+
+void Do_Step_CG()
+{
+  int x, y, k, b[4];
+  int update_phi = !overlap_reduction;
+  int jacobi = (preconditioner == PC_JACOBI);
+  double a, g, global_pdotv, pdotv, strips;
+  double new_dots[2], global_new_dots[2];	/* r' * r, r' * z */
+  MPI_Request req;
+  
+  /* Calculate "v" in interior of my grid (matrix-vector multiply) and p' * v */
+  if (overlap)
+  {
+    Exchange_Borders_Start(pCG);
+    pdotv = Compute_V_Region(2, dim[X_DIR] - 2, 2, dim[Y_DIR] - 2);
+    Exchange_Borders_Finish();
+    strips = 0.0;
+    for (k = 0; k < 4; k++)
+      if (Strip_Bounds(k, b))
+        strips += Compute_V_Region(b[0], b[1], b[2], b[3]);
+    pdotv += strips;
+  }
+  else
+    pdotv = Compute_V_Region(1, dim[X_DIR] - 1, 1, dim[Y_DIR] - 1);
+  
+  Phase_Begin(PHASE_REDUCE);
+  MPI_Allreduce(&pdotv, &global_pdotv, 1, MPI_DOUBLE, MPI_SUM, grid_comm);
+  Phase_End();
+  
+  a = global_rdotz / global_pdotv;
+  
+  new_dots[0] = 0;
+  new_dots[1] = 0;
+  if (preconditioner == PC_NONE || jacobi)
+  {
+    /* pointwise z: the updates of phi, r and z and both dots in one pass */
+    #pragma omp parallel for private(y) reduction(+:new_dots[:2]) schedule(static)
+    for (x = 1; x < dim[X_DIR] - 1; x++)
+      for (y = 1; y < dim[Y_DIR] - 1; y++)
+      {
+        if (update_phi)
+          phi[x][y] += a * pCG[x][y];
+        rCG[x][y] -= a * vCG[x][y];
+        if (jacobi)
+          zCG[x][y] = dCG[x][y] * rCG[x][y];
+        new_dots[0] += rCG[x][y] * rCG[x][y];
+        new_dots[1] += rCG[x][y] * zCG[x][y];
+      }
+  }
+  else
+  {
+    if (update_phi)
+    {
+      #pragma omp parallel for private(y) schedule(static)
+      for (x = 1; x < dim[X_DIR] - 1; x++)
+        for (y = 1; y < dim[Y_DIR] - 1; y++)
+          phi[x][y] += a * pCG[x][y];
+    }
+    
+    #pragma omp parallel for private(y) schedule(static)
+    for (x = 1; x < dim[X_DIR] - 1; x++)
+      for (y = 1; y < dim[Y_DIR] - 1; y++)
+        rCG[x][y] -= a * vCG[x][y];
+    
+    Precondition_CG();
+    
+    #pragma omp parallel for private(y) reduction(+:new_dots[:2]) schedule(static)
+    for (x = 1; x < dim[X_DIR] - 1; x++)
+      for (y = 1; y < dim[Y_DIR] - 1; y++)
+      {
+        new_dots[0] += rCG[x][y] * rCG[x][y];
+        new_dots[1] += rCG[x][y] * zCG[x][y];
+      }
+  }
+  
+  if (overlap_reduction)
+  {
+    /* the update of phi does not depend on r.r, hide the reduction behind it */
+    MPI_Iallreduce(new_dots, global_new_dots, 2, MPI_DOUBLE, MPI_SUM, grid_comm, &req);
+    #pragma omp parallel for private(y) schedule(static)
+    for (x = 1; x < dim[X_DIR] - 1; x++)
+      for (y = 1; y < dim[Y_DIR] - 1; y++)
+        phi[x][y] += a * pCG[x][y];
+    Phase_Begin(PHASE_REDUCE);
+    MPI_Wait(&req, MPI_STATUS_IGNORE);
+    Phase_End();
+  }
+  else
+  {
+    Phase_Begin(PHASE_REDUCE);
+    MPI_Allreduce(new_dots, global_new_dots, 2, MPI_DOUBLE, MPI_SUM, grid_comm);
+    Phase_End();
+  }
+  
+  g = global_new_dots[1] / global_rdotz;
+  global_residue = global_new_dots[0];
+  global_rdotz = global_new_dots[1];
   
-  /* Calculate "v" in interior of my grid (matrix-vector multiply) */
+  #pragma omp parallel for private(y) schedule(static)
   for (x = 1; x < dim[X_DIR] - 1; x++)
     for (y = 1; y < dim[Y_DIR] - 1; y++)
+      pCG[x][y] = zCG[x][y] + g * pCG[x][y];
+}
+#endif
+
+void Exchange_Borders()
+{
+  Debug("Exchange_Borders", 0);
+
+  /* the other engines exchange all four borders at once */
+  if (exchange != EXCHANGE_SENDRECV)
+  {
+    #ifdef CG
+    Exchange_Borders_Start(pCG);
+    #else
+    Exchange_Borders_Start(phi);
+    #endif
+    Exchange_Borders_Finish();
+    return;
+  }
+
+  Phase_Begin(PHASE_HALO);
+  Count_Halo(border_type);
+  
+  #ifdef CG
+  MPI_Sendrecv(
+    &pCG[1][1], 1, border_type[Y_DIR], proc_top, 0,
+    &pCG[1][dim[Y_DIR] - 1], 1, border_type[Y_DIR], proc_bottom, 0,
+    grid_comm, &status); /* all traffic in direction top */
+  
+  MPI_Sendrecv(
+    &pCG[1][dim[Y_DIR] - 2], 1, border_type[Y_DIR], proc_bottom, 1,
+    &pCG[1][0], 1, border_type[Y_DIR], proc_top, 1,
+    grid_comm, &status); /* all traffic in direction bottom */
+  
+  MPI_Sendrecv(
+    &pCG[1][1], 1, border_type[X_DIR], proc_left, 2,
+    &pCG[dim[X_DIR] - 1][1], 1, border_type[X_DIR], proc_right, 2,
+    grid_comm, &status); /* all traffic in direction left */
+  
+  MPI_Sendrecv(
+    &pCG[dim[X_DIR] - 2][1], 1, border_type[X_DIR], proc_right, 3,
+    &pCG[0][1], 1, border_type[X_DIR], proc_left, 3,
+    grid_comm, &status); /* all traffic in direction right */
+  #else
+  MPI_Sendrecv(
+    &phi[1][1], 1, border_type[Y_DIR], proc_top, 0,
+    &phi[1][dim[Y_DIR] - 1], 1, border_type[Y_DIR], proc_bottom, 0,
+    grid_comm, &status); /* all traffic in direction top */
+  
+  MPI_Sendrecv(
+    &phi[1][dim[Y_DIR] - 2], 1, border_type[Y_DIR], proc_bottom, 1,
+    &phi[1][0], 1, border_type[Y_DIR], proc_top, 1,
+    grid_comm, &status); /* all traffic in direction bottom */
+  
+  MPI_Sendrecv(
+    &phi[1][1], 1, border_type[X_DIR], proc_left, 2,
+    &phi[dim[X_DIR] - 1][1], 1, border_type[X_DIR], proc_right, 2,
+    grid_comm, &status); /* all traffic in direction left */
+  
+  MPI_Sendrecv(
+    &phi[dim[X_DIR] - 2][1], 1, border_type[X_DIR], proc_right, 3,
+    &phi[0][1], 1, border_type[X_DIR], proc_left, 3,
+    grid_comm, &status); /* all traffic in direction right */
+  #endif
+
+  Phase_End();
+}
+
+/* Exchange of all 'halo' ghost layers of a grid, corners included */
+void Exchange_Halo(double **grid)
+{
+  Debug("Exchange_Halo", 0);
+
+  Phase_Begin(PHASE_HALO);
+  Count_Halo(halo_type);
+
+  MPI_Sendrecv(
+    &grid[1][1], 1, halo_type[X_DIR], proc_left, 2,
+    &grid[dim[X_DIR] - 1][1], 1, halo_type[X_DIR], proc_right, 2,
+    grid_comm, &status); /* all traffic in direction left */
+
+  MPI_Sendrecv(
+    &grid[dim[X_DIR] - 1 - halo][1], 1, halo_type[X_DIR], proc_right, 3,
+    &grid[1 - halo][1], 1, halo_type[X_DIR], proc_left, 3,
+    grid_comm, &status); /* all traffic in direction right */
+
+  MPI_Sendrecv(
+    &grid[1 - halo][1], 1, halo_type[Y_DIR], proc_top, 0,
+    &grid[1 - halo][dim[Y_DIR] - 1], 1, halo_type[Y_DIR], proc_bottom, 0,
+    grid_comm, &status); /* all traffic in direction top */
+
+  MPI_Sendrecv(
+    &grid[1 - halo][dim[Y_DIR] - 1 - halo], 1, halo_type[Y_DIR], proc_bottom, 1,
+    &grid[1 - halo][1 - halo], 1, halo_type[Y_DIR], proc_top, 1,
+    grid_comm, &status); /* all traffic in direction bottom */
+
+  Phase_End();
+}
+
+/*
+ * Non-blocking counterpart of Exchange_Borders() for an arbitrary grid.
+ * Only the outermost interior ring is sent and only the ghost ring is
+ * received, so [2, dim - 2) may be updated until Exchange_Borders_Finish().
+ */
+void Exchange_Borders_Start(double **grid)
+{
+  Debug("Exchange_Borders_Start", 0);
+
+  Phase_Begin(PHASE_HALO);
+  Count_Halo(border_type);
+
+  if (exchange == EXCHANGE_PERSISTENT)
+  {
+    border_active = Border_Requests(grid);
+    border_nreq = 8;
+    MPI_Startall(8, border_active);
+  }
+  else if (exchange == EXCHANGE_NEIGHBOR)
+    Exchange_Borders_Neighbor(grid);
+  else
+    Exchange_Borders_Post(grid);
+
+  Phase_End();
+}
+
+/* Exchange_Borders_Start() with MPI_Irecv/MPI_Isend per direction */
+void Exchange_Borders_Post(double **grid)
+{
+  border_active = border_req;
+  border_nreq = 8;
+  MPI_Irecv(&grid[1][dim[Y_DIR] - 1], 1, border_type[Y_DIR], proc_bottom, 0,
+    grid_comm, &border_req[0]);
+  MPI_Irecv(&grid[1][0], 1, border_type[Y_DIR], proc_top, 1,
+    grid_comm, &border_req[1]);
+  MPI_Irecv(&grid[dim[X_DIR] - 1][1], 1, border_type[X_DIR], proc_right, 2,
+    grid_comm, &border_req[2]);
+  MPI_Irecv(&grid[0][1], 1, border_type[X_DIR], proc_left, 3,
+    grid_comm, &border_req[3]);
+
+  MPI_Isend(&grid[1][1], 1, border_type[Y_DIR], proc_top, 0,
+    grid_comm, &border_req[4]); /* all traffic in direction top */
+  MPI_Isend(&grid[1][dim[Y_DIR] - 2], 1, border_type[Y_DIR], proc_bottom, 1,
+    grid_comm, &border_req[5]); /* all traffic in direction bottom */
+  MPI_Isend(&grid[1][1], 1, border_type[X_DIR], proc_left, 2,
+    grid_comm, &border_req[6]); /* all traffic in direction left */
+  MPI_Isend(&grid[dim[X_DIR] - 2][1], 1, border_type[X_DIR], proc_right, 3,
+    grid_comm, &border_req[7]); /* all traffic in direction right */
+}
+
+void Exchange_Borders_Finish()
+{
+  Phase_Begin(PHASE_HALO);
+  MPI_Waitall(border_nreq, border_active, MPI_STATUSES_IGNORE);
+  Phase_End();
+}
+
+/*
+ * The requests of Exchange_Borders_Start() as persistent requests, set
+ * up the first time a grid is exchanged. Every grid belongs to a single
+ * multigrid level, so the datatypes and neighbours of the current level
+ * are the right ones.
+ */
+MPI_Request *Border_Requests(double **grid)
+{
+  int k;
+  MPI_Request *req;
+
+  for (k = 0; k < N_border_grids && border_grid[k] != grid; k++) ;
+  if (k < N_border_grids)
+    return border_preq[k];
+
+  if (k == MAX_HALO_GRIDS)
+    Debug("Border_Requests : too many exchanged grids", 1);
+  req = border_preq[k];
+  MPI_Recv_init(&grid[1][dim[Y_DIR] - 1], 1, border_type[Y_DIR], proc_bottom, 0,
+    grid_comm, &req[0]);
+  MPI_Recv_init(&grid[1][0], 1, border_type[Y_DIR], proc_top, 1,
+    grid_comm, &req[1]);
+  MPI_Recv_init(&grid[dim[X_DIR] - 1][1], 1, border_type[X_DIR], proc_right, 2,
+    grid_comm, &req[2]);
+  MPI_Recv_init(&grid[0][1], 1, border_type[X_DIR], proc_left, 3,
+    grid_comm, &req[3]);
+  MPI_Send_init(&grid[1][1], 1, border_type[Y_DIR], proc_top, 0,
+    grid_comm, &req[4]);
+  MPI_Send_init(&grid[1][dim[Y_DIR] - 2], 1, border_type[Y_DIR], proc_bottom, 1,
+    grid_comm, &req[5]);
+  MPI_Send_init(&grid[1][1], 1, border_type[X_DIR], proc_left, 2,
+    grid_comm, &req[6]);
+  MPI_Send_init(&grid[dim[X_DIR] - 2][1], 1, border_type[X_DIR], proc_right, 3,
+    grid_comm, &req[7]);
+  border_grid[k] = grid;
+  N_border_grids++;
+
+  return req;
+}
+
+/*
+ * Starts the border exchange as one MPI_Ineighbor_alltoallw. A Cartesian
+ * communicator orders the neighbours per dimension, negative side first:
+ * left, right, top, bottom. The borders are packed into border_buf, as
+ * the send and receive buffer of a collective may not be the same; the
+ * ghosts are received in place, relative to &grid[0][0].
+ */
+void Exchange_Borders_Neighbor(double **grid)
+{
+  int j, pos, size, need = 0;
+  int nb[4], scounts[4], rcounts[4];
+  MPI_Aint sdispls[4], rdispls[4];
+  MPI_Datatype stypes[4], rtypes[4];
+  double *send[4], *recv[4];
+  char *base = (char *) &grid[0][0];
+
+  border_nreq = 0;
+  if (proc_left == MPI_PROC_NULL && proc_right == MPI_PROC_NULL &&
+      proc_top == MPI_PROC_NULL && proc_bottom == MPI_PROC_NULL)
+    return;		/* single process, or an agglomerated level */
+
+  nb[0] = proc_left;
+  nb[1] = proc_right;
+  nb[2] = proc_top;
+  nb[3] = proc_bottom;
+  send[0] = &grid[1][1];
+  send[1] = &grid[dim[X_DIR] - 2][1];
+  send[2] = &grid[1][1];
+  send[3] = &grid[1][dim[Y_DIR] - 2];
+  recv[0] = &grid[0][1];
+  recv[1] = &grid[dim[X_DIR] - 1][1];
+  recv[2] = &grid[1][0];
+  recv[3] = &grid[1][dim[Y_DIR] - 1];
+
+  for (j = 0; j < 4; j++)
+  {
+    rtypes[j] = border_type[j < 2 ? X_DIR : Y_DIR];
+    MPI_Pack_size(1, rtypes[j], grid_comm, &size);
+    need += size;
+  }
+  if (need > border_buf_size)
+  {
+    border_buf_size = need;
+    if ((border_buf = realloc(border_buf, border_buf_size)) == NULL)
+      Debug("Exchange_Borders_Neighbor : realloc(border_buf) failed", 1);
+  }
+
+  pos = 0;
+  for (j = 0; j < 4; j++)
+  {
+    stypes[j] = MPI_PACKED;
+    sdispls[j] = pos;
+    rdispls[j] = (char *) recv[j] - base;
+    rcounts[j] = (nb[j] == MPI_PROC_NULL) ? 0 : 1;
+    if (nb[j] != MPI_PROC_NULL)
+      MPI_Pack(send[j], 1, rtypes[j], border_buf, border_buf_size, &pos, grid_comm);
+    scounts[j] = pos - sdispls[j];
+  }
+
+  MPI_Ineighbor_alltoallw(border_buf, scounts, sdispls, stypes,
+    base, rcounts, rdispls, rtypes, grid_comm, &border_req[0]);
+  border_active = border_req;
+  border_nreq = 1;
+}
+
+/*
+ * Multigrid. level[0] is the local grid itself, and level n + 1 has half
+ * the points of level n in each direction: coarse point I is fine point
+ * 2I. Smoothing is red-black Gauss-Seidel through Do_Step(), so each
+ * level is made current with Use_Level() first. The coarse operator is
+ * the same 5-point stencil, so the coarse right hand side is 4 times the
+ * full weighting of the residual, which is the transpose of bilinear
+ * prolongation. Levels keep the decomposition of grid_comm until a
+ * subgrid would be smaller than mg_coarse_size in either direction. That
+ * "gather" level is then copied to rank 0, which handles all coarser
+ * levels on its own.
+ */
+void Use_Level(Level *l)
+{
+  phi = l->phi;
+  rhs = l->rhs;
+  source = l->source;
+  mask = l->mask;
+  dim[X_DIR] = l->dim[X_DIR];
+  dim[Y_DIR] = l->dim[Y_DIR];
+  offset[X_DIR] = l->offset[X_DIR];
+  offset[Y_DIR] = l->offset[Y_DIR];
+  row_stride = l->row_stride;
+  grid_comm = l->comm;
+  proc_top = l->top;
+  proc_right = l->right;
+  proc_bottom = l->bottom;
+  proc_left = l->left;
+  border_type[X_DIR] = l->border_type[X_DIR];
+  border_type[Y_DIR] = l->border_type[Y_DIR];
+  halo_type[X_DIR] = l->halo_type[X_DIR];
+  halo_type[Y_DIR] = l->halo_type[Y_DIR];
+}
+
+/* border and corner including datatypes of a level, halo is 1 */
+void Setup_Level_Datatypes(Level *l)
+{
+  MPI_Type_vector(l->dim[X_DIR] - 2, 1, l->row_stride, MPI_DOUBLE, &l->border_type[Y_DIR]);
+  MPI_Type_commit(&l->border_type[Y_DIR]);
+  MPI_Type_vector(l->dim[Y_DIR] - 2, 1, 1, MPI_DOUBLE, &l->border_type[X_DIR]);
+  MPI_Type_commit(&l->border_type[X_DIR]);
+  MPI_Type_vector(1, l->dim[Y_DIR] - 2, l->row_stride, MPI_DOUBLE, &l->halo_type[X_DIR]);
+  MPI_Type_commit(&l->halo_type[X_DIR]);
+  MPI_Type_vector(l->dim[X_DIR], 1, l->row_stride, MPI_DOUBLE, &l->halo_type[Y_DIR]);
+  MPI_Type_commit(&l->halo_type[Y_DIR]);
+}
+
+/* Packs the interior of 'local' on the gather level into mg_allbuf on rank 0 */
+void MG_Gather(Level *w, double **local)
+{
+  int x, y, p, n = 0;
+
+  for (x = 1; x < w->dim[X_DIR] - 1; x++)
+    for (y = 1; y < w->dim[Y_DIR] - 1; y++)
+      mg_buf[n++] = local[x][y];
+
+  if (proc_rank == 0)
+    for (p = 0; p < P; p++)
+    {
+      mg_counts[p] = (mg_layout[4 * p + 2] - 2) * (mg_layout[4 * p + 3] - 2);
+      mg_displs[p] = (p == 0) ? 0 : mg_displs[p - 1] + mg_counts[p - 1];
+    }
+
+  Phase_Begin(PHASE_HALO);
+  MPI_Gatherv(mg_buf, n, MPI_DOUBLE, mg_allbuf, mg_counts, mg_displs,
+    MPI_DOUBLE, 0, w->comm);
+  Phase_End();
+}
+
+/* Rank 0: unpacks the result of MG_Gather() into the copy of the gather level */
+void MG_Unpack(double **global)
+{
+  int x, y, p, n;
+  int *lay;
+
+  for (p = 0; p < P; p++)
+  {
+    lay = mg_layout + 4 * p;
+    n = mg_displs[p];
+    for (x = 1; x < lay[2] - 1; x++)
+      for (y = 1; y < lay[3] - 1; y++)
+        global[lay[0] + x][lay[1] + y] = mg_allbuf[n++];
+  }
+}
+
+/* Sends every process its part of 'global', ghost ring included */
+void MG_Scatter(Level *w, double **global, double **local)
+{
+  int x, y, p, n = 0;
+  int *lay;
+
+  if (proc_rank == 0)
+    for (p = 0; p < P; p++)
+    {
+      lay = mg_layout + 4 * p;
+      mg_counts[p] = lay[2] * lay[3];
+      mg_displs[p] = n;
+      for (x = 0; x < lay[2]; x++)
+        for (y = 0; y < lay[3]; y++)
+          mg_allbuf[n++] = global[lay[0] + x][lay[1] + y];
+    }
+
+  Phase_Begin(PHASE_HALO);
+  MPI_Scatterv(mg_allbuf, mg_counts, mg_displs, MPI_DOUBLE,
+    mg_buf, w->dim[X_DIR] * w->dim[Y_DIR], MPI_DOUBLE, 0, w->comm);
+  Phase_End();
+
+  n = 0;
+  for (x = 0; x < w->dim[X_DIR]; x++)
+    for (y = 0; y < w->dim[Y_DIR]; y++)
+      local[x][y] = mg_buf[n++];
+}
+
+/*
+ * Allocates and initialises level c below level f. A point of c is fixed
+ * if it lies outside the domain or if any fine point of its full
+ * weighting stencil is fixed. Fixing only the point on top would put
+ * sources between coarse points, and the domain boundary of an even
+ * sized grid, in the wrong place, and the cycle would diverge.
+ */
+void Setup_Level(Level *c, Level *f)
+{
+  int x, y, i, j, p, gx, gy, n;
+  int lay[4];
+
+  c->row_stride = c->dim[Y_DIR];
+  Use_Level(c);
+  c->phi = Alloc_Grid("mg phi");
+  c->rhs = Alloc_Grid("mg rhs");
+  c->res = Alloc_Grid("mg res");
+  c->mask = Alloc_Grid("mg mask");
+  c->source = Alloc_Source();
+
+  if (f->gather)
+    MG_Unpack(c->mask);
+
+  for (x = 0; x < c->dim[X_DIR]; x++)
+    for (y = 0; y < c->dim[Y_DIR]; y++)
+    {
+      c->phi[x][y] = 0.0;
+      c->rhs[x][y] = 0.0;
+      c->res[x][y] = 0.0;
+      gx = x + c->offset[X_DIR];
+      gy = y + c->offset[Y_DIR];
+      if (gx < 1 || gx > c->gridsize[X_DIR] || gy < 1 || gy > c->gridsize[Y_DIR])
+        c->source[x][y] = 1;
+      else if (x == 0 || x == c->dim[X_DIR] - 1 || y == 0 || y == c->dim[Y_DIR] - 1)
+        c->source[x][y] = 0;
+      else if (f->gather)
+        c->source[x][y] = (c->mask[x][y] == 0.0);
+      else
+      {
+        c->source[x][y] = 0;
+        for (i = -1; i <= 1; i++)
+          for (j = -1; j <= 1; j++)
+            if (f->source[2 * gx - f->offset[X_DIR] + i][2 * gy - f->offset[Y_DIR] + j] == 1)
+              c->source[x][y] = 1;
+      }
+      c->mask[x][y] = (c->source[x][y] == 1) ? 0.0 : 1.0;
+    }
+
+  if (!c->gather)
+  {
+    /* the next level needs the flags of the ghost points as well */
+    Setup_Level_Datatypes(c);
+    Use_Level(c);
+    Exchange_Halo(c->mask);
+    for (x = 0; x < c->dim[X_DIR]; x++)
+      for (y = 0; y < c->dim[Y_DIR]; y++)
+        c->source[x][y] = (c->mask[x][y] == 0.0);
+    return;
+  }
+
+  /* the gather level: layout of all processes and packing buffers on rank 0 */
+  if ((mg_buf = malloc(c->dim[X_DIR] * c->dim[Y_DIR] * sizeof(double))) == NULL)
+    Debug("Setup_Level : malloc(mg_buf) failed", 1);
+  if (proc_rank == 0)
+  {
+    if ((mg_layout = malloc(4 * P * sizeof(int))) == NULL)
+      Debug("Setup_Level : malloc(mg_layout) failed", 1);
+    if ((mg_counts = malloc(P * sizeof(int))) == NULL)
+      Debug("Setup_Level : malloc(mg_counts) failed", 1);
+    if ((mg_displs = malloc(P * sizeof(int))) == NULL)
+      Debug("Setup_Level : malloc(mg_displs) failed", 1);
+  }
+  lay[0] = c->offset[X_DIR];
+  lay[1] = c->offset[Y_DIR];
+  lay[2] = c->dim[X_DIR];
+  lay[3] = c->dim[Y_DIR];
+  MPI_Gather(lay, 4, MPI_INT, mg_layout, 4, MPI_INT, 0, c->comm);
+  if (proc_rank == 0)
+  {
+    n = 0;
+    for (p = 0; p < P; p++)
+      n += mg_layout[4 * p + 2] * mg_layout[4 * p + 3];
+    if ((mg_allbuf = malloc(n * sizeof(double))) == NULL)
+      Debug("Setup_Level : malloc(mg_allbuf) failed", 1);
+  }
+
+  MG_Gather(c, c->mask);
+}
+
+/* res = rhs - A * phi on the current level, returns the local r' * r */
+double MG_Residual(double **res)
+{
+  int x, y;
+  double r, sum = 0.0;
+
+  #pragma omp parallel for private(y, r) reduction(+:sum) schedule(static)
+  for (x = 1; x < dim[X_DIR] - 1; x++)
+    for (y = 1; y < dim[Y_DIR] - 1; y++)
+    {
+      r = 0.0;
+      if (source[x][y] != 1)
+      {
+        r = (phi[x + 1][y] + phi[x - 1][y] +
+          phi[x][y + 1] + phi[x][y - 1]) * 0.25 - phi[x][y];
+        if (rhs != NULL)
+          r += rhs[x][y];
+      }
+      res[x][y] = r;
+      sum += r * r;
+    }
+
+  return sum;
+}
+
+/* c->rhs = 4 * full weighting of f->res, the ghosts of f->res must be up to date */
+void MG_Restrict(Level *f, Level *c)
+{
+  int X, Y, x, y;
+  double **r = f->res;
+
+  #pragma omp parallel for private(Y, x, y) schedule(static)
+  for (X = 1; X < c->dim[X_DIR] - 1; X++)
+    for (Y = 1; Y < c->dim[Y_DIR] - 1; Y++)
+    {
+      x = 2 * (X + c->offset[X_DIR]) - f->offset[X_DIR];
+      y = 2 * (Y + c->offset[Y_DIR]) - f->offset[Y_DIR];
+      if (c->source[X][Y] == 1)
+        c->rhs[X][Y] = 0.0;
+      else
+        c->rhs[X][Y] = r[x][y] +
+          0.5 * (r[x + 1][y] + r[x - 1][y] + r[x][y + 1] + r[x][y - 1]) +
+          0.25 * (r[x + 1][y + 1] + r[x + 1][y - 1] +
+            r[x - 1][y + 1] + r[x - 1][y - 1]);
+    }
+}
+
+/* f->phi += bilinear interpolation of c->phi, the ghosts of c->phi must be up to date */
+void MG_Prolong(Level *c, Level *f)
+{
+  int x, y, gx, gy, X0, X1, Y0, Y1;
+  double **e = c->phi;
+
+  #pragma omp parallel for private(y, gx, gy, X0, X1, Y0, Y1) schedule(static)
+  for (x = 1; x < f->dim[X_DIR] - 1; x++)
+  {
+    gx = x + f->offset[X_DIR];
+    X0 = gx / 2 - c->offset[X_DIR];
+    X1 = (gx + 1) / 2 - c->offset[X_DIR];
+    for (y = 1; y < f->dim[Y_DIR] - 1; y++)
+      if (f->source[x][y] != 1)
+      {
+        gy = y + f->offset[Y_DIR];
+        Y0 = gy / 2 - c->offset[Y_DIR];
+        Y1 = (gy + 1) / 2 - c->offset[Y_DIR];
+        f->phi[x][y] += 0.25 * (e[X0][Y0] + e[X0][Y1] + e[X1][Y0] + e[X1][Y1]);
+      }
+  }
+}
+
+/* 'sweeps' red-black sweeps on the current level, starting with colour 'first' */
+void MG_Smooth(int first, int sweeps)
+{
+  int i;
+
+  Exchange_Borders_Start(phi);
+  Exchange_Borders_Finish();
+  for (i = 0; i < sweeps; i++)
+  {
+    Do_Step(first);
+    Exchange_Borders_Start(phi);
+    Exchange_Borders_Finish();
+    Do_Step(1 - first);
+    Exchange_Borders_Start(phi);
+    Exchange_Borders_Finish();
+  }
+}
+
+/*
+ * One cycle on level n, improving level[n].phi. The post-smoothing runs
+ * the colours in reverse order, so the cycle is a symmetric operator and
+ * can be used as a CG preconditioner.
+ */
+void MG_Cycle(int n)
+{
+  int k;
+  Level *l = &level[n];
+  Level *c = &level[n + 1];
+
+  if (l->gather)
+  {
+    Use_Level(l);
+    MG_Gather(l, l->phi);
+    if (proc_rank == 0)
+      MG_Unpack(c->phi);
+    MG_Gather(l, l->rhs);
+    if (proc_rank == 0)
+    {
+      MG_Unpack(c->rhs);
+      MG_Cycle(n + 1);
+      Use_Level(l);
+    }
+    MG_Scatter(l, c->phi, l->phi);
+    return;
+  }
+
+  Use_Level(l);
+  if (n == N_levels - 1)
+  {
+    /* coarsest level */
+    k = l->gridsize[X_DIR] + l->gridsize[Y_DIR];
+    MG_Smooth(0, k);
+    MG_Smooth(1, k);
+    return;
+  }
+
+  MG_Smooth(0, mg_smooth);
+  MG_Residual(l->res);
+  Exchange_Halo(l->res);
+  MG_Restrict(l, c);
+
+  for (k = 0; k < c->dim[X_DIR] * c->dim[Y_DIR]; k++)
+    c->phi[0][k] = 0.0;
+  for (k = 0; k < mg_cycle; k++)
+    MG_Cycle(n + 1);
+  if (!c->gather)
+  {
+    Use_Level(c);
+    Exchange_Halo(c->phi);
+  }
+
+  Use_Level(l);
+  MG_Prolong(c, l);
+  MG_Smooth(1, mg_smooth);
+}
+
+void Setup_Multigrid()
+{
+  int k, ext[2], min_ext;
+  Level *f, *c;
+
+  Debug("Setup_Multigrid", 0);
+
+  if (halo != 1)
+    Debug("Setup_Multigrid : multigrid needs halo width 1", 1);
+  if (mg_coarse_size < 1 || mg_smooth < 1)
+    Debug("Setup_Multigrid : invalid multigrid settings in input.dat", 1);
+
+  omega = 1.0;		/* the smoother is red-black Gauss-Seidel */
+  omega_mode = OMEGA_FIXED;
+
+  /* level 0 is the grid set up by Setup_Grid() */
+  c = &level[0];
+  c->gridsize[X_DIR] = gridsize[X_DIR];
+  c->gridsize[Y_DIR] = gridsize[Y_DIR];
+  c->offset[X_DIR] = offset[X_DIR];
+  c->offset[Y_DIR] = offset[Y_DIR];
+  c->dim[X_DIR] = dim[X_DIR];
+  c->dim[Y_DIR] = dim[Y_DIR];
+  c->row_stride = row_stride;
+  c->phi = phi;
+  c->rhs = NULL;
+  c->source = source;
+  c->mask = mask;
+  c->comm = grid_comm;
+  c->top = proc_top;
+  c->right = proc_right;
+  c->bottom = proc_bottom;
+  c->left = proc_left;
+  Setup_Level_Datatypes(c);
+  c->res = Alloc_Grid("mg res");
+  for (k = 0; k < c->dim[X_DIR] * c->dim[Y_DIR]; k++)
+    c->res[0][k] = 0.0;
+  N_levels = 1;
+
+  while (N_levels < MAX_LEVELS)
+  {
+    f = &level[N_levels - 1];
+    c = &level[N_levels];
+
+    if (f->gather)
+    {
+      /* the same level again, on rank 0 only */
+      if (proc_rank != 0)
+        break;
+      c->gridsize[X_DIR] = f->gridsize[X_DIR];
+      c->gridsize[Y_DIR] = f->gridsize[Y_DIR];
+    }
+    else
+    {
+      if (f->gridsize[X_DIR] < 4 || f->gridsize[Y_DIR] < 4)
+        break;
+      c->gridsize[X_DIR] = f->gridsize[X_DIR] / 2;
+      c->gridsize[Y_DIR] = f->gridsize[Y_DIR] / 2;
+    }
+
+    if (f->gather || f->comm == MPI_COMM_SELF)
+    {
+      c->offset[X_DIR] = 0;
+      c->offset[Y_DIR] = 0;
+      c->dim[X_DIR] = c->gridsize[X_DIR] + 2;
+      c->dim[Y_DIR] = c->gridsize[Y_DIR] + 2;
+      c->comm = MPI_COMM_SELF;
+      c->top = c->right = c->bottom = c->left = MPI_PROC_NULL;
+    }
+    else
+    {
+      /* the coarse points on top of the fine points of this process */
+      c->offset[X_DIR] = f->offset[X_DIR] / 2;
+      c->offset[Y_DIR] = f->offset[Y_DIR] / 2;
+      c->dim[X_DIR] = (f->offset[X_DIR] + f->dim[X_DIR] - 2) / 2 - c->offset[X_DIR] + 2;
+      c->dim[Y_DIR] = (f->offset[Y_DIR] + f->dim[Y_DIR] - 2) / 2 - c->offset[Y_DIR] + 2;
+      c->comm = f->comm;
+      c->top = f->top;
+      c->right = f->right;
+      c->bottom = f->bottom;
+      c->left = f->left;
+
+      ext[0] = c->dim[X_DIR] - 2;
+      ext[1] = c->dim[Y_DIR] - 2;
+      ext[0] = (ext[0] < ext[1]) ? ext[0] : ext[1];
+      MPI_Allreduce(&ext[0], &min_ext, 1, MPI_INT, MPI_MIN, c->comm);
+      c->gather = (P > 1 && min_ext < mg_coarse_size);
+    }
+
+    Setup_Level(c, f);
+    N_levels++;
+  }
+
+  Use_Level(&level[0]);
+}
+
+/* z = one multigrid cycle applied to r, starting from z = 0 */
+void MG_Precondition(double **z, double **r)
+{
+  int x, y;
+  double **grid = level[0].phi;
+
+  for (x = 0; x < dim[X_DIR]; x++)
+    for (y = 0; y < dim[Y_DIR]; y++)
+      z[x][y] = 0.0;
+
+  level[0].phi = z;
+  level[0].rhs = r;
+  MG_Cycle(0);
+  level[0].phi = grid;
+  level[0].rhs = NULL;
+  Use_Level(&level[0]);
+}
+
+/* Standalone multigrid, cycles until r' * r is below precision_goal */
+int MG_Solve()
+{
+  int count = 0;
+  double sub, global_res = 2 * precision_goal;
+
+  if (restart)
+  {
+    count = Read_Checkpoint();
+    global_res = ckpt_scalar[0];
+  }
+  while (global_res > precision_goal && count < max_iter)
+  {
+    MG_Cycle(0);
+    count++;
+    sub = MG_Residual(level[0].res);
+    Phase_Begin(PHASE_REDUCE);
+    MPI_Allreduce(&sub, &global_res, 1, MPI_DOUBLE, MPI_SUM, grid_comm);
+    Phase_End();
+    Checkpoint(count, 0, global_res);
+  }
+
+  return count;
+}
+
+void Free_Multigrid()
+{
+  int n;
+
+  for (n = 0; n < N_levels; n++)
+  {
+    if (!level[n].gather)
+    {
+      MPI_Type_free(&level[n].border_type[X_DIR]);
+      MPI_Type_free(&level[n].border_type[Y_DIR]);
+      MPI_Type_free(&level[n].halo_type[X_DIR]);
+      MPI_Type_free(&level[n].halo_type[Y_DIR]);
+    }
+    if (level[n].gather)
+    {
+      free(mg_buf);
+      if (proc_rank == 0)
+      {
+        free(mg_layout);
+        free(mg_counts);
+        free(mg_displs);
+        free(mg_allbuf);
+      }
+    }
+  }
+  N_levels = 0;
+}
+
+/*
+ * Adaptive omega, after Hageman and Young. While omega <= omega_b the
+ * SOR error shrinks by lambda per iteration, with
+ * (lambda + omega - 1)^2 = lambda * omega^2 * rho^2 and rho the spectral
+ * radius of Jacobi. lambda is measured as the decay of global_delta, the
+ * change at iteration iter, over at least OMEGA_WINDOW iterations. The
+ * estimates of rho come from below, so omega_b = 2 / (1 + sqrt(1 - rho^2))
+ * is approached from below: a larger estimate is taken, and the next
+ * window starts after it. global_delta is the same on all processes, so
+ * they all pick the same omega.
+ */
+void Adapt_Omega(int iter, double global_delta)
+{
+  double lambda, rho2, pi = acos(-1.0);
+  /* rho of the grid without sources, the sources only lower it */
+  double rho_max = 0.5 * (cos(pi / (gridsize[X_DIR] + 1)) + cos(pi / (gridsize[Y_DIR] + 1)));
+
+  if (omega_mode == OMEGA_FIXED || global_delta <= 0.0)
+    return;
+  if (omega_iter < 0)
+  {
+    omega_iter = iter;
+    omega_delta = global_delta;
+    return;
+  }
+  if (iter - omega_iter < OMEGA_WINDOW)
+    return;
+
+  lambda = pow(global_delta / omega_delta, 1.0 / (iter - omega_iter));
+  omega_iter = iter;
+  omega_delta = global_delta;
+
+  /* no decay yet, or close enough to omega_b, where lambda = omega - 1 */
+  if (lambda >= 1.0 || lambda <= pow(omega - 1.0, OMEGA_F))
+    return;
+  rho2 = (lambda + omega - 1.0) * (lambda + omega - 1.0) / (lambda * omega * omega);
+  if (rho2 > rho_max * rho_max)
+    rho2 = rho_max * rho_max;
+  if (rho2 <= rho_jacobi * rho_jacobi)
+    return;
+
+  rho_jacobi = sqrt(rho2);
+  if (omega_mode == OMEGA_ADAPTIVE)
+    omega = 2.0 / (1.0 + sqrt(1.0 - rho2));
+  omega_iter = -1;
+  if (proc_rank == 0)
+    printf("(%i / %i) Iteration %i: spectral radius %f, omega_b %f\n", proc_rank, P,
+           iter, rho_jacobi, 2.0 / (1.0 + sqrt(1.0 - rho2)));
+}
+
+/*
+ * Chebyshev acceleration of the red-black sweeps: the omega of the next
+ * half step, 1 / (1 - rho^2 * omega / 4), which starts at 1 and tends to
+ * omega_b of the current estimate of rho.
+ */
+void Next_Omega()
+{
+  if (omega_mode == OMEGA_CHEBYSHEV)
+    omega = 1.0 / (1.0 - 0.25 * rho_jacobi * rho_jacobi * omega);
+}
+
+void Solve()
+{
+  Debug("Solve", 0);
+  int count = 0;
+  
+  #ifdef CG
+  InitCG();
+  if (restart)
+  {
+    /* zCG is not saved, it follows from rCG */
+    count = Read_Checkpoint();
+    Precondition_CG();
+  }
+  while (global_residue > precision_goal && count < max_iter)
+  {
+    if (!overlap)
+      Exchange_Borders();
+    Do_Step_CG();
+    count++;
+    Checkpoint(count, 0, global_residue);
+  }
+  #else
+  double delta;
+  double delta1, delta2;
+  double global_delta;
+  int step = 0;		/* half steps done */
+  int last_check = 0;	/* iteration of the last convergence check */
+  int n;
+  double send_delta, recv_delta;
+  MPI_Request delta_req = MPI_REQUEST_NULL;
+  
+  if (multigrid)
+  {
+    count = MG_Solve();
+    global_delta = 0.0;		/* MG_Solve() did the convergence test */
+  }
+  else
+    /* give global_delta a higher value then precision_goal */
+    global_delta = 2 * precision_goal;
+
+  if (restart && !multigrid)
+  {
+    /* the ghost points are not saved, fill them before the first step */
+    count = Read_Checkpoint();
+    step = ckpt_step;
+    last_check = count - count % check_interval;
+    global_delta = ckpt_scalar[0];
+    Exchange_Borders();
+  }
+  else
+    omega_iter = -1;	/* a restart continues the estimate of the checkpoint */
+
+  /* with an odd halo width a block may end on a red half step */
+  while ((global_delta > precision_goal || step % 2) && count < max_iter)
+  {
+    if (halo > 1)
+    {
+      /* the last block ends with the black half step or at max_iter */
+      n = halo;
+      if (global_delta <= precision_goal)
+        n = 1;
+      if (n > 2 * max_iter - step)
+        n = 2 * max_iter - step;
+      Debug("Do_Steps_Deep", 0);
+      delta1 = Do_Steps_Deep(step % 2, n);
+      delta2 = 0.0;
+      step += n - 2;
+    }
+    else if (kernel == KERNEL_FUSED)
+    {
+      Debug("Do_Sweep_Fused", 0);
+      delta1 = Do_Sweep_Fused();
+      delta2 = 0.0;
+    }
+    else if (overlap)
+    {
+      /* each half step first completes the halo of the previous one */
+      Debug("Do_Step_Overlap 0", 0);
+      delta1 = Do_Step_Overlap(0);
+      Next_Omega();
+
+      Debug("Do_Step_Overlap 1", 0);
+      delta2 = Do_Step_Overlap(1);
+      Next_Omega();
+    }
+    else
+    {
+      Debug("Do_Step 0", 0);
+      delta1 = Do_Step(0);
+      Exchange_Borders();
+      Next_Omega();
+
+      Debug("Do_Step 1", 0);
+      delta2 = Do_Step(1);
+      Exchange_Borders();
+      Next_Omega();
+    }
+
+    delta = max(delta1, delta2);
+    step += 2;
+    count = step / 2;
+
+    /* a started reduction is completed one iteration later */
+    if (delta_req != MPI_REQUEST_NULL)
+    {
+      Phase_Begin(PHASE_REDUCE);
+      MPI_Wait(&delta_req, MPI_STATUS_IGNORE);
+      Phase_End();
+      global_delta = recv_delta;
+      Adapt_Omega(last_check, global_delta);
+    }
+
+    if (count - last_check >= check_interval || count >= max_iter)
+    {
+      last_check = count;
+      if (overlap_reduction)
+      {
+        send_delta = delta;
+        MPI_Iallreduce(&send_delta, &recv_delta, 1, MPI_DOUBLE, MPI_MAX, grid_comm, &delta_req);
+      }
+      else
+      {
+        Phase_Begin(PHASE_REDUCE);
+        MPI_Allreduce(&delta, &global_delta, 1, MPI_DOUBLE, MPI_MAX, grid_comm);
+        Phase_End();
+        Adapt_Omega(count, global_delta);
+      }
+    }
+
+    Checkpoint(count, step, global_delta);
+  }
+
+  if (delta_req != MPI_REQUEST_NULL)
+  {
+    Phase_Begin(PHASE_REDUCE);
+    MPI_Wait(&delta_req, MPI_STATUS_IGNORE);
+    Phase_End();
+  }
+  if (omega_mode != OMEGA_FIXED && proc_rank == 0)
+    printf("(%i / %i) Final omega %f, spectral radius %f\n", proc_rank, P, omega, rho_jacobi);
+  #endif
+
+  Finish_Checkpoint();
+
+  printf("(%i / %i) Number of iterations: %i\n", proc_rank, P, count);
+  solve_iter = count;
+}
+
+#if defined(USE_GPU) && defined(CG)
+/*
+ * Device copies of the grids the CG works on, once per setup like
+ * Alloc_CG(). Only the plain and the Jacobi CG with one ghost layer
+ * and without overlap are ported.
+ */
+void Setup_GPU()
+{
+  size_t n = dim[X_DIR] * (size_t) row_stride;
+
+  Debug("Setup_GPU", 0);
+
+  if (N_sets > 1 || halo != 1 || overlap)
+    Debug("Setup_GPU : backend gpu needs one source set, halo width 1 and no overlap", 1);
+  if (preconditioner != PC_NONE && preconditioner != PC_JACOBI)
+    Debug("Setup_GPU : backend gpu only has the jacobi preconditioner", 1);
+  if (checkpoint_interval > 0 || restart)
+    Debug("Setup_GPU : backend gpu writes no checkpoints", 1);
+
+  Gpu_Init(proc_rank);
+
+  gpu_phi = Gpu_Alloc(n * sizeof(double));
+  gpu_p = Gpu_Alloc(n * sizeof(double));
+  gpu_r = Gpu_Alloc(n * sizeof(double));
+  gpu_v = Gpu_Alloc(n * sizeof(double));
+  gpu_z = gpu_r;
+  if (preconditioner == PC_JACOBI)
+  {
+    gpu_z = Gpu_Alloc(n * sizeof(double));
+    gpu_d = Gpu_Alloc(n * sizeof(double));
+    Gpu_Upload(gpu_d, &dCG[0][0], n * sizeof(double));
+  }
+  gpu_source = Gpu_Alloc(n * sizeof(int));
+  Gpu_Upload(gpu_source, &source[0][0], n * sizeof(int));
+
+  gpu_sbuf[0] = Gpu_Alloc((dim[X_DIR] - 2) * sizeof(double));
+  gpu_sbuf[1] = Gpu_Alloc((dim[X_DIR] - 2) * sizeof(double));
+  gpu_rbuf[0] = Gpu_Alloc((dim[X_DIR] - 2) * sizeof(double));
+  gpu_rbuf[1] = Gpu_Alloc((dim[X_DIR] - 2) * sizeof(double));
+}
+
+/*
+ * Exchange_Borders() of a device grid. The rows (X_DIR) are contiguous
+ * and go to MPI as they are, the columns are packed on the device. MPI
+ * gets device pointers, which takes a CUDA-aware MPI (e.g. Open MPI
+ * built --with-cuda).
+ */
+void Exchange_GPU(double *d_grid)
+{
+  int nx = dim[X_DIR], ny = dim[Y_DIR];
+  MPI_Request req[8];
+
+  Phase_Begin(PHASE_HALO);
+  Count_Halo(border_type);
+
+  Gpu_Pack_Column(gpu_sbuf[0], d_grid, 1, nx, row_stride);
+  Gpu_Pack_Column(gpu_sbuf[1], d_grid, ny - 2, nx, row_stride);
+  Gpu_Sync();
+
+  /* the directions and tags of Exchange_Borders() */
+  MPI_Irecv(gpu_rbuf[0], nx - 2, MPI_DOUBLE, proc_bottom, 0, grid_comm, &req[0]);
+  MPI_Irecv(gpu_rbuf[1], nx - 2, MPI_DOUBLE, proc_top, 1, grid_comm, &req[1]);
+  MPI_Irecv(d_grid + (nx - 1) * row_stride + 1, ny - 2, MPI_DOUBLE,
+    proc_right, 2, grid_comm, &req[2]);
+  MPI_Irecv(d_grid + 1, ny - 2, MPI_DOUBLE, proc_left, 3, grid_comm, &req[3]);
+  MPI_Isend(gpu_sbuf[0], nx - 2, MPI_DOUBLE, proc_top, 0, grid_comm, &req[4]);
+  MPI_Isend(gpu_sbuf[1], nx - 2, MPI_DOUBLE, proc_bottom, 1, grid_comm, &req[5]);
+  MPI_Isend(d_grid + row_stride + 1, ny - 2, MPI_DOUBLE,
+    proc_left, 2, grid_comm, &req[6]);
+  MPI_Isend(d_grid + (nx - 2) * row_stride + 1, ny - 2, MPI_DOUBLE,
+    proc_right, 3, grid_comm, &req[7]);
+  MPI_Waitall(8, req, MPI_STATUSES_IGNORE);
+
+  if (proc_bottom != MPI_PROC_NULL)
+    Gpu_Unpack_Column(d_grid, gpu_rbuf[0], ny - 1, nx, row_stride);
+  if (proc_top != MPI_PROC_NULL)
+    Gpu_Unpack_Column(d_grid, gpu_rbuf[1], 0, nx, row_stride);
+
+  Phase_End();
+}
+
+/*
+ * Solve() of the CG build on the GPU, with the fused update of
+ * Do_Step_CG(): the same iterations, the sums only differ in the order
+ * of the additions. InitCG() runs on the host, then the grids go to
+ * the device and only phi comes back once the solve is done.
+ */
+void Solve_GPU()
+{
+  int count = 0;
+  int nx = dim[X_DIR], ny = dim[Y_DIR];
+  size_t bytes = nx * (size_t) row_stride * sizeof(double);
+  double a, g, pdotv, global_pdotv;
+  double new_dots[2], global_new_dots[2];	/* r' * r, r' * z */
+  MPI_Request req;
+
+  Debug("Solve_GPU", 0);
+
+  InitCG();
+  Gpu_Upload(gpu_phi, &phi[0][0], bytes);
+  Gpu_Upload(gpu_p, &pCG[0][0], bytes);
+  Gpu_Upload(gpu_r, &rCG[0][0], bytes);
+  if (gpu_d)
+    Gpu_Upload(gpu_z, &zCG[0][0], bytes);
+
+  while (global_residue > precision_goal && count < max_iter)
+  {
+    /* v = A * p and p' * v */
+    Exchange_GPU(gpu_p);
+    pdotv = Gpu_Stencil_Dot(gpu_v, gpu_p, gpu_source, nx, ny, row_stride);
+    Phase_Begin(PHASE_REDUCE);
+    MPI_Allreduce(&pdotv, &global_pdotv, 1, MPI_DOUBLE, MPI_SUM, grid_comm);
+    Phase_End();
+    a = global_rdotz / global_pdotv;
+
+    /* phi, r and z and both dots, in overlap mode phi behind the reduction */
+    Gpu_Update_CG(a, overlap_reduction ? NULL : gpu_phi, gpu_p, gpu_v, gpu_r,
+      gpu_z, gpu_d, nx, ny, row_stride, new_dots);
+    if (overlap_reduction)
+    {
+      MPI_Iallreduce(new_dots, global_new_dots, 2, MPI_DOUBLE, MPI_SUM, grid_comm, &req);
+      Gpu_Axpy(gpu_phi, gpu_p, a, nx, ny, row_stride);
+      Phase_Begin(PHASE_REDUCE);
+      MPI_Wait(&req, MPI_STATUS_IGNORE);
+      Phase_End();
+    }
+    else
+    {
+      Phase_Begin(PHASE_REDUCE);
+      MPI_Allreduce(new_dots, global_new_dots, 2, MPI_DOUBLE, MPI_SUM, grid_comm);
+      Phase_End();
+    }
+
+    g = global_new_dots[1] / global_rdotz;
+    global_residue = global_new_dots[0];
+    global_rdotz = global_new_dots[1];
+
+    /* p = z + g*p */
+    Gpu_Xpay(gpu_p, gpu_z, g, nx, ny, row_stride);
+    count++;
+  }
+
+  Gpu_Download(&phi[0][0], gpu_phi, bytes);
+
+  printf("(%i / %i) Number of iterations: %i\n", proc_rank, P, count);
+  solve_iter = count;
+}
+
+void Free_GPU()
+{
+  Gpu_Free(gpu_phi);
+  Gpu_Free(gpu_p);
+  Gpu_Free(gpu_r);
+  Gpu_Free(gpu_v);
+  if (gpu_d)
+  {
+    Gpu_Free(gpu_z);
+    Gpu_Free(gpu_d);
+  }
+  Gpu_Free(gpu_source);
+  Gpu_Free(gpu_sbuf[0]);
+  Gpu_Free(gpu_sbuf[1]);
+  Gpu_Free(gpu_rbuf[0]);
+  Gpu_Free(gpu_rbuf[1]);
+  Gpu_Release();
+}
+#endif
+
+/* everything the solves share: grids, datatypes and solver arrays */
+void Setup_Solver()
+{
+  Setup_Grid();
+  Setup_MPI_Datatypes();
+  if (N_sets > 1)
+    Setup_Batch();
+  #ifdef CG
+  else
+    Alloc_CG();
+  #else
+  else if (multigrid)
+    Setup_Multigrid();
+  #endif
+
+  #if defined(USE_GPU) && defined(CG)
+  if (backend == BACKEND_GPU)
+    Setup_GPU();
+  #else
+  if (backend == BACKEND_GPU)
+    Debug("Setup_Solver : backend gpu needs the CG built with -DUSE_GPU", 1);
+  #endif
+}
+
+/*
+ * One solve, starting from the current phi; nothing is allocated after
+ * Setup_Solver(). Poisson_Solve() calls it for a library caller, which
+ * may change phi at the sources in between. Returns the number of
+ * iterations.
+ */
+int Run_Solver()
+{
+  if (N_sets > 1)
+    Solve_Batch();
+  #if defined(USE_GPU) && defined(CG)
+  else if (backend == BACKEND_GPU)
+    Solve_GPU();
+  #endif
+  else
+    Solve();
+  restart = 0;		/* only the first solve continues the checkpoint */
+
+  return solve_iter;
+}
+
+size_t State_Size()
+{
+  int k;
+  size_t n = 0;
+
+  for (k = 0; k < N_STATE; k++)
+    n += solver_state[k].size;
+  return n;
+}
+
+/* makes the state of s current */
+void Use_Solver(Poisson_Solver *s)
+{
+  int k;
+  char *p = s->state;
+
+  for (k = 0; k < N_STATE; k++)
+  {
+    memcpy(solver_state[k].addr, p, solver_state[k].size);
+    p += solver_state[k].size;
+  }
+}
+
+/* stores the current state in s */
+void Save_Solver(Poisson_Solver *s)
+{
+  int k;
+  char *p = s->state;
+
+  for (k = 0; k < N_STATE; k++)
+  {
+    memcpy(p, solver_state[k].addr, solver_state[k].size);
+    p += solver_state[k].size;
+  }
+}
+
+/* the library interface, see poisson.h */
+Poisson_Solver *Poisson_Create(MPI_Comm comm, int px, int py, const char *settings)
+{
+  Poisson_Solver *s, defaults;
+
+  if ((s = malloc(sizeof(*s))) == NULL ||
+      (s->state = malloc(State_Size())) == NULL)
+    Debug("Poisson_Create : malloc(s) failed", 1);
+  if (state_defaults == NULL)
+  {
+    if ((state_defaults = malloc(State_Size())) == NULL)
+      Debug("Poisson_Create : malloc(state_defaults) failed", 1);
+    defaults.state = state_defaults;
+    Save_Solver(&defaults);
+  }
+  memcpy(s->state, state_defaults, State_Size());
+  Use_Solver(s);
+
+  solver_comm = comm;
+  settings_file = settings;
+  P_grid[X_DIR] = px;
+  P_grid[Y_DIR] = py;
+  Setup_Topology();
+  Setup_Solver();
+  if (N_sets > 1)
+    Debug("Poisson_Create : source sets need the program, not the library", 1);
+  settings_file = NULL;		/* only read during the setup */
+
+  Save_Solver(s);
+  return s;
+}
+
+int Poisson_Solve(Poisson_Solver *s)
+{
+  int n;
+
+  Use_Solver(s);
+  n = Run_Solver();
+  Save_Solver(s);
+  return n;
+}
+
+double *Poisson_Grid(Poisson_Solver *s, int *grid_offset, int *grid_dim, int *stride)
+{
+  Use_Solver(s);
+  grid_offset[X_DIR] = offset[X_DIR];
+  grid_offset[Y_DIR] = offset[Y_DIR];
+  grid_dim[X_DIR] = dim[X_DIR];
+  grid_dim[Y_DIR] = dim[Y_DIR];
+  *stride = row_stride;
+  return phi[0];
+}
+
+const int *Poisson_Source(Poisson_Solver *s)
+{
+  Use_Solver(s);
+  return source[0];
+}
+
+void Poisson_Write(Poisson_Solver *s)
+{
+  Use_Solver(s);
+  Write_Grid();
+  Save_Solver(s);
+}
+
+void Poisson_Destroy(Poisson_Solver *s)
+{
+  Use_Solver(s);
+  Clean_Up();
+  free(s->state);
+  free(s);
+}
+
+/*
+ * Batch mode, more than one source set: the sets are solved together as
+ * K = N_sets right hand sides on the same grid. A batch grid keeps the K
+ * values of a point next to each other, so the stencil loads a row once
+ * for all sets and every border exchange and reduction carries K values.
+ * Once a set has converged it is no longer updated, so it ends with the
+ * solution and iteration count of a run with only its own sources.
+ * Batch grids have one ghost layer and use the blocking exchange.
+ */
+double **Alloc_Batch_Grid(char *name)
+{
+  int x, y;
+  int width = dim[Y_DIR] * N_sets;
+  double **grid;
+
+  grid = Arena_Alloc(dim[X_DIR] * sizeof(*grid), name);
+  grid[0] = Arena_Alloc(dim[X_DIR] * width * sizeof(**grid), name);
+  for (x = 1; x < dim[X_DIR]; x++)
+    grid[x] = grid[0] + x * width;
+  #pragma omp parallel for private(y) schedule(static)
+  for (x = 0; x < dim[X_DIR]; x++)
+    for (y = 0; y < width; y++)
+      grid[x][y] = 0.0;
+
+  return grid;
+}
+
+void Setup_Batch()
+{
+  int x, y, k, s;
+  int K = N_sets;
+
+  Debug("Setup_Batch", 0);
+
+  if (halo > 1 || overlap || multigrid || preconditioner != PC_NONE ||
+      checkpoint_interval > 0 || restart)
+    Debug("Setup_Batch : source sets need halo width 1 and no overlap, multigrid, preconditioner or checkpoints", 1);
+
+  phiB = Alloc_Batch_Grid("phiB");
+  maskB = Alloc_Batch_Grid("maskB");
+
+  /* points outside the domain are fixed for every set */
+  for (x = 0; x < dim[X_DIR]; x++)
+    for (y = 0; y < dim[Y_DIR]; y++)
+      for (k = 0; k < K; k++)
+        maskB[x][y * K + k] =
+          (x + offset[X_DIR] < 1 || x + offset[X_DIR] > gridsize[X_DIR] ||
+           y + offset[Y_DIR] < 1 || y + offset[Y_DIR] > gridsize[Y_DIR]) ? 0.0 : 1.0;
+
+  /* the sources of set k only in column k, placed as in Setup_Grid() */
+  for (k = 0; k < K; k++)
+    for (s = set_first[k]; s < set_first[k + 1]; s++)
     {
-      vCG[x][y] = pCG[x][y];
-      if (source[x][y] != 1) /* only if point is not fixed */
-        vCG[x][y] -= (
-          pCG[x + 1][y] + pCG[x - 1][y] +
-          pCG[x][y + 1] + pCG[x][y - 1]
-        ) * 0.25;
+      x = sources[3 * s] * gridsize[X_DIR];
+      y = sources[3 * s + 1] * gridsize[Y_DIR];
+      x = x + 1 - offset[X_DIR];
+      y = y + 1 - offset[Y_DIR];
+      if (x >= 0 && x < dim[X_DIR] && y >= 0 && y < dim[Y_DIR])
+      {
+        phiB[x][y * K + k] = sources[3 * s + 2];
+        maskB[x][y * K + k] = 0.0;
+      }
     }
-  
-  pdotv = 0;
-  for (x = 1; x < dim[X_DIR] - 1; x++)
-    for (y = 1; y < dim[Y_DIR] - 1; y++)
-      pdotv += pCG[x][y] * vCG[x][y];
-  
-  MPI_Allreduce(&pdotv, &global_pdotv, 1, MPI_DOUBLE, MPI_SUM, grid_comm);
-  
-  a = global_residue / global_pdotv;
-  
-  for (x = 1; x < dim[X_DIR] - 1; x++)
-    for (y = 1; y < dim[Y_DIR] - 1; y++)
-      phi[x][y] += a * pCG[x][y];
-  
-  for (x = 1; x < dim[X_DIR] - 1; x++)
-    for (y = 1; y < dim[Y_DIR] - 1; y++)
-      rCG[x][y] -= a * vCG[x][y];
-  
-  new_rdotr = 0;
-  for (x = 1; x < dim[X_DIR] - 1; x++)
-    for (y = 1; y < dim[Y_DIR] - 1; y++)
-      new_rdotr += rCG[x][y] * rCG[x][y];
-  
-  MPI_Allreduce(&new_rdotr, &global_new_rdotr, 1, MPI_DOUBLE, MPI_SUM, grid_comm);
-  
-  g = global_new_rdotr / global_residue;
-  global_residue = global_new_rdotr;
-  
-  for (x = 1; x < dim[X_DIR] - 1; x++)
-    for (y = 1; y < dim[Y_DIR] - 1; y++)
-      pCG[x][y] = rCG[x][y] + g * pCG[x][y];
+
+  /* border_type with K values per point */
+  MPI_Type_vector(dim[X_DIR] - 2, K, dim[Y_DIR] * K, MPI_DOUBLE, &batch_type[Y_DIR]);
+  MPI_Type_commit(&batch_type[Y_DIR]);
+  MPI_Type_contiguous((dim[Y_DIR] - 2) * K, MPI_DOUBLE, &batch_type[X_DIR]);
+  MPI_Type_commit(&batch_type[X_DIR]);
+
+  #ifdef CG
+  pB = Alloc_Batch_Grid("pB");
+  rB = Alloc_Batch_Grid("rB");
+  vB = Alloc_Batch_Grid("vB");
+  #endif
 }
-#endif
 
-void Exchange_Borders()
+/* Exchange_Borders() of a batch grid */
+void Exchange_Batch(double **grid)
 {
-  Debug("Exchange_Borders", 0);
-  
-  #ifdef CG
-  MPI_Sendrecv(
-    &pCG[1][1], 1, border_type[Y_DIR], proc_top, 0,
-    &pCG[1][dim[Y_DIR] - 1], 1, border_type[Y_DIR], proc_bottom, 0,
-    grid_comm, &status); /* all traffic in direction top */
-  
-  MPI_Sendrecv(
-    &pCG[1][dim[Y_DIR] - 2], 1, border_type[Y_DIR], proc_bottom, 1,
-    &pCG[1][0], 1, border_type[Y_DIR], proc_top, 1,
-    grid_comm, &status); /* all traffic in direction bottom */
-  
-  MPI_Sendrecv(
-    &pCG[1][1], 1, border_type[X_DIR], proc_left, 2,
-    &pCG[dim[X_DIR] - 1][1], 1, border_type[X_DIR], proc_right, 2,
-    grid_comm, &status); /* all traffic in direction left */
-  
-  MPI_Sendrecv(
-    &pCG[dim[X_DIR] - 2][1], 1, border_type[X_DIR], proc_right, 3,
-    &pCG[0][1], 1, border_type[X_DIR], proc_left, 3,
-    grid_comm, &status); /* all traffic in direction right */
-  #else
+  int K = N_sets;
+
+  Phase_Begin(PHASE_HALO);
+  Count_Halo(batch_type);
+
   MPI_Sendrecv(
-    &phi[1][1], 1, border_type[Y_DIR], proc_top, 0,
-    &phi[1][dim[Y_DIR] - 1], 1, border_type[Y_DIR], proc_bottom, 0,
+    &grid[1][K], 1, batch_type[Y_DIR], proc_top, 0,
+    &grid[1][(dim[Y_DIR] - 1) * K], 1, batch_type[Y_DIR], proc_bottom, 0,
     grid_comm, &status); /* all traffic in direction top */
-  
+
   MPI_Sendrecv(
-    &phi[1][dim[Y_DIR] - 2], 1, border_type[Y_DIR], proc_bottom, 1,
-    &phi[1][0], 1, border_type[Y_DIR], proc_top, 1,
+    &grid[1][(dim[Y_DIR] - 2) * K], 1, batch_type[Y_DIR], proc_bottom, 1,
+    &grid[1][0], 1, batch_type[Y_DIR], proc_top, 1,
     grid_comm, &status); /* all traffic in direction bottom */
-  
+
   MPI_Sendrecv(
-    &phi[1][1], 1, border_type[X_DIR], proc_left, 2,
-    &phi[dim[X_DIR] - 1][1], 1, border_type[X_DIR], proc_right, 2,
+    &grid[1][K], 1, batch_type[X_DIR], proc_left, 2,
+    &grid[dim[X_DIR] - 1][K], 1, batch_type[X_DIR], proc_right, 2,
     grid_comm, &status); /* all traffic in direction left */
-  
+
   MPI_Sendrecv(
-    &phi[dim[X_DIR] - 2][1], 1, border_type[X_DIR], proc_right, 3,
-    &phi[0][1], 1, border_type[X_DIR], proc_left, 3,
+    &grid[dim[X_DIR] - 2][K], 1, batch_type[X_DIR], proc_right, 3,
+    &grid[0][K], 1, batch_type[X_DIR], proc_left, 3,
     grid_comm, &status); /* all traffic in direction right */
-  #endif
+
+  Phase_End();
 }
 
-void Solve()
+#ifndef CG
+/* Do_Step() on all sets that are still active, err[k]: largest change */
+void Do_Step_Batch(int parity, double *err, int *active)
 {
-  Debug("Solve", 0);
-  int count = 0;
-  
+  int x, y, k, i;
+  int K = N_sets;
+  int parity_offset = offset[X_DIR] + offset[Y_DIR];
+  double old_phi, c;
+
+  #pragma omp parallel for private(y, k, i, old_phi, c) reduction(max:err[:K]) schedule(static)
+  for (x = 1; x < dim[X_DIR] - 1; x++)
+    for (y = 1 + (x + 1 + parity_offset + parity) % 2; y < dim[Y_DIR] - 1; y += 2)
+      for (k = 0; k < K; k++)
+      {
+        i = y * K + k;
+        if (!active[k] || maskB[x][i] == 0.0)
+          continue;
+        old_phi = phiB[x][i];
+        c = (
+          phiB[x + 1][i] + phiB[x - 1][i] +
+          phiB[x][i + K] + phiB[x][i - K]
+        ) * 0.25 - old_phi;
+        phiB[x][i] = old_phi + omega * c;
+
+        if (err[k] < fabs(old_phi - phiB[x][i]))
+          err[k] = fabs(old_phi - phiB[x][i]);
+      }
+}
+#endif
+
+void Solve_Batch()
+{
+  int k;
+  int K = N_sets;
+  int count = 0, n_active = 0;
+  int *active, *iters;
+  double *dots, *global_dots;	/* K or 2 K values per reduction */
+
+  Debug("Solve_Batch", 0);
+
+  if ((active = malloc(K * sizeof(int))) == NULL ||
+      (iters = malloc(K * sizeof(int))) == NULL ||
+      (dots = malloc(2 * K * sizeof(double))) == NULL ||
+      (global_dots = malloc(2 * K * sizeof(double))) == NULL)
+    Debug("Solve_Batch : malloc failed", 1);
+
   #ifdef CG
-  InitCG();
-  while (global_residue > precision_goal && count < max_iter)
+  int x, y, i;
+  double *residue, *rdotz, *a, g;
+
+  if ((residue = malloc(3 * K * sizeof(double))) == NULL)
+    Debug("Solve_Batch : malloc(residue) failed", 1);
+  rdotz = residue + K;
+  a = residue + 2 * K;
+
+  /* InitCG() for every set, z = r without a preconditioner */
+  for (k = 0; k < 2 * K; k++)
+    dots[k] = 0.0;
+  #pragma omp parallel for private(y, k, i) reduction(+:dots[:2 * K]) schedule(static)
+  for (x = 1; x < dim[X_DIR] - 1; x++)
+    for (y = K; y < (dim[Y_DIR] - 1) * K; y += K)
+      for (k = 0; k < K; k++)
+      {
+        i = y + k;
+        rB[x][i] = 0;
+        if (maskB[x][i] != 0.0)
+          rB[x][i] = (
+            phiB[x + 1][i] + phiB[x - 1][i] +
+            phiB[x][i + K] + phiB[x][i - K]
+          ) * 0.25;
+        pB[x][i] = rB[x][i];
+        dots[2 * k] += rB[x][i] * rB[x][i];
+        dots[2 * k + 1] += rB[x][i] * rB[x][i];
+      }
+  Phase_Begin(PHASE_REDUCE);
+  MPI_Allreduce(dots, global_dots, 2 * K, MPI_DOUBLE, MPI_SUM, grid_comm);
+  Phase_End();
+  for (k = 0; k < K; k++)
   {
-    Exchange_Borders();
-    Do_Step_CG();
+    residue[k] = global_dots[2 * k];
+    rdotz[k] = global_dots[2 * k + 1];
+    iters[k] = 0;
+    active[k] = residue[k] > precision_goal && count < max_iter;
+    n_active += active[k];
+  }
+
+  while (n_active > 0)
+  {
+    /* Do_Step_CG() for the active sets */
+    Exchange_Batch(pB);
+
+    for (k = 0; k < K; k++)
+      dots[k] = 0.0;
+    #pragma omp parallel for private(y, k, i) reduction(+:dots[:K]) schedule(static)
+    for (x = 1; x < dim[X_DIR] - 1; x++)
+      for (y = K; y < (dim[Y_DIR] - 1) * K; y += K)
+        for (k = 0; k < K; k++)
+        {
+          i = y + k;
+          vB[x][i] = pB[x][i];
+          if (maskB[x][i] != 0.0)
+            vB[x][i] -= (
+              pB[x + 1][i] + pB[x - 1][i] +
+              pB[x][i + K] + pB[x][i - K]
+            ) * 0.25;
+          dots[k] += pB[x][i] * vB[x][i];
+        }
+    Phase_Begin(PHASE_REDUCE);
+    MPI_Allreduce(dots, global_dots, K, MPI_DOUBLE, MPI_SUM, grid_comm);
+    Phase_End();
+
+    for (k = 0; k < K; k++)
+      a[k] = active[k] ? rdotz[k] / global_dots[k] : 0.0;
+
+    for (k = 0; k < 2 * K; k++)
+      dots[k] = 0.0;
+    #pragma omp parallel for private(y, k, i) reduction(+:dots[:2 * K]) schedule(static)
+    for (x = 1; x < dim[X_DIR] - 1; x++)
+      for (y = K; y < (dim[Y_DIR] - 1) * K; y += K)
+        for (k = 0; k < K; k++)
+          if (active[k])
+          {
+            i = y + k;
+            phiB[x][i] += a[k] * pB[x][i];
+            rB[x][i] -= a[k] * vB[x][i];
+            dots[2 * k] += rB[x][i] * rB[x][i];
+            dots[2 * k + 1] += rB[x][i] * rB[x][i];
+          }
+    Phase_Begin(PHASE_REDUCE);
+    MPI_Allreduce(dots, global_dots, 2 * K, MPI_DOUBLE, MPI_SUM, grid_comm);
+    Phase_End();
+
+    for (k = 0; k < K; k++)
+      if (active[k])
+      {
+        g = global_dots[2 * k + 1] / rdotz[k];
+        residue[k] = global_dots[2 * k];
+        rdotz[k] = global_dots[2 * k + 1];
+        #pragma omp parallel for private(y) schedule(static)
+        for (x = 1; x < dim[X_DIR] - 1; x++)
+          for (y = K + k; y < (dim[Y_DIR] - 1) * K; y += K)
+            pB[x][y] = rB[x][y] + g * pB[x][y];
+      }
+
     count++;
+    for (k = 0; k < K; k++)
+      if (active[k])
+      {
+        iters[k] = count;
+        if (!(residue[k] > precision_goal && count < max_iter))
+        {
+          active[k] = 0;
+          n_active--;
+        }
+      }
   }
+
+  free(residue);
   #else
+  int last_check = 0;	/* iteration of the last convergence check */
   double delta;
-  double delta1, delta2;
-  double global_delta;
-  
-  /* give global_delta a higher value then precision_goal */
-  global_delta = 2 * precision_goal;
 
-  while (global_delta > precision_goal && count < max_iter)
+  for (k = 0; k < K; k++)
   {
-    Debug("Do_Step 0", 0);
-    delta1 = Do_Step(0);
-    Exchange_Borders();
+    iters[k] = 0;
+    active[k] = 2 * precision_goal > precision_goal && count < max_iter;
+    n_active += active[k];
+  }
 
-    Debug("Do_Step 1", 0);
-    delta2 = Do_Step(1);
-    Exchange_Borders();
+  /* SOR as in Solve(), one convergence test for all sets */
+  while (n_active > 0)
+  {
+    for (k = 0; k < K; k++)
+      dots[k] = 0.0;
+    Debug("Do_Step_Batch 0", 0);
+    Do_Step_Batch(0, dots, active);
+    Exchange_Batch(phiB);
+    Next_Omega();
+
+    Debug("Do_Step_Batch 1", 0);
+    Do_Step_Batch(1, dots, active);
+    Exchange_Batch(phiB);
+    Next_Omega();
 
-    delta = max(delta1, delta2);
-    MPI_Allreduce(&delta, &global_delta, 1, MPI_DOUBLE, MPI_MAX, grid_comm);
     count++;
+    for (k = 0; k < K; k++)
+      if (active[k])
+        iters[k] = count;
+
+    if (count - last_check >= check_interval || count >= max_iter)
+    {
+      last_check = count;
+      Phase_Begin(PHASE_REDUCE);
+      MPI_Allreduce(dots, global_dots, K, MPI_DOUBLE, MPI_MAX, grid_comm);
+      Phase_End();
+
+      /* one omega for the batch, from the slowest set still running */
+      delta = 0.0;
+      for (k = 0; k < K; k++)
+        if (active[k])
+          delta = max(delta, global_dots[k]);
+      Adapt_Omega(count, delta);
+
+      for (k = 0; k < K; k++)
+        if (active[k] && !(global_dots[k] > precision_goal && count < max_iter))
+        {
+          active[k] = 0;
+          n_active--;
+        }
+    }
   }
   #endif
 
+  if (proc_rank == 0)
+    for (k = 0; k < K; k++)
+      printf("(%i / %i) Source set %i : %i iterations\n", proc_rank, P, k, iters[k]);
+  #ifndef CG
+  if (omega_mode != OMEGA_FIXED && proc_rank == 0)
+    printf("(%i / %i) Final omega %f, spectral radius %f\n", proc_rank, P, omega, rho_jacobi);
+  #endif
   printf("(%i / %i) Number of iterations: %i\n", proc_rank, P, count);
+  solve_iter = count;
+
+  free(active);
+  free(iters);
+  free(dots);
+  free(global_dots);
+}
+
+/* Write_Grid() once per set, through phi */
+void Write_Batch()
+{
+  int x, y, k;
+
+  for (k = 0; k < N_sets; k++)
+  {
+    for (x = 1; x < dim[X_DIR] - 1; x++)
+      for (y = 1; y < dim[Y_DIR] - 1; y++)
+        phi[x][y] = phiB[x][y * N_sets + k];
+    batch_set = k;
+    Write_Grid();
+  }
+  batch_set = -1;
+}
+
+/* the batch grids themselves go with the arena */
+void Free_Batch()
+{
+  MPI_Type_free(&batch_type[X_DIR]);
+  MPI_Type_free(&batch_type[Y_DIR]);
 }
 
 void Write_Grid()
@@ -487,7 +3315,24 @@ void Write_Grid()
   FILE *f;
   
   char filename[40];
-  sprintf(filename, "output%i.dat", proc_rank);
+
+  /* batch mode writes one file (set) per source set */
+  if (N_sets > 1 && batch_set < 0)
+  {
+    Write_Batch();
+    return;
+  }
+
+  if (output_format == OUTPUT_BINARY)
+  {
+    Write_Grid_Binary();
+    return;
+  }
+
+  if (batch_set >= 0)
+    sprintf(filename, "output%i_%i.dat", proc_rank, batch_set);
+  else
+    sprintf(filename, "output%i.dat", proc_rank);
 
   if ((f = fopen(filename, "w")) == NULL)
     Debug("Write_Grid : fopen failed", 1);
@@ -501,44 +3346,367 @@ void Write_Grid()
   fclose(f);
 }
 
+/*
+ * Writes the whole grid to output.bin: the 8 characters "POISOUT1", nx
+ * and ny as ints, then nx * ny doubles, point (x, y) (1 based, as in the
+ * text output) at index (x - 1) * ny + (y - 1). Every process writes its
+ * interior through a subarray view of the global grid, in one collective
+ * call.
+ */
+void Write_Grid_Binary()
+{
+  int head[2];
+  int sizes[2], subsizes[2], starts[2];
+  MPI_Datatype filetype, memtype;
+  MPI_File fh;
+  char filename[40];
+
+  Debug("Write_Grid_Binary", 0);
+
+  if (batch_set >= 0)
+    sprintf(filename, "output_%i.bin", batch_set);
+  else
+    strcpy(filename, "output.bin");
+  if (MPI_File_open(grid_comm, filename, MPI_MODE_WRONLY | MPI_MODE_CREATE,
+                    MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+    Debug("Write_Grid_Binary : MPI_File_open failed", 1);
+  MPI_File_set_size(fh, 0);
+
+  if (proc_rank == 0)
+  {
+    head[0] = gridsize[X_DIR];
+    head[1] = gridsize[Y_DIR];
+    MPI_File_write_at(fh, 0, "POISOUT1", 8, MPI_CHAR, &status);
+    MPI_File_write_at(fh, 8, head, 2, MPI_INT, &status);
+  }
+
+  sizes[X_DIR] = gridsize[X_DIR];
+  sizes[Y_DIR] = gridsize[Y_DIR];
+  subsizes[X_DIR] = dim[X_DIR] - 2;
+  subsizes[Y_DIR] = dim[Y_DIR] - 2;
+  starts[X_DIR] = offset[X_DIR];
+  starts[Y_DIR] = offset[Y_DIR];
+  MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C,
+                           MPI_DOUBLE, &filetype);
+  MPI_Type_commit(&filetype);
+
+  /* interior rows of phi, row_stride apart */
+  MPI_Type_vector(dim[X_DIR] - 2, dim[Y_DIR] - 2, row_stride, MPI_DOUBLE,
+                  &memtype);
+  MPI_Type_commit(&memtype);
+
+  MPI_File_set_view(fh, 8 + 2 * sizeof(int), MPI_DOUBLE, filetype, "native",
+                    MPI_INFO_NULL);
+  MPI_File_write_at_all(fh, 0, &phi[1][1], 1, memtype, &status);
+  MPI_File_close(&fh);
+
+  MPI_Type_free(&filetype);
+  MPI_Type_free(&memtype);
+}
+
+/* the grids saved in a checkpoint, N_CKPT_GRIDS of them */
+int Checkpoint_Grids(double ***grids)
+{
+  grids[0] = phi;
+  #ifdef CG
+  grids[1] = pCG;
+  grids[2] = rCG;
+  #endif
+
+  return N_CKPT_GRIDS;
+}
+
+/*
+ * checkpoint.bin starts with the 8 characters "POISCKP1", then as ints
+ * N_CKPT_INTS, the settings of ckpt_ints[], the iteration count, the SOR
+ * half steps and N_CKPT_GRIDS, then as doubles the settings of
+ * ckpt_doubles[], global_residue and global_rdotz (SOR: the last delta
+ * and 0.0) and the sources (x, y, value). The grids follow, each as
+ * nx * ny doubles in the order of output.bin, so a restart may use
+ * another process grid.
+ */
+MPI_Offset Checkpoint_Header_Size()
+{
+  return 8 + (N_CKPT_INTS + 4) * sizeof(int) +
+    (N_CKPT_DOUBLES + 2 + 3 * N_sources) * sizeof(double);
+}
+
+/* the interior of this process in each of the grids of the checkpoint */
+void Checkpoint_View(MPI_File fh)
+{
+  int sizes[3], subsizes[3], starts[3];
+  MPI_Datatype filetype;
+
+  sizes[0] = subsizes[0] = N_CKPT_GRIDS;
+  starts[0] = 0;
+  sizes[1] = gridsize[X_DIR];
+  sizes[2] = gridsize[Y_DIR];
+  subsizes[1] = dim[X_DIR] - 2;
+  subsizes[2] = dim[Y_DIR] - 2;
+  starts[1] = offset[X_DIR];
+  starts[2] = offset[Y_DIR];
+  MPI_Type_create_subarray(3, sizes, subsizes, starts, MPI_ORDER_C,
+                           MPI_DOUBLE, &filetype);
+  MPI_Type_commit(&filetype);
+  MPI_File_set_view(fh, Checkpoint_Header_Size(), MPI_DOUBLE, filetype,
+                    "native", MPI_INFO_NULL);
+  MPI_Type_free(&filetype);
+}
+
+/*
+ * Called after every iteration: lets a running checkpoint progress and
+ * starts the next one every checkpoint_interval iterations. delta is the
+ * last reduced change (SOR), residual (multigrid) or r' * r (CG), so that
+ * a restart of a converged run stops at once.
+ */
+void Checkpoint(int count, int step, double delta)
+{
+  int done;
+
+  if (ckpt_req != MPI_REQUEST_NULL)
+    MPI_Test(&ckpt_req, &done, MPI_STATUS_IGNORE);
+  if (checkpoint_interval > 0 && count - ckpt_last >= checkpoint_interval)
+  {
+    ckpt_last = count;
+    Write_Checkpoint(count, step, delta);
+  }
+}
+
+/*
+ * Copies the grids into ckpt_buf and starts a nonblocking collective
+ * write of them to checkpoint.tmp, the iterations continue meanwhile.
+ * Rank 0 writes the small header directly. The previous checkpoint is
+ * completed first, so at most one is in flight.
+ */
+void Write_Checkpoint(int count, int step, double delta)
+{
+  int x, y, k, n = 0;
+  int ints[N_CKPT_INTS + 4];
+  double doubles[N_CKPT_DOUBLES + 2];
+  double **grids[N_CKPT_GRIDS];
+
+  Debug("Write_Checkpoint", 0);
+
+  Finish_Checkpoint();
+  Phase_Begin(PHASE_OUTPUT);
+
+  Checkpoint_Grids(grids);
+  if (ckpt_buf == NULL && (ckpt_buf = malloc(N_CKPT_GRIDS * (dim[X_DIR] - 2) *
+      (dim[Y_DIR] - 2) * sizeof(double) + 1)) == NULL)
+    Debug("Write_Checkpoint : malloc(ckpt_buf) failed", 1);
+  for (k = 0; k < N_CKPT_GRIDS; k++)
+    for (x = 1; x < dim[X_DIR] - 1; x++)
+      for (y = 1; y < dim[Y_DIR] - 1; y++)
+        ckpt_buf[n++] = grids[k][x][y];
+
+  if (MPI_File_open(grid_comm, "checkpoint.tmp", MPI_MODE_WRONLY | MPI_MODE_CREATE,
+                    MPI_INFO_NULL, &ckpt_fh) != MPI_SUCCESS)
+    Debug("Write_Checkpoint : MPI_File_open failed", 1);
+  MPI_File_set_size(ckpt_fh, 0);
+
+  if (proc_rank == 0)
+  {
+    ints[0] = N_CKPT_INTS;
+    for (k = 0; k < N_CKPT_INTS; k++)
+      ints[k + 1] = *ckpt_ints[k];
+    ints[N_CKPT_INTS + 1] = count;
+    ints[N_CKPT_INTS + 2] = step;
+    ints[N_CKPT_INTS + 3] = N_CKPT_GRIDS;
+    for (k = 0; k < N_CKPT_DOUBLES; k++)
+      doubles[k] = *ckpt_doubles[k];
+    doubles[N_CKPT_DOUBLES] = delta;
+    #ifdef CG
+    doubles[N_CKPT_DOUBLES + 1] = global_rdotz;
+    #else
+    doubles[N_CKPT_DOUBLES + 1] = 0.0;
+    #endif
+    MPI_File_write_at(ckpt_fh, 0, "POISCKP1", 8, MPI_CHAR, &status);
+    MPI_File_write_at(ckpt_fh, 8, ints, N_CKPT_INTS + 4, MPI_INT, &status);
+    MPI_File_write_at(ckpt_fh, 8 + (N_CKPT_INTS + 4) * sizeof(int), doubles,
+                      N_CKPT_DOUBLES + 2, MPI_DOUBLE, &status);
+    MPI_File_write_at(ckpt_fh, 8 + (N_CKPT_INTS + 4) * sizeof(int) +
+                      (N_CKPT_DOUBLES + 2) * sizeof(double), sources,
+                      3 * N_sources, MPI_DOUBLE, &status);
+  }
+
+  Checkpoint_View(ckpt_fh);
+  MPI_File_iwrite_at_all(ckpt_fh, 0, ckpt_buf, n, MPI_DOUBLE, &ckpt_req);
+  ckpt_open = 1;
+
+  Phase_End();
+}
+
+/*
+ * Waits for the running checkpoint and, once every rank has closed it,
+ * replaces checkpoint.bin by it. An aborted run therefore always leaves
+ * the last complete checkpoint behind.
+ */
+void Finish_Checkpoint()
+{
+  if (!ckpt_open)
+    return;
+
+  Phase_Begin(PHASE_OUTPUT);
+  MPI_Wait(&ckpt_req, MPI_STATUS_IGNORE);
+  MPI_File_close(&ckpt_fh);
+  ckpt_open = 0;
+  MPI_Barrier(grid_comm);
+  if (proc_rank == 0 && rename("checkpoint.tmp", "checkpoint.bin") != 0)
+    Debug("Finish_Checkpoint : rename(checkpoint.tmp) failed", 1);
+  Phase_End();
+}
+
+/* rank 0, instead of reading input.dat: the settings and sources of checkpoint.bin */
+void Read_Checkpoint_Header()
+{
+  int k, n, grids, ok;
+  char magic[8];
+  FILE *f;
+
+  Debug("Read_Checkpoint_Header", 0);
+
+  if ((f = fopen("checkpoint.bin", "rb")) == NULL)
+    Debug("Read_Checkpoint_Header : Can't open checkpoint.bin", 1);
+  ok = fread(magic, 1, 8, f) == 8 && memcmp(magic, "POISCKP1", 8) == 0 &&
+    fread(&n, sizeof(int), 1, f) == 1 && n == N_CKPT_INTS;
+  if (!ok)
+    Debug("Read_Checkpoint_Header : checkpoint.bin has an unknown layout", 1);
+
+  for (k = 0; k < N_CKPT_INTS; k++)
+    ok &= fread(ckpt_ints[k], sizeof(int), 1, f) == 1;
+  ok &= fread(&ckpt_count, sizeof(int), 1, f) == 1;
+  ok &= fread(&ckpt_step, sizeof(int), 1, f) == 1;
+  ok &= fread(&grids, sizeof(int), 1, f) == 1;
+  for (k = 0; k < N_CKPT_DOUBLES; k++)
+    ok &= fread(ckpt_doubles[k], sizeof(double), 1, f) == 1;
+  ok &= fread(ckpt_scalar, sizeof(double), 2, f) == 2;
+  if (!ok)
+    Debug("Read_Checkpoint_Header : checkpoint.bin is truncated", 1);
+  if (grids != N_CKPT_GRIDS)
+    Debug("Read_Checkpoint_Header : checkpoint.bin was written by the other solver", 1);
+
+  if ((sources = malloc(3 * N_sources * sizeof(*sources) + 1)) == NULL)
+    Debug("Read_Checkpoint_Header : malloc(sources) failed", 1);
+  if (fread(sources, sizeof(*sources), 3 * N_sources, f) != (size_t) (3 * N_sources))
+    Debug("Read_Checkpoint_Header : checkpoint.bin is truncated", 1);
+
+  fclose(f);
+}
+
+/* restores the grids of checkpoint.bin, returns the iteration count */
+int Read_Checkpoint()
+{
+  int x, y, k, n = 0;
+  double *buf;
+  double **grids[N_CKPT_GRIDS];
+  MPI_File fh;
+
+  Debug("Read_Checkpoint", 0);
+
+  Checkpoint_Grids(grids);
+  if ((buf = malloc(N_CKPT_GRIDS * (dim[X_DIR] - 2) * (dim[Y_DIR] - 2) *
+      sizeof(double) + 1)) == NULL)
+    Debug("Read_Checkpoint : malloc(buf) failed", 1);
+
+  if (MPI_File_open(grid_comm, "checkpoint.bin", MPI_MODE_RDONLY,
+                    MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+    Debug("Read_Checkpoint : MPI_File_open failed", 1);
+  Checkpoint_View(fh);
+  MPI_File_read_at_all(fh, 0, buf, N_CKPT_GRIDS * (dim[X_DIR] - 2) *
+                       (dim[Y_DIR] - 2), MPI_DOUBLE, &status);
+  MPI_File_close(&fh);
+
+  for (k = 0; k < N_CKPT_GRIDS; k++)
+    for (x = 1; x < dim[X_DIR] - 1; x++)
+      for (y = 1; y < dim[Y_DIR] - 1; y++)
+        grids[k][x][y] = buf[n++];
+  free(buf);
+
+  #ifdef CG
+  global_residue = ckpt_scalar[0];
+  global_rdotz = ckpt_scalar[1];
+  #endif
+  ckpt_last = ckpt_count;
+
+  if (proc_rank == 0)
+    printf("Restarted from checkpoint.bin at iteration %i\n", ckpt_count);
+
+  return ckpt_count;
+}
+
 void Clean_Up()
 {
+  int k, i;
+
   Debug("Clean_Up", 0);
 
-  free(phi[0]);
-  free(phi);
-  free(source[0]);
-  free(source);
-  
-  #ifdef CG
-  free(pCG[0]);
-  free(pCG);
-  free(rCG[0]);
-  free(rCG);
-  free(vCG[0]);
-  free(vCG);
+  for (k = 0; k < N_border_grids; k++)
+    for (i = 0; i < 8; i++)
+      MPI_Request_free(&border_preq[k][i]);
+  free(border_buf);
+
+  /* the datatypes of level 0 replace those of Setup_MPI_Datatypes() */
+  if (N_levels > 0)
+  {
+    Use_Level(&level[0]);
+    Free_Multigrid();
+  }
+  else
+  {
+    MPI_Type_free(&border_type[X_DIR]);
+    MPI_Type_free(&border_type[Y_DIR]);
+    if (halo > 1)
+    {
+      MPI_Type_free(&halo_type[X_DIR]);
+      MPI_Type_free(&halo_type[Y_DIR]);
+    }
+  }
+  MPI_Comm_free(&grid_comm);
+
+  free(ckpt_buf);
+  free(sources);
+  free(set_first);
+  if (N_sets > 1)
+    Free_Batch();
+
+  Arena_Free();
+  #if defined(USE_GPU) && defined(CG)
+  if (backend == BACKEND_GPU)
+    Free_GPU();
   #endif
 }
 
+#ifndef LIBRARY
 int main(int argc, char **argv)
 {
-  MPI_Init(&argc, &argv);
+  int provided;
+
+  /* OpenMP threads compute, only the master thread communicates */
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+  if (provided < MPI_THREAD_FUNNELED)
+    Debug("ERROR: MPI does not provide MPI_THREAD_FUNNELED", 1);
   Setup_Proc_Grid(argc, argv);
   
   start_timer();
   
-  Setup_Grid();
-  Setup_MPI_Datatypes();
+  Setup_Solver();
 
-  Solve();
+  Phase_Begin(PHASE_COMPUTE);
+  Run_Solver();
+  Phase_End();
 
+  Phase_Begin(PHASE_OUTPUT);
   Write_Grid();
+  Phase_End();
 
   print_timer();
 
+  Print_Profile();
+
   Clean_Up();
   
   MPI_Finalize();
   
   return 0;
 }
+#endif
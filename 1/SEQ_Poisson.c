@@ -6,21 +6,44 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include <time.h>
 
 #define DEBUG 0
 
 #define max(a,b) ((a)>(b)?a:b)
+#define OMEGA_WINDOW 10		/* adaptive omega: least iterations per estimate */
+#define OMEGA_F 0.75		/* adaptive omega: keep omega once lambda < (omega - 1)^F */
 
 enum
 {
   X_DIR, Y_DIR
 };
 
+enum
+{
+  KERNEL_PLAIN,		/* visit every point, test colour and source */
+  KERNEL_STRIDED,	/* active colour only, source mask, no branches */
+  KERNEL_FUSED		/* strided, both colours in one pass over the rows */
+};
+
+enum
+{
+  OMEGA_FIXED,		/* omega as set, 1.0 (Gauss-Seidel) by default */
+  OMEGA_ADAPTIVE,	/* omega_b of the estimated spectral radius, see Adapt_Omega() */
+  OMEGA_CHEBYSHEV	/* Chebyshev schedule per half step towards that omega_b */
+};
+
 /* global variables */
 int gridsize[2];
 double precision_goal;		/* precision_goal of solution */
 int max_iter;			/* maximum number of iterations alowed */
+int kernel = KERNEL_PLAIN;	/* Gauss-Seidel kernel used by Do_Step */
+double omega = 1.0;		/* relaxation parameter, 1.0 is Gauss-Seidel */
+int omega_mode = OMEGA_FIXED;	/* "omega: <value>", "omega: adaptive" or "omega: chebyshev" */
+double rho_jacobi = 0.0;	/* adaptive omega: estimated spectral radius of Jacobi */
+int omega_iter = -1;		/* adaptive omega: iteration of omega_delta, -1 if none */
+double omega_delta;		/* adaptive omega: delta the estimate starts from */
 
 /* benchmark related variables */
 clock_t ticks;			/* number of systemticks */
@@ -29,10 +52,15 @@ int timer_on = 0;		/* is timer running? */
 /* local grid related variables */
 double **phi;			/* grid */
 int **source;			/* TRUE if subgrid element is a source */
+double **mask;			/* 0.0 on sources, 1.0 elsewhere (non-plain kernels) */
 int dim[2];			/* grid dimensions */
 
 void Setup_Grid();
 double Do_Step(int parity);
+double Relax_Row(int x, int parity);
+double Do_Sweep_Fused();
+void Adapt_Omega(int iter, double delta);
+void Next_Omega();
 void Solve();
 void Write_Grid();
 void Clean_Up();
@@ -93,6 +121,7 @@ void Setup_Grid()
 {
   int x, y, s;
   double source_x, source_y, source_val;
+  char key[40], value[40];
   FILE *f;
 
   Debug("Setup_Subgrid", 0);
@@ -132,12 +161,14 @@ void Setup_Grid()
       source[x][y] = 0;
     }
 
-  /* put sources in field */
-  do
+  /* put sources in field, other settings may be mixed in */
+  while (fscanf(f, " %39[^:]:", key) == 1)
   {
-    s = fscanf(f, "source: %lf %lf %lf\n", &source_x, &source_y, &source_val);
-    if (s==3)
+    if (strcmp(key, "source") == 0)
     {
+      s = fscanf(f, "%lf %lf %lf", &source_x, &source_y, &source_val);
+      if (s != 3)
+        Debug("Setup_Subgrid : bad source in input.dat", 1);
       x = source_x * gridsize[X_DIR];
       y = source_y * gridsize[Y_DIR];
       x += 1;
@@ -145,10 +176,52 @@ void Setup_Grid()
       phi[x][y] = source_val;
       source[x][y] = 1;
     }
+    else if (strcmp(key, "kernel") == 0)
+    {
+      fscanf(f, "%39s", value);
+      if (strcmp(value, "plain") == 0)
+        kernel = KERNEL_PLAIN;
+      else if (strcmp(value, "strided") == 0)
+        kernel = KERNEL_STRIDED;
+      else if (strcmp(value, "fused") == 0)
+        kernel = KERNEL_FUSED;
+      else
+        Debug("Setup_Subgrid : unknown kernel in input.dat", 1);
+    }
+    else if (strcmp(key, "omega") == 0)
+    {
+      fscanf(f, "%39s", value);
+      if (strcmp(value, "adaptive") == 0)
+        omega_mode = OMEGA_ADAPTIVE;
+      else if (strcmp(value, "chebyshev") == 0)
+        omega_mode = OMEGA_CHEBYSHEV;
+      else if (sscanf(value, "%lf", &omega) == 1 && omega > 0.0 && omega < 2.0)
+        omega_mode = OMEGA_FIXED;
+      else
+        Debug("Setup_Subgrid : unknown omega in input.dat", 1);
+      if (omega_mode != OMEGA_FIXED)
+        omega = 1.0;		/* Gauss-Seidel until the first estimate */
+    }
+    else
+      fscanf(f, "%*[^\n]");	/* setting of MPI_Poisson, not used here */
   }
-  while (s==3);
 
   fclose(f);
+
+  /* the branch free kernels multiply the update by a precomputed mask */
+  if (kernel != KERNEL_PLAIN)
+  {
+    if ((mask = malloc(dim[X_DIR] * sizeof(*mask))) == NULL)
+      Debug("Setup_Subgrid : malloc(mask) failed", 1);
+    if ((mask[0] = malloc(dim[Y_DIR] * dim[X_DIR] * sizeof(**mask))) == NULL)
+      Debug("Setup_Subgrid : malloc(*mask) failed", 1);
+    for (x = 0; x < dim[X_DIR]; x++)
+    {
+      mask[x] = mask[0] + x * dim[Y_DIR];
+      for (y = 0; y < dim[Y_DIR]; y++)
+        mask[x][y] = (source[x][y] == 1) ? 0.0 : 1.0;
+    }
+  }
 }
 
 double Do_Step(int parity)
@@ -157,6 +230,16 @@ double Do_Step(int parity)
   double old_phi;
   double max_err = 0.0;
 
+  if (kernel != KERNEL_PLAIN)
+  {
+    for (x = 1; x < dim[X_DIR] - 1; x++)
+    {
+      old_phi = Relax_Row(x, parity);
+      max_err = max(max_err, old_phi);
+    }
+    return max_err;
+  }
+
   /* calculate interior of grid */
   for (x = 1; x < dim[X_DIR] - 1; x++)
     for (y = 1; y < dim[Y_DIR] - 1; y++)
@@ -165,6 +248,8 @@ double Do_Step(int parity)
 	old_phi = phi[x][y];
 	phi[x][y] = (phi[x + 1][y] + phi[x - 1][y] +
 		     phi[x][y + 1] + phi[x][y - 1]) * 0.25;
+	if (omega != 1.0)
+	  phi[x][y] = old_phi + omega * (phi[x][y] - old_phi);
 	if (max_err < fabs(old_phi - phi[x][y]))
 	  max_err = fabs(old_phi - phi[x][y]);
       }
@@ -172,6 +257,112 @@ double Do_Step(int parity)
   return max_err;
 }
 
+/*
+ * Branch free relaxation (Gauss-Seidel for omega = 1) of one colour on row x.
+ * Only points of the active colour are visited, sources are kept fixed
+ * by the mask.
+ */
+double Relax_Row(int x, int parity)
+{
+  double *restrict p = phi[x];
+  const double *restrict p_left = phi[x - 1];
+  const double *restrict p_right = phi[x + 1];
+  const double *restrict m = mask[x];
+  double d, max_err = 0.0;
+  int y;
+  int y_start = 1 + ((x + 1 + parity) & 1);
+
+  #pragma omp simd reduction(max:max_err) private(d)
+  for (y = y_start; y < dim[Y_DIR] - 1; y += 2)
+  {
+    d = omega * m[y] * (
+      (p_right[y] + p_left[y] + p[y + 1] + p[y - 1]) * 0.25 - p[y]);
+    p[y] += d;
+    max_err = max(max_err, fabs(d));
+  }
+
+  return max_err;
+}
+
+/*
+ * Both colours in one pass: black row x - 1 is updated right after red
+ * row x, while the three rows involved are still in cache. The result is
+ * identical to Do_Step(0) followed by Do_Step(1).
+ */
+double Do_Sweep_Fused()
+{
+  int x;
+  double err, max_err = 0.0;
+
+  for (x = 1; x < dim[X_DIR]; x++)
+  {
+    if (x < dim[X_DIR] - 1)
+    {
+      err = Relax_Row(x, 0);
+      max_err = max(max_err, err);
+    }
+    if (x - 1 >= 1)
+    {
+      err = Relax_Row(x - 1, 1);
+      max_err = max(max_err, err);
+    }
+  }
+
+  return max_err;
+}
+
+/*
+ * Adaptive omega, as Adapt_Omega() of MPI_Poisson: the decay of delta
+ * over at least OMEGA_WINDOW iterations gives lambda, the SOR error
+ * reduction per iteration, and from (lambda + omega - 1)^2 =
+ * lambda * omega^2 * rho^2 an estimate of rho, the spectral radius of
+ * Jacobi, from below. omega_b = 2 / (1 + sqrt(1 - rho^2)) of each larger
+ * estimate is taken, rho is bounded by that of the grid without sources.
+ */
+void Adapt_Omega(int iter, double delta)
+{
+  double lambda, rho2, pi = acos(-1.0);
+  double rho_max = 0.5 * (cos(pi / (gridsize[X_DIR] + 1)) + cos(pi / (gridsize[Y_DIR] + 1)));
+
+  if (omega_mode == OMEGA_FIXED || delta <= 0.0)
+    return;
+  if (omega_iter < 0)
+  {
+    omega_iter = iter;
+    omega_delta = delta;
+    return;
+  }
+  if (iter - omega_iter < OMEGA_WINDOW)
+    return;
+
+  lambda = pow(delta / omega_delta, 1.0 / (iter - omega_iter));
+  omega_iter = iter;
+  omega_delta = delta;
+
+  /* no decay yet, or close enough to omega_b, where lambda = omega - 1 */
+  if (lambda >= 1.0 || lambda <= pow(omega - 1.0, OMEGA_F))
+    return;
+  rho2 = (lambda + omega - 1.0) * (lambda + omega - 1.0) / (lambda * omega * omega);
+  if (rho2 > rho_max * rho_max)
+    rho2 = rho_max * rho_max;
+  if (rho2 <= rho_jacobi * rho_jacobi)
+    return;
+
+  rho_jacobi = sqrt(rho2);
+  if (omega_mode == OMEGA_ADAPTIVE)
+    omega = 2.0 / (1.0 + sqrt(1.0 - rho2));
+  omega_iter = -1;
+  printf("Iteration %i: spectral radius %f, omega_b %f\n", iter, rho_jacobi,
+	 2.0 / (1.0 + sqrt(1.0 - rho2)));
+}
+
+/* Chebyshev acceleration: the omega of the next half step, see MPI_Poisson */
+void Next_Omega()
+{
+  if (omega_mode == OMEGA_CHEBYSHEV)
+    omega = 1.0 / (1.0 - 0.25 * rho_jacobi * rho_jacobi * omega);
+}
+
 void Solve()
 {
   int count = 0;
@@ -185,16 +376,32 @@ void Solve()
 
   while (delta > precision_goal && count < max_iter)
   {
-    Debug("Do_Step 0", 0);
-    delta1 = Do_Step(0);
+    if (kernel == KERNEL_FUSED)
+    {
+      Debug("Do_Sweep_Fused", 0);
+      delta1 = Do_Sweep_Fused();
+      delta2 = 0.0;
+      Next_Omega();
+      Next_Omega();
+    }
+    else
+    {
+      Debug("Do_Step 0", 0);
+      delta1 = Do_Step(0);
+      Next_Omega();
 
-    Debug("Do_Step 1", 0);
-    delta2 = Do_Step(1);
+      Debug("Do_Step 1", 0);
+      delta2 = Do_Step(1);
+      Next_Omega();
+    }
 
     delta = max(delta1, delta2);
     count++;
+    Adapt_Omega(count, delta);
   }
 
+  if (omega_mode != OMEGA_FIXED)
+    printf("Final omega %f, spectral radius %f\n", omega, rho_jacobi);
   printf("Number of iterations : %i\n", count);
 }
 
@@ -223,6 +430,11 @@ void Clean_Up()
   free(phi);
   free(source[0]);
   free(source);
+  if (kernel != KERNEL_PLAIN)
+  {
+    free(mask[0]);
+    free(mask);
+  }
 }
 
 int main(int argc, char **argv)
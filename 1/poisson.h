@@ -0,0 +1,30 @@
+/*
+ * poisson.h
+ * The library interface of MPI_Poisson.c, built with -DLIBRARY into
+ * libpoisson.a (CG) or libpoisson_sor.a (red-black SOR). A solver is set
+ * up once from a settings file in the format of input.dat and then
+ * solves as often as the caller needs, each solve starting from the last
+ * solution; nothing is allocated after Poisson_Create(). MPI must be
+ * initialised with at least MPI_THREAD_FUNNELED. Every call is collective
+ * over the communicator of the solver. Several solvers may exist at
+ * once, one call at a time.
+ *
+ * The grid of a process is flat, rows of 'stride' values: (x, y) is at
+ * x * stride + y for 0 <= x < dim[0] and 0 <= y < dim[1], the subgrid and
+ * its first ghost layer. The interior 0 < x < dim[0] - 1, 0 < y < dim[1] - 1
+ * holds the points (offset[0] + x, offset[1] + y) of the output files.
+ * The points with source value 1 keep their value of phi; the caller may
+ * change it between solves.
+ */
+
+#include "mpi.h"
+
+typedef struct Poisson_Solver Poisson_Solver;
+
+/* px * py processes of comm; settings is only read by Poisson_Create() */
+Poisson_Solver *Poisson_Create(MPI_Comm comm, int px, int py, const char *settings);
+int Poisson_Solve(Poisson_Solver *s);		/* returns the number of iterations */
+double *Poisson_Grid(Poisson_Solver *s, int *offset, int *dim, int *stride);
+const int *Poisson_Source(Poisson_Solver *s);	/* in the layout of Poisson_Grid */
+void Poisson_Write(Poisson_Solver *s);		/* output files as written by the program */
+void Poisson_Destroy(Poisson_Solver *s);
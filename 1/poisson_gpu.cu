@@ -0,0 +1,301 @@
+// poisson_gpu.cu
+// CUDA backend of the MPI_Poisson CG, see poisson_gpu.h and Solve_GPU().
+// The grids stay in device memory for the whole solve; per iteration
+// only the block sums of the dot products and, through a CUDA-aware
+// MPI, the borders leave the device.
+//
+// A block of TILE_Y x TILE_X threads covers TILE_Y consecutive points of
+// TILE_X rows, so the threads of a warp read one stretch of a row and the
+// neighbours in y come from the same cache lines. The reductions follow
+// FindNormW/ComputeLamda of 3/power_gpu.cu, a tree in shared memory per
+// block; the block sums go to d_Part without atomicAdd (no double
+// version before compute capability 6.0) and the host adds them in a
+// fixed order, so a run repeats exactly.
+////////////////////////////////////////////
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "cuda.h"
+#include "poisson_gpu.h"
+
+
+const int TILE_Y = 32;        // threads per block along a row, one warp
+const int TILE_X = 8;         // rows per block
+const int MAX_BLOCKS_Y = 16;  // blocks along the rows, the loops stride over the rest
+const int MAX_BLOCKS = 256;   // blocks per launch
+const int THREADS = 256;      // threads per block of the column kernels
+
+// Reduction Variables
+double* d_Part = NULL;        // block sums, two per block
+double* h_Part = NULL;        // host copy of d_Part
+
+
+// Functions
+dim3 Blocks(int, int);
+double SumParts(int, int, double*);
+void checkCardVersion(void);
+
+// Kernels
+__device__ void BlockSum(double* sdata, double* g_Part);
+__global__ void Stencil_Dot(double* g_GridV, const double* g_GridP, const int* g_Source, double* g_Part, int nx, int ny, int stride);
+__global__ void Update_CG(double a, double* g_GridPhi, const double* g_GridP, const double* g_GridV, double* g_GridR, double* g_GridZ, const double* g_GridD, double* g_Part, int nx, int ny, int stride);
+__global__ void Axpy(double* g_GridY, const double* g_GridX, double a, int nx, int ny, int stride);
+__global__ void Xpay(double* g_GridY, const double* g_GridX, double b, int nx, int ny, int stride);
+__global__ void Pack_Column(double* g_Buf, const double* g_Grid, int y, int nx, int stride);
+__global__ void Unpack_Column(double* g_Grid, const double* g_Buf, int y, int nx, int stride);
+
+
+// tree reduction of sdata[0 .. threads) as in FindNormW, the sum of the
+// block goes to g_Part[block]
+__device__ void BlockSum(double* sdata, double* g_Part)
+{
+  unsigned int tid = threadIdx.y*blockDim.x + threadIdx.x;
+
+  __syncthreads();
+  for (unsigned int s=blockDim.x*blockDim.y / 2; s > 0; s = s >> 1) {
+     if (tid < s) {
+         sdata[tid] = sdata[tid] + sdata[tid+ s];
+     }
+     __syncthreads();
+  }
+  if (tid == 0) g_Part[blockIdx.y*gridDim.x + blockIdx.x] = sdata[0];
+}
+
+// loops of a thread over the interior [1, nx - 1) x [1, ny - 1)
+#define FOR_INTERIOR(x, y) \
+  for (int x = 1 + blockIdx.y*blockDim.y + threadIdx.y; x < nx - 1; x += gridDim.y*blockDim.y) \
+    for (int y = 1 + blockIdx.x*blockDim.x + threadIdx.x; y < ny - 1; y += gridDim.x*blockDim.x)
+
+// Compute_V_Region() of MPI_Poisson: v = A * p with the 5-point stencil,
+// v = p on the sources, and the block sums of p' * v
+__global__ void Stencil_Dot(double* g_GridV, const double* g_GridP, const int* g_Source, double* g_Part, int nx, int ny, int stride)
+{
+  // shared memory size declared at kernel launch
+  extern __shared__ double sdata[];
+  double v, sub = 0;
+
+  FOR_INTERIOR(x, y) {
+     int i = x*stride + y;
+     v = g_GridP[i];
+     if (g_Source[i] != 1)
+         v -= (g_GridP[i + stride] + g_GridP[i - stride] +
+               g_GridP[i + 1] + g_GridP[i - 1]) * 0.25;
+     g_GridV[i] = v;
+     sub += g_GridP[i] * v;
+  }
+  sdata[threadIdx.y*blockDim.x + threadIdx.x] = sub;
+  BlockSum(sdata, g_Part);
+}
+
+// the fused update of Do_Step_CG(): phi = phi + a*p (if phi),
+// r = r - a*v, z = d * r (if d) and the block sums of r' * r and r' * z
+__global__ void Update_CG(double a, double* g_GridPhi, const double* g_GridP, const double* g_GridV, double* g_GridR, double* g_GridZ, const double* g_GridD, double* g_Part, int nx, int ny, int stride)
+{
+  extern __shared__ double sdata[];
+  unsigned int tid = threadIdx.y*blockDim.x + threadIdx.x;
+  unsigned int threads = blockDim.x*blockDim.y;
+  double r, z, rr = 0, rz = 0;
+
+  FOR_INTERIOR(x, y) {
+     int i = x*stride + y;
+     if (g_GridPhi)
+         g_GridPhi[i] += a * g_GridP[i];
+     r = g_GridR[i] - a * g_GridV[i];
+     g_GridR[i] = r;
+     z = r;
+     if (g_GridD) {
+         z = g_GridD[i] * r;
+         g_GridZ[i] = z;
+     }
+     rr += r * r;
+     rz += r * z;
+  }
+  sdata[tid] = rr;
+  sdata[threads + tid] = rz;
+  BlockSum(sdata, g_Part);
+  BlockSum(sdata + threads, g_Part + gridDim.x*gridDim.y);
+}
+
+// y = y + a*x
+__global__ void Axpy(double* g_GridY, const double* g_GridX, double a, int nx, int ny, int stride)
+{
+  FOR_INTERIOR(x, y)
+     g_GridY[x*stride + y] += a * g_GridX[x*stride + y];
+}
+
+// y = x + b*y
+__global__ void Xpay(double* g_GridY, const double* g_GridX, double b, int nx, int ny, int stride)
+{
+  FOR_INTERIOR(x, y)
+     g_GridY[x*stride + y] = g_GridX[x*stride + y] + b * g_GridY[x*stride + y];
+}
+
+// buf[k] = grid[k + 1][y], the column border_type[Y_DIR] describes
+__global__ void Pack_Column(double* g_Buf, const double* g_Grid, int y, int nx, int stride)
+{
+  for (int k = blockIdx.x*blockDim.x + threadIdx.x; k < nx - 2; k += gridDim.x*blockDim.x)
+     g_Buf[k] = g_Grid[(k + 1)*stride + y];
+}
+
+__global__ void Unpack_Column(double* g_Grid, const double* g_Buf, int y, int nx, int stride)
+{
+  for (int k = blockIdx.x*blockDim.x + threadIdx.x; k < nx - 2; k += gridDim.x*blockDim.x)
+     g_Grid[(k + 1)*stride + y] = g_Buf[k];
+}
+
+
+// blocks over the interior of an nx x ny grid, at most MAX_BLOCKS
+dim3 Blocks(int nx, int ny)
+{
+  int by = (ny - 2 + TILE_Y - 1) / TILE_Y;
+  int bx = (nx - 2 + TILE_X - 1) / TILE_X;
+
+  if (by > MAX_BLOCKS_Y)
+    by = MAX_BLOCKS_Y;
+  if (by < 1)
+    by = 1;
+  if (bx > MAX_BLOCKS / by)
+    bx = MAX_BLOCKS / by;
+  if (bx < 1)
+    bx = 1;
+  return dim3(by, bx);
+}
+
+// copies the block sums of nsum reductions back and adds them up
+double SumParts(int blocks, int nsum, double* sub)
+{
+  cudaMemcpy(h_Part, d_Part, nsum * blocks * sizeof(double), cudaMemcpyDeviceToHost);
+  for (int k = 0; k < nsum; k++) {
+    sub[k] = 0;
+    for (int b = 0; b < blocks; b++)
+      sub[k] += h_Part[k * blocks + b];
+  }
+  return sub[0];
+}
+
+void checkCardVersion()
+{
+   cudaDeviceProp prop;
+   int device;
+
+   cudaGetDevice(&device);
+   cudaGetDeviceProperties(&prop, device);
+
+   if(prop.major < 2)
+   {
+      fprintf(stderr,"Need compute capability 2 or higher.\n");
+      exit(1);
+   }
+}
+
+
+// one device per rank, the ranks of a node take turns
+extern "C" void Gpu_Init(int rank)
+{
+  int ndev = 0;
+
+  if (cudaGetDeviceCount(&ndev) != cudaSuccess || ndev == 0)
+  {
+    fprintf(stderr, "(%i) Gpu_Init : no CUDA device\n", rank);
+    exit(1);
+  }
+  cudaSetDevice(rank % ndev);
+  checkCardVersion();
+
+  d_Part = (double*) Gpu_Alloc(2 * MAX_BLOCKS * sizeof(double));
+  if ((h_Part = (double*) malloc(2 * MAX_BLOCKS * sizeof(double))) == NULL)
+  {
+    fprintf(stderr, "(%i) Gpu_Init : malloc(h_Part) failed\n", rank);
+    exit(1);
+  }
+}
+
+extern "C" void *Gpu_Alloc(size_t bytes)
+{
+  void* d = NULL;
+
+  if (cudaMalloc(&d, bytes > 0 ? bytes : 1) != cudaSuccess)
+  {
+    fprintf(stderr, "Gpu_Alloc : cudaMalloc of %lu bytes failed\n", (unsigned long) bytes);
+    exit(1);
+  }
+  cudaMemset(d, 0, bytes);
+  return d;
+}
+
+extern "C" void Gpu_Free(void *d)
+{
+  cudaFree(d);
+}
+
+extern "C" void Gpu_Upload(void *d, const void *h, size_t bytes)
+{
+  cudaMemcpy(d, h, bytes, cudaMemcpyHostToDevice);
+}
+
+extern "C" void Gpu_Download(void *h, const void *d, size_t bytes)
+{
+  cudaMemcpy(h, d, bytes, cudaMemcpyDeviceToHost);
+}
+
+// the kernels run asynchronously, MPI may only touch their output after this
+extern "C" void Gpu_Sync()
+{
+  cudaDeviceSynchronize();
+}
+
+extern "C" void Gpu_Release()
+{
+  cudaFree(d_Part);
+  free(h_Part);
+  d_Part = NULL;
+  h_Part = NULL;
+}
+
+extern "C" double Gpu_Stencil_Dot(double *v, const double *p, const int *source,
+  int nx, int ny, int stride)
+{
+  dim3 threads(TILE_Y, TILE_X);
+  dim3 blocks = Blocks(nx, ny);
+  double sub;
+
+  Stencil_Dot<<<blocks, threads, TILE_Y * TILE_X * sizeof(double)>>>(v, p, source, d_Part, nx, ny, stride);
+  return SumParts(blocks.x * blocks.y, 1, &sub);
+}
+
+// phi may be NULL (no update of phi), d NULL for z = r
+extern "C" void Gpu_Update_CG(double a, double *phi, const double *p, const double *v,
+  double *r, double *z, const double *d, int nx, int ny, int stride,
+  double *sub)
+{
+  dim3 threads(TILE_Y, TILE_X);
+  dim3 blocks = Blocks(nx, ny);
+
+  Update_CG<<<blocks, threads, 2 * TILE_Y * TILE_X * sizeof(double)>>>(a, phi, p, v, r, z, d, d_Part, nx, ny, stride);
+  SumParts(blocks.x * blocks.y, 2, sub);
+}
+
+extern "C" void Gpu_Axpy(double *y, const double *x, double a, int nx, int ny, int stride)
+{
+  dim3 threads(TILE_Y, TILE_X);
+
+  Axpy<<<Blocks(nx, ny), threads>>>(y, x, a, nx, ny, stride);
+}
+
+extern "C" void Gpu_Xpay(double *y, const double *x, double b, int nx, int ny, int stride)
+{
+  dim3 threads(TILE_Y, TILE_X);
+
+  Xpay<<<Blocks(nx, ny), threads>>>(y, x, b, nx, ny, stride);
+}
+
+extern "C" void Gpu_Pack_Column(double *buf, const double *grid, int y, int nx, int stride)
+{
+  Pack_Column<<<(nx - 2 + THREADS - 1) / THREADS, THREADS>>>(buf, grid, y, nx, stride);
+}
+
+extern "C" void Gpu_Unpack_Column(double *grid, const double *buf, int y, int nx, int stride)
+{
+  Unpack_Column<<<(nx - 2 + THREADS - 1) / THREADS, THREADS>>>(grid, buf, y, nx, stride);
+}
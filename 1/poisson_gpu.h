@@ -0,0 +1,34 @@
+/*
+ * poisson_gpu.h
+ * The CUDA backend of the MPI_Poisson CG ("backend: gpu", built with
+ * -DUSE_GPU), implemented in poisson_gpu.cu. A grid is a device copy of
+ * a grid of MPI_Poisson with one ghost layer: nx = dim[X_DIR] rows of
+ * 'stride' values, point (x, y) at x * stride + y. The kernels work on
+ * the interior, the reductions return the local sums on the host.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void Gpu_Init(int rank);
+void *Gpu_Alloc(size_t bytes);		/* zeroed device memory */
+void Gpu_Free(void *d);
+void Gpu_Upload(void *d, const void *h, size_t bytes);
+void Gpu_Download(void *h, const void *d, size_t bytes);
+void Gpu_Sync();
+void Gpu_Release();
+
+double Gpu_Stencil_Dot(double *v, const double *p, const int *source,
+  int nx, int ny, int stride);
+void Gpu_Update_CG(double a, double *phi, const double *p, const double *v,
+  double *r, double *z, const double *d, int nx, int ny, int stride,
+  double *sub);
+void Gpu_Axpy(double *y, const double *x, double a, int nx, int ny, int stride);
+void Gpu_Xpay(double *y, const double *x, double b, int nx, int ny, int stride);
+void Gpu_Pack_Column(double *buf, const double *grid, int y, int nx, int stride);
+void Gpu_Unpack_Column(double *grid, const double *buf, int y, int nx, int stride);
+
+#ifdef __cplusplus
+}
+#endif
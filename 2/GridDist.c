@@ -19,6 +19,8 @@ int N_sources;			/* number of sources */
 int *source;			/* global vertex id of source */
 double *source_val;		/* value of sources */
 int do_adapt;			/* perfrom grid adaptation */
+int do_binary;			/* also write input<P>.bin */
+int do_graph;			/* partition the vertex graph */
 
 void Debug(char *mesg, int terminate);
 void Setup_Grid(int argc, char **argv);
@@ -27,6 +29,9 @@ void Write_Datafiles();
 void Write_GraphMap();
 
 #include "grid.c"
+#include "fempart.h"
+#include "partition.c"
+#include "graphpart.c"
 
 void Debug(char *mesg, int terminate)
 {
@@ -38,18 +43,18 @@ void Debug(char *mesg, int terminate)
 
 void Setup_Grid(int argc, char **argv)
 {
-  int i, x, y, N = 0;
+  int i, N = 0;
   int wrong_param = 0;
-  double source_x, source_y;
-  FILE *f;
 
   Debug("Setup_Grid", 0);
 
   gridsize[X_DIR] = gridsize[Y_DIR] = 0;
 
   do_adapt = 0;
+  do_binary = 0;
+  do_graph = 0;
 
-  if ( (argc != 5) && (argc != 6) )
+  if ( (argc < 5) || (argc > 8) )
     wrong_param = 1;
   else
   {
@@ -60,16 +65,20 @@ void Setup_Grid(int argc, char **argv)
     gridsize[Y_DIR] = atoi(argv[4]);
     if ((N == 0) || (gridsize[X_DIR] * gridsize[Y_DIR] == 0))
       wrong_param = 1;
-    if (argc==6)
+    for (i = 5; i < argc; i++)
     {
-      if (strcmp(argv[5],"adapt"))
-        wrong_param = 1;
-      else
+      if (strcmp(argv[i],"adapt") == 0)
         do_adapt = 1;
+      else if (strcmp(argv[i],"binary") == 0)
+        do_binary = 1;
+      else if (strcmp(argv[i],"graph") == 0)
+        do_graph = 1;
+      else
+        wrong_param = 1;
     }
   }
   if (wrong_param)
-    Debug("Wrong number of parameters.\nUse : GridDist <Px> <Py> <dim_x> <dim_y> [adapt]", 1);
+    Debug("Wrong number of parameters.\nUse : GridDist <Px> <Py> <dim_x> <dim_y> [adapt] [binary] [graph]", 1);
 
 /****/
   nx = gridsize[X_DIR];
@@ -77,39 +86,7 @@ void Setup_Grid(int argc, char **argv)
   nm = 50;
 /****/
 
-  if ((f = fopen("sources.dat", "r")) == NULL)
-    Debug("Can't open sources.dat", 1);
-
-  fscanf(f, "%i\n", &N_sources);
-  if (N_sources > 0)
-  {
-    if ((source = malloc(N_sources * sizeof(int))) == NULL)
-        Debug("Error: malloc 'source'", 1);
-    if ((source_val = malloc(N_sources * sizeof(double))) == NULL)
-        Debug("Error: malloc 'source_val'", 1);
-
-/****/
-    nsource = N_sources;
-    if ((source2=malloc(nsource*sizeof(sourcepoint)))==NULL)
-      Debug("Out of memory", 1);
-/****/
-
-    for (i = 0; i < N_sources; i++)
-    {
-      fscanf(f, "source: %lf %lf %lf\n", &source_x, &source_y, &source_val[i]);
-      x = floor(0.5 + source_x * (gridsize[X_DIR] - 1));
-      y = floor(0.5 + source_y * (gridsize[Y_DIR] - 1));
-      source[i] = y * gridsize[X_DIR] + x;
-      source2[i].xpos = source_x; /****/
-      source2[i].ypos = source_y; /****/
-      source2[i].value = source_val[i]; /****/
-/*
-      printf("(%f,%f) --> (%f,%f) --> (%i,%i) --> %i\n", source_x, source_y,
-	     (double) x / (gridsize[X_DIR] - 1),
-	     (double) y / (gridsize[Y_DIR] - 1), x, y, source[i]);
-*/
-    }
-  }
+  Read_Sources();
 /*
   for (i = 0; i < N_sources; i++)
     printf("source %i : %f\n", source[i], source_val[i]);
@@ -136,232 +113,175 @@ void Write_Grid()
 }
 
 
+void Write_Text_Partition(FILE *f, Partition *part)
+{
+  int i, j, k, *halo = part->halo, *nb;
+
+  /* print vertices */
+  fprintf(f, "N_vert: %i\n", part->h.N_vert);
+  fprintf(f, "id x y type\n");
+  for (i = 0; i < part->h.N_vert; i++)
+    fprintf(f, "%i %20.15e %20.15e %i %20.15e\n", i, part->x[i], part->y[i],
+	    part->type[i], part->val[i]);
+
+  /* print elements */
+  fprintf(f, "N_elm: %i\n", part->h.N_elm);
+  fprintf(f, "id v1 v2 v3\n");
+  for (i = 0; i < part->h.N_elm; i++)
+    fprintf(f, "%i %i %i %i\n", i, part->elm[3 * i], part->elm[3 * i + 1],
+	    part->elm[3 * i + 2]);
+
+  /* print neighbour connectivity */
+  fprintf(f, "Neighbours: %i\n", part->h.N_neighb);
+  for (i = 0; i < part->h.N_neighb; i++)
+  {
+    nb = part->neighb + 3 * i;
+    for (k = 1; k <= 2; k++)
+    {
+      fprintf(f, "%s %i :", (k == 1) ? "from" : "to", nb[0]);
+      for (j = 0; j < nb[k]; j++)
+	fprintf(f, " %i", *halo++);
+      fprintf(f, "\n");
+    }
+  }
+}
+
+void Write_Binary_Partition(FILE *f, Partition *part)
+{
+  PartHeader *h = &part->h;
+  long long pad = Part_Bytes(h) - sizeof(PartHeader)
+    - (long long) h->N_vert * (3 * sizeof(double) + 2 * sizeof(int))
+    - (long long) (3 * h->N_elm + 3 * h->N_neighb + h->N_halo) * sizeof(int);
+  char zero[8] = { 0 };
+
+  fwrite(h, sizeof(PartHeader), 1, f);
+  fwrite(part->x, sizeof(double), h->N_vert, f);
+  fwrite(part->y, sizeof(double), h->N_vert, f);
+  fwrite(part->val, sizeof(double), h->N_vert, f);
+  fwrite(part->type, sizeof(int), h->N_vert, f);
+  fwrite(part->gid, sizeof(int), h->N_vert, f);
+  fwrite(part->elm, sizeof(int), 3 * h->N_elm, f);
+  fwrite(part->neighb, sizeof(int), 3 * h->N_neighb, f);
+  fwrite(part->halo, sizeof(int), h->N_halo, f);
+  fwrite(zero, 1, pad, f);
+}
+
+/*
+ * The partitions are built and their text files written in parallel
+ * (OpenMP). With 'binary' they are kept until all are built and then
+ * appended to input<P>.bin in rank order. With 'graph' the parts of
+ * vert_part are written instead of the rectangles of the process grid.
+ */
 void Write_Datafiles()
 {
-  int i, x, y, t, v;
-  int px, py;
-  int x_off, y_off, x_dim, y_dim;
-  int N_vert, N_elm;
-  int top, left, right, bottom;
-  int start, end;
-  double s_val = 0;
+  int rank;
+  int N_proc = P_grid[X_DIR] * P_grid[Y_DIR];
+  int head[2];
+  long long *offset = NULL;
   char filename[25];
-  FILE *f;
+  Partition *parts = NULL;
+  FILE *fb = NULL;
 
   Debug("Write_Datafiles", 0);
 
+  if (do_binary)
+    if ((parts = malloc(N_proc * sizeof(Partition))) == NULL)
+      Debug("Write_Datafiles: out of memory", 1);
+
   printf("Writing file");
-  for (py = 0; py < P_grid[Y_DIR]; py++)
-    for (px = 0; px < P_grid[X_DIR]; px++)
+  #pragma omp parallel for schedule(dynamic)
+  for (rank = 0; rank < N_proc; rank++)
+  {
+    char name[25];
+    Partition part;
+    FILE *f;
+
+    if (do_graph)
+      Build_Graph_Partition(rank, N_proc, &part);
+    else
+      Build_Partition(rank % P_grid[X_DIR], rank / P_grid[X_DIR], &part);
+
+    sprintf(name, "input%i-%i.dat", N_proc, rank);
+    if ((f = fopen(name, "w")) == NULL)
+      Debug("Write_Datafiles: Could not open data outputfile", 1);
+    Write_Text_Partition(f, &part);
+    fclose(f);
+
+    if (do_binary)
+      parts[rank] = part;
+    else
+      Free_Partition(&part);
+
+    #pragma omp critical
     {
-      printf(" %i", py * P_grid[X_DIR] + px);
+      printf(" %i", rank);
       fflush(stdout);
-      sprintf(filename, "input%i-%i.dat", P_grid[X_DIR] * P_grid[Y_DIR],
-	      py * P_grid[X_DIR] + px);
-      if ((f = fopen(filename, "w")) == NULL)
-	Debug("Write_Datafiles: Could not open data outputfile", 1);
-      x_off = gridsize[X_DIR] * px / P_grid[X_DIR];
-      y_off = gridsize[Y_DIR] * py / P_grid[Y_DIR];
-      x_dim = gridsize[X_DIR] * (px + 1) / P_grid[X_DIR] - x_off;
-      y_dim = gridsize[Y_DIR] * (py + 1) / P_grid[Y_DIR] - y_off;
-      top = bottom = right = left = start = end = 0;
-      if (py != 0)
-	top = 1;
-      if (py != P_grid[Y_DIR] - 1)
-	bottom = 1;
-      if (px != 0)
-	left = 1;
-      if (px != P_grid[X_DIR] - 1)
-	right = 1;
-      if (top && left)
-	start = -1;
-      if (bottom && right)
-	end = -1;
-      x_dim += left + right;
-      y_dim += top + bottom;
-      x_off -= left;
-      y_off -= top;
-
-      /* print vertices */
-      N_vert = x_dim * y_dim + start;
-      if (bottom && right)
-	N_vert--;
-      fprintf(f, "N_vert: %i\n", N_vert);
-      fprintf(f, "id x y type\n");
-      for (y = 0; y < y_dim; y++)
-	for (x = ((y == 0) ? -start : 0); x < x_dim +
-	     ((y == y_dim - 1) ? end : 0); x++)
-	{
-	  t = 0;
-	  if (((x == 0) && left) || ((y == 0) && top) ||
-	      ((x == x_dim - 1) && right) || ((y == y_dim - 1) && bottom))
-	    t += TYPE_GHOST;
-	  v = (y + y_off) * gridsize[X_DIR] + (x + x_off);
-
-	  /* check if current vertex is a source */
-	  if ((x + x_off == 0) || (x + x_off == gridsize[X_DIR] - 1) ||
-	      (y + y_off == 0) || (y + y_off == gridsize[Y_DIR] - 1))
-	  {
-	    t |= TYPE_SOURCE;
-	    s_val = 0;
-	  }
-	  for (i = 0; (i < N_sources) && (source[i] != v); i++) ;
-	  if (i < N_sources)
-	  {
-	    t |= TYPE_SOURCE;
-	    s_val = source_val[i];
-	  }
-
-          if (do_adapt)
-	    fprintf(f, "%i %20.15e %20.15e %i ", y * x_dim + x + start,
-		    grid[x+x_off+(y+y_off)*gridsize[X_DIR]+1].xpos,
-		    grid[x+x_off+(y+y_off)*gridsize[X_DIR]+1].ypos, t);
-          else
-	    fprintf(f, "%i %20.15e %20.15e %i ", y * x_dim + x + start,
-		    ((float) x + x_off) / (gridsize[X_DIR] - 1),
-		    ((float) y + y_off) / (gridsize[Y_DIR] - 1), t);
-
-	  if (t & TYPE_SOURCE)
-	    fprintf(f, "%20.15e\n", s_val);
-	  else
-	    fprintf(f, "%20.15e\n", 0.0);
-	}
-
-      /* print elements */
-      N_elm = 2 * (x_dim - 1) * (y_dim - 1) + start + end;
-      fprintf(f, "N_elm: %i\n", N_elm);
-      fprintf(f, "id v1 v2 v3\n");
-      for (y = 0; y < y_dim - 1; y++)
-	for (x = 0; x < x_dim - 1; x++)
-	{
-	  if ((y != 0) || (x != 0) || (start == 0))
-	    fprintf(f, "%i %i %i %i\n", (y * (x_dim - 1) + x) * 2 + start,
-		    y * x_dim + x + start, y * x_dim + x + 1 + start,
-		    (y + 1) * x_dim + x + start);
-	  if ((y != y_dim - 2) || (x != x_dim - 2) || (end == 0))
-	    fprintf(f, "%i %i %i %i\n", (y * (x_dim - 1) + x) * 2 + 1 + start,
-		    y * x_dim + x + 1 + start, (y + 1) * x_dim + x + start,
-		    (y + 1) * x_dim + x + 1 + start);
-	}
-
-      /* print neighbour connectivity */
-      fprintf(f, "Neighbours: %i\n", top + bottom + left + right +
-	      ((top && right) ? 1 : 0) + ((bottom && left) ? 1 : 0));
-      if (top)
-      {
-	fprintf(f, "from %i :", (py - 1) * P_grid[X_DIR] + px);
-	for (x = left; x < x_dim - right; x++)
-	  fprintf(f, " %i", x + start);
-	fprintf(f, "\n");
-	fprintf(f, "to %i :", (py - 1) * P_grid[X_DIR] + px);
-	for (x = left; x < x_dim - right; x++)
-	  fprintf(f, " %i", x_dim + x + start);
-	fprintf(f, "\n");
-      }
-      if (bottom)
-      {
-	fprintf(f, "from %i :", (py + 1) * P_grid[X_DIR] + px);
-	for (x = left; x < x_dim - right; x++)
-	  fprintf(f, " %i", (y_dim - 1) * x_dim + x + start);
-	fprintf(f, "\n");
-	fprintf(f, "to %i :", (py + 1) * P_grid[X_DIR] + px);
-	for (x = left; x < x_dim - right; x++)
-	  fprintf(f, " %i", (y_dim - 2) * x_dim + x + start);
-	fprintf(f, "\n");
-      }
-      if (left)
-      {
-	fprintf(f, "from %i :", py * P_grid[X_DIR] + px - 1);
-	for (y = top; y < y_dim - bottom; y++)
-	  fprintf(f, " %i", y * x_dim + start);
-	fprintf(f, "\n");
-	fprintf(f, "to %i :", py * P_grid[X_DIR] + px - 1);
-	for (y = top; y < y_dim - bottom; y++)
-	  fprintf(f, " %i", y * x_dim + 1 + start);
-	fprintf(f, "\n");
-      }
-      if (right)
-      {
-	fprintf(f, "from %i :", py * P_grid[X_DIR] + px + 1);
-	for (y = top; y < y_dim - bottom; y++)
-	  fprintf(f, " %i", (y + 1) * x_dim - 1 + start);
-	fprintf(f, "\n");
-	fprintf(f, "to %i :", py * P_grid[X_DIR] + px + 1);
-	for (y = top; y < y_dim - bottom; y++)
-	  fprintf(f, " %i", (y + 1) * x_dim - 2 + start);
-	fprintf(f, "\n");
-      }
-      if (top && right)
-      {
-	fprintf(f, "from %i : %i\n", (py - 1) * P_grid[X_DIR] + px + 1,
-		x_dim - 1 + start);
-	fprintf(f, "to %i : %i\n", (py - 1) * P_grid[X_DIR] + px + 1,
-		2 * x_dim - 2 + start);
-      }
-      if (bottom && left)
-      {
-	fprintf(f, "from %i : %i\n", (py + 1) * P_grid[X_DIR] + px - 1,
-		(y_dim - 1) * x_dim);
-	fprintf(f, "to %i : %i\n", (py + 1) * P_grid[X_DIR] + px - 1,
-		(y_dim - 2) * x_dim + 1);
-      }
-      fclose(f);
     }
+  }
+
+  if (do_binary)
+  {
+    sprintf(filename, "input%i.bin", N_proc);
+    if ((fb = fopen(filename, "wb")) == NULL)
+      Debug("Write_Datafiles: Could not open binary outputfile", 1);
+    if ((offset = malloc(N_proc * sizeof(long long))) == NULL)
+      Debug("Write_Datafiles: out of memory", 1);
+    offset[0] = PART_TABLE + N_proc * sizeof(long long);
+    for (rank = 1; rank < N_proc; rank++)
+      offset[rank] = offset[rank - 1] + Part_Bytes(&parts[rank - 1].h);
+
+    head[0] = N_proc;
+    head[1] = gridsize[X_DIR] * gridsize[Y_DIR];
+    fwrite(PART_MAGIC, 1, 8, fb);
+    fwrite(head, sizeof(int), 2, fb);
+    fwrite(offset, sizeof(long long), N_proc, fb);
+    for (rank = 0; rank < N_proc; rank++)
+    {
+      Write_Binary_Partition(fb, &parts[rank]);
+      Free_Partition(&parts[rank]);
+    }
+    fclose(fb);
+    free(offset);
+    free(parts);
+  }
 }
 
 void Write_GraphMap()
 {
-  int px, py;
-  int n = 0;
+  int i, n;
+  int N_proc = P_grid[X_DIR] * P_grid[Y_DIR];
+  int *index, *edges;
   FILE *f;
   char filename[25];
 
   Debug("Write_GraphMap", 0);
 
-  sprintf(filename, "mapping%i.dat", P_grid[X_DIR] * P_grid[Y_DIR]);
+  if ((index = malloc(N_proc * sizeof(int))) == NULL ||
+      (edges = malloc((do_graph ? N_proc : 6) * N_proc * sizeof(int))) == NULL)
+    Debug("Write_GraphMap: out of memory", 1);
+  if (do_graph)
+    n = Graph_Map_Parts(N_proc, index, edges);
+  else
+    n = Graph_Map(index, edges);
+
+  sprintf(filename, "mapping%i.dat", N_proc);
   if ((f = fopen(filename, "w")) == NULL)
     Debug("Write_GraphMap: Could not open mapping outputfile", 1);
 
   printf(" map\n");
 
-  fprintf(f, "N_proc : %i\n", P_grid[X_DIR] * P_grid[Y_DIR]);
+  fprintf(f, "N_proc : %i\n", N_proc);
   fprintf(f, "number of neighbours :\n");
-  for (py = 0; py < P_grid[Y_DIR]; py++)
-    for (px = 0; px < P_grid[X_DIR]; px++)
-    {
-      if (py > 0)
-	n++;
-      if (py < P_grid[Y_DIR] - 1)
-	n++;
-      if (px > 0)
-	n++;
-      if (px < P_grid[X_DIR] - 1)
-	n++;
-      if ((py > 0) && (px < P_grid[X_DIR] - 1))
-	n++;
-      if ((px > 0) && (py < P_grid[Y_DIR] - 1))
-	n++;
-      fprintf(f, "%i\n", n);
-    }
+  for (i = 0; i < N_proc; i++)
+    fprintf(f, "%i\n", index[i]);
 
   fprintf(f, "neighbours :\n");
-  for (py = 0; py < P_grid[Y_DIR]; py++)
-    for (px = 0; px < P_grid[X_DIR]; px++)
-    {
-      if (py > 0)
-	fprintf(f, "%i\n", (py - 1) * P_grid[X_DIR] + px);
-      if (py < P_grid[Y_DIR] - 1)
-	fprintf(f, "%i\n", (py + 1) * P_grid[X_DIR] + px);
-      if (px > 0)
-	fprintf(f, "%i\n", py * P_grid[X_DIR] + px - 1);
-      if (px < P_grid[X_DIR] - 1)
-	fprintf(f, "%i\n", py * P_grid[X_DIR] + px + 1);
-      if ((py > 0) && (px < P_grid[X_DIR] - 1))
-	fprintf(f, "%i\n", (py - 1) * P_grid[X_DIR] + px + 1);
-      if ((px > 0) && (py < P_grid[Y_DIR] - 1))
-	fprintf(f, "%i\n", (py + 1) * P_grid[X_DIR] + px - 1);
-    }
+  for (i = 0; i < n; i++)
+    fprintf(f, "%i\n", edges[i]);
   fclose(f);
+
+  free(index);
+  free(edges);
 }
 
 int main(int argc, char **argv)
@@ -372,6 +292,10 @@ int main(int argc, char **argv)
     adaptgrid();
     Write_Grid();
   }
+  else if (do_graph)
+    gridgen();
+  if (do_graph)
+    Partition_Grid(P_grid[X_DIR] * P_grid[Y_DIR]);
   Write_Datafiles();
   Write_GraphMap();
 
@@ -1,27 +1,136 @@
 /*
  * MPI_Fempois.c
  * 2D Poisson equation solver with MPI and FEM
+ *
+ * Built with -fopenmp every rank runs OMP_NUM_THREADS threads over the
+ * rows of A and the vectors (hybrid MPI+OpenMP); only the master thread
+ * calls MPI (MPI_THREAD_FUNNELED).
+ *
+ * Built with -DLIBRARY there is no main(), see fempois.h: the caller
+ * initialises MPI, sets up once and then solves as often as it needs.
+ *
+ * Built with -DUSE_GPU and linked with fempois_gpu.cu, "backend: gpu"
+ * runs the CG on one CUDA device per rank, see Solve_GPU().
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include <time.h>
+#include <sys/mman.h>
 #include "mpi.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "fempart.h"
+#include "fempois.h"
+#ifdef USE_GPU
+#include "fempois_gpu.h"
+#endif
 
 #define DEBUG 0
 
-#define TYPE_GHOST 1
-#define TYPE_SOURCE 2
-
 #define MAXCOL 20
+#define MAX_HALO_VECTORS 16
+#define MAX_MEMB 4		/* renumbering: halo memberships compared per vertex */
+#define MAX_PHASE_DEPTH 8
+#define MAX_WORK 9		/* work vectors of the pipelined solver */
+#define ARENA_ALIGN 64		/* bytes, one cache line */
+#define ARENA_BLOCK (2 << 20)	/* bytes, one huge page, the smallest block */
+#define N_CKPT_INTS 9		/* checkpoint header: P, solver, ..., see Write_Checkpoint() */
+#define N_CKPT_SCALARS 4	/* checkpoint header: solver scalars */
+
+enum
+{
+  X_DIR, Y_DIR
+};
 
-typedef struct
+/* one block of the arena, the allocations follow the padded header */
+typedef struct Arena_Block
 {
-  int type;
-  double x, y;
+  struct Arena_Block *next;	/* the block before */
+  size_t size, used;		/* bytes, header included */
+  int mapped;			/* from mmap(), else posix_memalign() */
 }
-Vertex;
+Arena_Block;
+
+enum
+{
+  FORMAT_CSR,		/* compressed sparse rows */
+  FORMAT_ELL		/* ELLPACK, column major, padded to the widest row */
+};
+
+enum
+{
+  SOLVER_CG,		/* textbook CG, two blocking reductions per iteration */
+  SOLVER_PIPELINED	/* Ghysels-Vanroose pipelined CG, one hidden reduction */
+};
+
+enum
+{
+  BACKEND_CPU,		/* the solvers of this file, OpenMP if built with it */
+  BACKEND_GPU		/* Solve_GPU(), -DUSE_GPU builds only */
+};
+
+enum
+{
+  INPUT_TEXT,		/* input<P>-<rank>.dat per rank */
+  INPUT_BINARY,		/* one input<P>.bin, read with MPI-IO */
+  INPUT_GENERATE	/* every rank builds its own partition, no files */
+};
+
+enum
+{
+  OUTPUT_TEXT,		/* output<P>-<rank>.dat per rank */
+  OUTPUT_BINARY		/* one output<P>.bin, written with MPI-IO */
+};
+
+enum
+{
+  EXCHANGE_SENDRECV,	/* one blocking MPI_Sendrecv per neighbour, in rank order */
+  EXCHANGE_PERSISTENT,	/* persistent requests per vector, all neighbours at once */
+  EXCHANGE_NEIGHBOR	/* MPI_Neighbor_alltoallw on the process graph */
+};
+
+enum
+{
+  HALO_DATATYPE,	/* one indexed MPI datatype per neighbour and direction */
+  HALO_PACKED		/* explicit gather/scatter through contiguous buffers */
+};
+
+enum
+{
+  PHASE_SETUP,		/* settings, partition input, matrix and halo setup */
+  PHASE_COMPUTE,	/* solver kernels */
+  PHASE_HALO,		/* halo exchanges */
+  PHASE_REDUCE,		/* global reductions */
+  PHASE_OUTPUT,		/* writing the solution */
+  N_PHASES
+};
+
+enum
+{
+  PROFILE_NONE,		/* only the table printed by rank 0 */
+  PROFILE_CSV,		/* also profile<P>.csv, one value per line */
+  PROFILE_JSON		/* also profile<P>.json */
+};
+
+enum
+{
+  PC_NONE,		/* plain CG */
+  PC_JACOBI,		/* diagonal scaling */
+  PC_SSOR,		/* block Jacobi, one local SSOR sweep per rank */
+  PC_IC			/* block Jacobi, local diagonal incomplete Cholesky */
+};
+
+enum
+{
+  REORDER_NONE,		/* vertices in the order of the partition */
+  REORDER_OWNED,	/* owned vertices first, ghosts last */
+  REORDER_RCM,		/* owned first, in reverse Cuthill-McKee order */
+  REORDER_HILBERT	/* owned first, along a Hilbert curve */
+};
 
 typedef int Element[3];
 
@@ -33,11 +142,53 @@ typedef struct
 }
 Matrixrow;
 
+/* one variable of the state of a solver, see solver_state[] */
+typedef struct
+{
+  void *addr;
+  size_t size;
+}
+State_Var;
+
+/* a solver of fempois.h, its copy of the variables in solver_state[] */
+struct Fempois_Solver
+{
+  char *state;
+};
+
 /* global variables */
+MPI_Comm solver_comm = MPI_COMM_WORLD;	/* all processes of the solver */
+const char *settings_file = "input.dat";	/* settings, read by rank 0 */
 double precision_goal;		/* precision_goal of solution */
 int max_iter;			/* maximum number of iterations alowed */
+int overlap_reduction = 0;	/* hide the r'r reduction behind the x update */
+int solver = SOLVER_CG;		/* CG variant used */
+int replace_interval = 50;	/* pipelined CG: iterations between residual replacements */
+int matrix_format = FORMAT_CSR;	/* storage of A after assembly */
+int preconditioner = PC_NONE;	/* CG preconditioner */
+double pc_omega = 1.0;		/* relaxation of the SSOR preconditioner */
+int backend = BACKEND_CPU;	/* where the solve runs */
+int input_format = INPUT_TEXT;	/* format of the partition files */
+int output_format = OUTPUT_TEXT;	/* format written by Write_Grid */
+int exchange = EXCHANGE_SENDRECV;	/* halo exchange engine */
+int halo_path = HALO_DATATYPE;	/* how the halo entries reach the messages */
+int renumber_halo = 0;		/* group every halo into consecutive vertices */
+int reorder = REORDER_NONE;	/* vertex order set up by Reorder_Vertices */
+int halo_bench = 0;		/* exchanges timed per halo path, 0: no benchmark */
+int checkpoint_interval = 0;	/* iterations between checkpoints, 0: none */
+int restart = 0;		/* --restart: continue from checkpoint<P>.bin */
+int N_batch_src = 0;		/* sources in input.dat, they replace the partition's */
+double *batch_src = NULL;	/* (x, y, value) per source of input.dat */
+int N_sets = 0;			/* source sets ("source set:"), solved as one batch */
+int *set_first = NULL;		/* set s: batch_src set_first[s] up to set_first[s + 1] */
+int batch_set = -1;		/* set written by Write_Grid, -1 outside batch mode */
 int P;				/* total number of processes */
 int P_grid[2];			/* processgrid dimensions */
+int gridsize[2];		/* generate: global grid dimensions */
+int do_adapt = 0;		/* generate: adapt the grid to the sources */
+int N_sources;			/* generate: number of sources */
+int *source;			/* generate: global vertex id of source */
+double *source_val;		/* generate: value of sources */
 MPI_Comm grid_comm;		/* grid COMMUNICATOR */
 MPI_Status status;
 
@@ -46,6 +197,29 @@ clock_t ticks;			/* number of systemticks */
 double wtime;			/* wallclock time */
 int timer_on = 0;		/* is timer running? */
 
+/* instrumentation related variables */
+char *phase_name[N_PHASES] = { "setup", "compute", "halo", "reduce", "output" };
+double phase_time[N_PHASES];	/* wallclock time spent in each phase */
+int phase_stack[MAX_PHASE_DEPTH];	/* current phase on top, PHASE_SETUP below all */
+int phase_depth = 0;
+double phase_mark;		/* start of the current stretch of the current phase */
+long long *halo_bytes;		/* bytes sent to each neighbour */
+int solve_iter = 0;		/* iterations done by the solver */
+int profile_format = PROFILE_NONE;	/* export of the profile */
+
+/* checkpoint related variables */
+MPI_File ckpt_fh;		/* checkpoint<P>.tmp while it is written */
+int ckpt_open = 0;
+MPI_Request ckpt_req = MPI_REQUEST_NULL;
+char *ckpt_buf = NULL;		/* header (rank 0) and snapshot of the saved vectors */
+MPI_Offset ckpt_offset;		/* start of this rank's part of the file */
+int ckpt_total;			/* vertices of all ranks, ghosts included */
+int ckpt_last = 0;		/* iteration of the last checkpoint */
+
+/* batch related variables, K = N_sets values per vertex, [i * K + k] */
+double *phiB, *maskB;		/* solutions, 0.0 on the boundary and the sources of set k */
+double *batch_sbuf, *batch_rbuf;	/* K wide halo_sbuf and halo_rbuf */
+
 /* local process related variables */
 int proc_rank;			/* rank of current process */
 int proc_coord[2];		/* coordinates of current procces in processgrid */
@@ -53,35 +227,205 @@ int N_neighb;			/* Number of neighbouring processes */
 int *proc_neighb;		/* ranks of neighbouring processes */
 MPI_Datatype *send_type;	/* MPI Datatypes for sending */
 MPI_Datatype *recv_type;	/* MPI Datatypes for receiving */
+int **send_list, **recv_list;	/* halo vertices per neighbour, sources dropped */
+int *send_count, *recv_count;
+int *send_first, *recv_first;	/* packed: first vertex of a consecutive list, else -1 */
+int *send_off, *recv_off;	/* packed: offset of the list in halo_sbuf/halo_rbuf */
+double *halo_sbuf, *halo_rbuf;	/* packed: contiguous send and receive buffers */
+
+/* halo exchange related variables */
+double *halo_vect[MAX_HALO_VECTORS];	/* persistent: vectors with requests */
+int halo_vect_path[MAX_HALO_VECTORS];	/* persistent: halo path of the requests */
+MPI_Request *halo_req[MAX_HALO_VECTORS];	/* persistent: 2 * N_neighb per vector */
+int N_halo_vect = 0;
+int N_graph_neighb;		/* neighbor: neighbours of this rank in grid_comm */
+int *nb_index;			/* neighbor: index in proc_neighb, -1 if no halo */
+int *nb_scounts, *nb_rcounts;	/* neighbor: alltoallw arguments */
+MPI_Aint *nb_sdispls, *nb_rdispls;
+MPI_Datatype *nb_stypes, *nb_rtypes;
+char *nb_buf;			/* neighbor: packed send halos */
+int nb_buf_size;
 
 /* local grid related variables */
-Vertex *vert;			/* vertices */
+double *vert_x, *vert_y;	/* vertex coordinates, one array each */
+int *vert_type;			/* vertex types, TYPE_GHOST and TYPE_SOURCE bits */
+int N_owned = -1;		/* owned vertices come first: their number, else -1 */
 double *phi;			/* vertex values */
 int N_vert;			/* number of vertices */
-Matrixrow *A;			/* matrix A */
+int *vert_gid;			/* global vertex ids, binary input only */
+int *vert_new;			/* renumbered: new index of the vertex read as i */
+int *renumber_memb;		/* renumbering: neighbours a vertex is sent to */
+unsigned int *reorder_key;	/* reordering: Hilbert index of a vertex */
+int N_global;			/* vertices of the whole grid, binary input only */
+Matrixrow *A;			/* matrix A during assembly */
+int *csr_row;			/* CSR: start of row i in csr_col/csr_val */
+int *csr_col;			/* CSR: column indices, sorted per row */
+double *csr_val;		/* CSR: values */
+int ell_width;			/* ELL: entries per row */
+int *ell_col;			/* ELL: column of entry k of row i at k*N_vert+i */
+double *ell_val;		/* ELL: values, 0.0 for padding */
+double *pc_inv;			/* inverse preconditioner diagonal, 0.0 off the free rows */
+
+/* solver related variables */
+Arena_Block *arena = NULL;	/* work vectors, the newest block first */
+double *work[MAX_WORK];		/* vectors of the solver, see Setup_Work() */
+int *work_int;			/* batch: 2 per set */
+double *work_scalar;		/* batch: 9 per set */
+
+/* GPU related variables, all device memory */
+int *gpu_row, *gpu_col;		/* csr_row and csr_col */
+double *gpu_val;		/* csr_val */
+double *gpu_pc = NULL;		/* pc_inv, NULL without preconditioner */
+double *gpu_phi, *gpu_r, *gpu_p, *gpu_q, *gpu_z;	/* gpu_z: gpu_r without preconditioner */
+int *gpu_send_list, *gpu_recv_list;	/* the halo lists back to back, at send_off/recv_off */
+double *gpu_sbuf, *gpu_rbuf;	/* halo_sbuf and halo_rbuf */
+MPI_Request *gpu_req;		/* host: 2 * N_neighb */
+
+/*
+ * Every variable above that belongs to one solver. A Fempois_Solver keeps
+ * its own copy of them; Use_Solver() makes it current, Save_Solver()
+ * stores it back. The grid generator of grid.c only keeps its variables
+ * during Generate_Partition().
+ */
+#define STATE(v) { &(v), sizeof(v) }
+State_Var solver_state[] = {
+  STATE(solver_comm), STATE(settings_file), STATE(precision_goal),
+  STATE(max_iter), STATE(overlap_reduction), STATE(solver),
+  STATE(replace_interval), STATE(matrix_format), STATE(preconditioner),
+  STATE(pc_omega), STATE(backend), STATE(input_format), STATE(output_format),
+  STATE(exchange), STATE(halo_path), STATE(renumber_halo), STATE(reorder),
+  STATE(halo_bench), STATE(checkpoint_interval), STATE(restart),
+  STATE(N_batch_src), STATE(batch_src), STATE(N_sets), STATE(set_first),
+  STATE(batch_set), STATE(P), STATE(P_grid), STATE(gridsize), STATE(do_adapt),
+  STATE(N_sources), STATE(source), STATE(source_val), STATE(grid_comm),
+  STATE(status),
+  STATE(ticks), STATE(wtime), STATE(timer_on),
+  STATE(phase_time), STATE(phase_stack), STATE(phase_depth), STATE(phase_mark),
+  STATE(halo_bytes), STATE(solve_iter), STATE(profile_format),
+  STATE(ckpt_fh), STATE(ckpt_open), STATE(ckpt_req), STATE(ckpt_buf),
+  STATE(ckpt_offset), STATE(ckpt_total), STATE(ckpt_last),
+  STATE(phiB), STATE(maskB), STATE(batch_sbuf), STATE(batch_rbuf),
+  STATE(proc_rank), STATE(proc_coord), STATE(N_neighb), STATE(proc_neighb),
+  STATE(send_type), STATE(recv_type), STATE(send_list), STATE(recv_list),
+  STATE(send_count), STATE(recv_count), STATE(send_first), STATE(recv_first),
+  STATE(send_off), STATE(recv_off), STATE(halo_sbuf), STATE(halo_rbuf),
+  STATE(halo_vect), STATE(halo_vect_path), STATE(halo_req), STATE(N_halo_vect),
+  STATE(N_graph_neighb), STATE(nb_index), STATE(nb_scounts), STATE(nb_rcounts),
+  STATE(nb_sdispls), STATE(nb_rdispls), STATE(nb_stypes), STATE(nb_rtypes),
+  STATE(nb_buf), STATE(nb_buf_size),
+  STATE(vert_x), STATE(vert_y), STATE(vert_type), STATE(N_owned), STATE(phi),
+  STATE(N_vert), STATE(vert_gid), STATE(vert_new), STATE(renumber_memb),
+  STATE(reorder_key), STATE(N_global), STATE(A), STATE(csr_row),
+  STATE(csr_col), STATE(csr_val), STATE(ell_width), STATE(ell_col),
+  STATE(ell_val), STATE(pc_inv),
+  STATE(arena), STATE(work), STATE(work_int), STATE(work_scalar),
+  STATE(gpu_row), STATE(gpu_col), STATE(gpu_val), STATE(gpu_pc),
+  STATE(gpu_phi), STATE(gpu_r), STATE(gpu_p), STATE(gpu_q), STATE(gpu_z),
+  STATE(gpu_send_list), STATE(gpu_recv_list), STATE(gpu_sbuf),
+  STATE(gpu_rbuf), STATE(gpu_req)
+};
+#define N_STATE ((int) (sizeof(solver_state) / sizeof(*solver_state)))
+char *state_defaults = NULL;	/* the initial values, the start of every solver */
 
 void Setup_Proc_Grid();
+void Read_Settings();
 void Setup_Grid();
+void Alloc_Grid();
+double *Alloc_Vector(char *name);
+void Arena_Reserve(size_t bytes, char *name);
+void *Arena_Alloc(size_t bytes, char *name);
+void *Arena_Move(void *p, size_t bytes, char *name);
+void Arena_Free();
+void Pack_Grid();
+void Setup_Work();
+void Load_Partition(PartHeader *h, double *x, double *y, double *val,
+                    int *type, int *gid, int *elm, int *neighb, int *halo);
+void Read_Binary_Partition();
+void Generate_Partition();
 void Build_ElMatrix(Element el);
-void Sort_MPI_Datatypes();
-void Setup_MPI_Datatypes(FILE *f);
+void Finalize_Matrix();
+void Setup_Preconditioner();
+void Precondition(double *z, double *r);
+void Sort_Halos();
+void Alloc_Halos();
+void Make_Halo_List(int *indices, int n, int **list, int *count);
+void Read_Halos(FILE *f);
+int Cmp_Int(const void *a, const void *b);
+int Cmp_Membership(const void *a, const void *b);
+void Renumber_Vertices();
+void Permute_Vertices(int *old);
+void Reorder_Vertices();
+void Order_RCM(int *list, int n);
+unsigned int Hilbert_Index(unsigned int x, unsigned int y);
+int Cmp_Hilbert(const void *a, const void *b);
+void Order_Hilbert(int *list, int n);
+int First_Consecutive(int *list, int n);
+void Commit_Halos();
+double *Send_Buffer(double *vect, int i);
+double *Recv_Buffer(double *vect, int i);
+void Setup_Exchange();
+MPI_Request *Halo_Requests(double *vect, int path);
+void Free_Halo_Requests();
+void Exchange_Datatypes(double *vect);
+void Exchange_Packed(double *vect);
 void Exchange_Borders(double *vect);
+void Benchmark_Halo();
+void SpMV(double *y, double *x);
+double Dot_Owned(double *x, double *y);
+double SpMV_Dot(double *y, double *x);
+void Update_CG(double a, double *x, double *p, double *q, double *r, double *z,
+  double *sub);
+void Setup_Solver();
+int Run_Solver();
+size_t State_Size();
+void Use_Solver(Fempois_Solver *s);
+void Save_Solver(Fempois_Solver *s);
 void Solve();
+void Solve_Pipelined();
+void Setup_GPU();
+void Exchange_GPU(double *d_vect);
+void Solve_GPU();
+void Free_GPU();
+void Strip_Sources();
+double *Alloc_Batch_Vector(char *name);
+void Setup_Batch();
+void Exchange_Batch(double *vect);
+void SpMV_Batch(double *y, double *x);
+void Dot_Batch(double *x, double *y, double *sub);
+void Solve_Batch();
+void Write_Batch();
+void Free_Batch();
 void Write_Grid();
+void Write_Grid_Binary();
+MPI_Offset Checkpoint_Header_Size();
+void Checkpoint_Layout(int nv);
+void Checkpoint(int count, double **vect, int nv, double *scalar);
+void Write_Checkpoint(int count, double **vect, int nv, double *scalar);
+void Finish_Checkpoint();
+int Read_Checkpoint(double **vect, int nv, double *scalar);
 void Clean_Up();
 void Debug(char *mesg, int terminate);
 void start_timer();
 void resume_timer();
 void stop_timer();
 void print_timer();
+void Phase_Account();
+void Phase_Begin(int p);
+void Phase_End();
+void Print_Profile();
+void Write_Profile(double *t, double rate, int *displs, int *nb, long long *bytes);
+
+#include "grid.c"
+#include "partition.c"
 
 void start_timer()
 {
   if (!timer_on)
   {
-    MPI_Barrier(MPI_COMM_WORLD);
+    MPI_Barrier(solver_comm);
     ticks = clock();
     wtime = MPI_Wtime();
+    phase_mark = wtime;
     timer_on = 1;
   }
 }
@@ -120,13 +464,192 @@ void print_timer()
 	   proc_rank, wtime, 100.0 * ticks * (1.0 / CLOCKS_PER_SEC) / wtime);
 }
 
+/* adds the time since phase_mark to the current phase */
+void Phase_Account()
+{
+  double now = MPI_Wtime();
+
+  phase_time[phase_stack[phase_depth]] += now - phase_mark;
+  phase_mark = now;
+}
+
+/* the time from here on counts for phase p, until Phase_End() */
+void Phase_Begin(int p)
+{
+  Phase_Account();
+  if (phase_depth == MAX_PHASE_DEPTH - 1)
+    Debug("Phase_Begin : phases nested too deep", 1);
+  phase_stack[++phase_depth] = p;
+}
+
+/* back to the phase that was current before the last Phase_Begin() */
+void Phase_End()
+{
+  Phase_Account();
+  if (phase_depth > 0)
+    phase_depth--;
+}
+
+/*
+ * Rank 0 prints the minimum, average and maximum over the processes of
+ * the time spent in each phase and of the halo bytes sent, with the
+ * maximum over the average as a measure of load imbalance. With
+ * "profile: csv" or "profile: json" it also writes every rank's numbers,
+ * and the bytes sent to every neighbour, to profile<P>.csv or .json.
+ */
+void Print_Profile()
+{
+  int i, j, n_nb = N_neighb;
+  double t[N_PHASES + 2], *all = NULL;
+  double lo, sum, hi, solve_time = 0.0;
+  int *counts = NULL, *displs = NULL, *nb_all = NULL;
+  long long *bytes_all = NULL;
+
+  Debug("Print_Profile", 0);
+
+  Phase_Account();
+
+  /* per rank: the phases, the total and the bytes sent */
+  t[N_PHASES] = 0.0;
+  t[N_PHASES + 1] = 0.0;
+  for (i = 0; i < N_PHASES; i++)
+  {
+    t[i] = phase_time[i];
+    t[N_PHASES] += phase_time[i];
+  }
+  for (i = 0; i < N_neighb; i++)
+    t[N_PHASES + 1] += halo_bytes[i];
+
+  if (proc_rank == 0)
+    if ((all = malloc(P * (N_PHASES + 2) * sizeof(double))) == NULL ||
+        (counts = malloc(P * sizeof(int))) == NULL ||
+        (displs = malloc((P + 1) * sizeof(int))) == NULL)
+      Debug("Print_Profile : malloc failed", 1);
+  MPI_Gather(t, N_PHASES + 2, MPI_DOUBLE, all, N_PHASES + 2, MPI_DOUBLE, 0,
+             grid_comm);
+
+  if (profile_format != PROFILE_NONE)
+  {
+    MPI_Gather(&n_nb, 1, MPI_INT, counts, 1, MPI_INT, 0, grid_comm);
+    if (proc_rank == 0)
+    {
+      displs[0] = 0;
+      for (i = 0; i < P; i++)
+        displs[i + 1] = displs[i] + counts[i];
+      if ((nb_all = malloc((displs[P] + 1) * sizeof(int))) == NULL ||
+          (bytes_all = malloc((displs[P] + 1) * sizeof(long long))) == NULL)
+        Debug("Print_Profile : malloc(nb_all) failed", 1);
+    }
+    MPI_Gatherv(proc_neighb, n_nb, MPI_INT, nb_all, counts, displs, MPI_INT,
+                0, grid_comm);
+    MPI_Gatherv(halo_bytes, n_nb, MPI_LONG_LONG, bytes_all, counts, displs,
+                MPI_LONG_LONG, 0, grid_comm);
+  }
+
+  if (proc_rank != 0)
+    return;
+
+  for (i = 0; i < P; i++)
+  {
+    sum = all[i * (N_PHASES + 2) + PHASE_COMPUTE]
+      + all[i * (N_PHASES + 2) + PHASE_HALO]
+      + all[i * (N_PHASES + 2) + PHASE_REDUCE];
+    if (sum > solve_time)
+      solve_time = sum;
+  }
+  printf("Profile : %i iterations, %.1f iterations/s\n", solve_iter,
+         solve_time > 0.0 ? solve_iter / solve_time : 0.0);
+  printf("Profile : %-8s %14s %14s %14s %8s\n", "phase", "min", "avg", "max",
+         "max/avg");
+  for (j = 0; j < N_PHASES + 2; j++)
+  {
+    lo = hi = sum = all[j];
+    for (i = 1; i < P; i++)
+    {
+      sum += all[i * (N_PHASES + 2) + j];
+      if (all[i * (N_PHASES + 2) + j] < lo)
+        lo = all[i * (N_PHASES + 2) + j];
+      if (all[i * (N_PHASES + 2) + j] > hi)
+        hi = all[i * (N_PHASES + 2) + j];
+    }
+    if (j < N_PHASES + 1)
+      printf("Profile : %-8s %12.6f s %12.6f s %12.6f s %8.3f\n",
+             j < N_PHASES ? phase_name[j] : "total", lo, sum / P, hi,
+             sum > 0.0 ? hi * P / sum : 1.0);
+    else
+      printf("Profile : %-8s %12.0f B %12.0f B %12.0f B %8.3f\n", "sent",
+             lo, sum / P, hi, sum > 0.0 ? hi * P / sum : 1.0);
+  }
+
+  if (profile_format != PROFILE_NONE)
+    Write_Profile(all, solve_time > 0.0 ? solve_iter / solve_time : 0.0,
+                  displs, nb_all, bytes_all);
+
+  free(all);
+  free(counts);
+  free(displs);
+  free(nb_all);
+  free(bytes_all);
+}
+
+/*
+ * Rank 0: writes the gathered profile, rate being the iterations per
+ * second. The CSV has one value per line, "rank,metric,key,value"; the
+ * key of a byte count is the neighbour's rank, and the iteration counts
+ * belong to no rank.
+ */
+void Write_Profile(double *t, double rate, int *displs, int *nb, long long *bytes)
+{
+  int i, j;
+  char filename[25];
+  FILE *f;
+
+  sprintf(filename, "profile%i.%s", P, profile_format == PROFILE_CSV ? "csv" : "json");
+  if ((f = fopen(filename, "w")) == NULL)
+    Debug("Write_Profile : Can't open profile outputfile", 1);
+
+  if (profile_format == PROFILE_CSV)
+  {
+    fprintf(f, "rank,metric,key,value\n");
+    fprintf(f, ",iterations,,%i\n", solve_iter);
+    fprintf(f, ",iterations_per_second,,%.3f\n", rate);
+    for (i = 0; i < P; i++)
+    {
+      for (j = 0; j < N_PHASES; j++)
+        fprintf(f, "%i,time,%s,%.9f\n", i, phase_name[j], t[i * (N_PHASES + 2) + j]);
+      fprintf(f, "%i,time,total,%.9f\n", i, t[i * (N_PHASES + 2) + N_PHASES]);
+      for (j = displs[i]; j < displs[i + 1]; j++)
+        fprintf(f, "%i,bytes,%i,%lld\n", i, nb[j], bytes[j]);
+    }
+  }
+  else
+  {
+    fprintf(f, "{\n  \"processes\": %i,\n  \"iterations\": %i,\n"
+            "  \"iterations_per_second\": %.3f,\n  \"ranks\": [\n",
+            P, solve_iter, rate);
+    for (i = 0; i < P; i++)
+    {
+      fprintf(f, "    { \"rank\": %i, \"time\": {", i);
+      for (j = 0; j < N_PHASES; j++)
+        fprintf(f, " \"%s\": %.9f,", phase_name[j], t[i * (N_PHASES + 2) + j]);
+      fprintf(f, " \"total\": %.9f }, \"bytes_sent\": {", t[i * (N_PHASES + 2) + N_PHASES]);
+      for (j = displs[i]; j < displs[i + 1]; j++)
+        fprintf(f, "%s \"%i\": %lld", j > displs[i] ? "," : "", nb[j], bytes[j]);
+      fprintf(f, " } }%s\n", i < P - 1 ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+  }
+
+  fclose(f);
+}
+
 void Debug(char *mesg, int terminate)
 {
   if (DEBUG || terminate)
     printf("(%i) %s\n", proc_rank, mesg);
   if (terminate)
   {
-    MPI_Abort(MPI_COMM_WORLD, 1);
+    MPI_Abort(solver_comm, 1);
     exit(1);
   }
 }
@@ -139,13 +662,28 @@ void Setup_Proc_Grid()
   int N_nodes = 0, N_edges = 0;
   int *index, *edges, reorder;
 
-  MPI_Comm_rank(MPI_COMM_WORLD, &proc_rank);
+  MPI_Comm_rank(solver_comm, &proc_rank);
   Debug("My_MPI_Init", 0);
 
   /* Retrieve the number of processes and current process rank */
-  MPI_Comm_size(MPI_COMM_WORLD, &P);
+  MPI_Comm_size(solver_comm, &P);
 
   /* Create process topology (Graph) */
+  if (input_format == INPUT_GENERATE)
+  {
+    if (P_grid[X_DIR] * P_grid[Y_DIR] != P || gridsize[X_DIR] * gridsize[Y_DIR] == 0)
+      Debug("My_MPI_Init : generate needs 'process grid' for P processes and 'grid size'", 1);
+    if ((index = malloc(P * sizeof(int))) == NULL ||
+        (edges = malloc(6 * P * sizeof(int))) == NULL)
+      Debug("My_MPI_Init : malloc(index) failed", 1);
+    N_edges = Graph_Map(index, edges);
+    MPI_Graph_create(solver_comm, P, index, edges, 1, &grid_comm);
+    MPI_Comm_rank(grid_comm, &proc_rank);
+    free(edges);
+    free(index);
+    return;
+  }
+
   if (proc_rank == 0)
   {
     sprintf(filename, "mapping%i.dat", P);
@@ -169,7 +707,7 @@ void Setup_Proc_Grid()
       fscanf(f, "%i\n", &index[i]);
   }
 
-  MPI_Bcast(index, N_nodes, MPI_INT, 0, MPI_COMM_WORLD);
+  MPI_Bcast(index, N_nodes, MPI_INT, 0, solver_comm);
 
   N_edges = index[N_nodes - 1];
   if (N_edges>0)
@@ -190,10 +728,10 @@ void Setup_Proc_Grid()
     fclose(f);
   }
 
-  MPI_Bcast(edges, N_edges, MPI_INT, 0, MPI_COMM_WORLD);
+  MPI_Bcast(edges, N_edges, MPI_INT, 0, solver_comm);
 
   reorder = 1;
-  MPI_Graph_create(MPI_COMM_WORLD, N_nodes, index, edges, reorder, &grid_comm);
+  MPI_Graph_create(solver_comm, N_nodes, index, edges, reorder, &grid_comm);
 
   /* Retrieve new rank of this process */
   MPI_Comm_rank(grid_comm, &proc_rank);
@@ -203,9 +741,235 @@ void Setup_Proc_Grid()
   free(index);
 }
 
+/*
+ * Reads input.dat on rank 0 and broadcasts the settings. Runs before the
+ * process graph exists, as "input format: generate" also describes it.
+ */
+void Read_Settings()
+{
+  int max_src = 0;
+  char key[40], value[40];
+  FILE *f;
+
+  Debug("Read_Settings", 0);
+
+  MPI_Comm_rank(solver_comm, &proc_rank);
+
+  /* read general parameters (precision/max_iter) */
+  if (proc_rank==0)
+  {
+    if ((f = fopen(settings_file, "r")) == NULL)
+      Debug("Read_Settings : Can't open input.dat", 1);
+    fscanf(f, "precision goal: %lf\n", &precision_goal);
+    fscanf(f, "max iterations: %i", &max_iter);
+
+    if ((set_first = malloc(2 * sizeof(int))) == NULL)
+      Debug("Read_Settings : malloc(set_first) failed", 1);
+    set_first[0] = 0;
+    N_sets = 1;
+
+    /* optional settings, one "key: value" per line */
+    while (fscanf(f, " %39[^:]:", key) == 1)
+    {
+      if (strcmp(key, "source") == 0)
+      {
+        if (N_batch_src == max_src)
+        {
+          max_src = 2 * max_src + 4;
+          if ((batch_src = realloc(batch_src, 3 * max_src * sizeof(double))) == NULL)
+            Debug("Read_Settings : realloc(batch_src) failed", 1);
+        }
+        fscanf(f, "%lf %lf %lf", &batch_src[3 * N_batch_src],
+          &batch_src[3 * N_batch_src + 1], &batch_src[3 * N_batch_src + 2]);
+        N_batch_src++;
+      }
+      else if (strcmp(key, "source set") == 0)
+      {
+        /* the sources that follow form the next right hand side */
+        if (N_batch_src > set_first[N_sets - 1])
+        {
+          if ((set_first = realloc(set_first, (N_sets + 2) * sizeof(int))) == NULL)
+            Debug("Read_Settings : realloc(set_first) failed", 1);
+          set_first[N_sets++] = N_batch_src;
+        }
+      }
+      else if (strcmp(key, "overlap reduction") == 0)
+        fscanf(f, "%i", &overlap_reduction);
+      else if (strcmp(key, "solver") == 0)
+      {
+        fscanf(f, "%39s", value);
+        if (strcmp(value, "cg") == 0)
+          solver = SOLVER_CG;
+        else if (strcmp(value, "pipelined") == 0)
+          solver = SOLVER_PIPELINED;
+        else
+          Debug("Read_Settings : unknown solver in input.dat", 1);
+      }
+      else if (strcmp(key, "replace interval") == 0)
+        fscanf(f, "%i", &replace_interval);
+      else if (strcmp(key, "matrix format") == 0)
+      {
+        fscanf(f, "%39s", value);
+        if (strcmp(value, "csr") == 0)
+          matrix_format = FORMAT_CSR;
+        else if (strcmp(value, "ell") == 0)
+          matrix_format = FORMAT_ELL;
+        else
+          Debug("Read_Settings : unknown matrix format in input.dat", 1);
+      }
+      else if (strcmp(key, "preconditioner omega") == 0)
+        fscanf(f, "%lf", &pc_omega);
+      else if (strcmp(key, "preconditioner") == 0)
+      {
+        fscanf(f, "%39s", value);
+        if (strcmp(value, "none") == 0)
+          preconditioner = PC_NONE;
+        else if (strcmp(value, "jacobi") == 0)
+          preconditioner = PC_JACOBI;
+        else if (strcmp(value, "ssor") == 0)
+          preconditioner = PC_SSOR;
+        else if (strcmp(value, "ic") == 0)
+          preconditioner = PC_IC;
+        else
+          Debug("Read_Settings : unknown preconditioner in input.dat", 1);
+      }
+      else if (strcmp(key, "backend") == 0)
+      {
+        fscanf(f, "%39s", value);
+        if (strcmp(value, "cpu") == 0)
+          backend = BACKEND_CPU;
+        else if (strcmp(value, "gpu") == 0)
+          backend = BACKEND_GPU;
+        else
+          Debug("Read_Settings : unknown backend in input.dat", 1);
+      }
+      else if (strcmp(key, "input format") == 0)
+      {
+        fscanf(f, "%39s", value);
+        if (strcmp(value, "text") == 0)
+          input_format = INPUT_TEXT;
+        else if (strcmp(value, "binary") == 0)
+          input_format = INPUT_BINARY;
+        else if (strcmp(value, "generate") == 0)
+          input_format = INPUT_GENERATE;
+        else
+          Debug("Read_Settings : unknown input format in input.dat", 1);
+      }
+      else if (strcmp(key, "output format") == 0)
+      {
+        fscanf(f, "%39s", value);
+        if (strcmp(value, "text") == 0)
+          output_format = OUTPUT_TEXT;
+        else if (strcmp(value, "binary") == 0)
+          output_format = OUTPUT_BINARY;
+        else
+          Debug("Read_Settings : unknown output format in input.dat", 1);
+      }
+      else if (strcmp(key, "exchange") == 0)
+      {
+        fscanf(f, "%39s", value);
+        if (strcmp(value, "sendrecv") == 0)
+          exchange = EXCHANGE_SENDRECV;
+        else if (strcmp(value, "persistent") == 0)
+          exchange = EXCHANGE_PERSISTENT;
+        else if (strcmp(value, "neighbor") == 0)
+          exchange = EXCHANGE_NEIGHBOR;
+        else
+          Debug("Read_Settings : unknown exchange in input.dat", 1);
+      }
+      else if (strcmp(key, "halo") == 0)
+      {
+        fscanf(f, "%39s", value);
+        if (strcmp(value, "datatype") == 0)
+          halo_path = HALO_DATATYPE;
+        else if (strcmp(value, "packed") == 0)
+          halo_path = HALO_PACKED;
+        else
+          Debug("Read_Settings : unknown halo in input.dat", 1);
+      }
+      else if (strcmp(key, "renumber halo") == 0)
+        fscanf(f, "%i", &renumber_halo);
+      else if (strcmp(key, "reorder") == 0)
+      {
+        fscanf(f, "%39s", value);
+        if (strcmp(value, "none") == 0)
+          reorder = REORDER_NONE;
+        else if (strcmp(value, "owned") == 0)
+          reorder = REORDER_OWNED;
+        else if (strcmp(value, "rcm") == 0)
+          reorder = REORDER_RCM;
+        else if (strcmp(value, "hilbert") == 0)
+          reorder = REORDER_HILBERT;
+        else
+          Debug("Read_Settings : unknown reorder in input.dat", 1);
+      }
+      else if (strcmp(key, "halo benchmark") == 0)
+        fscanf(f, "%i", &halo_bench);
+      else if (strcmp(key, "profile") == 0)
+      {
+        fscanf(f, "%39s", value);
+        if (strcmp(value, "none") == 0)
+          profile_format = PROFILE_NONE;
+        else if (strcmp(value, "csv") == 0)
+          profile_format = PROFILE_CSV;
+        else if (strcmp(value, "json") == 0)
+          profile_format = PROFILE_JSON;
+        else
+          Debug("Read_Settings : unknown profile in input.dat", 1);
+      }
+      else if (strcmp(key, "grid size") == 0)
+        fscanf(f, "%i %i", &gridsize[X_DIR], &gridsize[Y_DIR]);
+      else if (strcmp(key, "process grid") == 0)
+        fscanf(f, "%i %i", &P_grid[X_DIR], &P_grid[Y_DIR]);
+      else if (strcmp(key, "adapt") == 0)
+        fscanf(f, "%i", &do_adapt);
+      else if (strcmp(key, "checkpoint interval") == 0)
+        fscanf(f, "%i", &checkpoint_interval);
+      else
+        Debug("Read_Settings : unknown setting in input.dat", 1);
+    }
+    fclose(f);
+    set_first[N_sets] = N_batch_src;
+    if (N_batch_src == 0)
+      N_sets = 0;
+  }
+  MPI_Bcast(&precision_goal, 1, MPI_DOUBLE, 0, solver_comm);
+  MPI_Bcast(&max_iter, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&overlap_reduction, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&solver, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&replace_interval, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&matrix_format, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&preconditioner, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&pc_omega, 1, MPI_DOUBLE, 0, solver_comm);
+  MPI_Bcast(&backend, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&input_format, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&output_format, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&exchange, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&halo_path, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&renumber_halo, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&reorder, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&halo_bench, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&profile_format, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(gridsize, 2, MPI_INT, 0, solver_comm);
+  MPI_Bcast(P_grid, 2, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&do_adapt, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&checkpoint_interval, 1, MPI_INT, 0, solver_comm);
+
+  MPI_Bcast(&N_batch_src, 1, MPI_INT, 0, solver_comm);
+  MPI_Bcast(&N_sets, 1, MPI_INT, 0, solver_comm);
+  if (N_batch_src == 0)
+    return;
+  if (proc_rank != 0)
+    if ((batch_src = malloc(3 * N_batch_src * sizeof(double))) == NULL ||
+        (set_first = malloc((N_sets + 1) * sizeof(int))) == NULL)
+      Debug("Read_Settings : malloc(batch_src) failed", 1);
+  MPI_Bcast(batch_src, 3 * N_batch_src, MPI_DOUBLE, 0, solver_comm);
+  MPI_Bcast(set_first, N_sets + 1, MPI_INT, 0, solver_comm);
+}
+
 void Setup_Grid()
 {
-  int i, j, v;
+  int i, j, n, v;
   Element element;
   int N_elm;
   char filename[25];
@@ -213,69 +977,412 @@ void Setup_Grid()
 
   Debug("Setup_Grid", 0);
 
-  /* read general parameters (precision/max_iter) */
-  if (proc_rank==0)
+  if (input_format == INPUT_GENERATE)
+    Generate_Partition();
+  else if (input_format == INPUT_BINARY)
+    Read_Binary_Partition();
+  else
   {
-    if ((f = fopen("input.dat", "r")) == NULL)
-      Debug("Setup_Grid : Can't open input.dat", 1);
-    fscanf(f, "precision goal: %lf\n", &precision_goal);
-    fscanf(f, "max iterations: %i", &max_iter);
+    /* read process specific data */
+    sprintf(filename, "input%i-%i.dat", P, proc_rank);
+    if ((f = fopen(filename, "r")) == NULL)
+      Debug("Setup_Grid : Can't open data inputfile", 1);
+    fscanf(f, "N_vert: %i\n%*[^\n]\n", &N_vert);
+
+    Alloc_Grid();
+
+    /* Read all values */
+    for (i = 0; i < N_vert; i++)
+    {
+      fscanf(f, "%i", &v);
+      fscanf(f, "%lf %lf %i %lf\n", &vert_x[v], &vert_y[v],
+	     &vert_type[v], &phi[v]);
+    }
+    if (N_sets > 0)
+      Strip_Sources();
+
+    /* build matrix from elements */
+    fscanf(f, "N_elm: %i\n%*[^\n]\n", &N_elm);
+    for (i = 0; i < N_elm; i++)
+    {
+      fscanf(f, "%*i");  /* we are not interested in the element-id */
+      for (j = 0; j < 3; j++)
+      {
+        fscanf(f, "%i", &v);
+        element[j] = v;
+      }
+      fscanf(f, "\n");
+      Build_ElMatrix(element);
+    }
+
+    Read_Halos(f);
+
     fclose(f);
   }
-  MPI_Bcast(&precision_goal, 1, MPI_DOUBLE, 0, grid_comm);
-  MPI_Bcast(&max_iter, 1, MPI_INT, 0, grid_comm);
 
-  /* read process specific data */
-  sprintf(filename, "input%i-%i.dat", P, proc_rank);
-  if ((f = fopen(filename, "r")) == NULL)
-    Debug("Setup_Grid : Can't open data inputfile", 1);
-  fscanf(f, "N_vert: %i\n%*[^\n]\n", &N_vert);
+  if (reorder != REORDER_NONE)
+    Reorder_Vertices();
+  if (renumber_halo)
+    Renumber_Vertices();
+  Commit_Halos();
+
+  /* with the owned vertices first the dot products need no type test */
+  for (n = 0; n < N_vert && !(vert_type[n] & TYPE_GHOST); n++) ;
+  for (i = n; i < N_vert && (vert_type[i] & TYPE_GHOST); i++) ;
+  N_owned = (i == N_vert) ? n : -1;
+
+  Finalize_Matrix();
+  Setup_Preconditioner();
+  Pack_Grid();
+}
+
+/* the vertex arrays, phi and the assembly rows of A for N_vert vertices */
+void Alloc_Grid()
+{
+  int i;
 
   /* allocate memory for phi and A */
-  if ((vert = malloc(N_vert * sizeof(Vertex))) == NULL)
+  if ((vert_x = malloc(N_vert * sizeof(double))) == NULL ||
+      (vert_y = malloc(N_vert * sizeof(double))) == NULL ||
+      (vert_type = malloc(N_vert * sizeof(int))) == NULL)
     Debug("Setup_Grid : malloc(vert) failed", 1);
   if ((phi = malloc(N_vert * sizeof(double))) == NULL)
     Debug("Setup_Grid : malloc(phi) failed", 1);
 
+  /* the assembly rows share one block, packed by Finalize_Matrix() */
   if ((A = malloc(N_vert * sizeof(*A))) == NULL)
     Debug("Setup_Grid : malloc(*A) failed", 1);
-  for (i=0; i<N_vert; i++)
+  if ((A[0].col = malloc(N_vert * MAXCOL * sizeof(int))) == NULL)
+    Debug("Setup_Grid : malloc(A.col) failed", 1);
+  if ((A[0].val = malloc(N_vert * MAXCOL * sizeof(double))) == NULL)
+    Debug("Setup_Grid : malloc(A.val) failed", 1);
+  for (i=1; i<N_vert; i++)
+  {
+    A[i].col = A[0].col + i * MAXCOL;
+    A[i].val = A[0].val + i * MAXCOL;
+  }
+
+  /* init matrix rows of A; phi is first touched by the threads that use it */
+  #pragma omp parallel for schedule(static)
+  for (i = 0; i < N_vert; i++)
   {
-    if ((A[i].col=malloc(MAXCOL*sizeof(int)))==NULL)
-      Debug("Setup_Grid : malloc(A.col) failed", 1);
-    if ((A[i].val=malloc(MAXCOL*sizeof(double)))==NULL)
-      Debug("Setup_Grid : malloc(A.val) failed", 1);
+    A[i].Ncol = 0;
+    phi[i] = 0.0;
   }
+}
+
+/*
+ * A zeroed vector of N_vert doubles from the arena, released only with
+ * all others by Clean_Up(). It is zeroed with the static schedule of the
+ * solver loops, so that its pages are first touched by the thread (and
+ * NUMA node) that works on them.
+ */
+double *Alloc_Vector(char *name)
+{
+  int i;
+  double *v;
 
-  /* init matrix rows of A */
+  v = Arena_Alloc(N_vert * sizeof(double), name);
+  #pragma omp parallel for schedule(static)
   for (i = 0; i < N_vert; i++)
-      A[i].Ncol = 0;
+    v[i] = 0.0;
+
+  return v;
+}
+
+/*
+ * Adds a block of at least 'bytes' to the arena. Blocks are whole huge
+ * pages and, where the system has them, mapped with the hint for
+ * transparent huge pages.
+ */
+void Arena_Reserve(size_t bytes, char *name)
+{
+  size_t head = (sizeof(Arena_Block) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+  size_t size = (head + bytes + ARENA_BLOCK - 1) / ARENA_BLOCK * ARENA_BLOCK;
+  Arena_Block *b = NULL;
+  int mapped = 0;
+  char mesg[80];
+
+#ifdef MAP_ANONYMOUS
+  b = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (b == MAP_FAILED)
+    b = NULL;
+  else
+  {
+    mapped = 1;
+#ifdef MADV_HUGEPAGE
+    madvise(b, size, MADV_HUGEPAGE);
+#endif
+  }
+#endif
+  if (b == NULL && posix_memalign((void **) &b, ARENA_ALIGN, size) != 0)
+  {
+    sprintf(mesg, "Arena_Reserve : allocation for %s failed", name);
+    Debug(mesg, 1);
+  }
+
+  b->next = arena;
+  b->size = size;
+  b->used = head;
+  b->mapped = mapped;
+  arena = b;
+}
+
+/* 'bytes' from the arena, aligned to ARENA_ALIGN and not zeroed */
+void *Arena_Alloc(size_t bytes, char *name)
+{
+  void *p;
+
+  bytes = (bytes + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+  if (arena == NULL || arena->used + bytes > arena->size)
+    Arena_Reserve(bytes, name);
+  p = (char *) arena + arena->used;
+  arena->used += bytes;
+
+  return p;
+}
+
+/*
+ * Moves the malloc'ed array p of 'bytes' into the arena and frees it.
+ * The copy runs on all threads, the pages are first touched by the
+ * threads of the static loops that use them.
+ */
+void *Arena_Move(void *p, size_t bytes, char *name)
+{
+  char *q, *from = p;
+  long i, n = (long) bytes;
+
+  if (p == NULL)
+    return NULL;
+
+  q = Arena_Alloc(bytes, name);
+  #pragma omp parallel for schedule(static)
+  for (i = 0; i < n; i++)
+    q[i] = from[i];
+  free(p);
+
+  return q;
+}
+
+void Arena_Free()
+{
+  Arena_Block *b;
+
+  while ((b = arena) != NULL)
+  {
+    arena = b->next;
+    if (b->mapped)
+      munmap(b, b->size);
+    else
+      free(b);
+  }
+}
+
+/*
+ * The grid and the matrix are malloc'ed piecewise while they are read,
+ * renumbered and assembled. Once complete they move into one arena block
+ * of flat arrays, released with the work vectors by Arena_Free().
+ */
+void Pack_Grid()
+{
+  size_t v = N_vert * sizeof(double) + ARENA_ALIGN;
+  size_t w = N_vert * sizeof(int) + ARENA_ALIGN;
+  size_t nnz = csr_row[N_vert] + 1, bytes;
+
+  bytes = 3 * v + w + (N_vert + 1) * sizeof(int) + ARENA_ALIGN
+        + nnz * (sizeof(int) + sizeof(double)) + 2 * ARENA_ALIGN;
+  if (vert_gid != NULL)
+    bytes += w;
+  if (vert_new != NULL)
+    bytes += w + ARENA_ALIGN;
+  if (pc_inv != NULL)
+    bytes += v;
+  if (ell_col != NULL)
+    bytes += (ell_width * (size_t) N_vert + 1) * (sizeof(int) + sizeof(double))
+           + 2 * ARENA_ALIGN;
+  Arena_Reserve(bytes, "grid");
+
+  vert_x = Arena_Move(vert_x, N_vert * sizeof(double), "grid");
+  vert_y = Arena_Move(vert_y, N_vert * sizeof(double), "grid");
+  vert_type = Arena_Move(vert_type, N_vert * sizeof(int), "grid");
+  phi = Arena_Move(phi, N_vert * sizeof(double), "grid");
+  vert_gid = Arena_Move(vert_gid, N_vert * sizeof(int), "grid");
+  vert_new = Arena_Move(vert_new, (N_vert + 1) * sizeof(int), "grid");
+  csr_row = Arena_Move(csr_row, (N_vert + 1) * sizeof(int), "grid");
+  csr_col = Arena_Move(csr_col, nnz * sizeof(int), "grid");
+  csr_val = Arena_Move(csr_val, nnz * sizeof(double), "grid");
+  pc_inv = Arena_Move(pc_inv, N_vert * sizeof(double), "grid");
+  ell_col = Arena_Move(ell_col, (ell_width * (size_t) N_vert + 1) * sizeof(int), "grid");
+  ell_val = Arena_Move(ell_val, (ell_width * (size_t) N_vert + 1) * sizeof(double), "grid");
+}
+
+/*
+ * The work vectors of the selected solver, N_vert long (N_vert * N_sets
+ * in batch mode), and the halo benchmark vector, all in one arena block.
+ * They stay allocated, so every solve after the setup allocates nothing.
+ */
+void Setup_Work()
+{
+  int i, n, extra, width = (N_sets > 0) ? N_sets : 1;
+  size_t vect = N_vert * (size_t) width * sizeof(double) + ARENA_ALIGN;
+
+  if (solver == SOLVER_PIPELINED && N_sets == 0)
+    n = (preconditioner != PC_NONE) ? 9 : 6;
+  else
+    n = (preconditioner != PC_NONE) ? 4 : 3;
+
+  /* the halo benchmark vector, in batch mode phiB, maskB and the scalars */
+  extra = (N_sets > 0) ? 3 : 1;
+  Arena_Reserve((n + extra) * vect + 11 * width * sizeof(double) + 2 * ARENA_ALIGN,
+    "work vectors");
+  for (i = 0; i < n; i++)
+    work[i] = (N_sets > 0) ? Alloc_Batch_Vector("work") : Alloc_Vector("work");
+  if (N_sets > 0)
+  {
+    work_int = Arena_Alloc(2 * N_sets * sizeof(int), "work_int");
+    work_scalar = Arena_Alloc(9 * N_sets * sizeof(double), "work_scalar");
+  }
+}
+
+/*
+ * Reads this rank's block of input<P>.bin (layout in fempart.h). All
+ * ranks read the header and offset table collectively, then their own
+ * block with one collective read at their offset.
+ */
+void Read_Binary_Partition()
+{
+  int head[2];
+  char filename[25], magic[8];
+  char *buf;
+  long long offset, bytes;
+  PartHeader h;
+  double *x, *y, *val;
+  int *type, *gid, *elm, *neighb, *halo;
+  MPI_File fh;
+
+  Debug("Read_Binary_Partition", 0);
+
+  sprintf(filename, "input%i.bin", P);
+  if (MPI_File_open(grid_comm, filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh)
+      != MPI_SUCCESS)
+    Debug("Read_Binary_Partition : Can't open data inputfile", 1);
+
+  MPI_File_read_at_all(fh, 0, magic, 8, MPI_CHAR, &status);
+  MPI_File_read_at_all(fh, 8, head, 2, MPI_INT, &status);
+  if (memcmp(magic, PART_MAGIC, 8) != 0 || head[0] != P)
+    Debug("Read_Binary_Partition : not a partition file for this number of processes", 1);
+  MPI_File_read_at_all(fh, PART_TABLE + proc_rank * sizeof(long long),
+                       &offset, 1, MPI_LONG_LONG, &status);
+  MPI_File_read_at_all(fh, offset, &h, sizeof(h), MPI_BYTE, &status);
+
+  bytes = Part_Bytes(&h) - sizeof(h);
+  if (bytes > 2147483647LL)
+    Debug("Read_Binary_Partition : partition block too large", 1);
+  if ((buf = malloc(bytes > 0 ? bytes : 1)) == NULL)
+    Debug("Read_Binary_Partition : malloc(buf) failed", 1);
+  MPI_File_read_at_all(fh, offset + sizeof(h), buf, (int) bytes, MPI_BYTE,
+                       &status);
+  MPI_File_close(&fh);
+
+  x = (double *) buf;
+  y = x + h.N_vert;
+  val = y + h.N_vert;
+  type = (int *) (val + h.N_vert);
+  gid = type + h.N_vert;
+  elm = gid + h.N_vert;
+  neighb = elm + 3 * h.N_elm;
+  halo = neighb + 3 * h.N_neighb;
+
+  N_global = head[1];
+  Load_Partition(&h, x, y, val, type, gid, elm, neighb, halo);
+
+  free(buf);
+}
+
+/*
+ * Sets up the vertices, phi, A and the halo lists from the arrays of a
+ * partition (layout in fempart.h). halo[] is overwritten.
+ */
+void Load_Partition(PartHeader *h, double *x, double *y, double *val,
+                    int *type, int *gid, int *elm, int *neighb, int *halo)
+{
+  int i;
 
-  /* Read all values */
+  N_vert = h->N_vert;
+  Alloc_Grid();
+  if ((vert_gid = malloc(N_vert * sizeof(int))) == NULL)
+    Debug("Load_Partition : malloc(vert_gid) failed", 1);
   for (i = 0; i < N_vert; i++)
   {
-    fscanf(f, "%i", &v);
-    fscanf(f, "%lf %lf %i %lf\n", &vert[v].x, &vert[v].y,
-	   &vert[v].type, &phi[v]);
+    vert_x[i] = x[i];
+    vert_y[i] = y[i];
+    vert_type[i] = type[i];
+    phi[i] = val[i];
+    vert_gid[i] = gid[i];
   }
+  if (N_sets > 0)
+    Strip_Sources();
+  for (i = 0; i < h->N_elm; i++)
+    Build_ElMatrix(elm + 3 * i);
 
-  /* build matrix from elements */
-  fscanf(f, "N_elm: %i\n%*[^\n]\n", &N_elm);
-  for (i = 0; i < N_elm; i++)
+  N_neighb = h->N_neighb;
+  Alloc_Halos();
+  for (i = 0; i < N_neighb; i++)
   {
-    fscanf(f, "%*i");  /* we are not interested in the element-id */
-    for (j = 0; j < 3; j++)
-    {
-      fscanf(f, "%i", &v);
-      element[j] = v;
-    }
-    fscanf(f, "\n");
-    Build_ElMatrix(element);
+    proc_neighb[i] = neighb[3 * i];
+    Make_Halo_List(halo, neighb[3 * i + 1], &recv_list[i], &recv_count[i]);
+    halo += neighb[3 * i + 1];
+    Make_Halo_List(halo, neighb[3 * i + 2], &send_list[i], &send_count[i]);
+    halo += neighb[3 * i + 2];
   }
+  Sort_Halos();
+}
+
+/*
+ * Builds this rank's partition in memory, as GridDist would write it,
+ * so no input files are needed. Rank 0 reads sources.dat. With adapt
+ * every rank runs the (OpenMP parallel) grid adaptation of the whole
+ * grid itself, which is cheaper than distributing it.
+ */
+void Generate_Partition()
+{
+  Partition part;
 
-  Setup_MPI_Datatypes(f);
+  Debug("Generate_Partition", 0);
 
-  fclose(f);
+  if (proc_rank == 0)
+    Read_Sources();
+  MPI_Bcast(&N_sources, 1, MPI_INT, 0, grid_comm);
+  if (proc_rank != 0 && N_sources > 0)
+    if ((source = malloc(N_sources * sizeof(int))) == NULL ||
+        (source_val = malloc(N_sources * sizeof(double))) == NULL ||
+        (source2 = malloc(N_sources * sizeof(sourcepoint))) == NULL)
+      Debug("Generate_Partition : malloc(source) failed", 1);
+  MPI_Bcast(source, N_sources, MPI_INT, 0, grid_comm);
+  MPI_Bcast(source_val, N_sources, MPI_DOUBLE, 0, grid_comm);
+  MPI_Bcast(source2, 3 * N_sources, MPI_FLOAT, 0, grid_comm);
+  nsource = N_sources;
+
+  if (do_adapt)
+  {
+    nx = gridsize[X_DIR];
+    ny = gridsize[Y_DIR];
+    nm = 50;
+    grid_quiet = (proc_rank != 0);
+    adaptgrid();
+  }
+
+  Build_Partition(proc_rank % P_grid[X_DIR], proc_rank / P_grid[X_DIR], &part);
+  N_global = gridsize[X_DIR] * gridsize[Y_DIR];
+  Load_Partition(&part.h, part.x, part.y, part.val, part.type, part.gid,
+                 part.elm, part.neighb, part.halo);
+  Free_Partition(&part);
+
+  if (do_adapt)
+    free(grid);
+  free(source);
+  free(source_val);
+  free(source2);
 }
 
 void Add_To_Matrix(int i, int j, double a)
@@ -304,12 +1411,12 @@ void Build_ElMatrix(Element el)
   double s[3][3];
   double det;
 
-  e[0][0] = vert[el[1]].y - vert[el[2]].y;	/* y1-y2 */
-  e[1][0] = vert[el[2]].y - vert[el[0]].y;	/* y2-y0 */
-  e[2][0] = vert[el[0]].y - vert[el[1]].y;	/* y0-y1 */
-  e[0][1] = vert[el[2]].x - vert[el[1]].x;	/* x2-x1 */
-  e[1][1] = vert[el[0]].x - vert[el[2]].x;	/* x0-x2 */
-  e[2][1] = vert[el[1]].x - vert[el[0]].x;	/* x1-x0 */
+  e[0][0] = vert_y[el[1]] - vert_y[el[2]];	/* y1-y2 */
+  e[1][0] = vert_y[el[2]] - vert_y[el[0]];	/* y2-y0 */
+  e[2][0] = vert_y[el[0]] - vert_y[el[1]];	/* y0-y1 */
+  e[0][1] = vert_x[el[2]] - vert_x[el[1]];	/* x2-x1 */
+  e[1][1] = vert_x[el[0]] - vert_x[el[2]];	/* x0-x2 */
+  e[2][1] = vert_x[el[1]] - vert_x[el[0]];	/* x1-x0 */
 
   det = e[2][0] * e[0][1] - e[2][1] * e[0][0];
   if (det == 0.0)
@@ -322,16 +1429,183 @@ void Build_ElMatrix(Element el)
       s[i][j] = (e[i][0] * e[j][0] + e[i][1] * e[j][1]) / det;
 
   for (i = 0; i < 3; i++)
-    if (!((vert[el[i]].type & TYPE_GHOST) |
-	  (vert[el[i]].type & TYPE_SOURCE)))
+    if (!((vert_type[el[i]] & TYPE_GHOST) |
+	  (vert_type[el[i]] & TYPE_SOURCE)))
       for (j = 0; j < 3; j++)
         Add_To_Matrix(el[i],el[j],s[i][j]);
 }
 
-void Sort_MPI_Datatypes()
+/*
+ * Packs the assembled rows into CSR with sorted columns and, if
+ * requested, ELLPACK. The assembly rows are released.
+ */
+void Finalize_Matrix()
+{
+  int i, j, k, col;
+  double val;
+
+  Debug("Finalize_Matrix", 0);
+
+  if ((csr_row = malloc((N_vert + 1) * sizeof(int))) == NULL)
+    Debug("Finalize_Matrix : malloc(csr_row) failed", 1);
+
+  csr_row[0] = 0;
+  ell_width = 0;
+  for (i = 0; i < N_vert; i++)
+  {
+    csr_row[i + 1] = csr_row[i] + A[i].Ncol;
+    if (A[i].Ncol > ell_width)
+      ell_width = A[i].Ncol;
+  }
+
+  if ((csr_col = malloc((csr_row[N_vert] + 1) * sizeof(int))) == NULL)
+    Debug("Finalize_Matrix : malloc(csr_col) failed", 1);
+  if ((csr_val = malloc((csr_row[N_vert] + 1) * sizeof(double))) == NULL)
+    Debug("Finalize_Matrix : malloc(csr_val) failed", 1);
+
+  #pragma omp parallel for private(j, k, col, val) schedule(static)
+  for (i = 0; i < N_vert; i++)
+  {
+    /* insertion sort, rows hold only a handful of entries */
+    for (j = 0; j < A[i].Ncol; j++)
+    {
+      col = A[i].col[j];
+      val = A[i].val[j];
+      for (k = csr_row[i] + j; k > csr_row[i] && csr_col[k - 1] > col; k--)
+      {
+        csr_col[k] = csr_col[k - 1];
+        csr_val[k] = csr_val[k - 1];
+      }
+      csr_col[k] = col;
+      csr_val[k] = val;
+    }
+  }
+
+  free(A[0].col);
+  free(A[0].val);
+  free(A);
+  A = NULL;
+
+  if (matrix_format == FORMAT_ELL)
+  {
+    if ((ell_col = malloc((ell_width * N_vert + 1) * sizeof(int))) == NULL)
+      Debug("Finalize_Matrix : malloc(ell_col) failed", 1);
+    if ((ell_val = malloc((ell_width * N_vert + 1) * sizeof(double))) == NULL)
+      Debug("Finalize_Matrix : malloc(ell_val) failed", 1);
+
+    /* padding points at the row itself with a zero value */
+    for (k = 0; k < ell_width; k++)
+    {
+      #pragma omp parallel for private(j) schedule(static)
+      for (i = 0; i < N_vert; i++)
+      {
+        j = csr_row[i] + k;
+        if (j < csr_row[i + 1])
+        {
+          ell_col[k * N_vert + i] = csr_col[j];
+          ell_val[k * N_vert + i] = csr_val[j];
+        }
+        else
+        {
+          ell_col[k * N_vert + i] = i;
+          ell_val[k * N_vert + i] = 0.0;
+        }
+      }
+    }
+  }
+}
+
+/*
+ * Computes pc_inv for the preconditioner. SSOR and IC only use the
+ * couplings between free vertices owned by this process (block Jacobi),
+ * so applying them needs no communication. IC is the diagonal variant of
+ * IC(0): it keeps the off-diagonals of A and only modifies the diagonal,
+ * D_i = a_ii - sum_{k<i} a_ik^2 / D_k.
+ */
+void Setup_Preconditioner()
+{
+  int i, j, k;
+  double diag, d;
+
+  Debug("Setup_Preconditioner", 0);
+
+  if (preconditioner == PC_NONE)
+    return;
+
+  if ((pc_inv = malloc(N_vert * sizeof(double))) == NULL)
+    Debug("Setup_Preconditioner : malloc(pc_inv) failed", 1);
+
+  /* ghost and source rows are empty and keep pc_inv = 0 */
+  for (i = 0; i < N_vert; i++)
+  {
+    pc_inv[i] = 0.0;
+    diag = 0.0;
+    d = 0.0;
+    for (j = csr_row[i]; j < csr_row[i + 1]; j++)
+    {
+      k = csr_col[j];
+      if (k == i)
+        diag = csr_val[j];
+      else if (k < i)
+        d += csr_val[j] * csr_val[j] * pc_inv[k];
+    }
+    if (diag == 0.0)
+      continue;
+
+    if (preconditioner == PC_IC)
+    {
+      /* guard against breakdown on meshes that are not an M-matrix */
+      if (diag - d <= 0.0)
+        d = 0.0;
+      pc_inv[i] = 1.0 / (diag - d);
+    }
+    else if (preconditioner == PC_SSOR)
+      pc_inv[i] = pc_omega / diag;
+    else
+      pc_inv[i] = 1.0 / diag;
+  }
+}
+
+/*
+ * z = M^-1 * r. For SSOR and IC a forward sweep (D + L) y = r followed by
+ * a backward sweep (D + U) z = D y, done in place in z. Entries with
+ * pc_inv = 0 are 0 in z, so couplings to them drop out by themselves.
+ * The sweeps are recurrences and stay sequential, Jacobi is threaded.
+ */
+void Precondition(double *restrict z, double *restrict r)
 {
   int i, j;
-  MPI_Datatype data2;
+  double sum;
+
+  if (preconditioner == PC_JACOBI)
+  {
+    #pragma omp parallel for schedule(static)
+    for (i = 0; i < N_vert; i++)
+      z[i] = pc_inv[i] * r[i];
+    return;
+  }
+
+  for (i = 0; i < N_vert; i++)
+  {
+    sum = r[i];
+    for (j = csr_row[i]; j < csr_row[i + 1] && csr_col[j] < i; j++)
+      sum -= csr_val[j] * z[csr_col[j]];
+    z[i] = pc_inv[i] * sum;
+  }
+
+  for (i = N_vert - 1; i >= 0; i--)
+  {
+    sum = 0.0;
+    for (j = csr_row[i + 1] - 1; j >= csr_row[i] && csr_col[j] > i; j--)
+      sum += csr_val[j] * z[csr_col[j]];
+    z[i] -= pc_inv[i] * sum;
+  }
+}
+
+void Sort_Halos()
+{
+  int i, j, n;
+  int *list;
   int proc2;
 
   for (i=0;i<N_neighb-1;i++)
@@ -341,265 +1615,2431 @@ void Sort_MPI_Datatypes()
         proc2 = proc_neighb[i];
         proc_neighb[i] = proc_neighb[j]; 
         proc_neighb[j] = proc2;
-        data2 = send_type[i];
-        send_type[i] = send_type[j];
-        send_type[j] = data2;
-        data2 = recv_type[i];
-        recv_type[i] = recv_type[j];
-        recv_type[j] = data2;
+        list = send_list[i];
+        send_list[i] = send_list[j];
+        send_list[j] = list;
+        n = send_count[i];
+        send_count[i] = send_count[j];
+        send_count[j] = n;
+        list = recv_list[i];
+        recv_list[i] = recv_list[j];
+        recv_list[j] = list;
+        n = recv_count[i];
+        recv_count[i] = recv_count[j];
+        recv_count[j] = n;
       }
 }
 
-void Setup_MPI_Datatypes(FILE * f)
+void Alloc_Halos()
 {
-  int i, s;
-  int count;
-  int *indices;
-  int *blocklens;
-
-  Debug("Setup_MPI_Datatypes", 0);
-
-  fscanf(f, "Neighbours: %i\n", &N_neighb);
-
-  /* allocate memory */
-
   if (N_neighb>0)
   {
     if ((proc_neighb = malloc(N_neighb * sizeof(int))) == NULL)
-        Debug("Setup_MPI_Datatypes: malloc(proc_neighb) failed", 1);
+        Debug("Alloc_Halos: malloc(proc_neighb) failed", 1);
     if ((send_type = malloc(N_neighb * sizeof(MPI_Datatype))) == NULL)
-      Debug("Setup_MPI_Datatypes: malloc(send_type) failed", 1);
+      Debug("Alloc_Halos: malloc(send_type) failed", 1);
     if ((recv_type = malloc(N_neighb * sizeof(MPI_Datatype))) == NULL)
-      Debug("Setup_MPI_Datatypes: malloc(recv_type) failed", 1);
+      Debug("Alloc_Halos: malloc(recv_type) failed", 1);
+    if ((send_list = malloc(N_neighb * sizeof(int *))) == NULL ||
+        (recv_list = malloc(N_neighb * sizeof(int *))) == NULL ||
+        (send_count = malloc(N_neighb * sizeof(int))) == NULL ||
+        (recv_count = malloc(N_neighb * sizeof(int))) == NULL ||
+        (send_first = malloc(N_neighb * sizeof(int))) == NULL ||
+        (recv_first = malloc(N_neighb * sizeof(int))) == NULL ||
+        (send_off = malloc(N_neighb * sizeof(int))) == NULL ||
+        (recv_off = malloc(N_neighb * sizeof(int))) == NULL)
+      Debug("Alloc_Halos: malloc(halo lists) failed", 1);
   }
   else
   {
     proc_neighb = NULL;
     send_type = NULL;
     recv_type = NULL;
+    send_list = recv_list = NULL;
+    send_count = recv_count = NULL;
+    send_first = recv_first = NULL;
+    send_off = recv_off = NULL;
   }
+}
 
-  if ((indices = malloc(N_vert * sizeof(int))) == NULL)
-      Debug("Setup_MPI_Datatypes: malloc(indices) failed", 1);
-  if ((blocklens = malloc(N_vert * sizeof(int))) == NULL)
-      Debug("Setup_MPI_Datatypes: malloc(blocklens) failed", 1);
+/* copies the halo of the n vertices in indices[] to *list, dropping
+ * the sources; indices[] is overwritten */
+void Make_Halo_List(int *indices, int n, int **list, int *count)
+{
+  int i;
 
-  for (i = 0; i < N_vert; i++)
-    blocklens[i] = 1;
+  *count = 0;
+  for (i = 0; i < n; i++)
+    if (!(vert_type[indices[i]] & TYPE_SOURCE))
+      indices[(*count)++] = indices[i];
+  if ((*list = malloc((*count + 1) * sizeof(int))) == NULL)
+    Debug("Make_Halo_List : malloc(list) failed", 1);
+  memcpy(*list, indices, *count * sizeof(int));
+}
+
+void Read_Halos(FILE * f)
+{
+  int i;
+  int count;
+  int *indices;
+
+  Debug("Read_Halos", 0);
+
+  fscanf(f, "Neighbours: %i\n", &N_neighb);
+
+  /* allocate memory */
+  Alloc_Halos();
+
+  if ((indices = malloc(N_vert * sizeof(int))) == NULL)
+      Debug("Read_Halos: malloc(indices) failed", 1);
 
   /* read vertices per neighbour */
   for (i = 0; i < N_neighb; i++)
   {
     fscanf(f, "from %i :", &proc_neighb[i]);
-    s = 1;
     count = 0;
-    while (s == 1)
-    {
-      s = fscanf(f, "%i", &indices[count]);
-      if ((s == 1) && !(vert[indices[count]].type & TYPE_SOURCE))
-	count++;
-    }
+    while (fscanf(f, "%i", &indices[count]) == 1)
+      count++;
     fscanf(f, "\n");
-    MPI_Type_indexed(count, blocklens, indices, MPI_DOUBLE, &recv_type[i]);
-    MPI_Type_commit(&recv_type[i]);
+    Make_Halo_List(indices, count, &recv_list[i], &recv_count[i]);
 
     fscanf(f, "to %i :", &proc_neighb[i]);
-    s = 1;
     count = 0;
-    while (s == 1)
-    {
-      s = fscanf(f, "%i", &indices[count]);
-      if ((s == 1) && !(vert[indices[count]].type & TYPE_SOURCE))
-	count++;
-    }
+    while (fscanf(f, "%i", &indices[count]) == 1)
+      count++;
     fscanf(f, "\n");
-    MPI_Type_indexed(count, blocklens, indices, MPI_DOUBLE, &send_type[i]);
-    MPI_Type_commit(&send_type[i]);
+    Make_Halo_List(indices, count, &send_list[i], &send_count[i]);
   }
 
-  Sort_MPI_Datatypes();
+  Sort_Halos();
 
-  free(blocklens);
   free(indices);
 }
 
+int Cmp_Int(const void *a, const void *b)
+{
+  return *(const int *) a - *(const int *) b;
+}
 
+/* orders shared vertices by the neighbours they are sent to */
+int Cmp_Membership(const void *a, const void *b)
+{
+  int *ma = renumber_memb + MAX_MEMB * *(const int *) a;
+  int *mb = renumber_memb + MAX_MEMB * *(const int *) b;
+  int k;
 
+  for (k = 0; k < MAX_MEMB; k++)
+    if (ma[k] != mb[k])
+      return ma[k] - mb[k];
+  return *(const int *) a - *(const int *) b;
+}
 
-
-void Exchange_Borders(double *vect)
+/*
+ * Renumbers the vertices so that the halos become runs of consecutive
+ * ids: first the owned vertices no neighbour needs, then the shared
+ * ones, ordered by the list of neighbours they are sent to, then the
+ * ghosts, neighbour after neighbour. Each send list is sorted by the new
+ * ids and its new order is sent to the neighbour, which reorders the
+ * matching receive list before it places its ghosts. So every receive
+ * list is consecutive, and so is every send list whose vertices go to
+ * no other neighbour in between; the rest is gathered as before.
+ */
+void Renumber_Vertices()
 {
-  // Please finish this part to realize the purpose of data communication among neighboring processors. (Tip: the function "MPI_Sendrecv" needs to be used here.)
+  int i, j, k, n, v;
+  int *old, *new_id, *slot, *key, *pos, *rpos;
+
+  Debug("Renumber_Vertices", 0);
+
+  if ((old = malloc((N_vert + 1) * sizeof(int))) == NULL ||
+      (new_id = malloc((N_vert + 1) * sizeof(int))) == NULL ||
+      (renumber_memb = malloc((MAX_MEMB * N_vert + 1) * sizeof(int))) == NULL ||
+      (slot = malloc((N_vert + 1) * sizeof(int))) == NULL ||
+      (key = malloc((N_vert + 1) * sizeof(int))) == NULL ||
+      (pos = malloc((N_vert + 1) * sizeof(int))) == NULL ||
+      (rpos = malloc((N_vert + 1) * sizeof(int))) == NULL)
+    Debug("Renumber_Vertices : malloc failed", 1);
+
+  /* neighbours each vertex is sent to, in ascending order */
+  for (i = 0; i < MAX_MEMB * N_vert; i++)
+    renumber_memb[i] = -1;
+  for (i = 0; i < N_neighb; i++)
+    for (j = 0; j < send_count[i]; j++)
+    {
+      v = send_list[i][j];
+      if (vert_type[v] & TYPE_GHOST)
+        Debug("Renumber_Vertices : ghost in a send list", 1);
+      for (k = 0; k < MAX_MEMB && renumber_memb[MAX_MEMB * v + k] >= 0; k++) ;
+      if (k < MAX_MEMB)
+        renumber_memb[MAX_MEMB * v + k] = i;
+    }
 
-  stop_timer();
-  
-  int i;
+  /* owned vertices: interior, then shared */
+  n = 0;
+  for (v = 0; v < N_vert; v++)
+    if (!(vert_type[v] & TYPE_GHOST) && renumber_memb[MAX_MEMB * v] < 0)
+      old[n++] = v;
+  k = n;
+  for (v = 0; v < N_vert; v++)
+    if (!(vert_type[v] & TYPE_GHOST) && renumber_memb[MAX_MEMB * v] >= 0)
+      old[n++] = v;
+  qsort(old + k, n - k, sizeof(int), Cmp_Membership);
+  for (v = 0; v < N_vert; v++)
+    new_id[v] = -1;
+  for (j = 0; j < n; j++)
+    new_id[old[j]] = j;
+  free(renumber_memb);
+  renumber_memb = NULL;
+
+  /* sort the send lists by the new ids; pos[j] is the old position of
+   * the j-th entry, which the neighbour applies to its receive list.
+   * In rank order, so the blocking pairs cannot deadlock */
   for (i = 0; i < N_neighb; i++)
   {
-    MPI_Sendrecv(
-      vect, 1, send_type[i], proc_neighb[i], 0,
-      vect, 1, recv_type[i], proc_neighb[i], 0,
-      grid_comm, &status);
+    for (j = 0; j < send_count[i]; j++)
+    {
+      slot[send_list[i][j]] = j;
+      key[j] = new_id[send_list[i][j]];
+    }
+    qsort(key, send_count[i], sizeof(int), Cmp_Int);
+    for (j = 0; j < send_count[i]; j++)
+    {
+      send_list[i][j] = old[key[j]];
+      pos[j] = slot[send_list[i][j]];
+    }
+    MPI_Sendrecv(pos, send_count[i], MPI_INT, proc_neighb[i], 1,
+                 rpos, recv_count[i], MPI_INT, proc_neighb[i], 1,
+                 grid_comm, &status);
+    for (j = 0; j < recv_count[i]; j++)
+      key[j] = recv_list[i][rpos[j]];
+    memcpy(recv_list[i], key, recv_count[i] * sizeof(int));
   }
-  
-  resume_timer();
+
+  /* ghosts in the order they are received, then the unlisted ones */
+  for (i = 0; i < N_neighb; i++)
+    for (j = 0; j < recv_count[i]; j++)
+    {
+      v = recv_list[i][j];
+      if (!(vert_type[v] & TYPE_GHOST))
+        Debug("Renumber_Vertices : owned vertex in a receive list", 1);
+      if (new_id[v] < 0)
+      {
+        old[n] = v;
+        new_id[v] = n++;
+      }
+    }
+  for (v = 0; v < N_vert; v++)
+    if (new_id[v] < 0)
+    {
+      old[n] = v;
+      new_id[v] = n++;
+    }
+
+  Permute_Vertices(old);
+
+  free(rpos);
+  free(pos);
+  free(key);
+  free(slot);
+  free(new_id);
+  free(old);
 }
 
+/*
+ * Moves every vertex to its new id, old[j] being the current id of the
+ * vertex that becomes j: the vertex arrays, phi, the assembly rows of A
+ * and the halo lists. vert_new, from the ids as read to the current
+ * ones, follows along, so the output stays in the input order.
+ */
+void Permute_Vertices(int *old)
+{
+  int i, j, k;
+  int *new_id, *type2, *gid2;
+  double *x2, *y2, *phi2;
+  Matrixrow *A2;
+
+  if ((new_id = malloc((N_vert + 1) * sizeof(int))) == NULL)
+    Debug("Permute_Vertices : malloc(new_id) failed", 1);
+  for (j = 0; j < N_vert; j++)
+    new_id[old[j]] = j;
+  if (vert_new == NULL)
+  {
+    if ((vert_new = malloc((N_vert + 1) * sizeof(int))) == NULL)
+      Debug("Permute_Vertices : malloc(vert_new) failed", 1);
+    for (i = 0; i < N_vert; i++)
+      vert_new[i] = i;
+  }
+  for (i = 0; i < N_vert; i++)
+    vert_new[i] = new_id[vert_new[i]];
+
+  if ((x2 = malloc(N_vert * sizeof(double))) == NULL ||
+      (y2 = malloc(N_vert * sizeof(double))) == NULL ||
+      (type2 = malloc(N_vert * sizeof(int))) == NULL ||
+      (phi2 = malloc(N_vert * sizeof(double))) == NULL)
+    Debug("Permute_Vertices : malloc(vert) failed", 1);
+  #pragma omp parallel for schedule(static)
+  for (j = 0; j < N_vert; j++)
+  {
+    x2[j] = vert_x[old[j]];
+    y2[j] = vert_y[old[j]];
+    type2[j] = vert_type[old[j]];
+    phi2[j] = phi[old[j]];
+  }
+  free(vert_x);
+  free(vert_y);
+  free(vert_type);
+  free(phi);
+  vert_x = x2;
+  vert_y = y2;
+  vert_type = type2;
+  phi = phi2;
 
+  if (vert_gid)
+  {
+    if ((gid2 = malloc(N_vert * sizeof(int))) == NULL)
+      Debug("Permute_Vertices : malloc(vert_gid) failed", 1);
+    for (j = 0; j < N_vert; j++)
+      gid2[j] = vert_gid[old[j]];
+    free(vert_gid);
+    vert_gid = gid2;
+  }
 
+  if ((A2 = malloc(N_vert * sizeof(*A2))) == NULL ||
+      (A2[0].col = malloc(N_vert * MAXCOL * sizeof(int))) == NULL ||
+      (A2[0].val = malloc(N_vert * MAXCOL * sizeof(double))) == NULL)
+    Debug("Permute_Vertices : malloc(A) failed", 1);
+  for (j = 0; j < N_vert; j++)
+  {
+    A2[j].col = A2[0].col + j * MAXCOL;
+    A2[j].val = A2[0].val + j * MAXCOL;
+    A2[j].Ncol = A[old[j]].Ncol;
+    for (k = 0; k < A2[j].Ncol; k++)
+    {
+      A2[j].col[k] = new_id[A[old[j]].col[k]];
+      A2[j].val[k] = A[old[j]].val[k];
+    }
+  }
+  free(A[0].col);
+  free(A[0].val);
+  free(A);
+  A = A2;
 
+  for (i = 0; i < N_neighb; i++)
+  {
+    for (j = 0; j < send_count[i]; j++)
+      send_list[i][j] = new_id[send_list[i][j]];
+    for (j = 0; j < recv_count[i]; j++)
+      recv_list[i][j] = new_id[recv_list[i][j]];
+  }
 
+  free(new_id);
+}
 
-void Solve()
+/*
+ * Load time vertex order ("reorder: owned|rcm|hilbert"): the owned
+ * vertices first, so the dot products run over [0, N_owned) without
+ * testing the type, then the ghosts in their current order. rcm orders
+ * the owned vertices by reverse Cuthill-McKee on the graph of A, which
+ * keeps the columns of a row close to its diagonal; hilbert orders them
+ * along a Hilbert curve over their coordinates. Runs before the halo
+ * renumbering, which keeps this order within its groups.
+ */
+void Reorder_Vertices()
 {
-  int count = 0;
-  int i, j;
-  double *r, *p, *q;
-  double a, b, r1, r2 = 1;
+  int n = 0, v;
+  int *old;
 
-  double sub;
+  Debug("Reorder_Vertices", 0);
 
-  Debug("Solve", 0);
+  if ((old = malloc((N_vert + 1) * sizeof(int))) == NULL)
+    Debug("Reorder_Vertices : malloc(old) failed", 1);
 
-  if ((r = malloc(N_vert * sizeof(double))) == NULL)
-      Debug("Solve : malloc(r) failed", 1);
-  if ((p = malloc(N_vert * sizeof(double))) == NULL)
-      Debug("Solve : malloc(p) failed", 1);
-  if ((q = malloc(N_vert * sizeof(double))) == NULL)
-      Debug("Solve : malloc(q) failed", 1);
+  for (v = 0; v < N_vert; v++)
+    if (!(vert_type[v] & TYPE_GHOST))
+      old[n++] = v;
+  if (reorder == REORDER_RCM)
+    Order_RCM(old, n);
+  else if (reorder == REORDER_HILBERT)
+    Order_Hilbert(old, n);
+  for (v = 0; v < N_vert; v++)
+    if (vert_type[v] & TYPE_GHOST)
+      old[n++] = v;
 
-  /* Implementation of the CG algorithm : */
+  Permute_Vertices(old);
 
-  Exchange_Borders(phi);
+  free(old);
+}
 
-  /* r = b-Ax */
-  for (i = 0; i < N_vert; i++)
+/*
+ * Reverse Cuthill-McKee order of the n vertices in list[]: breadth first
+ * from a vertex of lowest degree, the new neighbours of each vertex by
+ * increasing degree, then reversed. The graph is that of A restricted to
+ * the listed vertices; a source or boundary vertex has no row, so its
+ * edges come from the rows of its neighbours.
+ */
+void Order_RCM(int *list, int n)
+{
+  int i, j, k, v, w, head, tail, first, start;
+  int *idx, *deg, *adj_start, *adj, *fill, *order, *done;
+
+  if ((idx = malloc((N_vert + 1) * sizeof(int))) == NULL ||
+      (deg = malloc((n + 1) * sizeof(int))) == NULL ||
+      (adj_start = malloc((n + 1) * sizeof(int))) == NULL ||
+      (fill = malloc((n + 1) * sizeof(int))) == NULL ||
+      (order = malloc((n + 1) * sizeof(int))) == NULL ||
+      (done = malloc((n + 1) * sizeof(int))) == NULL)
+    Debug("Order_RCM : malloc failed", 1);
+
+  for (v = 0; v < N_vert; v++)
+    idx[v] = -1;
+  for (i = 0; i < n; i++)
   {
-    r[i] = 0.0;
-    for (j = 0; j < A[i].Ncol; j++)
-      r[i] -= A[i].val[j] * phi[A[i].col[j]];
+    idx[list[i]] = i;
+    deg[i] = 0;
+    done[i] = 0;
   }
 
-  r1 = 2 * precision_goal;
-  while ((count < max_iter) && (r1 > precision_goal))
+  /* adjacency lists, as CSR */
+  for (i = 0; i < n; i++)
+    for (k = 0; k < A[list[i]].Ncol; k++)
+      if ((j = idx[A[list[i]].col[k]]) >= 0 && j != i)
+      {
+        deg[i]++;
+        if (A[list[j]].Ncol == 0)
+          deg[j]++;
+      }
+  adj_start[0] = 0;
+  for (i = 0; i < n; i++)
   {
-    /* r1 = r' * r */
-    sub = 0.0;
-    for (i = 0; i < N_vert; i++)
-      if (!(vert[i].type & TYPE_GHOST))
-	sub += r[i] * r[i];
-    stop_timer();
-    MPI_Allreduce(&sub, &r1, 1, MPI_DOUBLE, MPI_SUM, grid_comm);
-    resume_timer();
+    adj_start[i + 1] = adj_start[i] + deg[i];
+    fill[i] = adj_start[i];
+  }
+  if ((adj = malloc((adj_start[n] + 1) * sizeof(int))) == NULL)
+    Debug("Order_RCM : malloc(adj) failed", 1);
+  for (i = 0; i < n; i++)
+    for (k = 0; k < A[list[i]].Ncol; k++)
+      if ((j = idx[A[list[i]].col[k]]) >= 0 && j != i)
+      {
+        adj[fill[i]++] = j;
+        if (A[list[j]].Ncol == 0)
+          adj[fill[j]++] = i;
+      }
 
-    if (count == 0)
+  /* Cuthill-McKee, one breadth first search per connected part */
+  head = tail = 0;
+  while (tail < n)
+  {
+    start = -1;
+    for (i = 0; i < n; i++)
+      if (!done[i] && (start < 0 || deg[i] < deg[start]))
+        start = i;
+    done[start] = 1;
+    order[tail++] = start;
+    while (head < tail)
     {
-      /* p = r */
-      for (i = 0; i < N_vert; i++)
-	p[i] = r[i];
+      v = order[head++];
+      first = tail;
+      for (k = adj_start[v]; k < adj_start[v + 1]; k++)
+        if (!done[w = adj[k]])
+        {
+          done[w] = 1;
+          /* insertion by degree, the lists are short */
+          for (j = tail++; j > first && deg[order[j - 1]] > deg[w]; j--)
+            order[j] = order[j - 1];
+          order[j] = w;
+        }
     }
-    else
-    {
-      b = r1 / r2;
+  }
 
-      /* p = r + b*p */
-      for (i = 0; i < N_vert; i++)
-	p[i] = r[i] + b * p[i];
-    }
-    Exchange_Borders(p);
+  /* reversed, back to vertex ids */
+  for (i = 0; i < n; i++)
+    fill[i] = list[order[n - 1 - i]];
+  memcpy(list, fill, n * sizeof(int));
+
+  free(adj);
+  free(done);
+  free(order);
+  free(fill);
+  free(adj_start);
+  free(deg);
+  free(idx);
+}
 
-    /* q = A * p */
-    for (i = 0; i < N_vert; i++)
+/* position of (x, y) on the Hilbert curve through a 65536 x 65536 grid */
+unsigned int Hilbert_Index(unsigned int x, unsigned int y)
+{
+  unsigned int s, rx, ry, t, d = 0;
+
+  for (s = 1u << 15; s > 0; s >>= 1)
+  {
+    rx = (x & s) > 0;
+    ry = (y & s) > 0;
+    d += s * s * ((3 * rx) ^ ry);
+    /* rotate the quadrant, so the curve is continuous */
+    if (ry == 0)
     {
-      q[i] = 0;
-      for (j = 0; j < A[i].Ncol; j++)
-        q[i] += A[i].val[j] * p[A[i].col[j]];
+      if (rx == 1)
+      {
+        x = 65535 - x;
+        y = 65535 - y;
+      }
+      t = x;
+      x = y;
+      y = t;
     }
+  }
+  return d;
+}
 
-    /* a = r1 / (p' * q) */
-    sub = 0.0;
-    for (i = 0; i < N_vert; i++)
-      if (!(vert[i].type & TYPE_GHOST))
-	sub += p[i] * q[i];
-    stop_timer();
-    MPI_Allreduce(&sub, &a, 1, MPI_DOUBLE, MPI_SUM, grid_comm);
-    resume_timer();
-    a = r1 / a;
+int Cmp_Hilbert(const void *a, const void *b)
+{
+  unsigned int ka = reorder_key[*(const int *) a];
+  unsigned int kb = reorder_key[*(const int *) b];
 
-    /* x = x + a*p */
-    for (i = 0; i < N_vert; i++)
-      phi[i] += a * p[i];
+  if (ka != kb)
+    return ka < kb ? -1 : 1;
+  return *(const int *) a - *(const int *) b;
+}
 
-    /* r = r - a*q */
-    for (i = 0; i < N_vert; i++)
-      r[i] -= a * q[i];
+/* sorts the n vertices in list[] along a Hilbert curve over their box */
+void Order_Hilbert(int *list, int n)
+{
+  int i, v;
+  double x0 = HUGE_VAL, x1 = -HUGE_VAL, y0 = HUGE_VAL, y1 = -HUGE_VAL;
+  double sx, sy;
 
-    r2 = r1;
+  if ((reorder_key = malloc((N_vert + 1) * sizeof(unsigned int))) == NULL)
+    Debug("Order_Hilbert : malloc(reorder_key) failed", 1);
 
-    count++;
+  for (i = 0; i < n; i++)
+  {
+    v = list[i];
+    x0 = (vert_x[v] < x0) ? vert_x[v] : x0;
+    x1 = (vert_x[v] > x1) ? vert_x[v] : x1;
+    y0 = (vert_y[v] < y0) ? vert_y[v] : y0;
+    y1 = (vert_y[v] > y1) ? vert_y[v] : y1;
   }
-  free(q);
-  free(p);
-  free(r);
+  sx = (x1 > x0) ? 65535.0 / (x1 - x0) : 0.0;
+  sy = (y1 > y0) ? 65535.0 / (y1 - y0) : 0.0;
+  for (i = 0; i < n; i++)
+  {
+    v = list[i];
+    reorder_key[v] = Hilbert_Index((unsigned int) ((vert_x[v] - x0) * sx),
+                                   (unsigned int) ((vert_y[v] - y0) * sy));
+  }
+  qsort(list, n, sizeof(int), Cmp_Hilbert);
 
-  if (proc_rank == 0)
-    printf("Number of iterations : %i\n", count);
+  free(reorder_key);
+  reorder_key = NULL;
 }
 
-void Write_Grid()
+/* first entry of a list of n consecutive vertices, -1 otherwise */
+int First_Consecutive(int *list, int n)
 {
-  int i;
-  char filename[25];
-  FILE *f;
-
-  Debug("Write_Grid", 0);
-
-  sprintf(filename, "output%i-%i.dat", P, proc_rank);
-  if ((f = fopen(filename, "w")) == NULL)
-    Debug("Write_Grid : Can't open data outputfile", 1);
-
-  for (i = 0; i < N_vert; i++)
-    if (!(vert[i].type & TYPE_GHOST))
-      fprintf(f, "%f %f %f\n", vert[i].x, vert[i].y, phi[i]);
+  int k;
 
-  fclose(f);
+  if (n == 0)
+    return -1;
+  for (k = 1; k < n; k++)
+    if (list[k] != list[0] + k)
+      return -1;
+  return list[0];
 }
 
-void Clean_Up()
+/*
+ * Commits the halo datatypes and lays out the packed path: consecutive
+ * lists are sent and received in place, the others through a slot in
+ * halo_sbuf or halo_rbuf. Every list has a slot, so the neighbour
+ * collective can gather all sends.
+ */
+void Commit_Halos()
 {
-  int i;
-  Debug("Clean_Up", 0);
+  int i, ns = 0, nr = 0;
 
-  if (N_neighb>0)
-  {
-    free(recv_type);
-    free(send_type);
-    free(proc_neighb);
-  }
+  Debug("Commit_Halos", 0);
 
-  for (i=0;i<N_vert;i++)
+  for (i = 0; i < N_neighb; i++)
   {
-    free(A[i].col);
-    free(A[i].val);
+    MPI_Type_create_indexed_block(send_count[i], 1, send_list[i], MPI_DOUBLE,
+                                  &send_type[i]);
+    MPI_Type_commit(&send_type[i]);
+    MPI_Type_create_indexed_block(recv_count[i], 1, recv_list[i], MPI_DOUBLE,
+                                  &recv_type[i]);
+    MPI_Type_commit(&recv_type[i]);
+
+    send_first[i] = First_Consecutive(send_list[i], send_count[i]);
+    recv_first[i] = First_Consecutive(recv_list[i], recv_count[i]);
+    send_off[i] = ns;
+    recv_off[i] = nr;
+    ns += send_count[i];
+    nr += recv_count[i];
   }
-  free(A);
-  free(vert);
-  free(phi);
+  if ((halo_sbuf = malloc((ns + 1) * sizeof(double))) == NULL ||
+      (halo_rbuf = malloc((nr + 1) * sizeof(double))) == NULL)
+    Debug("Commit_Halos : malloc(halo buffers) failed", 1);
+  if ((halo_bytes = malloc((N_neighb + 1) * sizeof(long long))) == NULL)
+    Debug("Commit_Halos : malloc(halo_bytes) failed", 1);
+  for (i = 0; i < N_neighb; i++)
+    halo_bytes[i] = 0;
 }
 
-int main(int argc, char **argv)
+/* where the packed path sends neighbour i's halo from */
+double *Send_Buffer(double *vect, int i)
 {
-  MPI_Init(&argc, &argv);
+  return send_first[i] >= 0 ? vect + send_first[i] : halo_sbuf + send_off[i];
+}
 
-  start_timer();
+/* where the packed path receives neighbour i's halo into */
+double *Recv_Buffer(double *vect, int i)
+{
+  return recv_first[i] >= 0 ? vect + recv_first[i] : halo_rbuf + recv_off[i];
+}
 
-  Setup_Proc_Grid();
 
-  Setup_Grid();
 
-  Solve();
 
-  Write_Grid();
+
+/*
+ * Prepares the neighbor exchange: the halos are matched to the order of
+ * MPI_Graph_neighbors, which MPI_Neighbor_alltoallw follows. The send
+ * halos are packed into nb_buf, since the send and receive buffer of a
+ * collective may not be the same; the ghosts are received in place.
+ */
+void Setup_Exchange()
+{
+  int i, j, size;
+  int *graph_neighb, matched = 0;
+
+  Debug("Setup_Exchange", 0);
+
+  if (exchange != EXCHANGE_NEIGHBOR)
+    return;
+
+  MPI_Graph_neighbors_count(grid_comm, proc_rank, &N_graph_neighb);
+  if ((graph_neighb = malloc((N_graph_neighb + 1) * sizeof(int))) == NULL ||
+      (nb_index = malloc((N_graph_neighb + 1) * sizeof(int))) == NULL ||
+      (nb_scounts = malloc((N_graph_neighb + 1) * sizeof(int))) == NULL ||
+      (nb_rcounts = malloc((N_graph_neighb + 1) * sizeof(int))) == NULL ||
+      (nb_sdispls = malloc((N_graph_neighb + 1) * sizeof(MPI_Aint))) == NULL ||
+      (nb_rdispls = malloc((N_graph_neighb + 1) * sizeof(MPI_Aint))) == NULL ||
+      (nb_stypes = malloc((N_graph_neighb + 1) * sizeof(MPI_Datatype))) == NULL ||
+      (nb_rtypes = malloc((N_graph_neighb + 1) * sizeof(MPI_Datatype))) == NULL)
+    Debug("Setup_Exchange : malloc failed", 1);
+  MPI_Graph_neighbors(grid_comm, proc_rank, N_graph_neighb, graph_neighb);
+
+  nb_buf_size = 0;
+  for (j = 0; j < N_graph_neighb; j++)
+  {
+    for (i = 0; i < N_neighb && proc_neighb[i] != graph_neighb[j]; i++) ;
+    nb_index[j] = (i < N_neighb) ? i : -1;
+    nb_scounts[j] = 0;
+    nb_sdispls[j] = 0;
+    nb_stypes[j] = MPI_PACKED;
+    nb_rcounts[j] = 0;
+    nb_rdispls[j] = 0;
+    nb_rtypes[j] = MPI_DOUBLE;
+    if (i < N_neighb)
+    {
+      matched++;
+      MPI_Pack_size(1, send_type[i], grid_comm, &size);
+      nb_buf_size += size;
+    }
+  }
+  if (matched != N_neighb)
+    Debug("Setup_Exchange : halo with a rank that is no neighbour in the mapping", 1);
+  if ((nb_buf = malloc(nb_buf_size + 1)) == NULL)
+    Debug("Setup_Exchange : malloc(nb_buf) failed", 1);
+
+  free(graph_neighb);
+}
+
+/*
+ * Persistent requests for vect on the given halo path, set up the first
+ * time it is exchanged that way. Receives and sends touch disjoint
+ * entries, so all of them run at once. The packed buffers are shared by
+ * all vectors, which is fine as exchanges never overlap.
+ */
+MPI_Request *Halo_Requests(double *vect, int path)
+{
+  int i, k;
+
+  for (k = 0; k < N_halo_vect &&
+       (halo_vect[k] != vect || halo_vect_path[k] != path); k++) ;
+  if (k < N_halo_vect)
+    return halo_req[k];
+
+  if (k == MAX_HALO_VECTORS)
+    Debug("Halo_Requests : too many exchanged vectors", 1);
+  if ((halo_req[k] = malloc(2 * N_neighb * sizeof(MPI_Request))) == NULL)
+    Debug("Halo_Requests : malloc(halo_req) failed", 1);
+  for (i = 0; i < N_neighb; i++)
+  {
+    if (path == HALO_PACKED)
+    {
+      MPI_Recv_init(Recv_Buffer(vect, i), recv_count[i], MPI_DOUBLE,
+		    proc_neighb[i], 0, grid_comm, &halo_req[k][i]);
+      MPI_Send_init(Send_Buffer(vect, i), send_count[i], MPI_DOUBLE,
+		    proc_neighb[i], 0, grid_comm, &halo_req[k][N_neighb + i]);
+    }
+    else
+    {
+      MPI_Recv_init(vect, 1, recv_type[i], proc_neighb[i], 0, grid_comm,
+		    &halo_req[k][i]);
+      MPI_Send_init(vect, 1, send_type[i], proc_neighb[i], 0, grid_comm,
+		    &halo_req[k][N_neighb + i]);
+    }
+  }
+  halo_vect[k] = vect;
+  halo_vect_path[k] = path;
+  N_halo_vect++;
+
+  return halo_req[k];
+}
+
+void Free_Halo_Requests()
+{
+  int i, k;
+
+  for (k = 0; k < N_halo_vect; k++)
+  {
+    for (i = 0; i < 2 * N_neighb; i++)
+      MPI_Request_free(&halo_req[k][i]);
+    free(halo_req[k]);
+  }
+  N_halo_vect = 0;
+}
+
+/* the halo of vect through the indexed datatypes */
+void Exchange_Datatypes(double *vect)
+{
+  int i, j, pos;
+  MPI_Request *req;
+
+  if (exchange == EXCHANGE_PERSISTENT && N_neighb > 0)
+  {
+    req = Halo_Requests(vect, HALO_DATATYPE);
+    MPI_Startall(2 * N_neighb, req);
+    MPI_Waitall(2 * N_neighb, req, MPI_STATUSES_IGNORE);
+  }
+  else if (exchange == EXCHANGE_NEIGHBOR)
+  {
+    pos = 0;
+    for (j = 0; j < N_graph_neighb; j++)
+      if ((i = nb_index[j]) >= 0)
+      {
+	nb_sdispls[j] = pos;
+	MPI_Pack(vect, 1, send_type[i], nb_buf, nb_buf_size, &pos, grid_comm);
+	nb_scounts[j] = pos - nb_sdispls[j];
+	nb_stypes[j] = MPI_PACKED;
+	nb_rcounts[j] = 1;
+	nb_rdispls[j] = 0;
+	nb_rtypes[j] = recv_type[i];
+      }
+    MPI_Neighbor_alltoallw(nb_buf, nb_scounts, nb_sdispls, nb_stypes,
+			   vect, nb_rcounts, nb_rdispls, nb_rtypes, grid_comm);
+  }
+  else
+  {
+    /* neighbours in rank order, so the blocking pairs cannot deadlock */
+    for (i = 0; i < N_neighb; i++)
+    {
+      MPI_Sendrecv(
+	vect, 1, send_type[i], proc_neighb[i], 0,
+	vect, 1, recv_type[i], proc_neighb[i], 0,
+	grid_comm, &status);
+    }
+  }
+}
+
+/*
+ * The halo of vect as plain runs of doubles: scattered send lists are
+ * gathered into halo_sbuf before and scattered receive lists copied out
+ * of halo_rbuf after the transfer; consecutive lists need no copy. The
+ * neighbour collective gathers every send list, since its send and
+ * receive buffer may not be the same, and receives at absolute
+ * addresses.
+ */
+void Exchange_Packed(double *vect)
+{
+  int i, j, k;
+  double *buf;
+  MPI_Request *req;
+
+  for (i = 0; i < N_neighb; i++)
+    if (send_first[i] < 0 || exchange == EXCHANGE_NEIGHBOR)
+    {
+      buf = halo_sbuf + send_off[i];
+      for (k = 0; k < send_count[i]; k++)
+	buf[k] = vect[send_list[i][k]];
+    }
+
+  if (exchange == EXCHANGE_PERSISTENT && N_neighb > 0)
+  {
+    req = Halo_Requests(vect, HALO_PACKED);
+    MPI_Startall(2 * N_neighb, req);
+    MPI_Waitall(2 * N_neighb, req, MPI_STATUSES_IGNORE);
+  }
+  else if (exchange == EXCHANGE_NEIGHBOR)
+  {
+    for (j = 0; j < N_graph_neighb; j++)
+      if ((i = nb_index[j]) >= 0)
+      {
+	nb_scounts[j] = send_count[i];
+	nb_sdispls[j] = send_off[i] * sizeof(double);
+	nb_stypes[j] = MPI_DOUBLE;
+	nb_rcounts[j] = recv_count[i];
+	MPI_Get_address(Recv_Buffer(vect, i), &nb_rdispls[j]);
+	nb_rtypes[j] = MPI_DOUBLE;
+      }
+    MPI_Neighbor_alltoallw(halo_sbuf, nb_scounts, nb_sdispls, nb_stypes,
+			   MPI_BOTTOM, nb_rcounts, nb_rdispls, nb_rtypes,
+			   grid_comm);
+  }
+  else
+  {
+    /* neighbours in rank order, so the blocking pairs cannot deadlock */
+    for (i = 0; i < N_neighb; i++)
+    {
+      MPI_Sendrecv(
+	Send_Buffer(vect, i), send_count[i], MPI_DOUBLE, proc_neighb[i], 0,
+	Recv_Buffer(vect, i), recv_count[i], MPI_DOUBLE, proc_neighb[i], 0,
+	grid_comm, &status);
+    }
+  }
+
+  for (i = 0; i < N_neighb; i++)
+    if (recv_first[i] < 0)
+    {
+      buf = halo_rbuf + recv_off[i];
+      for (k = 0; k < recv_count[i]; k++)
+	vect[recv_list[i][k]] = buf[k];
+    }
+}
+
+void Exchange_Borders(double *vect)
+{
+  int i;
+
+  Phase_Begin(PHASE_HALO);
+
+  if (halo_path == HALO_PACKED)
+    Exchange_Packed(vect);
+  else
+    Exchange_Datatypes(vect);
+
+  /* both paths send the same entries */
+  for (i = 0; i < N_neighb; i++)
+    halo_bytes[i] += send_count[i] * sizeof(double);
+
+  Phase_End();
+}
+
+/*
+ * Microbenchmark of the two halo paths ("halo benchmark: <exchanges>"):
+ * times that many exchanges of a test vector on each path, with the
+ * selected exchange engine, and checks that every ghost gets its owner's
+ * value. The value of a vertex is a function of its coordinates, which
+ * owner and ghost share. Not counted in the solver time.
+ */
+void Benchmark_Halo()
+{
+  int i, k, v, path, bad = 0, lists[3], sum[3];
+  double *x, t[2], tmax[2];
+
+  if (halo_bench <= 0)
+    return;
+
+  Debug("Benchmark_Halo", 0);
+
+  stop_timer();
+
+  x = Alloc_Vector("x");
+  for (path = HALO_DATATYPE; path <= HALO_PACKED; path++)
+  {
+    for (i = 0; i < N_vert; i++)
+      x[i] = (vert_type[i] & TYPE_GHOST) ? 0.0 : vert_x[i] + 3.0 * vert_y[i];
+
+    MPI_Barrier(grid_comm);
+    t[path] = MPI_Wtime();
+    for (k = 0; k < halo_bench; k++)
+      if (path == HALO_PACKED)
+        Exchange_Packed(x);
+      else
+        Exchange_Datatypes(x);
+    t[path] = (MPI_Wtime() - t[path]) / halo_bench;
+
+    for (i = 0; i < N_neighb; i++)
+      for (k = 0; k < recv_count[i]; k++)
+      {
+        v = recv_list[i][k];
+        if (x[v] != vert_x[v] + 3.0 * vert_y[v])
+          bad++;
+      }
+  }
+  Free_Halo_Requests();
+
+  lists[0] = lists[1] = 0;
+  lists[2] = bad;
+  for (i = 0; i < N_neighb; i++)
+  {
+    lists[0] += (send_first[i] >= 0) + (recv_first[i] >= 0);
+    lists[1] += (send_count[i] > 0) + (recv_count[i] > 0);
+  }
+  MPI_Reduce(t, tmax, 2, MPI_DOUBLE, MPI_MAX, 0, grid_comm);
+  MPI_Reduce(lists, sum, 3, MPI_INT, MPI_SUM, 0, grid_comm);
+  if (proc_rank == 0)
+  {
+    printf("Halo benchmark : %i exchanges, %i of %i halos consecutive\n",
+	   halo_bench, sum[0], sum[1]);
+    printf("Halo benchmark : datatype %10.3f us, packed %10.3f us per exchange\n",
+	   1e6 * tmax[0], 1e6 * tmax[1]);
+    if (sum[2] > 0)
+      Debug("Benchmark_Halo : ghosts differ from their owners", 1);
+  }
+
+  resume_timer();
+}
+
+void Solve()
+{
+  int count = 0, first;
+  int i;
+  int fused = (preconditioner == PC_NONE || preconditioner == PC_JACOBI);
+  double *r, *p, *q, *z;
+  double a, b, r1, rz1, rz2 = 1, rr_next = 0, rz_next = 0;
+
+  double sub, subs[2], dots[2];	/* r' * r, r' * z */
+  double *ckv[3], cks[N_CKPT_SCALARS] = { 0.0 };	/* checkpoint */
+  MPI_Request req;
+
+  Debug("Solve", 0);
+
+  r = work[0];
+  p = work[1];
+  q = work[2];
+  z = r;
+  if (preconditioner != PC_NONE)
+    z = work[3];
+
+  /* Implementation of the CG algorithm : */
+
+  Exchange_Borders(phi);
+
+  /* r = b-Ax */
+  SpMV(r, phi);
+  #pragma omp parallel for schedule(static)
+  for (i = 0; i < N_vert; i++)
+    r[i] = -r[i];
+
+  r1 = 2 * precision_goal;
+
+  ckv[0] = phi;
+  ckv[1] = r;
+  ckv[2] = p;
+  if (restart)
+  {
+    /* z is not saved, it follows from r */
+    count = Read_Checkpoint(ckv, 3, cks);
+    r1 = cks[0];
+    rz1 = cks[1];
+    rz2 = cks[2];
+    if (overlap_reduction && preconditioner != PC_NONE)
+      Precondition(z, r);
+  }
+  first = count;
+
+  while ((count < max_iter) && (r1 > precision_goal))
+  {
+    /* z = M^-1 * r, r1 = r' * r and rz1 = r' * z, in overlap mode
+     * already done by the previous iteration, fused they were taken
+     * with the update of r and are reduced but not yet used */
+    if (fused && !overlap_reduction && count > first)
+    {
+      r1 = rr_next;
+      rz1 = rz_next;
+    }
+    else if (!overlap_reduction || count == 0)
+    {
+      if (preconditioner != PC_NONE)
+        Precondition(z, r);
+      subs[0] = Dot_Owned(r, r);
+      subs[1] = Dot_Owned(r, z);
+      Phase_Begin(PHASE_REDUCE);
+      MPI_Allreduce(subs, dots, 2, MPI_DOUBLE, MPI_SUM, grid_comm);
+      Phase_End();
+      r1 = dots[0];
+      rz1 = dots[1];
+    }
+
+    if (count == 0)
+    {
+      /* p = z */
+      #pragma omp parallel for schedule(static)
+      for (i = 0; i < N_vert; i++)
+	p[i] = z[i];
+    }
+    else
+    {
+      b = rz1 / rz2;
+
+      /* p = z + b*p */
+      #pragma omp parallel for schedule(static)
+      for (i = 0; i < N_vert; i++)
+	p[i] = z[i] + b * p[i];
+    }
+    Exchange_Borders(p);
+
+    /* q = A * p, a = r1 / (p' * q) */
+    sub = SpMV_Dot(q, p);
+    Phase_Begin(PHASE_REDUCE);
+    MPI_Allreduce(&sub, &a, 1, MPI_DOUBLE, MPI_SUM, grid_comm);
+    Phase_End();
+    a = rz1 / a;
+
+    if (overlap_reduction)
+    {
+      /* r = r - a*q */
+      if (fused)
+        Update_CG(a, NULL, p, q, r, z, subs);
+      else
+      {
+        #pragma omp parallel for schedule(static)
+        for (i = 0; i < N_vert; i++)
+          r[i] -= a * q[i];
+        Precondition(z, r);
+        subs[0] = Dot_Owned(r, r);
+        subs[1] = Dot_Owned(r, z);
+      }
+
+      /* the next r1 and rz1 are reduced while x is updated */
+      rz2 = rz1;
+      MPI_Iallreduce(subs, dots, 2, MPI_DOUBLE, MPI_SUM, grid_comm, &req);
+
+      /* x = x + a*p */
+      #pragma omp parallel for schedule(static)
+      for (i = 0; i < N_vert; i++)
+        phi[i] += a * p[i];
+
+      Phase_Begin(PHASE_REDUCE);
+      MPI_Wait(&req, MPI_STATUS_IGNORE);
+      Phase_End();
+      r1 = dots[0];
+      rz1 = dots[1];
+    }
+    else if (fused)
+    {
+      /* x = x + a*p, r = r - a*q and the next r1 and rz1 */
+      Update_CG(a, phi, p, q, r, z, subs);
+      Phase_Begin(PHASE_REDUCE);
+      MPI_Allreduce(subs, dots, 2, MPI_DOUBLE, MPI_SUM, grid_comm);
+      Phase_End();
+      rr_next = dots[0];
+      rz_next = dots[1];
+      rz2 = rz1;
+    }
+    else
+    {
+      /* x = x + a*p */
+      #pragma omp parallel for schedule(static)
+      for (i = 0; i < N_vert; i++)
+        phi[i] += a * p[i];
+
+      /* r = r - a*q */
+      #pragma omp parallel for schedule(static)
+      for (i = 0; i < N_vert; i++)
+        r[i] -= a * q[i];
+
+      rz2 = rz1;
+    }
+
+    count++;
+    cks[0] = r1;
+    cks[1] = rz1;
+    cks[2] = rz2;
+    Checkpoint(count, ckv, 3, cks);
+  }
+  Finish_Checkpoint();
+
+  if (proc_rank == 0)
+    printf("Number of iterations : %i\n", count);
+  solve_iter = count;
+}
+
+#ifdef USE_GPU
+/*
+ * Moves the solver to the device, once per setup like Setup_Work(): the
+ * CSR matrix, the Jacobi diagonal, the halo lists and the CG vectors.
+ * Only the textbook CG with a pointwise preconditioner is ported.
+ */
+void Setup_GPU()
+{
+  int i, nnz = csr_row[N_vert], ns = 0, nr = 0;
+  size_t vect = N_vert * sizeof(double);
+
+  Debug("Setup_GPU", 0);
+
+  if (solver != SOLVER_CG || N_sets > 0)
+    Debug("Setup_GPU : backend gpu only runs the cg solver on one source set", 1);
+  if (preconditioner != PC_NONE && preconditioner != PC_JACOBI)
+    Debug("Setup_GPU : backend gpu only has the jacobi preconditioner", 1);
+  if (checkpoint_interval > 0 || restart)
+    Debug("Setup_GPU : backend gpu writes no checkpoints", 1);
+
+  Gpu_Init(proc_rank);
+
+  gpu_row = Gpu_Alloc((N_vert + 1) * sizeof(int));
+  gpu_col = Gpu_Alloc(nnz * sizeof(int));
+  gpu_val = Gpu_Alloc(nnz * sizeof(double));
+  Gpu_Upload(gpu_row, csr_row, (N_vert + 1) * sizeof(int));
+  Gpu_Upload(gpu_col, csr_col, nnz * sizeof(int));
+  Gpu_Upload(gpu_val, csr_val, nnz * sizeof(double));
+
+  gpu_phi = Gpu_Alloc(vect);
+  gpu_r = Gpu_Alloc(vect);
+  gpu_p = Gpu_Alloc(vect);
+  gpu_q = Gpu_Alloc(vect);
+  gpu_z = gpu_r;
+  if (preconditioner == PC_JACOBI)
+  {
+    gpu_pc = Gpu_Alloc(vect);
+    Gpu_Upload(gpu_pc, pc_inv, vect);
+    gpu_z = Gpu_Alloc(vect);
+  }
+
+  /* the lists in the layout of halo_sbuf and halo_rbuf */
+  for (i = 0; i < N_neighb; i++)
+  {
+    ns += send_count[i];
+    nr += recv_count[i];
+  }
+  gpu_send_list = Gpu_Alloc(ns * sizeof(int));
+  gpu_recv_list = Gpu_Alloc(nr * sizeof(int));
+  gpu_sbuf = Gpu_Alloc(ns * sizeof(double));
+  gpu_rbuf = Gpu_Alloc(nr * sizeof(double));
+  for (i = 0; i < N_neighb; i++)
+  {
+    Gpu_Upload(gpu_send_list + send_off[i], send_list[i], send_count[i] * sizeof(int));
+    Gpu_Upload(gpu_recv_list + recv_off[i], recv_list[i], recv_count[i] * sizeof(int));
+  }
+  if ((gpu_req = malloc((2 * N_neighb + 1) * sizeof(MPI_Request))) == NULL)
+    Debug("Setup_GPU : malloc(gpu_req) failed", 1);
+}
+
+/*
+ * Exchange_Borders() of a device vector. The halos are packed and
+ * unpacked on the device and MPI gets the device buffers themselves,
+ * which takes a CUDA-aware MPI (e.g. Open MPI built --with-cuda).
+ */
+void Exchange_GPU(double *d_vect)
+{
+  int i;
+
+  Phase_Begin(PHASE_HALO);
+
+  for (i = 0; i < N_neighb; i++)
+    Gpu_Gather(gpu_sbuf + send_off[i], d_vect, gpu_send_list + send_off[i],
+      send_count[i]);
+  Gpu_Sync();
+
+  for (i = 0; i < N_neighb; i++)
+  {
+    MPI_Irecv(gpu_rbuf + recv_off[i], recv_count[i], MPI_DOUBLE,
+      proc_neighb[i], 0, grid_comm, &gpu_req[i]);
+    MPI_Isend(gpu_sbuf + send_off[i], send_count[i], MPI_DOUBLE,
+      proc_neighb[i], 0, grid_comm, &gpu_req[N_neighb + i]);
+  }
+  MPI_Waitall(2 * N_neighb, gpu_req, MPI_STATUSES_IGNORE);
+
+  for (i = 0; i < N_neighb; i++)
+  {
+    Gpu_Scatter(d_vect, gpu_rbuf + recv_off[i], gpu_recv_list + recv_off[i],
+      recv_count[i]);
+    halo_bytes[i] += send_count[i] * sizeof(double);
+  }
+
+  Phase_End();
+}
+
+/*
+ * Solve() on the GPU, the fused variant: it takes the same iterations,
+ * the sums only differ in the order of the additions. phi goes to the
+ * device at the start and comes back at the end, in between only the
+ * halos and the local dot products cross to the host.
+ */
+void Solve_GPU()
+{
+  int count = 0;
+  double a, r1, rz1 = 0, rz2 = 1, rr_next, rz_next;
+
+  double sub, subs[2], dots[2];	/* r' * r, r' * z */
+  MPI_Request req;
+
+  Debug("Solve_GPU", 0);
+
+  /* the caller may have changed phi since the last solve */
+  Gpu_Upload(gpu_phi, phi, N_vert * sizeof(double));
+  Exchange_GPU(gpu_phi);
+
+  /* r = b-Ax, z = M^-1 * r */
+  Gpu_SpMV_Dot(gpu_r, gpu_phi, gpu_row, gpu_col, gpu_val, N_vert);
+  Gpu_Scale(gpu_r, -1.0, N_vert);
+  if (gpu_pc)
+    Gpu_Jacobi(gpu_z, gpu_pc, gpu_r, N_vert);
+  Gpu_Dots(gpu_r, gpu_z, N_vert, subs);
+  Phase_Begin(PHASE_REDUCE);
+  MPI_Allreduce(subs, dots, 2, MPI_DOUBLE, MPI_SUM, grid_comm);
+  Phase_End();
+  rr_next = dots[0];
+  rz_next = dots[1];
+
+  r1 = 2 * precision_goal;
+
+  while ((count < max_iter) && (r1 > precision_goal))
+  {
+    /* r1 and rz1 of the current r, reduced by the previous iteration */
+    if (!overlap_reduction || count == 0)
+    {
+      r1 = rr_next;
+      rz1 = rz_next;
+    }
+
+    /* p = z, then p = z + b*p */
+    if (count == 0)
+      Gpu_Copy(gpu_p, gpu_z, N_vert * sizeof(double));
+    else
+      Gpu_Xpay(gpu_p, gpu_z, rz1 / rz2, N_vert);
+    Exchange_GPU(gpu_p);
+
+    /* q = A * p, a = rz1 / (p' * q) */
+    sub = Gpu_SpMV_Dot(gpu_q, gpu_p, gpu_row, gpu_col, gpu_val, N_vert);
+    Phase_Begin(PHASE_REDUCE);
+    MPI_Allreduce(&sub, &a, 1, MPI_DOUBLE, MPI_SUM, grid_comm);
+    Phase_End();
+    a = rz1 / a;
+
+    /* x = x + a*p, r = r - a*q, z = M^-1 * r and the next r1 and rz1;
+     * in overlap mode x is updated while they are reduced */
+    Gpu_Update_CG(a, overlap_reduction ? NULL : gpu_phi, gpu_p, gpu_q,
+      gpu_r, gpu_z, gpu_pc, N_vert, subs);
+    rz2 = rz1;
+    if (overlap_reduction)
+    {
+      MPI_Iallreduce(subs, dots, 2, MPI_DOUBLE, MPI_SUM, grid_comm, &req);
+      Gpu_Axpy(gpu_phi, gpu_p, a, N_vert);
+      Phase_Begin(PHASE_REDUCE);
+      MPI_Wait(&req, MPI_STATUS_IGNORE);
+      Phase_End();
+      r1 = dots[0];
+      rz1 = dots[1];
+    }
+    else
+    {
+      Phase_Begin(PHASE_REDUCE);
+      MPI_Allreduce(subs, dots, 2, MPI_DOUBLE, MPI_SUM, grid_comm);
+      Phase_End();
+      rr_next = dots[0];
+      rz_next = dots[1];
+    }
+
+    count++;
+  }
+
+  Gpu_Download(phi, gpu_phi, N_vert * sizeof(double));
+
+  if (proc_rank == 0)
+    printf("Number of iterations : %i\n", count);
+  solve_iter = count;
+}
+
+void Free_GPU()
+{
+  Gpu_Free(gpu_row);
+  Gpu_Free(gpu_col);
+  Gpu_Free(gpu_val);
+  Gpu_Free(gpu_phi);
+  Gpu_Free(gpu_r);
+  Gpu_Free(gpu_p);
+  Gpu_Free(gpu_q);
+  if (gpu_pc)
+  {
+    Gpu_Free(gpu_pc);
+    Gpu_Free(gpu_z);
+  }
+  Gpu_Free(gpu_send_list);
+  Gpu_Free(gpu_recv_list);
+  Gpu_Free(gpu_sbuf);
+  Gpu_Free(gpu_rbuf);
+  free(gpu_req);
+  Gpu_Release();
+}
+#endif
+
+/* y = A * x, the ghost values of x must be up to date */
+void SpMV(double *restrict y, double *restrict x)
+{
+  int i, j, k;
+  double sum;
+
+  if (matrix_format == FORMAT_ELL)
+  {
+    /* unit stride over the rows, so the inner loop vectorises; the
+     * static schedule gives every thread the same rows for all k */
+    #pragma omp parallel private(k)
+    {
+      #pragma omp for schedule(static) nowait
+      for (i = 0; i < N_vert; i++)
+        y[i] = 0.0;
+      for (k = 0; k < ell_width; k++)
+      {
+        const int *col = ell_col + k * N_vert;
+        const double *val = ell_val + k * N_vert;
+        #pragma omp for schedule(static) nowait
+        for (i = 0; i < N_vert; i++)
+          y[i] += val[i] * x[col[i]];
+      }
+    }
+  }
+  else
+  {
+    #pragma omp parallel for private(j, sum) schedule(static)
+    for (i = 0; i < N_vert; i++)
+    {
+      sum = 0.0;
+      for (j = csr_row[i]; j < csr_row[i + 1]; j++)
+        sum += csr_val[j] * x[csr_col[j]];
+      y[i] = sum;
+    }
+  }
+}
+
+/*
+ * q = A * p and the local part of p' * q in one pass (ELL: two). The
+ * ghost and source rows are empty, so q is zero there and the sum needs
+ * no test for ownership.
+ */
+double SpMV_Dot(double *restrict y, double *restrict x)
+{
+  int i, j;
+  double sum, sub = 0.0;
+
+  if (matrix_format == FORMAT_ELL)
+  {
+    SpMV(y, x);
+    return Dot_Owned(x, y);
+  }
+
+  #pragma omp parallel for private(j, sum) reduction(+:sub) schedule(static)
+  for (i = 0; i < N_vert; i++)
+  {
+    sum = 0.0;
+    for (j = csr_row[i]; j < csr_row[i + 1]; j++)
+      sum += csr_val[j] * x[csr_col[j]];
+    y[i] = sum;
+    sub += x[i] * sum;
+  }
+
+  return sub;
+}
+
+/*
+ * The CG update in one pass for the pointwise preconditioners:
+ * x = x + a*p (skipped if x is NULL), r = r - a*q, z = M^-1 * r and the
+ * local r' * r and r' * z into sub[]. r stays zero on the ghosts like q.
+ */
+void Update_CG(double a, double *x, double *p, double *q, double *r, double *z,
+  double *sub)
+{
+  int i;
+  int jacobi = (preconditioner == PC_JACOBI);
+  double rr = 0.0, rz = 0.0;
+
+  #pragma omp parallel for reduction(+:rr, rz) schedule(static)
+  for (i = 0; i < N_vert; i++)
+  {
+    if (x)
+      x[i] += a * p[i];
+    r[i] -= a * q[i];
+    if (jacobi)
+      z[i] = pc_inv[i] * r[i];
+    rr += r[i] * r[i];
+    rz += r[i] * z[i];
+  }
+
+  sub[0] = rr;
+  sub[1] = rz;
+}
+
+/* local part of x' * y, ghosts are counted by their owner */
+double Dot_Owned(double *x, double *y)
+{
+  int i;
+  double sub = 0.0;
+
+  if (N_owned >= 0)
+  {
+    #pragma omp parallel for reduction(+:sub) schedule(static)
+    for (i = 0; i < N_owned; i++)
+      sub += x[i] * y[i];
+    return sub;
+  }
+
+  #pragma omp parallel for reduction(+:sub) schedule(static)
+  for (i = 0; i < N_vert; i++)
+    if (!(vert_type[i] & TYPE_GHOST))
+      sub += x[i] * y[i];
+
+  return sub;
+}
+
+/*
+ * Recomputes the recurrence vectors of the pipelined CG from phi and p:
+ * r = b-Ax, u = M^-1*r, w = A*u, s = A*p, t = M^-1*s, z = A*t. Without a
+ * preconditioner u and t are r and s themselves. Returns the true r' * r.
+ */
+double Replace_Residual(double *r, double *u, double *w, double *p,
+  double *s, double *t, double *z)
+{
+  int i;
+  double sub, r1;
+
+  Exchange_Borders(phi);
+  SpMV(r, phi);
+  #pragma omp parallel for schedule(static)
+  for (i = 0; i < N_vert; i++)
+    r[i] = -r[i];
+  if (preconditioner != PC_NONE)
+    Precondition(u, r);
+  Exchange_Borders(u);
+  SpMV(w, u);
+  Exchange_Borders(p);
+  SpMV(s, p);
+  if (preconditioner != PC_NONE)
+    Precondition(t, s);
+  Exchange_Borders(t);
+  SpMV(z, t);
+
+  sub = Dot_Owned(r, r);
+  Phase_Begin(PHASE_REDUCE);
+  MPI_Allreduce(&sub, &r1, 1, MPI_DOUBLE, MPI_SUM, grid_comm);
+  Phase_End();
+
+  return r1;
+}
+
+/*
+ * Pipelined CG (Ghysels and Vanroose, 2014). Both inner products of an
+ * iteration are combined in a single MPI_Iallreduce, which is in flight
+ * while q = A*w is computed. The recurrences for r and w drift from the
+ * true residual, so they are recomputed every replace_interval iterations
+ * and before convergence is accepted. With a preconditioner the extra
+ * vectors u = M^-1*r, m = M^-1*w and t = M^-1*s are carried along and
+ * m is computed while the reduction is in flight.
+ */
+void Solve_Pipelined()
+{
+  int count = 0, since_replace = 0;
+  int i;
+  double *r, *w, *q, *z, *s, *p, *u, *m, *t;
+  double sub[3], dots[3];	/* r' * r, r' * u, w' * u */
+  double a = 1, a_old = 1, b, r1, rz1, rz2 = 1;
+  double *ckv[8], cks[N_CKPT_SCALARS] = { 0.0 };	/* checkpoint */
+  int nv;
+  MPI_Request req;
+
+  Debug("Solve_Pipelined", 0);
+
+  r = work[0];
+  w = work[1];
+  q = work[2];
+  z = work[3];
+  s = work[4];
+  p = work[5];
+  u = r;
+  m = w;
+  t = s;
+  if (preconditioner != PC_NONE)
+  {
+    u = work[6];
+    m = work[7];
+    t = work[8];
+  }
+
+  /* r = b-Ax, u = M^-1*r, w = A*u, s = t = z = 0 */
+  Replace_Residual(r, u, w, p, s, t, z);
+
+  /* the recurrences; m and q are recomputed from w */
+  ckv[0] = phi;
+  ckv[1] = r;
+  ckv[2] = w;
+  ckv[3] = z;
+  ckv[4] = s;
+  ckv[5] = p;
+  ckv[6] = u;
+  ckv[7] = t;
+  nv = (preconditioner != PC_NONE) ? 8 : 6;
+  if (restart)
+  {
+    count = Read_Checkpoint(ckv, nv, cks);
+    rz2 = cks[0];
+    a_old = cks[1];
+    since_replace = (int) cks[2];
+  }
+
+  while (count < max_iter)
+  {
+    sub[0] = Dot_Owned(r, r);
+    sub[1] = Dot_Owned(r, u);
+    sub[2] = Dot_Owned(w, u);
+    MPI_Iallreduce(sub, dots, 3, MPI_DOUBLE, MPI_SUM, grid_comm, &req);
+
+    /* m = M^-1 * w and q = A * m, overlapping the reduction */
+    if (preconditioner != PC_NONE)
+      Precondition(m, w);
+    Exchange_Borders(m);
+    SpMV(q, m);
+
+    Phase_Begin(PHASE_REDUCE);
+    MPI_Wait(&req, MPI_STATUS_IGNORE);
+    Phase_End();
+    r1 = dots[0];
+    rz1 = dots[1];
+
+    if (r1 <= precision_goal)
+    {
+      /* only stop if the true residual agrees */
+      r1 = Replace_Residual(r, u, w, p, s, t, z);
+      since_replace = 0;
+      if (r1 <= precision_goal)
+        break;
+      continue;
+    }
+
+    if (count == 0)
+    {
+      b = 0.0;
+      a = rz1 / dots[2];
+    }
+    else
+    {
+      b = rz1 / rz2;
+      a = rz1 / (dots[2] - b * rz1 / a_old);
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (i = 0; i < N_vert; i++)
+    {
+      z[i] = q[i] + b * z[i];
+      s[i] = w[i] + b * s[i];
+      p[i] = u[i] + b * p[i];
+      phi[i] += a * p[i];
+      r[i] -= a * s[i];
+      w[i] -= a * z[i];
+    }
+    if (preconditioner != PC_NONE)
+      #pragma omp parallel for schedule(static)
+      for (i = 0; i < N_vert; i++)
+      {
+        t[i] = m[i] + b * t[i];
+        u[i] -= a * t[i];
+      }
+
+    rz2 = rz1;
+    a_old = a;
+    count++;
+
+    if (replace_interval > 0 && ++since_replace >= replace_interval)
+    {
+      Replace_Residual(r, u, w, p, s, t, z);
+      since_replace = 0;
+    }
+
+    cks[0] = rz2;
+    cks[1] = a_old;
+    cks[2] = since_replace;
+    Checkpoint(count, ckv, nv, cks);
+  }
+  Finish_Checkpoint();
+
+  if (proc_rank == 0)
+    printf("Number of iterations : %i\n", count);
+  solve_iter = count;
+}
+
+/*
+ * Batch mode, sources in input.dat: the source sets replace the sources
+ * of the partition and are solved together as K = N_sets right hand
+ * sides with one matrix. The rows of all vertices off the boundary are
+ * assembled, so the partition's sources are cleared here, before the
+ * assembly and the halo lists; the sources of each set are applied as
+ * a mask instead (maskB). Called once the vertex types and values are
+ * known.
+ */
+void Strip_Sources()
+{
+  int i;
+
+  for (i = 0; i < N_vert; i++)
+    if (vert_x[i] != 0.0 && vert_x[i] != 1.0 &&
+        vert_y[i] != 0.0 && vert_y[i] != 1.0 && (vert_type[i] & TYPE_SOURCE))
+    {
+      vert_type[i] &= ~TYPE_SOURCE;
+      phi[i] = 0.0;
+    }
+}
+
+/* Alloc_Vector() of K values per vertex */
+double *Alloc_Batch_Vector(char *name)
+{
+  int i;
+  double *v;
+
+  v = Arena_Alloc(N_vert * N_sets * sizeof(double) + 1, name);
+  #pragma omp parallel for schedule(static)
+  for (i = 0; i < N_vert * N_sets; i++)
+    v[i] = 0.0;
+
+  return v;
+}
+
+/*
+ * Sets up phiB and maskB. A source (x, y, value) of input.dat goes to
+ * the vertex nearest to (x, y), on every rank that holds a copy of it.
+ */
+void Setup_Batch()
+{
+  int i, k, s, K = N_sets, ns = 0, nr = 0;
+  double d, dmin, global_dmin;
+
+  Debug("Setup_Batch", 0);
+
+  if (solver != SOLVER_CG || overlap_reduction ||
+      (preconditioner != PC_NONE && preconditioner != PC_JACOBI) ||
+      checkpoint_interval > 0 || restart)
+    Debug("Setup_Batch : source sets need solver cg, no overlap reduction, preconditioner none or jacobi and no checkpoints", 1);
+
+  phiB = Alloc_Batch_Vector("phiB");
+  maskB = Alloc_Batch_Vector("maskB");
+  for (i = 0; i < N_vert; i++)
+    for (k = 0; k < K; k++)
+    {
+      phiB[i * K + k] = phi[i];
+      maskB[i * K + k] = (vert_type[i] & TYPE_SOURCE) ? 0.0 : 1.0;
+    }
+
+  for (k = 0; k < K; k++)
+    for (s = set_first[k]; s < set_first[k + 1]; s++)
+    {
+      dmin = HUGE_VAL;
+      for (i = 0; i < N_vert; i++)
+      {
+        d = (vert_x[i] - batch_src[3 * s]) * (vert_x[i] - batch_src[3 * s]) +
+          (vert_y[i] - batch_src[3 * s + 1]) * (vert_y[i] - batch_src[3 * s + 1]);
+        if (d < dmin)
+          dmin = d;
+      }
+      MPI_Allreduce(&dmin, &global_dmin, 1, MPI_DOUBLE, MPI_MIN, grid_comm);
+      for (i = 0; i < N_vert; i++)
+      {
+        d = (vert_x[i] - batch_src[3 * s]) * (vert_x[i] - batch_src[3 * s]) +
+          (vert_y[i] - batch_src[3 * s + 1]) * (vert_y[i] - batch_src[3 * s + 1]);
+        if (d == global_dmin)
+        {
+          phiB[i * K + k] = batch_src[3 * s + 2];
+          maskB[i * K + k] = 0.0;
+        }
+      }
+    }
+
+  for (i = 0; i < N_neighb; i++)
+  {
+    ns += send_count[i];
+    nr += recv_count[i];
+  }
+  if ((batch_sbuf = malloc(ns * K * sizeof(double) + 1)) == NULL ||
+      (batch_rbuf = malloc(nr * K * sizeof(double) + 1)) == NULL)
+    Debug("Setup_Batch : malloc(batch buffers) failed", 1);
+}
+
+/*
+ * The halo of a batch vector, K values per vertex, through the packed
+ * buffers and blocking pairs in rank order; the exchange settings do not
+ * apply.
+ */
+void Exchange_Batch(double *vect)
+{
+  int i, j, k, K = N_sets;
+  double *buf;
+
+  Phase_Begin(PHASE_HALO);
+
+  for (i = 0; i < N_neighb; i++)
+  {
+    buf = batch_sbuf + send_off[i] * K;
+    for (j = 0; j < send_count[i]; j++)
+      for (k = 0; k < K; k++)
+        buf[j * K + k] = vect[send_list[i][j] * K + k];
+  }
+
+  for (i = 0; i < N_neighb; i++)
+  {
+    MPI_Sendrecv(
+      batch_sbuf + send_off[i] * K, send_count[i] * K, MPI_DOUBLE, proc_neighb[i], 0,
+      batch_rbuf + recv_off[i] * K, recv_count[i] * K, MPI_DOUBLE, proc_neighb[i], 0,
+      grid_comm, &status);
+    halo_bytes[i] += send_count[i] * K * sizeof(double);
+  }
+
+  for (i = 0; i < N_neighb; i++)
+  {
+    buf = batch_rbuf + recv_off[i] * K;
+    for (j = 0; j < recv_count[i]; j++)
+      for (k = 0; k < K; k++)
+        vect[recv_list[i][j] * K + k] = buf[j * K + k];
+  }
+
+  Phase_End();
+}
+
+/* y = A * x for K vectors, through CSR; each matrix entry is loaded once */
+void SpMV_Batch(double *restrict y, double *restrict x)
+{
+  int i, j, k, K = N_sets;
+  double a;
+
+  #pragma omp parallel for private(j, k, a) schedule(static)
+  for (i = 0; i < N_vert; i++)
+  {
+    for (k = 0; k < K; k++)
+      y[i * K + k] = 0.0;
+    for (j = csr_row[i]; j < csr_row[i + 1]; j++)
+    {
+      a = csr_val[j];
+      for (k = 0; k < K; k++)
+        y[i * K + k] += a * x[csr_col[j] * K + k];
+    }
+    for (k = 0; k < K; k++)
+      y[i * K + k] *= maskB[i * K + k];
+  }
+}
+
+/* Dot_Owned() for K vectors, sub[k] = x_k' * y_k */
+void Dot_Batch(double *x, double *y, double *sub)
+{
+  int i, k, K = N_sets;
+
+  for (k = 0; k < K; k++)
+    sub[k] = 0.0;
+  if (N_owned >= 0)
+  {
+    #pragma omp parallel for private(k) reduction(+:sub[:K]) schedule(static)
+    for (i = 0; i < N_owned; i++)
+      for (k = 0; k < K; k++)
+        sub[k] += x[i * K + k] * y[i * K + k];
+    return;
+  }
+
+  #pragma omp parallel for private(k) reduction(+:sub[:K]) schedule(static)
+  for (i = 0; i < N_vert; i++)
+    if (!(vert_type[i] & TYPE_GHOST))
+      for (k = 0; k < K; k++)
+        sub[k] += x[i * K + k] * y[i * K + k];
+}
+
+/*
+ * Solve() for all sets at once. Every reduction carries the K (or 2 K)
+ * values of the sets; a set that has converged keeps its x, r and p, so
+ * it ends as a run with only its own sources would.
+ */
+void Solve_Batch()
+{
+  int count = 0, n_active;
+  int i, k, K = N_sets;
+  int *active, *iters;
+  double *r, *p, *q, *z;
+  double *a, *b, *r1, *rz1, *rz2, *subs, *dots;
+
+  Debug("Solve_Batch", 0);
+
+  r = work[0];
+  p = work[1];
+  q = work[2];
+  z = r;
+  if (preconditioner != PC_NONE)
+    z = work[3];
+  active = work_int;
+  a = work_scalar;
+  iters = active + K;
+  b = a + K;
+  r1 = a + 2 * K;
+  rz1 = a + 3 * K;
+  rz2 = a + 4 * K;
+  subs = a + 5 * K;
+  dots = a + 7 * K;
+
+  Exchange_Batch(phiB);
+
+  /* r = b-Ax */
+  SpMV_Batch(r, phiB);
+  #pragma omp parallel for schedule(static)
+  for (i = 0; i < N_vert * K; i++)
+    r[i] = -r[i];
+
+  for (k = 0; k < K; k++)
+  {
+    r1[k] = 2 * precision_goal;
+    rz2[k] = 1;
+    active[k] = 1;
+    iters[k] = 0;
+  }
+
+  while (1)
+  {
+    n_active = 0;
+    for (k = 0; k < K; k++)
+    {
+      if (active[k] && !((count < max_iter) && (r1[k] > precision_goal)))
+      {
+        active[k] = 0;
+        iters[k] = count;
+      }
+      n_active += active[k];
+    }
+    if (n_active == 0)
+      break;
+
+    /* z = M^-1 * r, r1 = r' * r and rz1 = r' * z */
+    if (preconditioner != PC_NONE)
+    {
+      #pragma omp parallel for private(k) schedule(static)
+      for (i = 0; i < N_vert; i++)
+        for (k = 0; k < K; k++)
+          z[i * K + k] = pc_inv[i] * r[i * K + k];
+    }
+    Dot_Batch(r, r, subs);
+    Dot_Batch(r, z, subs + K);
+    Phase_Begin(PHASE_REDUCE);
+    MPI_Allreduce(subs, dots, 2 * K, MPI_DOUBLE, MPI_SUM, grid_comm);
+    Phase_End();
+    for (k = 0; k < K; k++)
+      if (active[k])
+      {
+        r1[k] = dots[k];
+        rz1[k] = dots[K + k];
+        b[k] = rz1[k] / rz2[k];
+      }
+
+    /* p = z, then p = z + b*p */
+    #pragma omp parallel for private(k) schedule(static)
+    for (i = 0; i < N_vert; i++)
+      for (k = 0; k < K; k++)
+        if (active[k])
+          p[i * K + k] = (count == 0) ? z[i * K + k] : z[i * K + k] + b[k] * p[i * K + k];
+    Exchange_Batch(p);
+
+    /* q = A * p */
+    SpMV_Batch(q, p);
+
+    /* a = r1 / (p' * q) */
+    Dot_Batch(p, q, subs);
+    Phase_Begin(PHASE_REDUCE);
+    MPI_Allreduce(subs, dots, K, MPI_DOUBLE, MPI_SUM, grid_comm);
+    Phase_End();
+    for (k = 0; k < K; k++)
+      a[k] = active[k] ? rz1[k] / dots[k] : 0.0;
+
+    /* x = x + a*p, r = r - a*q */
+    #pragma omp parallel for private(k) schedule(static)
+    for (i = 0; i < N_vert; i++)
+      for (k = 0; k < K; k++)
+        if (active[k])
+        {
+          phiB[i * K + k] += a[k] * p[i * K + k];
+          r[i * K + k] -= a[k] * q[i * K + k];
+        }
+
+    for (k = 0; k < K; k++)
+      if (active[k])
+        rz2[k] = rz1[k];
+    count++;
+  }
+
+  if (proc_rank == 0)
+  {
+    for (k = 0; k < K; k++)
+      printf("Source set %i : %i iterations\n", k, iters[k]);
+    printf("Number of iterations : %i\n", count);
+  }
+  solve_iter = count;
+}
+
+/* Write_Grid() once per set, through phi */
+void Write_Batch()
+{
+  int i, k;
+
+  for (k = 0; k < N_sets; k++)
+  {
+    for (i = 0; i < N_vert; i++)
+      phi[i] = phiB[i * N_sets + k];
+    batch_set = k;
+    Write_Grid();
+  }
+  batch_set = -1;
+}
+
+void Free_Batch()
+{
+  free(batch_sbuf);
+  free(batch_rbuf);
+}
+
+void Write_Grid()
+{
+  int i, v;
+  char filename[25];
+  FILE *f;
+
+  Debug("Write_Grid", 0);
+
+  /* batch mode writes one file (set) per source set */
+  if (N_sets > 0 && batch_set < 0)
+  {
+    Write_Batch();
+    return;
+  }
+
+  if (output_format == OUTPUT_BINARY)
+  {
+    Write_Grid_Binary();
+    return;
+  }
+
+  if (batch_set >= 0)
+    sprintf(filename, "output%i-%i_%i.dat", P, proc_rank, batch_set);
+  else
+    sprintf(filename, "output%i-%i.dat", P, proc_rank);
+  if ((f = fopen(filename, "w")) == NULL)
+    Debug("Write_Grid : Can't open data outputfile", 1);
+
+  /* in the order of the input, also when renumbered */
+  for (i = 0; i < N_vert; i++)
+  {
+    v = vert_new ? vert_new[i] : i;
+    if (!(vert_type[v] & TYPE_GHOST))
+      fprintf(f, "%f %f %f\n", vert_x[v], vert_y[v], phi[v]);
+  }
+
+  fclose(f);
+}
+
+/*
+ * Writes all owned vertices to output<P>.bin: the 8 characters
+ * "FEMOUT1", 0-terminated, the number of records and a placement flag
+ * as ints, then one record of doubles (x, y, phi) per vertex. With
+ * binary input the record of a vertex is at its global id (flag 1);
+ * the text input has no global ids, so the records are then stored
+ * rank after rank (flag 0). One collective write in both cases.
+ */
+void Write_Grid_Binary()
+{
+  int i, v, n = 0, head[2];
+  int *disp;
+  double *buf;
+  char filename[25];
+  MPI_Offset start = 0;
+  long long mine, before = 0, total;
+  MPI_Datatype record, filetype;
+  MPI_File fh;
+
+  Debug("Write_Grid_Binary", 0);
+
+  if ((buf = malloc(3 * N_vert * sizeof(double) + 1)) == NULL)
+    Debug("Write_Grid_Binary : malloc(buf) failed", 1);
+  if ((disp = malloc(N_vert * sizeof(int) + 1)) == NULL)
+    Debug("Write_Grid_Binary : malloc(disp) failed", 1);
+  for (i = 0; i < N_vert; i++)
+  {
+    v = vert_new ? vert_new[i] : i;
+    if (!(vert_type[v] & TYPE_GHOST))
+    {
+      buf[3 * n] = vert_x[v];
+      buf[3 * n + 1] = vert_y[v];
+      buf[3 * n + 2] = phi[v];
+      if (vert_gid)
+        disp[n] = vert_gid[v];
+      n++;
+    }
+  }
+
+  mine = n;
+  MPI_Exscan(&mine, &before, 1, MPI_LONG_LONG, MPI_SUM, grid_comm);
+  if (proc_rank == 0)
+    before = 0;
+  MPI_Allreduce(&mine, &total, 1, MPI_LONG_LONG, MPI_SUM, grid_comm);
+
+  if (batch_set >= 0)
+    sprintf(filename, "output%i_%i.bin", P, batch_set);
+  else
+    sprintf(filename, "output%i.bin", P);
+  if (MPI_File_open(grid_comm, filename, MPI_MODE_WRONLY | MPI_MODE_CREATE,
+                    MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+    Debug("Write_Grid_Binary : MPI_File_open failed", 1);
+  MPI_File_set_size(fh, 0);
+
+  if (proc_rank == 0)
+  {
+    head[0] = vert_gid ? N_global : (int) total;
+    head[1] = vert_gid ? 1 : 0;
+    MPI_File_write_at(fh, 0, "FEMOUT1", 8, MPI_CHAR, &status);
+    MPI_File_write_at(fh, 8, head, 2, MPI_INT, &status);
+  }
+
+  MPI_Type_contiguous(3, MPI_DOUBLE, &record);
+  MPI_Type_commit(&record);
+  if (vert_gid)
+    MPI_Type_create_indexed_block(n, 1, disp, record, &filetype);
+  else
+  {
+    start = before;
+    MPI_Type_contiguous(1, record, &filetype);
+  }
+  MPI_Type_commit(&filetype);
+
+  MPI_File_set_view(fh, 8 + 2 * sizeof(int), record, filetype, "native",
+                    MPI_INFO_NULL);
+  MPI_File_write_at_all(fh, start, buf, n, record, &status);
+  MPI_File_close(&fh);
+
+  MPI_Type_free(&filetype);
+  MPI_Type_free(&record);
+  free(disp);
+  free(buf);
+}
+
+/*
+ * checkpoint<P>.bin starts with the 8 characters "FEMCKP1", 0-terminated,
+ * N_CKPT_INTS ints (P, solver, preconditioner, overlap reduction, renumber
+ * halo, number of vectors, total number of vertices, the iteration count
+ * and reorder) and N_CKPT_SCALARS doubles of the solver. The vectors follow
+ * rank after rank, each rank's vectors one after the other, ghosts
+ * included, so a restart needs the same partition and settings.
+ */
+MPI_Offset Checkpoint_Header_Size()
+{
+  return 8 + N_CKPT_INTS * sizeof(int) + N_CKPT_SCALARS * sizeof(double);
+}
+
+/* ckpt_offset and ckpt_total for nv vectors per rank */
+void Checkpoint_Layout(int nv)
+{
+  long long mine = (long long) nv * N_vert, before = 0;
+
+  MPI_Exscan(&mine, &before, 1, MPI_LONG_LONG, MPI_SUM, grid_comm);
+  if (proc_rank == 0)
+    before = 0;
+  ckpt_offset = Checkpoint_Header_Size() + before * sizeof(double);
+  MPI_Allreduce(&N_vert, &ckpt_total, 1, MPI_INT, MPI_SUM, grid_comm);
+}
+
+/*
+ * Called after every iteration: lets a running checkpoint progress and
+ * starts the next one every checkpoint_interval iterations.
+ */
+void Checkpoint(int count, double **vect, int nv, double *scalar)
+{
+  int done;
+
+  if (ckpt_req != MPI_REQUEST_NULL)
+    MPI_Test(&ckpt_req, &done, MPI_STATUS_IGNORE);
+  if (checkpoint_interval > 0 && count - ckpt_last >= checkpoint_interval)
+  {
+    ckpt_last = count;
+    Write_Checkpoint(count, vect, nv, scalar);
+  }
+}
+
+/*
+ * Copies the vectors into ckpt_buf, rank 0 puts the header in front, and
+ * starts one nonblocking collective write to checkpoint<P>.tmp, the
+ * iterations continue meanwhile. The previous checkpoint is completed
+ * first, so at most one is in flight.
+ */
+void Write_Checkpoint(int count, double **vect, int nv, double *scalar)
+{
+  int k, head[N_CKPT_INTS];
+  MPI_Offset start, size = nv * N_vert * sizeof(double);
+  char *data;
+  char filename[25];
+
+  Debug("Write_Checkpoint", 0);
+
+  Finish_Checkpoint();
+  Phase_Begin(PHASE_OUTPUT);
+
+  if (ckpt_buf == NULL)
+    Checkpoint_Layout(nv);
+  start = ckpt_offset;
+  if (proc_rank == 0)
+  {
+    start = 0;
+    size += Checkpoint_Header_Size();
+  }
+  if (ckpt_buf == NULL && (ckpt_buf = malloc(size + 1)) == NULL)
+    Debug("Write_Checkpoint : malloc(ckpt_buf) failed", 1);
+
+  data = ckpt_buf;
+  if (proc_rank == 0)
+  {
+    head[0] = P;
+    head[1] = solver;
+    head[2] = preconditioner;
+    head[3] = overlap_reduction;
+    head[4] = renumber_halo;
+    head[5] = nv;
+    head[6] = ckpt_total;
+    head[7] = count;
+    head[8] = reorder;
+    memcpy(data, "FEMCKP1", 8);
+    memcpy(data + 8, head, sizeof(head));
+    memcpy(data + 8 + sizeof(head), scalar, N_CKPT_SCALARS * sizeof(double));
+    data += Checkpoint_Header_Size();
+  }
+  for (k = 0; k < nv; k++)
+    memcpy(data + k * N_vert * sizeof(double), vect[k], N_vert * sizeof(double));
+
+  sprintf(filename, "checkpoint%i.tmp", P);
+  if (MPI_File_open(grid_comm, filename, MPI_MODE_WRONLY | MPI_MODE_CREATE,
+                    MPI_INFO_NULL, &ckpt_fh) != MPI_SUCCESS)
+    Debug("Write_Checkpoint : MPI_File_open failed", 1);
+  MPI_File_set_size(ckpt_fh, 0);
+  MPI_File_iwrite_at_all(ckpt_fh, start, ckpt_buf, size, MPI_BYTE, &ckpt_req);
+  ckpt_open = 1;
+
+  Phase_End();
+}
+
+/*
+ * Waits for the running checkpoint and, once every rank has closed it,
+ * replaces checkpoint<P>.bin by it. An aborted run therefore always
+ * leaves the last complete checkpoint behind.
+ */
+void Finish_Checkpoint()
+{
+  char tmpname[25], filename[25];
+
+  if (!ckpt_open)
+    return;
+
+  Phase_Begin(PHASE_OUTPUT);
+  MPI_Wait(&ckpt_req, MPI_STATUS_IGNORE);
+  MPI_File_close(&ckpt_fh);
+  ckpt_open = 0;
+  MPI_Barrier(grid_comm);
+  sprintf(tmpname, "checkpoint%i.tmp", P);
+  sprintf(filename, "checkpoint%i.bin", P);
+  if (proc_rank == 0 && rename(tmpname, filename) != 0)
+    Debug("Finish_Checkpoint : rename failed", 1);
+  Phase_End();
+}
+
+/* restores nv vectors and the scalars of checkpoint<P>.bin, returns the iteration count */
+int Read_Checkpoint(double **vect, int nv, double *scalar)
+{
+  int k, ok = 0, head[N_CKPT_INTS];
+  char magic[8];
+  double *buf;
+  char filename[25];
+  MPI_File fh;
+
+  Debug("Read_Checkpoint", 0);
+
+  sprintf(filename, "checkpoint%i.bin", P);
+  if (MPI_File_open(grid_comm, filename, MPI_MODE_RDONLY, MPI_INFO_NULL,
+                    &fh) != MPI_SUCCESS)
+    Debug("Read_Checkpoint : Can't open checkpoint file", 1);
+
+  if (proc_rank == 0)
+  {
+    MPI_File_read_at(fh, 0, magic, 8, MPI_CHAR, &status);
+    MPI_File_read_at(fh, 8, head, N_CKPT_INTS, MPI_INT, &status);
+    MPI_File_read_at(fh, 8 + sizeof(head), scalar, N_CKPT_SCALARS,
+                     MPI_DOUBLE, &status);
+    ok = memcmp(magic, "FEMCKP1", 8) == 0;
+  }
+  MPI_Bcast(&ok, 1, MPI_INT, 0, grid_comm);
+  if (!ok)
+    Debug("Read_Checkpoint : checkpoint file has an unknown layout", 1);
+  MPI_Bcast(head, N_CKPT_INTS, MPI_INT, 0, grid_comm);
+  MPI_Bcast(scalar, N_CKPT_SCALARS, MPI_DOUBLE, 0, grid_comm);
+
+  Checkpoint_Layout(nv);
+  if (head[0] != P || head[1] != solver || head[2] != preconditioner ||
+      head[3] != overlap_reduction || head[4] != renumber_halo ||
+      head[5] != nv || head[6] != ckpt_total || head[8] != reorder)
+    Debug("Read_Checkpoint : checkpoint is of another partition or solver", 1);
+
+  if ((buf = malloc(nv * N_vert * sizeof(double) + 1)) == NULL)
+    Debug("Read_Checkpoint : malloc(buf) failed", 1);
+  MPI_File_read_at_all(fh, ckpt_offset, buf, nv * N_vert, MPI_DOUBLE, &status);
+  MPI_File_close(&fh);
+  for (k = 0; k < nv; k++)
+    memcpy(vect[k], buf + k * N_vert, N_vert * sizeof(double));
+  free(buf);
+
+  ckpt_last = head[7];
+  if (proc_rank == 0)
+    printf("Restarted from %s at iteration %i\n", filename, head[7]);
+
+  return head[7];
+}
+
+void Clean_Up()
+{
+  int i;
+
+  Debug("Clean_Up", 0);
+
+  Free_Halo_Requests();
+  if (exchange == EXCHANGE_NEIGHBOR)
+  {
+    free(nb_index);
+    free(nb_scounts);
+    free(nb_rcounts);
+    free(nb_sdispls);
+    free(nb_rdispls);
+    free(nb_stypes);
+    free(nb_rtypes);
+    free(nb_buf);
+  }
+
+  if (N_neighb>0)
+  {
+    for (i = 0; i < N_neighb; i++)
+    {
+      MPI_Type_free(&send_type[i]);
+      MPI_Type_free(&recv_type[i]);
+      free(send_list[i]);
+      free(recv_list[i]);
+    }
+    free(recv_type);
+    free(send_type);
+    free(proc_neighb);
+    free(send_list);
+    free(recv_list);
+    free(send_count);
+    free(recv_count);
+    free(send_first);
+    free(recv_first);
+    free(send_off);
+    free(recv_off);
+  }
+  free(halo_sbuf);
+  free(halo_rbuf);
+  free(halo_bytes);
+  free(ckpt_buf);
+  free(batch_src);
+  free(set_first);
+  if (N_sets > 0)
+    Free_Batch();
+
+  /* the grid and the matrix too, see Pack_Grid() */
+  Arena_Free();
+#ifdef USE_GPU
+  if (backend == BACKEND_GPU)
+    Free_GPU();
+#endif
+  MPI_Comm_free(&grid_comm);
+}
+
+/* everything the solves share: grid, matrix, halos and work vectors */
+void Setup_Solver()
+{
+  Setup_Grid();
+
+  Setup_Exchange();
+
+  Setup_Work();
+
+#ifdef USE_GPU
+  if (backend == BACKEND_GPU)
+    Setup_GPU();
+#else
+  if (backend == BACKEND_GPU)
+    Debug("Setup_Solver : backend gpu needs a build with -DUSE_GPU", 1);
+#endif
+
+  Benchmark_Halo();
+
+  if (N_sets > 0)
+    Setup_Batch();
+}
+
+/*
+ * One solve, starting from the current phi; the library interface of
+ * fempois.h solves this way as often as its caller likes. Returns the
+ * number of iterations.
+ */
+int Run_Solver()
+{
+  if (N_sets > 0)
+    Solve_Batch();
+#ifdef USE_GPU
+  else if (backend == BACKEND_GPU)
+    Solve_GPU();
+#endif
+  else if (solver == SOLVER_PIPELINED)
+    Solve_Pipelined();
+  else
+    Solve();
+  restart = 0;		/* only the first solve continues the checkpoint */
+
+  return solve_iter;
+}
+
+size_t State_Size()
+{
+  int k;
+  size_t n = 0;
+
+  for (k = 0; k < N_STATE; k++)
+    n += solver_state[k].size;
+  return n;
+}
+
+/* makes the state of s current */
+void Use_Solver(Fempois_Solver *s)
+{
+  int k;
+  char *p = s->state;
+
+  for (k = 0; k < N_STATE; k++)
+  {
+    memcpy(solver_state[k].addr, p, solver_state[k].size);
+    p += solver_state[k].size;
+  }
+}
+
+/* stores the current state in s */
+void Save_Solver(Fempois_Solver *s)
+{
+  int k;
+  char *p = s->state;
+
+  for (k = 0; k < N_STATE; k++)
+  {
+    memcpy(p, solver_state[k].addr, solver_state[k].size);
+    p += solver_state[k].size;
+  }
+}
+
+/* the library interface, see fempois.h */
+Fempois_Solver *Fempois_Create(MPI_Comm comm, const char *settings)
+{
+  Fempois_Solver *s, defaults;
+
+  if ((s = malloc(sizeof(*s))) == NULL ||
+      (s->state = malloc(State_Size())) == NULL)
+    Debug("Fempois_Create : malloc(s) failed", 1);
+  if (state_defaults == NULL)
+  {
+    if ((state_defaults = malloc(State_Size())) == NULL)
+      Debug("Fempois_Create : malloc(state_defaults) failed", 1);
+    defaults.state = state_defaults;
+    Save_Solver(&defaults);
+  }
+  memcpy(s->state, state_defaults, State_Size());
+  Use_Solver(s);
+
+  solver_comm = comm;
+  settings_file = settings;
+  Read_Settings();
+  if (N_sets > 0)
+    Debug("Fempois_Create : sources in the settings need the program, not the library", 1);
+  Setup_Proc_Grid();
+  Setup_Solver();
+  settings_file = NULL;		/* only read during the setup */
+
+  Save_Solver(s);
+  return s;
+}
+
+int Fempois_Solve(Fempois_Solver *s)
+{
+  int n;
+
+  Use_Solver(s);
+  n = Run_Solver();
+  Save_Solver(s);
+  return n;
+}
+
+double *Fempois_Phi(Fempois_Solver *s, int *n_vert)
+{
+  Use_Solver(s);
+  *n_vert = N_vert;
+  return phi;
+}
+
+void Fempois_Vertices(Fempois_Solver *s, const double **x, const double **y,
+                      const int **type)
+{
+  Use_Solver(s);
+  *x = vert_x;
+  *y = vert_y;
+  *type = vert_type;
+}
+
+void Fempois_Write(Fempois_Solver *s)
+{
+  Use_Solver(s);
+  Write_Grid();
+  Save_Solver(s);
+}
+
+void Fempois_Destroy(Fempois_Solver *s)
+{
+  Use_Solver(s);
+  Clean_Up();
+  free(s->state);
+  free(s);
+}
+
+#ifndef LIBRARY
+int main(int argc, char **argv)
+{
+  int provided;
+
+  /* OpenMP threads compute, only the master thread communicates */
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+  if (provided < MPI_THREAD_FUNNELED)
+  {
+    printf("MPI does not provide MPI_THREAD_FUNNELED\n");
+    MPI_Abort(solver_comm, 1);
+  }
+
+  restart = (argc > 1 && strcmp(argv[1], "--restart") == 0);
+
+  start_timer();
+
+  Read_Settings();
+
+  Setup_Proc_Grid();
+#ifdef _OPENMP
+  if (proc_rank == 0)
+    printf("(%i) %i OpenMP threads per process\n", proc_rank, omp_get_max_threads());
+#endif
+
+  Setup_Solver();
+
+  Phase_Begin(PHASE_COMPUTE);
+  Run_Solver();
+  Phase_End();
+
+  Phase_Begin(PHASE_OUTPUT);
+  Write_Grid();
+  Phase_End();
+
+  Print_Profile();
 
   Clean_Up();
 
@@ -611,3 +4051,4 @@ int main(int argc, char **argv)
 
   return 0;
 }
+#endif
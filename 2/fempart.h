@@ -0,0 +1,39 @@
+/*
+ * fempart.h
+ * Binary partition file written by GridDist and read by MPI_Fempois
+ *
+ * input<P>.bin holds all P partitions:
+ *   char      magic[8]        "FEMPART2"
+ *   int       N_proc, N_global   processes, vertices of the whole grid
+ *   long long offset[N_proc]  start of the block of each rank
+ * and per rank, at its offset, a block of
+ *   PartHeader                N_vert, N_elm, N_neighb, N_halo
+ *   double    x[N_vert], y[N_vert], val[N_vert]
+ *   int       type[N_vert]
+ *   int       gid[N_vert]      global vertex id, increasing
+ *   int       elm[3 * N_elm]
+ *   int       neighb[3 * N_neighb]   rank, #from, #to
+ *   int       halo[N_halo]           from list, to list, per neighbour
+ * padded to a multiple of 8 bytes. Local vertex and element ids are the
+ * array indices. All values are native endian, so every array can be
+ * read or mapped in place.
+ */
+
+#define PART_MAGIC "FEMPART2"
+#define PART_TABLE 16		/* bytes before the offset table */
+
+typedef struct
+{
+  int N_vert, N_elm, N_neighb, N_halo;
+}
+PartHeader;
+
+/* size in bytes of the block described by h, header included */
+static long long Part_Bytes(PartHeader *h)
+{
+  long long n = sizeof(PartHeader)
+    + (long long) h->N_vert * (3 * sizeof(double) + 2 * sizeof(int))
+    + (long long) (3 * h->N_elm + 3 * h->N_neighb + h->N_halo) * sizeof(int);
+
+  return (n + 7) & ~7LL;
+}
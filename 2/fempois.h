@@ -0,0 +1,36 @@
+/*
+ * fempois.h
+ * The library interface of MPI_Fempois.c, built with -DLIBRARY into
+ * libfempois.a. A solver is set up once from a settings file in the
+ * format of input.dat and then solves as often as the caller needs, each
+ * solve starting from the last solution; nothing is allocated after
+ * Fempois_Create(). The partition files (input<P>-<rank>.dat or
+ * input<P>.bin) and mapping<P>.dat are read from the working directory,
+ * "input format: generate" needs neither. The sources are the ones of
+ * the grid: "source:" lines of the settings (batch mode) are only for the
+ * program. MPI must be initialised with at least
+ * MPI_THREAD_FUNNELED. Every call is collective over the communicator of
+ * the solver. Several solvers may exist at once, one call at a time.
+ *
+ * The vertices of a process are flat arrays of n_vert values, in the
+ * order of the solver (renumbered or reordered as set up). The vertices
+ * whose type has TYPE_GHOST set belong to another process; the ones with
+ * TYPE_SOURCE keep their value of phi, the caller may change it between
+ * solves.
+ */
+
+#include "mpi.h"
+
+#define TYPE_GHOST 1
+#define TYPE_SOURCE 2
+
+typedef struct Fempois_Solver Fempois_Solver;
+
+/* the processes of comm; settings is only read by Fempois_Create() */
+Fempois_Solver *Fempois_Create(MPI_Comm comm, const char *settings);
+int Fempois_Solve(Fempois_Solver *s);		/* returns the number of iterations */
+double *Fempois_Phi(Fempois_Solver *s, int *n_vert);
+void Fempois_Vertices(Fempois_Solver *s, const double **x, const double **y,
+                      const int **type);	/* in the order of Fempois_Phi */
+void Fempois_Write(Fempois_Solver *s);		/* output files as written by the program */
+void Fempois_Destroy(Fempois_Solver *s);
@@ -0,0 +1,331 @@
+// fempois_gpu.cu
+// CUDA backend of MPI_Fempois, see fempois_gpu.h and Solve_GPU(). The
+// matrix and all CG vectors stay in device memory for the whole solve;
+// per iteration only the block sums of the dot products and, through a
+// CUDA-aware MPI, the packed halos leave the device.
+//
+// The reductions follow FindNormW/ComputeLamda of 3/power_gpu.cu: every
+// thread sums its part, the block reduces in shared memory and thread 0
+// stores the result. Instead of the atomicAdd, which has no double version
+// before compute capability 6.0 (the TitanX of the jobs), each block
+// writes its own sum to d_Part and the host adds the few block sums, in
+// a fixed order, so a run repeats exactly.
+////////////////////////////////////////////
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "cuda.h"
+#include "fempois_gpu.h"
+
+
+const int THREADS = 256;      // threads per block, a power of 2 for the reductions
+const int MAX_BLOCKS = 256;   // blocks of the reductions, the loops stride over the rest
+
+// Reduction Variables
+double* d_Part = NULL;        // block sums, two per block
+double* h_Part = NULL;        // host copy of d_Part
+
+
+// Functions
+int Blocks(int);
+double SumParts(int, int, double*);
+void checkCardVersion(void);
+
+// Kernels
+__device__ void BlockSum(double* sdata, double* g_Part);
+__global__ void SpMV_Dot(double* g_VecY, const double* g_VecX, const int* g_Row, const int* g_Col, const double* g_Val, double* g_Part, int N);
+__global__ void Dots(const double* g_VecR, const double* g_VecZ, double* g_Part, int N);
+__global__ void Jacobi(double* g_VecZ, const double* g_Diag, const double* g_VecR, int N);
+__global__ void Scale(double* g_VecX, double s, int N);
+__global__ void Axpy(double* g_VecY, const double* g_VecX, double a, int N);
+__global__ void Xpay(double* g_VecY, const double* g_VecX, double b, int N);
+__global__ void Update_CG(double a, double* g_VecX, const double* g_VecP, const double* g_VecQ, double* g_VecR, double* g_VecZ, const double* g_Diag, double* g_Part, int N);
+__global__ void Gather(double* g_Buf, const double* g_VecX, const int* g_List, int N);
+__global__ void Scatter(double* g_VecX, const double* g_Buf, const int* g_List, int N);
+
+
+// tree reduction of sdata[0 .. blockDim.x) as in FindNormW, the sum of
+// the block goes to g_Part[blockIdx.x]
+__device__ void BlockSum(double* sdata, double* g_Part)
+{
+  unsigned int tid = threadIdx.x;
+
+  __syncthreads();
+  for (unsigned int s=blockDim.x / 2; s > 0; s = s >> 1) {
+     if (tid < s) {
+         sdata[tid] = sdata[tid] + sdata[tid+ s];
+     }
+     __syncthreads();
+  }
+  if (tid == 0) g_Part[blockIdx.x] = sdata[0];
+}
+
+// y = A * x with A in CSR, one row per thread, and the block sums of
+// x' * y; the ghost and source rows are empty, so no test for ownership
+__global__ void SpMV_Dot(double* g_VecY, const double* g_VecX, const int* g_Row, const int* g_Col, const double* g_Val, double* g_Part, int N)
+{
+  // shared memory size declared at kernel launch
+  extern __shared__ double sdata[];
+  double sum, sub = 0;
+
+  for (int i = blockIdx.x*blockDim.x + threadIdx.x; i < N; i += gridDim.x*blockDim.x) {
+     sum = 0;
+     for (int j = g_Row[i]; j < g_Row[i+1]; j++)
+         sum += g_Val[j] * g_VecX[g_Col[j]];
+     g_VecY[i] = sum;
+     sub += g_VecX[i] * sum;
+  }
+  sdata[threadIdx.x] = sub;
+  BlockSum(sdata, g_Part);
+}
+
+// block sums of r' * r and r' * z, r is zero on the ghosts
+__global__ void Dots(const double* g_VecR, const double* g_VecZ, double* g_Part, int N)
+{
+  extern __shared__ double sdata[];
+  double rr = 0, rz = 0;
+
+  for (int i = blockIdx.x*blockDim.x + threadIdx.x; i < N; i += gridDim.x*blockDim.x) {
+     rr += g_VecR[i] * g_VecR[i];
+     rz += g_VecR[i] * g_VecZ[i];
+  }
+  sdata[threadIdx.x] = rr;
+  sdata[blockDim.x + threadIdx.x] = rz;
+  BlockSum(sdata, g_Part);
+  BlockSum(sdata + blockDim.x, g_Part + gridDim.x);
+}
+
+// z = M^-1 * r for the diagonal M
+__global__ void Jacobi(double* g_VecZ, const double* g_Diag, const double* g_VecR, int N)
+{
+  for (int i = blockIdx.x*blockDim.x + threadIdx.x; i < N; i += gridDim.x*blockDim.x)
+     g_VecZ[i] = g_Diag[i] * g_VecR[i];
+}
+
+__global__ void Scale(double* g_VecX, double s, int N)
+{
+  for (int i = blockIdx.x*blockDim.x + threadIdx.x; i < N; i += gridDim.x*blockDim.x)
+     g_VecX[i] *= s;
+}
+
+// y = y + a*x
+__global__ void Axpy(double* g_VecY, const double* g_VecX, double a, int N)
+{
+  for (int i = blockIdx.x*blockDim.x + threadIdx.x; i < N; i += gridDim.x*blockDim.x)
+     g_VecY[i] += a * g_VecX[i];
+}
+
+// y = x + b*y
+__global__ void Xpay(double* g_VecY, const double* g_VecX, double b, int N)
+{
+  for (int i = blockIdx.x*blockDim.x + threadIdx.x; i < N; i += gridDim.x*blockDim.x)
+     g_VecY[i] = g_VecX[i] + b * g_VecY[i];
+}
+
+// Update_CG() of MPI_Fempois: x = x + a*p (if x), r = r - a*q,
+// z = d * r (if d) and the block sums of r' * r and r' * z
+__global__ void Update_CG(double a, double* g_VecX, const double* g_VecP, const double* g_VecQ, double* g_VecR, double* g_VecZ, const double* g_Diag, double* g_Part, int N)
+{
+  extern __shared__ double sdata[];
+  double r, z, rr = 0, rz = 0;
+
+  for (int i = blockIdx.x*blockDim.x + threadIdx.x; i < N; i += gridDim.x*blockDim.x) {
+     if (g_VecX)
+         g_VecX[i] += a * g_VecP[i];
+     r = g_VecR[i] - a * g_VecQ[i];
+     g_VecR[i] = r;
+     z = r;
+     if (g_Diag) {
+         z = g_Diag[i] * r;
+         g_VecZ[i] = z;
+     }
+     rr += r * r;
+     rz += r * z;
+  }
+  sdata[threadIdx.x] = rr;
+  sdata[blockDim.x + threadIdx.x] = rz;
+  BlockSum(sdata, g_Part);
+  BlockSum(sdata + blockDim.x, g_Part + gridDim.x);
+}
+
+// buf[k] = x[list[k]], the halo to send
+__global__ void Gather(double* g_Buf, const double* g_VecX, const int* g_List, int N)
+{
+  for (int k = blockIdx.x*blockDim.x + threadIdx.x; k < N; k += gridDim.x*blockDim.x)
+     g_Buf[k] = g_VecX[g_List[k]];
+}
+
+// x[list[k]] = buf[k], the halo received
+__global__ void Scatter(double* g_VecX, const double* g_Buf, const int* g_List, int N)
+{
+  for (int k = blockIdx.x*blockDim.x + threadIdx.x; k < N; k += gridDim.x*blockDim.x)
+     g_VecX[g_List[k]] = g_Buf[k];
+}
+
+
+// blocks for n elements, the grid-stride loops take any excess
+int Blocks(int n)
+{
+  int blocks = (n + THREADS - 1) / THREADS;
+
+  if (blocks > MAX_BLOCKS)
+    blocks = MAX_BLOCKS;
+  return blocks > 0 ? blocks : 1;
+}
+
+// copies the block sums of nsum reductions back and adds them up
+double SumParts(int blocks, int nsum, double* sub)
+{
+  cudaMemcpy(h_Part, d_Part, nsum * blocks * sizeof(double), cudaMemcpyDeviceToHost);
+  for (int k = 0; k < nsum; k++) {
+    sub[k] = 0;
+    for (int b = 0; b < blocks; b++)
+      sub[k] += h_Part[k * blocks + b];
+  }
+  return sub[0];
+}
+
+void checkCardVersion()
+{
+   cudaDeviceProp prop;
+   int device;
+
+   cudaGetDevice(&device);
+   cudaGetDeviceProperties(&prop, device);
+
+   if(prop.major < 2)
+   {
+      fprintf(stderr,"Need compute capability 2 or higher.\n");
+      exit(1);
+   }
+}
+
+
+// one device per rank, the ranks of a node take turns
+extern "C" void Gpu_Init(int rank)
+{
+  int ndev = 0;
+
+  if (cudaGetDeviceCount(&ndev) != cudaSuccess || ndev == 0)
+  {
+    fprintf(stderr, "(%i) Gpu_Init : no CUDA device\n", rank);
+    exit(1);
+  }
+  cudaSetDevice(rank % ndev);
+  checkCardVersion();
+
+  d_Part = (double*) Gpu_Alloc(2 * MAX_BLOCKS * sizeof(double));
+  if ((h_Part = (double*) malloc(2 * MAX_BLOCKS * sizeof(double))) == NULL)
+  {
+    fprintf(stderr, "(%i) Gpu_Init : malloc(h_Part) failed\n", rank);
+    exit(1);
+  }
+}
+
+extern "C" void *Gpu_Alloc(size_t bytes)
+{
+  void* d = NULL;
+
+  if (cudaMalloc(&d, bytes > 0 ? bytes : 1) != cudaSuccess)
+  {
+    fprintf(stderr, "Gpu_Alloc : cudaMalloc of %lu bytes failed\n", (unsigned long) bytes);
+    exit(1);
+  }
+  cudaMemset(d, 0, bytes);
+  return d;
+}
+
+extern "C" void Gpu_Free(void *d)
+{
+  cudaFree(d);
+}
+
+extern "C" void Gpu_Upload(void *d, const void *h, size_t bytes)
+{
+  cudaMemcpy(d, h, bytes, cudaMemcpyHostToDevice);
+}
+
+extern "C" void Gpu_Download(void *h, const void *d, size_t bytes)
+{
+  cudaMemcpy(h, d, bytes, cudaMemcpyDeviceToHost);
+}
+
+extern "C" void Gpu_Copy(void *d, const void *s, size_t bytes)
+{
+  cudaMemcpy(d, s, bytes, cudaMemcpyDeviceToDevice);
+}
+
+// the kernels run asynchronously, MPI may only touch their output after this
+extern "C" void Gpu_Sync()
+{
+  cudaDeviceSynchronize();
+}
+
+extern "C" void Gpu_Release()
+{
+  cudaFree(d_Part);
+  free(h_Part);
+  d_Part = NULL;
+  h_Part = NULL;
+}
+
+extern "C" double Gpu_SpMV_Dot(double *y, const double *x, const int *row,
+  const int *col, const double *val, int n)
+{
+  int blocks = Blocks(n);
+  double sub;
+
+  SpMV_Dot<<<blocks, THREADS, THREADS * sizeof(double)>>>(y, x, row, col, val, d_Part, n);
+  return SumParts(blocks, 1, &sub);
+}
+
+extern "C" void Gpu_Dots(const double *r, const double *z, int n, double *sub)
+{
+  int blocks = Blocks(n);
+
+  Dots<<<blocks, THREADS, 2 * THREADS * sizeof(double)>>>(r, z, d_Part, n);
+  SumParts(blocks, 2, sub);
+}
+
+extern "C" void Gpu_Jacobi(double *z, const double *d, const double *r, int n)
+{
+  Jacobi<<<Blocks(n), THREADS>>>(z, d, r, n);
+}
+
+extern "C" void Gpu_Scale(double *x, double s, int n)
+{
+  Scale<<<Blocks(n), THREADS>>>(x, s, n);
+}
+
+extern "C" void Gpu_Axpy(double *y, const double *x, double a, int n)
+{
+  Axpy<<<Blocks(n), THREADS>>>(y, x, a, n);
+}
+
+extern "C" void Gpu_Xpay(double *y, const double *x, double b, int n)
+{
+  Xpay<<<Blocks(n), THREADS>>>(y, x, b, n);
+}
+
+// x may be NULL (no update of x), d NULL for z = r
+extern "C" void Gpu_Update_CG(double a, double *x, const double *p, const double *q,
+  double *r, double *z, const double *d, int n, double *sub)
+{
+  int blocks = Blocks(n);
+
+  Update_CG<<<blocks, THREADS, 2 * THREADS * sizeof(double)>>>(a, x, p, q, r, z, d, d_Part, n);
+  SumParts(blocks, 2, sub);
+}
+
+extern "C" void Gpu_Gather(double *buf, const double *x, const int *list, int n)
+{
+  if (n > 0)
+    Gather<<<Blocks(n), THREADS>>>(buf, x, list, n);
+}
+
+extern "C" void Gpu_Scatter(double *x, const double *buf, const int *list, int n)
+{
+  if (n > 0)
+    Scatter<<<Blocks(n), THREADS>>>(x, buf, list, n);
+}
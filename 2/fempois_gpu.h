@@ -0,0 +1,36 @@
+/*
+ * fempois_gpu.h
+ * The CUDA backend of MPI_Fempois ("backend: gpu", built with -DUSE_GPU),
+ * implemented in fempois_gpu.cu. Vectors are device pointers to n
+ * doubles in the vertex order of MPI_Fempois; the reductions return the
+ * local sums on the host, the global reduction stays with the caller.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void Gpu_Init(int rank);
+void *Gpu_Alloc(size_t bytes);		/* zeroed device memory */
+void Gpu_Free(void *d);
+void Gpu_Upload(void *d, const void *h, size_t bytes);
+void Gpu_Download(void *h, const void *d, size_t bytes);
+void Gpu_Copy(void *d, const void *s, size_t bytes);
+void Gpu_Sync();
+void Gpu_Release();
+
+double Gpu_SpMV_Dot(double *y, const double *x, const int *row,
+  const int *col, const double *val, int n);
+void Gpu_Dots(const double *r, const double *z, int n, double *sub);
+void Gpu_Jacobi(double *z, const double *d, const double *r, int n);
+void Gpu_Scale(double *x, double s, int n);
+void Gpu_Axpy(double *y, const double *x, double a, int n);
+void Gpu_Xpay(double *y, const double *x, double b, int n);
+void Gpu_Update_CG(double a, double *x, const double *p, const double *q,
+  double *r, double *z, const double *d, int n, double *sub);
+void Gpu_Gather(double *buf, const double *x, const int *list, int n);
+void Gpu_Scatter(double *x, const double *buf, const int *list, int n);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,724 @@
+/***
+ * Graph partitioning of the grid for the 'graph' mode of GridDist.
+ * The vertex graph is taken from gridpoint.neighbour[6] and split into
+ * P parts by a multilevel k-way scheme: heavy edge matching coarsens
+ * the graph, the coarsest graph is split by recursive graph growing,
+ * and a greedy boundary refinement is applied on every level while the
+ * parts are projected back. Compiled with -DUSE_METIS the split is done
+ * by METIS_PartGraphKway instead. Every vertex gets weight 1, as each
+ * owned vertex costs one matrix row. Included by GridDist.c after
+ * grid.c and partition.c.
+ ***/
+
+#define PART_IMBALANCE 1.03	/* allowed heaviest part / average part */
+#define COARSEN_TO 50		/* coarsest graph : vertices per part */
+#define MAX_LEVELS 64
+#define REFINE_PASSES 8
+#define GROW_TRIES 8		/* initial regions tried per bisection */
+
+typedef struct
+{
+  int n;			/* number of vertices */
+  int *xadj, *adj;		/* adjacency lists, CSR */
+  int *adjw;			/* edge weights */
+  int *vw;			/* vertex weights */
+  int *cmap;			/* vertex in the next coarser graph */
+}
+Graph;
+
+Graph vgraph;			/* vertex graph of the grid */
+int *vert_part;			/* part of each global vertex */
+
+void Alloc_Graph(Graph *g, int n, int m)
+{
+  g->n = n;
+  if ((g->xadj = malloc((n + 1) * sizeof(int))) == NULL ||
+      (g->adj = malloc((m + 1) * sizeof(int))) == NULL ||
+      (g->adjw = malloc((m + 1) * sizeof(int))) == NULL ||
+      (g->vw = malloc(n * sizeof(int))) == NULL ||
+      (g->cmap = malloc(n * sizeof(int))) == NULL)
+    Debug("Alloc_Graph: out of memory", 1);
+}
+
+void Free_Graph(Graph *g)
+{
+  free(g->xadj);
+  free(g->adj);
+  free(g->adjw);
+  free(g->vw);
+  free(g->cmap);
+}
+
+/* vertex i of vgraph is grid[i + 1], i.e. global vertex id i */
+void Build_Vertex_Graph()
+{
+  int i, j, m = 0;
+
+  Alloc_Graph(&vgraph, ngrid, 6 * ngrid);
+  vgraph.xadj[0] = 0;
+  for (i = 0; i < ngrid; i++)
+  {
+    for (j = 0; j < 6; j++)
+      if (grid[i + 1].neighbour[j] != 0)
+      {
+	vgraph.adj[m] = grid[i + 1].neighbour[j] - 1;
+	vgraph.adjw[m++] = 1;
+      }
+    vgraph.xadj[i + 1] = m;
+    vgraph.vw[i] = 1;
+  }
+}
+
+int Cmp_Int(const void *a, const void *b)
+{
+  return *(const int *) a - *(const int *) b;
+}
+
+#ifdef USE_METIS
+
+#include <metis.h>
+
+void Part_Graph_Kway(Graph *g, int k, int *part)
+{
+  idx_t i, n = g->n, ncon = 1, nparts = k, cut;
+  idx_t *xadj, *adj, *adjw, *vw, *p;
+  idx_t options[METIS_NOPTIONS];
+
+  if ((xadj = malloc((n + 1) * sizeof(idx_t))) == NULL ||
+      (adj = malloc((g->xadj[n] + 1) * sizeof(idx_t))) == NULL ||
+      (adjw = malloc((g->xadj[n] + 1) * sizeof(idx_t))) == NULL ||
+      (vw = malloc(n * sizeof(idx_t))) == NULL ||
+      (p = malloc(n * sizeof(idx_t))) == NULL)
+    Debug("Part_Graph_Kway: out of memory", 1);
+  for (i = 0; i <= n; i++)
+    xadj[i] = g->xadj[i];
+  for (i = 0; i < g->xadj[n]; i++)
+  {
+    adj[i] = g->adj[i];
+    adjw[i] = g->adjw[i];
+  }
+  for (i = 0; i < n; i++)
+    vw[i] = g->vw[i];
+
+  METIS_SetDefaultOptions(options);
+  options[METIS_OPTION_UFACTOR] = (idx_t) (1000 * (PART_IMBALANCE - 1));
+  if (METIS_PartGraphKway(&n, &ncon, xadj, adj, vw, NULL, adjw, &nparts,
+			  NULL, NULL, options, &cut, p) != METIS_OK)
+    Debug("Part_Graph_Kway: METIS_PartGraphKway failed", 1);
+  for (i = 0; i < n; i++)
+    part[i] = p[i];
+
+  free(xadj);
+  free(adj);
+  free(adjw);
+  free(vw);
+  free(p);
+}
+
+#else
+
+unsigned int gp_seed = 1;	/* fixed, so the parts are reproducible */
+
+int GP_Rand(int n)
+{
+  gp_seed = gp_seed * 1103515245 + 12345;
+  return (gp_seed >> 16) % n;
+}
+
+/*
+ * Heavy edge matching: each vertex, in random order, is merged with
+ * the unmatched neighbour it shares the heaviest edge with, unless the
+ * pair would outweigh maxvw. Fills g->cmap and builds the coarse graph c.
+ */
+void Coarsen(Graph *g, Graph *c, int maxvw)
+{
+  int i, j, k, v, u, w, cv, best, bestw;
+  int nc = 0, m = 0;
+  int *perm, *match, *rep, *mark;
+
+  if ((perm = malloc(g->n * sizeof(int))) == NULL ||
+      (match = malloc(g->n * sizeof(int))) == NULL ||
+      (rep = malloc(g->n * sizeof(int))) == NULL ||
+      (mark = malloc(g->n * sizeof(int))) == NULL)
+    Debug("Coarsen: out of memory", 1);
+
+  for (i = 0; i < g->n; i++)
+  {
+    perm[i] = i;
+    match[i] = -1;
+    mark[i] = -1;
+  }
+  for (i = g->n - 1; i > 0; i--)
+  {
+    j = GP_Rand(i + 1);
+    k = perm[i];
+    perm[i] = perm[j];
+    perm[j] = k;
+  }
+
+  for (i = 0; i < g->n; i++)
+  {
+    v = perm[i];
+    if (match[v] >= 0)
+      continue;
+    best = v;
+    bestw = 0;
+    for (j = g->xadj[v]; j < g->xadj[v + 1]; j++)
+    {
+      u = g->adj[j];
+      if (match[u] < 0 && u != v && g->adjw[j] > bestw &&
+	  g->vw[v] + g->vw[u] <= maxvw)
+      {
+	best = u;
+	bestw = g->adjw[j];
+      }
+    }
+    match[v] = best;
+    match[best] = v;
+    g->cmap[v] = g->cmap[best] = nc;
+    rep[nc++] = v;
+  }
+
+  /* merge the adjacency lists of each matched pair */
+  Alloc_Graph(c, nc, g->xadj[g->n]);
+  c->xadj[0] = 0;
+  for (cv = 0; cv < nc; cv++)
+  {
+    v = rep[cv];
+    c->vw[cv] = 0;
+    for (k = 0; k < 2; k++, v = match[v])
+    {
+      c->vw[cv] += g->vw[v];
+      for (j = g->xadj[v]; j < g->xadj[v + 1]; j++)
+      {
+	w = g->cmap[g->adj[j]];
+	if (w == cv)
+	  continue;
+	if (mark[w] < 0)
+	{
+	  mark[w] = m;
+	  c->adj[m] = w;
+	  c->adjw[m++] = g->adjw[j];
+	}
+	else
+	  c->adjw[mark[w]] += g->adjw[j];
+      }
+      if (match[v] == v)
+	break;
+    }
+    for (j = c->xadj[cv]; j < m; j++)
+      mark[c->adj[j]] = -1;
+    c->xadj[cv + 1] = m;
+  }
+
+  free(perm);
+  free(match);
+  free(rep);
+  free(mark);
+}
+
+/*
+ * Grows a region of weight target inside part p0 from seed, each time
+ * adding the frontier vertex with the largest gain, i.e. edges into
+ * the region minus edges to the rest of p0 (greedy graph growing). The
+ * region is returned in region[0 .. *n-1], the result is its cut.
+ */
+int Grow_Region(Graph *g, int *part, int p0, int seed, long long target,
+		int *work, char *seen, int *region, int *n)
+{
+  int i, j, u, w, best, nf = 0, cut = 0, v = 0;
+  int *gain = work, *front = work + g->n;
+  long long grown = 0;
+
+  for (u = 0; u < g->n; u++)
+    seen[u] = 0;
+  *n = 0;
+  while (grown < target)
+  {
+    if (nf == 0)
+    {
+      /* region ran out of neighbours : restart at an unseen vertex */
+      while (seen[seed] || part[seed] != p0)
+	seed = v++;
+      seen[seed] = 1;
+      gain[seed] = 0;
+      front[nf++] = seed;
+    }
+    best = 0;
+    for (i = 1; i < nf; i++)
+      if (gain[front[i]] > gain[front[best]])
+	best = i;
+    u = front[best];
+    front[best] = front[--nf];
+    seen[u] = 2;
+    region[(*n)++] = u;
+    grown += g->vw[u];
+
+    for (j = g->xadj[u]; j < g->xadj[u + 1]; j++)
+    {
+      w = g->adj[j];
+      if (part[w] != p0)
+	continue;
+      if (seen[w] == 2)
+      {
+	cut -= g->adjw[j];
+	continue;
+      }
+      cut += g->adjw[j];
+      if (seen[w] == 0)
+      {
+	seen[w] = 1;
+	front[nf++] = w;
+	gain[w] = 0;
+	for (i = g->xadj[w]; i < g->xadj[w + 1]; i++)
+	  if (part[g->adj[i]] == p0)
+	    gain[w] += (seen[g->adj[i]] == 2) ? g->adjw[i] : -g->adjw[i];
+      }
+      else
+	gain[w] += 2 * g->adjw[j];
+    }
+  }
+
+  return cut;
+}
+
+/*
+ * Splits the vertices of part p0 into parts p0 .. p0 + k - 1: a region
+ * of the right weight is grown GROW_TRIES times, first from a far
+ * vertex and then from random ones. The region with the smallest cut
+ * becomes part p0 + k / 2, and both halves are split further.
+ */
+void Split_Part(Graph *g, int *part, int p0, int k, int *work, char *seen)
+{
+  int i, j, v, u, head, tail, seed, try, cut, n, best_n = 0;
+  int best_cut = -1, k1 = k / 2, p1 = p0 + k / 2;
+  int *queue = work + 2 * g->n, *region = work + 2 * g->n;
+  int *best = work + 3 * g->n;
+  long long total = 0, target;
+
+  if (k == 1)
+    return;
+
+  seed = -1;
+  for (v = 0; v < g->n; v++)
+    if (part[v] == p0)
+    {
+      total += g->vw[v];
+      if (seed < 0)
+	seed = v;
+    }
+  if (seed < 0)
+    Debug("Split_Part: empty part, too many processes for the grid", 1);
+  target = total * (k - k1) / k;
+
+  /* the last vertex reached from seed is far from it */
+  for (i = 0; i < 2; i++)
+  {
+    for (v = 0; v < g->n; v++)
+      seen[v] = 0;
+    queue[0] = seed;
+    seen[seed] = 1;
+    for (head = 0, tail = 1; head < tail; head++)
+    {
+      v = queue[head];
+      for (j = g->xadj[v]; j < g->xadj[v + 1]; j++)
+	if (part[u = g->adj[j]] == p0 && !seen[u])
+	{
+	  seen[u] = 1;
+	  queue[tail++] = u;
+	}
+    }
+    seed = queue[tail - 1];
+  }
+
+  for (try = 0; try < GROW_TRIES; try++)
+  {
+    if (try > 0)
+      for (seed = GP_Rand(g->n); part[seed] != p0; seed = (seed + 1) % g->n) ;
+    cut = Grow_Region(g, part, p0, seed, target, work, seen, region, &n);
+    if (best_cut < 0 || cut < best_cut)
+    {
+      best_cut = cut;
+      best_n = n;
+      for (i = 0; i < n; i++)
+	best[i] = region[i];
+    }
+  }
+  for (i = 0; i < best_n; i++)
+    part[best[i]] = p1;
+
+  Split_Part(g, part, p0, k1, work, seen);
+  Split_Part(g, part, p1, k - k1, work, seen);
+}
+
+/*
+ * Greedy k-way refinement: a boundary vertex moves to the neighbouring
+ * part with the largest cut reduction, if that keeps the part under
+ * maxpw. Moves without gain are made only towards a lighter part.
+ */
+void Refine(Graph *g, int k, int *part)
+{
+  int i, j, v, q, from, inner, best, gain, nt, moves, pass;
+  int maxvw = 0;
+  long long total = 0, maxpw;
+  long long *pw;
+  int *conn, *touched;
+
+  if ((pw = calloc(k, sizeof(long long))) == NULL ||
+      (conn = calloc(k, sizeof(int))) == NULL ||
+      (touched = malloc(k * sizeof(int))) == NULL)
+    Debug("Refine: out of memory", 1);
+
+  for (v = 0; v < g->n; v++)
+  {
+    pw[part[v]] += g->vw[v];
+    total += g->vw[v];
+    if (g->vw[v] > maxvw)
+      maxvw = g->vw[v];
+  }
+  maxpw = (long long) (PART_IMBALANCE * total / k);
+  if (maxpw < total / k + maxvw)
+    maxpw = total / k + maxvw;
+
+  for (pass = 0; pass < REFINE_PASSES; pass++)
+  {
+    moves = 0;
+    for (v = 0; v < g->n; v++)
+    {
+      from = part[v];
+      inner = nt = 0;
+      for (j = g->xadj[v]; j < g->xadj[v + 1]; j++)
+      {
+	q = part[g->adj[j]];
+	if (q == from)
+	  inner += g->adjw[j];
+	else
+	{
+	  if (conn[q] == 0)
+	    touched[nt++] = q;
+	  conn[q] += g->adjw[j];
+	}
+      }
+      if (nt == 0)
+	continue;
+
+      best = -1;
+      gain = 0;
+      for (i = 0; i < nt; i++)
+      {
+	q = touched[i];
+	if (pw[q] + g->vw[v] > maxpw)
+	  continue;
+	if (best < 0 || conn[q] - inner > gain ||
+	    (conn[q] - inner == gain && pw[q] < pw[best]))
+	{
+	  best = q;
+	  gain = conn[q] - inner;
+	}
+      }
+      if (best >= 0 && (gain > 0 || pw[from] > maxpw ||
+			(gain == 0 && pw[best] + g->vw[v] < pw[from])))
+      {
+	pw[from] -= g->vw[v];
+	pw[best] += g->vw[v];
+	part[v] = best;
+	moves++;
+      }
+      for (i = 0; i < nt; i++)
+	conn[touched[i]] = 0;
+    }
+    if (moves == 0)
+      break;
+  }
+
+  free(pw);
+  free(conn);
+  free(touched);
+}
+
+void Part_Graph_Kway(Graph *g, int k, int *part)
+{
+  Graph level[MAX_LEVELS];
+  int *lpart[MAX_LEVELS];
+  int *work;
+  char *seen;
+  int l = 0, v, maxvw;
+
+  /* coarsen until about COARSEN_TO vertices per part are left */
+  level[0] = *g;
+  maxvw = 1 + 1.5 * g->n / (COARSEN_TO * k);
+  while (level[l].n > COARSEN_TO * k && l < MAX_LEVELS - 1)
+  {
+    Coarsen(&level[l], &level[l + 1], maxvw);
+    l++;
+    if (level[l].n > 0.95 * level[l - 1].n)
+      break;
+  }
+
+  /* split the coarsest graph */
+  lpart[0] = part;
+  for (v = 1; v <= l; v++)
+    if ((lpart[v] = malloc(level[v].n * sizeof(int))) == NULL)
+      Debug("Part_Graph_Kway: out of memory", 1);
+  if ((work = malloc(4 * level[l].n * sizeof(int))) == NULL ||
+      (seen = malloc(level[l].n)) == NULL)
+    Debug("Part_Graph_Kway: out of memory", 1);
+  for (v = 0; v < level[l].n; v++)
+    lpart[l][v] = 0;
+  Split_Part(&level[l], lpart[l], 0, k, work, seen);
+  free(work);
+  free(seen);
+
+  /* project back, refining on every level */
+  Refine(&level[l], k, lpart[l]);
+  for (; l > 0; l--)
+  {
+    for (v = 0; v < level[l - 1].n; v++)
+      lpart[l - 1][v] = lpart[l][level[l - 1].cmap[v]];
+    Refine(&level[l - 1], k, lpart[l - 1]);
+    Free_Graph(&level[l]);
+    free(lpart[l]);
+  }
+}
+
+#endif
+
+/* partitions the grid into N_proc parts and reports the balance */
+void Partition_Grid(int N_proc)
+{
+  int v, j, cut = 0, min, max;
+  int *size;
+
+  Debug("Partition_Grid", 0);
+
+  Build_Vertex_Graph();
+  if ((vert_part = malloc(ngrid * sizeof(int))) == NULL ||
+      (size = calloc(N_proc, sizeof(int))) == NULL)
+    Debug("Partition_Grid: out of memory", 1);
+
+  if (N_proc == 1)
+    for (v = 0; v < ngrid; v++)
+      vert_part[v] = 0;
+  else
+    Part_Graph_Kway(&vgraph, N_proc, vert_part);
+
+  for (v = 0; v < ngrid; v++)
+  {
+    size[vert_part[v]]++;
+    for (j = vgraph.xadj[v]; j < vgraph.xadj[v + 1]; j++)
+      if (vert_part[vgraph.adj[j]] != vert_part[v])
+	cut++;
+  }
+  min = max = size[0];
+  for (v = 1; v < N_proc; v++)
+  {
+    if (size[v] < min)
+      min = size[v];
+    if (size[v] > max)
+      max = size[v];
+  }
+  if (min == 0)
+    Debug("Partition_Grid: empty part, too many processes for the grid", 1);
+  printf("Graph partition : %i parts of %i to %i vertices, %i cut edges\n",
+	 N_proc, min, max, cut / 2);
+
+  free(size);
+}
+
+/* position of global vertex v in the sorted list loc[0 .. n-1] */
+int Local_Index(int *loc, int n, int v)
+{
+  int *p = bsearch(&v, loc, n, sizeof(int), Cmp_Int);
+
+  if (p == NULL)
+    Debug("Local_Index: vertex is not in the partition", 1);
+  return p - loc;
+}
+
+/*
+ * Builds partition 'rank' of vert_part: the owned vertices together
+ * with their neighbours of other parts as ghosts, in global id order,
+ * and every element with an owned vertex. Halo lists are in global id
+ * order on both sides.
+ */
+void Build_Graph_Partition(int rank, int N_proc, Partition *part)
+{
+  int i, j, k, n, c, v, u, cx, cy, q, t;
+  int N_vert = 0, N_elm = 0, N_neighb = 0, N_halo = 0;
+  int *loc, *slot, *nbs, *pos, tri[6][3];
+  int X = gridsize[X_DIR];
+
+  /* owned vertices and their ghosts */
+  for (v = 0; v < ngrid; v++)
+    if (vert_part[v] == rank)
+      N_vert += 1 + vgraph.xadj[v + 1] - vgraph.xadj[v];
+  if ((loc = malloc(N_vert * sizeof(int))) == NULL ||
+      (slot = malloc(N_proc * sizeof(int))) == NULL)
+    Debug("Build_Graph_Partition: out of memory", 1);
+  n = 0;
+  for (v = 0; v < ngrid; v++)
+    if (vert_part[v] == rank)
+    {
+      loc[n++] = v;
+      for (j = vgraph.xadj[v]; j < vgraph.xadj[v + 1]; j++)
+	if (vert_part[vgraph.adj[j]] != rank)
+	  loc[n++] = vgraph.adj[j];
+    }
+  qsort(loc, n, sizeof(int), Cmp_Int);
+  for (i = N_vert = 0; i < n; i++)
+    if (i == 0 || loc[i] != loc[i - 1])
+      loc[N_vert++] = loc[i];
+
+  /* neighbouring parts, in rank order */
+  for (q = 0; q < N_proc; q++)
+    slot[q] = -1;
+  for (i = 0; i < N_vert; i++)
+    if ((q = vert_part[loc[i]]) != rank && slot[q] < 0)
+      slot[q] = N_neighb++;
+  for (q = 0, k = 0; q < N_proc; q++)
+    if (slot[q] >= 0)
+      slot[q] = k++;
+
+  part->h.N_vert = N_vert;
+  part->h.N_elm = 0;
+  part->h.N_neighb = N_neighb;
+  if ((part->x = malloc(N_vert * sizeof(double))) == NULL ||
+      (part->y = malloc(N_vert * sizeof(double))) == NULL ||
+      (part->val = malloc(N_vert * sizeof(double))) == NULL ||
+      (part->type = malloc(N_vert * sizeof(int))) == NULL ||
+      (part->gid = malloc(N_vert * sizeof(int))) == NULL ||
+      (part->elm = malloc(3 * 6 * N_vert * sizeof(int))) == NULL ||
+      (part->neighb = calloc(3 * N_neighb + 1, sizeof(int))) == NULL ||
+      (nbs = malloc(6 * sizeof(int))) == NULL ||
+      (pos = malloc((2 * N_neighb + 1) * sizeof(int))) == NULL)
+    Debug("Build_Graph_Partition: out of memory", 1);
+
+  /* vertices, and the halo sizes */
+  for (q = 0; q < N_proc; q++)
+    if (slot[q] >= 0)
+      part->neighb[3 * slot[q]] = q;
+  for (i = 0; i < N_vert; i++)
+  {
+    v = loc[i];
+    Vertex_Pos(v, &part->x[i], &part->y[i]);
+    part->type[i] = Vertex_Type(v, &part->val[i]);
+    part->gid[i] = v;
+    if ((q = vert_part[v]) != rank)
+    {
+      part->type[i] |= TYPE_GHOST;
+      part->neighb[3 * slot[q] + 1]++;
+      N_halo++;
+      continue;
+    }
+    for (j = vgraph.xadj[v], c = 0; j < vgraph.xadj[v + 1]; j++)
+      if ((q = vert_part[vgraph.adj[j]]) != rank)
+      {
+	for (k = 0; k < c && nbs[k] != q; k++) ;
+	if (k == c)
+	{
+	  nbs[c++] = q;
+	  part->neighb[3 * slot[q] + 2]++;
+	  N_halo++;
+	}
+      }
+  }
+
+  /* elements: each once, from its first owned vertex */
+  for (i = 0; i < N_vert; i++)
+  {
+    v = loc[i];
+    if (vert_part[v] != rank)
+      continue;
+    for (cy = v / X - 1; cy <= v / X; cy++)
+      for (cx = v % X - 1; cx <= v % X; cx++)
+      {
+	if (cx < 0 || cy < 0 || cx >= X - 1 || cy >= gridsize[Y_DIR] - 1)
+	  continue;
+	u = cy * X + cx;
+	tri[0][0] = u;
+	tri[0][1] = u + 1;
+	tri[0][2] = u + X;
+	tri[1][0] = u + 1;
+	tri[1][1] = u + X;
+	tri[1][2] = u + X + 1;
+	for (t = 0; t < 2; t++)
+	{
+	  for (k = 0; k < 3 && tri[t][k] != v; k++) ;
+	  if (k == 3)
+	    continue;
+	  for (k = 0; k < 3; k++)
+	    if (tri[t][k] < v && vert_part[tri[t][k]] == rank)
+	      break;
+	  if (k < 3)
+	    continue;
+	  for (k = 0; k < 3; k++)
+	    part->elm[N_elm++] = Local_Index(loc, N_vert, tri[t][k]);
+	}
+      }
+  }
+  part->h.N_elm = N_elm / 3;
+
+  /* halo lists: from list, then to list, of each neighbour */
+  part->h.N_halo = N_halo;
+  if ((part->halo = malloc((N_halo + 1) * sizeof(int))) == NULL)
+    Debug("Build_Graph_Partition: out of memory", 1);
+  for (k = 0, j = 0; k < N_neighb; k++)
+  {
+    pos[2 * k] = j;
+    pos[2 * k + 1] = j + part->neighb[3 * k + 1];
+    j = pos[2 * k + 1] + part->neighb[3 * k + 2];
+  }
+  for (i = 0; i < N_vert; i++)
+  {
+    v = loc[i];
+    if ((q = vert_part[v]) != rank)
+    {
+      part->halo[pos[2 * slot[q]]++] = i;
+      continue;
+    }
+    for (j = vgraph.xadj[v], c = 0; j < vgraph.xadj[v + 1]; j++)
+      if ((q = vert_part[vgraph.adj[j]]) != rank)
+      {
+	for (k = 0; k < c && nbs[k] != q; k++) ;
+	if (k == c)
+	{
+	  nbs[c++] = q;
+	  part->halo[pos[2 * slot[q] + 1]++] = i;
+	}
+      }
+  }
+
+  free(loc);
+  free(slot);
+  free(nbs);
+  free(pos);
+}
+
+/*
+ * The process graph of vert_part, in the format of MPI_Graph_create.
+ * edges[] needs room for N_proc * (N_proc - 1) neighbours. Returns the
+ * number of edges.
+ */
+int Graph_Map_Parts(int N_proc, int *index, int *edges)
+{
+  int v, j, p, q, n = 0;
+  char *adjacent;
+
+  if ((adjacent = calloc((long long) N_proc * N_proc, 1)) == NULL)
+    Debug("Graph_Map_Parts: out of memory", 1);
+  for (v = 0; v < ngrid; v++)
+    for (j = vgraph.xadj[v]; j < vgraph.xadj[v + 1]; j++)
+      if ((q = vert_part[vgraph.adj[j]]) != vert_part[v])
+	adjacent[(long long) vert_part[v] * N_proc + q] = 1;
+
+  for (p = 0; p < N_proc; p++)
+  {
+    for (q = 0; q < N_proc; q++)
+      if (adjacent[(long long) p * N_proc + q])
+	edges[n++] = q;
+    index[p] = n;
+  }
+
+  free(adjacent);
+  return n;
+}
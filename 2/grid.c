@@ -26,6 +26,7 @@ gridpoint *grid;
 sourcepoint *source2;
 int ngrid;
 int nsource;
+int grid_quiet = 0;	/* no progress output from grid_deform */
 
 float sqr(float a)
 {
@@ -129,6 +130,8 @@ float gridmove()
   float maxdiff = 0;
   int i, j;
 
+  /* the forces only read the positions, so the points are independent */
+  #pragma omp parallel for private(g, g2, dx, dy, r, centerx, centery, springc, j) schedule(static)
   for(i=1; i<ngrid; i++)
   {
     g = &grid[i];
@@ -153,6 +156,7 @@ float gridmove()
 
   fmin = 0.1 / (nx + ny);
 
+  #pragma omp parallel for private(g, f) reduction(max:maxdiff) schedule(static)
   for(i=1; i<ngrid; i++)
   {
     g = &grid[i];
@@ -182,7 +186,8 @@ void grid_deform(int count)
   for(i=0; i<count; i++)
   {
     maxdiff = gridmove();
-    fprintf(stderr, "iter %3i: %10.2e\n", i, maxdiff);
+    if (!grid_quiet)
+      fprintf(stderr, "iter %3i: %10.2e\n", i, maxdiff);
     if( maxdiff < 1e-7 )
       break;
   }
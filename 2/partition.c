@@ -0,0 +1,262 @@
+/***
+ * Splits the gridsize[X_DIR] by gridsize[Y_DIR] grid into P_grid
+ * rectangles and builds the vertices, elements and halo lists of one
+ * of them. Included by GridDist.c, which writes the partitions to
+ * files, and by MPI_Fempois.c, which can build its own partition in
+ * memory. The includer provides gridsize, P_grid, the sources, do_adapt
+ * and grid.c.
+ ***/
+
+/* reads sources.dat into source, source_val and, for grid.c, source2 */
+void Read_Sources()
+{
+  int i, x, y;
+  double source_x, source_y;
+  FILE *f;
+
+  if ((f = fopen("sources.dat", "r")) == NULL)
+    Debug("Can't open sources.dat", 1);
+
+  fscanf(f, "%i\n", &N_sources);
+  if (N_sources > 0)
+  {
+    if ((source = malloc(N_sources * sizeof(int))) == NULL)
+        Debug("Error: malloc 'source'", 1);
+    if ((source_val = malloc(N_sources * sizeof(double))) == NULL)
+        Debug("Error: malloc 'source_val'", 1);
+
+/****/
+    nsource = N_sources;
+    if ((source2=malloc(nsource*sizeof(sourcepoint)))==NULL)
+      Debug("Out of memory", 1);
+/****/
+
+    for (i = 0; i < N_sources; i++)
+    {
+      fscanf(f, "source: %lf %lf %lf\n", &source_x, &source_y, &source_val[i]);
+      x = floor(0.5 + source_x * (gridsize[X_DIR] - 1));
+      y = floor(0.5 + source_y * (gridsize[Y_DIR] - 1));
+      source[i] = y * gridsize[X_DIR] + x;
+      source2[i].xpos = source_x; /****/
+      source2[i].ypos = source_y; /****/
+      source2[i].value = source_val[i]; /****/
+/*
+      printf("(%f,%f) --> (%f,%f) --> (%i,%i) --> %i\n", source_x, source_y,
+	     (double) x / (gridsize[X_DIR] - 1),
+	     (double) y / (gridsize[Y_DIR] - 1), x, y, source[i]);
+*/
+    }
+  }
+  fclose(f);
+}
+
+/* one partition, as in input<P>-<rank>.dat or a block of input<P>.bin */
+typedef struct
+{
+  PartHeader h;
+  double *x, *y, *val;		/* vertex coordinates and source values */
+  int *type;			/* vertex types */
+  int *gid;			/* global vertex ids */
+  int *elm;			/* 3 vertices per element */
+  int *neighb;			/* rank, #from, #to per neighbour */
+  int *halo;			/* from and to lists of each neighbour */
+}
+Partition;
+
+/* type and source value of global vertex v */
+int Vertex_Type(int v, double *val)
+{
+  int j, x = v % gridsize[X_DIR], y = v / gridsize[X_DIR];
+
+  *val = 0.0;
+  for (j = 0; (j < N_sources) && (source[j] != v); j++) ;
+  if (j < N_sources)
+  {
+    *val = source_val[j];
+    return TYPE_SOURCE;
+  }
+  if ((x == 0) || (x == gridsize[X_DIR] - 1) ||
+      (y == 0) || (y == gridsize[Y_DIR] - 1))
+    return TYPE_SOURCE;
+  return 0;
+}
+
+/* coordinates of global vertex v, from the adapted grid if there is one */
+void Vertex_Pos(int v, double *x, double *y)
+{
+  if (do_adapt)
+  {
+    *x = grid[v + 1].xpos;
+    *y = grid[v + 1].ypos;
+  }
+  else
+  {
+    *x = ((float) (v % gridsize[X_DIR])) / (gridsize[X_DIR] - 1);
+    *y = ((float) (v / gridsize[X_DIR])) / (gridsize[Y_DIR] - 1);
+  }
+}
+
+void Add_Halo(Partition *part, int proc, int from0, int from_step,
+	      int to0, int to_step, int n)
+{
+  int i, *nb = part->neighb + 3 * part->h.N_neighb++;
+
+  nb[0] = proc;
+  nb[1] = nb[2] = n;
+  for (i = 0; i < n; i++)
+    part->halo[part->h.N_halo++] = from0 + i * from_step;
+  for (i = 0; i < n; i++)
+    part->halo[part->h.N_halo++] = to0 + i * to_step;
+}
+
+void Build_Partition(int px, int py, Partition *part)
+{
+  int i, x, y, t, v;
+  int x_off, y_off, x_dim, y_dim;
+  int N_vert, N_elm;
+  int top, left, right, bottom;
+  int start, end;
+
+  x_off = gridsize[X_DIR] * px / P_grid[X_DIR];
+  y_off = gridsize[Y_DIR] * py / P_grid[Y_DIR];
+  x_dim = gridsize[X_DIR] * (px + 1) / P_grid[X_DIR] - x_off;
+  y_dim = gridsize[Y_DIR] * (py + 1) / P_grid[Y_DIR] - y_off;
+  top = bottom = right = left = start = end = 0;
+  if (py != 0)
+    top = 1;
+  if (py != P_grid[Y_DIR] - 1)
+    bottom = 1;
+  if (px != 0)
+    left = 1;
+  if (px != P_grid[X_DIR] - 1)
+    right = 1;
+  if (top && left)
+    start = -1;
+  if (bottom && right)
+    end = -1;
+  x_dim += left + right;
+  y_dim += top + bottom;
+  x_off -= left;
+  y_off -= top;
+
+  N_vert = x_dim * y_dim + start;
+  if (bottom && right)
+    N_vert--;
+  N_elm = 2 * (x_dim - 1) * (y_dim - 1) + start + end;
+
+  part->h.N_vert = N_vert;
+  part->h.N_elm = N_elm;
+  part->h.N_neighb = 0;
+  part->h.N_halo = 0;
+  if ((part->x = malloc(N_vert * sizeof(double))) == NULL ||
+      (part->y = malloc(N_vert * sizeof(double))) == NULL ||
+      (part->val = malloc(N_vert * sizeof(double))) == NULL ||
+      (part->type = malloc(N_vert * sizeof(int))) == NULL ||
+      (part->gid = malloc(N_vert * sizeof(int))) == NULL ||
+      (part->elm = malloc(3 * N_elm * sizeof(int))) == NULL ||
+      (part->neighb = malloc(3 * 6 * sizeof(int))) == NULL ||
+      (part->halo = malloc((4 * (x_dim + y_dim) + 4) * sizeof(int))) == NULL)
+    Debug("Build_Partition: out of memory", 1);
+
+  /* vertices */
+  i = 0;
+  for (y = 0; y < y_dim; y++)
+    for (x = ((y == 0) ? -start : 0); x < x_dim +
+	 ((y == y_dim - 1) ? end : 0); x++, i++)
+    {
+      t = 0;
+      if (((x == 0) && left) || ((y == 0) && top) ||
+	  ((x == x_dim - 1) && right) || ((y == y_dim - 1) && bottom))
+	t += TYPE_GHOST;
+      v = (y + y_off) * gridsize[X_DIR] + (x + x_off);
+
+      Vertex_Pos(v, &part->x[i], &part->y[i]);
+      part->type[i] = t | Vertex_Type(v, &part->val[i]);
+      part->gid[i] = v;
+    }
+
+  /* elements */
+  i = 0;
+  for (y = 0; y < y_dim - 1; y++)
+    for (x = 0; x < x_dim - 1; x++)
+    {
+      if ((y != 0) || (x != 0) || (start == 0))
+      {
+	part->elm[i++] = y * x_dim + x + start;
+	part->elm[i++] = y * x_dim + x + 1 + start;
+	part->elm[i++] = (y + 1) * x_dim + x + start;
+      }
+      if ((y != y_dim - 2) || (x != x_dim - 2) || (end == 0))
+      {
+	part->elm[i++] = y * x_dim + x + 1 + start;
+	part->elm[i++] = (y + 1) * x_dim + x + start;
+	part->elm[i++] = (y + 1) * x_dim + x + 1 + start;
+      }
+    }
+
+  /* neighbour connectivity */
+  if (top)
+    Add_Halo(part, (py - 1) * P_grid[X_DIR] + px, left + start, 1,
+	     x_dim + left + start, 1, x_dim - right - left);
+  if (bottom)
+    Add_Halo(part, (py + 1) * P_grid[X_DIR] + px,
+	     (y_dim - 1) * x_dim + left + start, 1,
+	     (y_dim - 2) * x_dim + left + start, 1, x_dim - right - left);
+  if (left)
+    Add_Halo(part, py * P_grid[X_DIR] + px - 1, top * x_dim + start, x_dim,
+	     top * x_dim + 1 + start, x_dim, y_dim - bottom - top);
+  if (right)
+    Add_Halo(part, py * P_grid[X_DIR] + px + 1,
+	     (top + 1) * x_dim - 1 + start, x_dim,
+	     (top + 1) * x_dim - 2 + start, x_dim, y_dim - bottom - top);
+  if (top && right)
+    Add_Halo(part, (py - 1) * P_grid[X_DIR] + px + 1, x_dim - 1 + start, 0,
+	     2 * x_dim - 2 + start, 0, 1);
+  if (bottom && left)
+    Add_Halo(part, (py + 1) * P_grid[X_DIR] + px - 1,
+	     (y_dim - 1) * x_dim + start, 0, (y_dim - 2) * x_dim + 1 + start, 0, 1);
+}
+
+void Free_Partition(Partition *part)
+{
+  free(part->x);
+  free(part->y);
+  free(part->val);
+  free(part->type);
+  free(part->gid);
+  free(part->elm);
+  free(part->neighb);
+  free(part->halo);
+}
+
+/*
+ * The process graph of the P_grid rectangles, in the format of
+ * MPI_Graph_create: index[] holds the cumulative neighbour counts and
+ * edges[] (at most 6 per process) the neighbours. Returns the number
+ * of edges.
+ */
+int Graph_Map(int *index, int *edges)
+{
+  int px, py;
+  int n = 0;
+
+  for (py = 0; py < P_grid[Y_DIR]; py++)
+    for (px = 0; px < P_grid[X_DIR]; px++)
+    {
+      if (py > 0)
+	edges[n++] = (py - 1) * P_grid[X_DIR] + px;
+      if (py < P_grid[Y_DIR] - 1)
+	edges[n++] = (py + 1) * P_grid[X_DIR] + px;
+      if (px > 0)
+	edges[n++] = py * P_grid[X_DIR] + px - 1;
+      if (px < P_grid[X_DIR] - 1)
+	edges[n++] = py * P_grid[X_DIR] + px + 1;
+      if ((py > 0) && (px < P_grid[X_DIR] - 1))
+	edges[n++] = (py - 1) * P_grid[X_DIR] + px + 1;
+      if ((px > 0) && (py < P_grid[Y_DIR] - 1))
+	edges[n++] = (py + 1) * P_grid[X_DIR] + px - 1;
+      index[py * P_grid[X_DIR] + px] = n;
+    }
+
+  return n;
+}
@@ -8,14 +8,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "cuda.h"
+#include <cuda_fp16.h>
+#if CUDART_VERSION >= 11000
+#include <cuda_bf16.h>
+#endif
 
 
 const int BLOCK_SIZE =32;  // number of threads per block
+const int MAX_GPUS = 16;   // devices used by the row-block mode
+const int CPU_ROWS = 4;    // rows per register block of CPU_AvProduct_Parallel
+const int MAX_BLOCK = 16;  // Lanczos: most vectors per product with A, and of --nev
+const int PROJ_THREADS = 256;  // threads per block of the Project reduction
 
 // Input Array Variables
 float* h_MatA = NULL;
-float* d_MatA = NULL;
+void* h_MatStore = NULL;       // A in the --matrix storage type, h_MatA for fp32
+void* d_MatA = NULL;           // device copy of h_MatStore
 
 // Output Array
 float* h_VecV = NULL;
@@ -26,12 +38,44 @@ float* h_NormW = NULL;
 float* d_NormW = NULL;
 float* h_Lambda = NULL;
 float* d_Lambda = NULL;
+float* d_OldLambda = NULL;     // device loop: lambda of the previous iteration
+int* d_Done = NULL;            // device loop: convergence flag
+int* d_Iter = NULL;            // device loop: iterations done
 
 // Variables to change
 int GlobalSize = 5000;         // this is the dimension of the matrix, GlobalSize*GlobalSize
 int BlockSize = BLOCK_SIZE;            // number of threads in each block
 const float EPS = 0.000005;    // tolerence of the error
 int max_iteration = 100;       // the maximum iteration steps
+int device_loop = 0;           // keep the whole power loop on the device
+int check_interval = 10;       // device loop: iterations between polls of d_Done
+int use_graph = 0;             // device loop: replay one iteration as a CUDA graph
+int gemv_warp = 0;             // use the warp-per-row Av_Product_Warp kernel
+int gemvBlocks = 0;            // Av_Product_Warp launch, set by SetupWarpGEMV
+int gemvThreads = 0;
+int num_gpus = 1;              // split the rows of A over this many devices
+int out_of_core = 0;           // stream A from host memory in row panels
+int panel_rows = 0;            // out-of-core panel height, 0 picks it from free memory
+void* d_Panel[2] = {NULL, NULL};   // out-of-core: double-buffered row panels
+cudaStream_t panelStream[2];
+
+// Storage types for A, the GEMV always accumulates in float
+enum { MAT_FP32, MAT_FP16, MAT_BF16, MAT_INT8 };
+int cpu_mode = 3;              // --cpu: bit 0 serial, bit 1 parallel baseline
+int matrix_type = MAT_FP32;    // set with --matrix fp32|fp16|bf16|int8
+size_t mat_elem = sizeof(float);   // bytes per element of h_MatStore
+float matrix_scale = 1;        // int8: A = matrix_scale * stored value
+
+// Eigen solvers, set with --eigen power|lanczos
+enum { EIGEN_POWER, EIGEN_LANCZOS };
+int eigen_mode = EIGEN_POWER;
+int num_eigen = 4;             // Lanczos: eigenpairs of largest magnitude wanted, --nev
+int block_vectors = 1;         // Lanczos: vectors multiplied per pass over A, --block
+int symmetric = 0;             // --symmetric: mirror A so that A = A^T
+float* d_Basis = NULL;         // Lanczos: orthonormal basis, vector k at k*N
+float* d_Block = NULL;         // Lanczos: A times the newest block of the basis
+float* d_Ritz = NULL;          // Lanczos: the eigenvectors
+float* d_Proj = NULL;          // Lanczos: inner products and small coefficient matrices
 
 
 // Functions
@@ -41,12 +85,33 @@ void UploadArray(float*, int);
 float CPUReduce(float*, int);
 void  Arguments(int, char**);
 void checkCardVersion(void);
+void LaunchIteration(cudaStream_t, int, int, int);
+void RunGPUDeviceLoop(int, int, int);
+void SetupWarpGEMV(int);
+void LaunchAvProduct(cudaStream_t, const void*, float*, float*, int);
+void ConvertMatrix(int);
+void GPU_AvProduct(cudaStream_t);
+void SetupOutOfCore(int);
+void RunGPUMultiDevice(void);
+void LaunchAvBlock(cudaStream_t, float*, float*, int);
+void BlockQR(float*, float*, double*, int);
+void SymEigen(double*, double*, int, int);
+void RunGPULanczos(void);
+double RitzPairs(const double*, int, int, int, double*, double*, double*, int);
 
 // Kernels
-__global__ void Av_Product(float* g_MatA, float* g_VecV, float* g_VecW, int N);
+__global__ void Av_Product(float* g_MatA, float* g_VecV, float* g_VecW, int rows, int N);
+template <typename T>
+__global__ void Av_Product_Warp(const T* __restrict__ g_MatA, const float* __restrict__ g_VecV, float* g_VecW, int rows, int N, float scale);
 __global__ void FindNormW(float* g_VecW, float * g_NormW, int N);
 __global__ void NormalizeW(float* g_VecW, float * g_NormW, float* g_VecV, int N);
 __global__ void ComputeLamda( float* g_VecV,float* g_VecW, float * g_Lamda,int N);
+__global__ void CheckConvergence(float* g_NormW, float* g_Lamda, float* g_OldLamda, int* g_Done, int* g_Iter, float eps);
+template <typename T>
+__global__ void Av_Product_Block(const T* __restrict__ g_MatA, const float* __restrict__ g_VecV, float* g_VecW, int rows, int N, int nb, float scale);
+__global__ void Project(const float* g_Basis, const float* g_Block, float* g_Proj, int nb, int N);
+__global__ void Orthogonalize(const float* g_Basis, float* g_Block, const float* g_Proj, int nvec, int nb, int N);
+__global__ void Combine(const float* g_In, float* g_Out, const float* g_Mat, int nin, int nout, int N);
 
 /*****************************************************************************
 This function finds the product of Matrix A and vector V
@@ -60,10 +125,12 @@ This function finds the product of Matrix A and vector V
 // The share memory is limited for a block, instead of reading an entire row of matrix A or vector V from global memory to share memory, 
 // a square submatrix of A is shared by a block, the size of square submatrix is BLOCK_SIZE*BLOCK_SIZE; Thus, a for-loop is used to
 // handle a multiplication of each row of Matrix A and vector V step by step. In eacg step, two subvectors with size BLOCK_SIZE is multiplied.
+
+// A has 'rows' rows of length N, so the kernel also takes a row block or panel of the full matrix.
 //*****************************************************************************************************************************************************/
 
 
-__global__ void Av_Product(float* g_MatA, float* g_VecV, float* g_VecW, int N)
+__global__ void Av_Product(float* g_MatA, float* g_VecV, float* g_VecW, int rows, int N)
 {
     // Block index
     int bx = blockIdx.x;
@@ -71,17 +138,19 @@ __global__ void Av_Product(float* g_MatA, float* g_VecV, float* g_VecW, int N)
     // Thread index
     int tx = threadIdx.x;
 
-    int aBegin = N * BLOCK_SIZE * bx;
+    // offsets into A in size_t, rows*N overflows int for N above 46340
+    size_t aBegin = (size_t)N * BLOCK_SIZE * bx;
 
-    int aEnd   = aBegin + N - 1;
+    size_t aEnd   = aBegin + N - 1;
+    size_t aSize  = (size_t)rows * N;
     int step  = BLOCK_SIZE;
 
-    int bBegin = 0;//BLOCK_SIZE * bx;
+    int b = 0;//BLOCK_SIZE * bx;
     int bIndex=0;
-    int aIndex =0;
+    size_t aIndex =0;
     float Csub = 0;
 
-    for (int a = aBegin, b = bBegin;
+    for (size_t a = aBegin;
          a <= aEnd;
          a += step, b += step)
     {
@@ -93,8 +162,8 @@ __global__ void Av_Product(float* g_MatA, float* g_VecV, float* g_VecW, int N)
 
         for (int aa = 0; aa < BLOCK_SIZE;aa+= 1)
         {
-            aIndex = a+tx+aa*N;
-            if( aIndex < N*N)
+            aIndex = a+tx+(size_t)aa*N;
+            if( aIndex < aSize)
         	    As[tx+aa*BLOCK_SIZE] = g_MatA[aIndex];
 		        else
         	    As[tx+aa*BLOCK_SIZE] = 0;
@@ -115,11 +184,119 @@ __global__ void Av_Product(float* g_MatA, float* g_VecV, float* g_VecW, int N)
         __syncthreads();
     }
 
-    g_VecW[ BLOCK_SIZE * bx + tx] = Csub;
+    if (BLOCK_SIZE * bx + tx < rows)
+        g_VecW[ BLOCK_SIZE * bx + tx] = Csub;
+}
+
+// Element of A as float, for each --matrix storage type
+__device__ inline float ToFloat(float x) { return x; }
+__device__ inline float ToFloat(__half x) { return __half2float(x); }
+#if CUDART_VERSION >= 11000
+__device__ inline float ToFloat(__nv_bfloat16 x) { return __bfloat162float(x); }
+#endif
+__device__ inline float ToFloat(signed char x) { return (float)x; }
+
+// Four consecutive elements of A, loaded as one vector
+template <typename T>
+struct __align__(4 * sizeof(T)) Vec4
+{
+    T x, y, z, w;
+};
+
+/*****************************************************************************
+Matrix-vector product with one warp per row. The lanes of a warp read
+consecutive elements of the row, four at a time when every row is
+aligned for it (N % 4 == 0), and the partial sums are combined with
+warp shuffles. Warps step through the rows grid-stride, so the grid can
+be sized for occupancy instead of for N. A is stored as T and converted
+to float, the sums are always float and multiplied by 'scale' at the end.
+*****************************************************************************/
+template <typename T>
+__global__ void Av_Product_Warp(const T* __restrict__ g_MatA, const float* __restrict__ g_VecV, float* g_VecW, int rows, int N, float scale)
+{
+    int lane = threadIdx.x % 32;
+    int warpsPerBlock = blockDim.x / 32;
+    int row = blockIdx.x * warpsPerBlock + threadIdx.x / 32;
+    int rowStep = gridDim.x * warpsPerBlock;
+
+    for (; row < rows; row += rowStep)
+    {
+        const T* a = g_MatA + (size_t)row * N;
+        float sum = 0;
+
+        if ((N & 3) == 0)
+        {
+            const Vec4<T>* a4 = (const Vec4<T>*)a;
+            const float4* v4 = (const float4*)g_VecV;
+            for (int j = lane; j < N / 4; j += 32)
+            {
+                Vec4<T> x = a4[j];
+                float4 y = __ldg(&v4[j]);
+                sum += ToFloat(x.x) * y.x + ToFloat(x.y) * y.y + ToFloat(x.z) * y.z + ToFloat(x.w) * y.w;
+            }
+        }
+        else
+        {
+            for (int j = lane; j < N; j += 32)
+                sum += ToFloat(a[j]) * __ldg(&g_VecV[j]);
+        }
+
+        // row is the same for the whole warp, so all lanes take part
+        for (int offset = 16; offset > 0; offset >>= 1)
+            sum += __shfl_down_sync(0xffffffff, sum, offset);
+
+        if (lane == 0)
+            g_VecW[row] = sum * scale;
+    }
+}
+
+/*****************************************************************************
+W = A V for a block of nb <= MAX_BLOCK vectors, vector c of V and W at
+c*N. One warp per row as in Av_Product_Warp, but every element of A that
+is read is used for all nb vectors, so one pass over A does the work of
+nb products. The loops over c are unrolled to keep the sums in registers.
+*****************************************************************************/
+template <typename T>
+__global__ void Av_Product_Block(const T* __restrict__ g_MatA, const float* __restrict__ g_VecV, float* g_VecW, int rows, int N, int nb, float scale)
+{
+    int lane = threadIdx.x % 32;
+    int warpsPerBlock = blockDim.x / 32;
+    int row = blockIdx.x * warpsPerBlock + threadIdx.x / 32;
+    int rowStep = gridDim.x * warpsPerBlock;
+
+    for (; row < rows; row += rowStep)
+    {
+        const T* a = g_MatA + (size_t)row * N;
+        float sum[MAX_BLOCK];
+
+        #pragma unroll
+        for (int c = 0; c < MAX_BLOCK; c++)
+            sum[c] = 0;
+
+        for (int j = lane; j < N; j += 32)
+        {
+            float x = ToFloat(a[j]);
+            #pragma unroll
+            for (int c = 0; c < MAX_BLOCK; c++)
+                if (c < nb)
+                    sum[c] += x * __ldg(&g_VecV[(size_t)c * N + j]);
+        }
+
+        // nb and row are the same for the whole warp, so all lanes take part
+        #pragma unroll
+        for (int c = 0; c < MAX_BLOCK; c++)
+            if (c < nb)
+            {
+                for (int offset = 16; offset > 0; offset >>= 1)
+                    sum[c] += __shfl_down_sync(0xffffffff, sum[c], offset);
+                if (lane == 0)
+                    g_VecW[(size_t)c * N + row] = sum[c] * scale;
+            }
+    }
 }
 
 /****************************************************
-Normalizes vector W : W/norm(W)
+Finds the squared norm of W, g_NormW must be zero on entry
 ****************************************************/
 __global__ void FindNormW(float* g_VecW, float * g_NormW, int N)
 {
@@ -153,6 +330,9 @@ __global__ void FindNormW(float* g_VecW, float * g_NormW, int N)
   if (tid == 0) atomicAdd(g_NormW,sdata[0]);
 }
 
+/****************************************************
+Normalizes vector W : V = W/sqrt(g_NormW)
+****************************************************/
 __global__ void NormalizeW(float* g_VecW, float * g_NormW, float* g_VecV, int N)
 {
   // shared memory size declared at kernel launch
@@ -160,7 +340,7 @@ __global__ void NormalizeW(float* g_VecW, float * g_NormW, float* g_VecV, int N)
   unsigned int tid = threadIdx.x;
   unsigned int globalid = blockIdx.x*blockDim.x + threadIdx.x;
 
-  if(tid==0) sNormData[0] =  g_NormW[0];
+  if(tid==0) sNormData[0] =  sqrtf(g_NormW[0]);
   __syncthreads();
 
   // For thread ids greater than data space
@@ -199,16 +379,113 @@ __global__ void ComputeLamda( float* g_VecV, float* g_VecW, float * g_Lamda,int
   if (tid == 0) atomicAdd(g_Lamda,sdataVW[0]);
 }
 
+/****************************************************
+Convergence test of the device loop, one thread. Keeps the last lambda
+in g_OldLamda and resets the accumulators for the next iteration. Once
+g_Done is set, further iterations (until the host polls) leave the
+result alone.
+****************************************************/
+__global__ void CheckConvergence(float* g_NormW, float* g_Lamda, float* g_OldLamda, int* g_Done, int* g_Iter, float eps)
+{
+  if (!*g_Done)
+  {
+    if (fabsf(*g_OldLamda - *g_Lamda) < eps)
+      *g_Done = 1;
+    *g_OldLamda = *g_Lamda;
+    *g_Iter = *g_Iter + 1;
+  }
+  *g_Lamda = 0;
+  *g_NormW = 0;
+}
+
+/****************************************************
+Inner products of the Lanczos vectors: g_Proj[p*nb + c] is basis vector
+p times block vector c, one block of PROJ_THREADS threads per product,
+reduced in shared memory as in ComputeLamda. Each block writes its own
+entry, so g_Proj needs no zeroing and no atomics.
+****************************************************/
+__global__ void Project(const float* g_Basis, const float* g_Block, float* g_Proj, int nb, int N)
+{
+  // shared memory size declared at kernel launch
+  extern __shared__ float sdataP[];
+  unsigned int tid = threadIdx.x;
+  const float* x = g_Basis + (size_t)(blockIdx.x / nb) * N;
+  const float* y = g_Block + (size_t)(blockIdx.x % nb) * N;
+  float sum = 0;
+
+  for (int i = tid; i < N; i += blockDim.x)
+     sum += x[i] * y[i];
+  sdataP[tid] = sum;
+  __syncthreads();
+
+  // do reduction in shared mem
+  for (unsigned int s=blockDim.x / 2; s > 0; s = s >> 1) {
+     if (tid < s) {
+         sdataP[tid] = sdataP[tid] + sdataP[tid+ s];
+     }
+     __syncthreads();
+  }
+  if (tid == 0) g_Proj[blockIdx.x] = sdataP[0];
+}
+
+/****************************************************
+Block vector c -= sum over p < nvec of g_Proj[p*nb + c] * basis vector p,
+one thread per row; each element of the basis is read once for all
+nb vectors of the block.
+****************************************************/
+__global__ void Orthogonalize(const float* g_Basis, float* g_Block, const float* g_Proj, int nvec, int nb, int N)
+{
+  unsigned int globalid = blockIdx.x*blockDim.x + threadIdx.x;
+  float sum[MAX_BLOCK];
+
+  if (globalid >= N)
+     return;
+
+  #pragma unroll
+  for (int c = 0; c < MAX_BLOCK; c++)
+     sum[c] = 0;
+  for (int p = 0; p < nvec; p++) {
+     float x = g_Basis[(size_t)p * N + globalid];
+     #pragma unroll
+     for (int c = 0; c < MAX_BLOCK; c++)
+        if (c < nb)
+           sum[c] += x * __ldg(&g_Proj[p * nb + c]);
+  }
+  #pragma unroll
+  for (int c = 0; c < MAX_BLOCK; c++)
+     if (c < nb)
+        g_Block[(size_t)c * N + globalid] -= sum[c];
+}
+
+/****************************************************
+Out vector c = sum over k < nin of g_Mat[k*nout + c] * in vector k, for
+c < nout, one thread per row. Out must not overlap In.
+****************************************************/
+__global__ void Combine(const float* g_In, float* g_Out, const float* g_Mat, int nin, int nout, int N)
+{
+  unsigned int globalid = blockIdx.x*blockDim.x + threadIdx.x;
+
+  if (globalid >= N)
+     return;
+
+  for (int c = 0; c < nout; c++) {
+     float sum = 0;
+     for (int k = 0; k < nin; k++)
+        sum += g_In[(size_t)k * N + globalid] * __ldg(&g_Mat[k * nout + c]);
+     g_Out[(size_t)c * N + globalid] = sum;
+  }
+}
+
 void CPU_AvProduct()
 {
 	int N = GlobalSize;
-	int matIndex =0;
+	size_t matIndex =0;
     for(int i=0;i<N;i++)
 	{
 		h_VecW[i] = 0;
 		for(int j=0;j<N;j++)
 		{
-			matIndex = i*N + j;
+			matIndex = (size_t)i*N + j;
 			h_VecW[i] += h_MatA[matIndex] * h_VecV[j];
 			
 		}
@@ -263,6 +540,107 @@ void RunCPUPowerMethod()
 	
 }
 
+/*****************************************************************************
+Parallel CPU baseline. Rows are shared out over OpenMP threads, and each
+thread takes CPU_ROWS rows at a time so every element of V it loads is
+used for CPU_ROWS products; the inner loops are vectorised with omp simd
+(AVX2/AVX-512 when built with -march=native). Without OpenMP the same
+code runs on one core, still blocked and vectorised.
+*****************************************************************************/
+void CPU_AvProduct_Parallel()
+{
+	int N = GlobalSize;
+	const float* v = h_VecV;
+
+	#pragma omp parallel for schedule(static)
+	for (int i0 = 0; i0 < N; i0 += CPU_ROWS)
+	{
+		if (i0 + CPU_ROWS <= N)
+		{
+			const float* a0 = h_MatA + (size_t)i0 * N;
+			const float* a1 = a0 + N;
+			const float* a2 = a1 + N;
+			const float* a3 = a2 + N;
+			float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+			#pragma omp simd reduction(+:s0,s1,s2,s3)
+			for (int j = 0; j < N; j++)
+			{
+				s0 += a0[j] * v[j];
+				s1 += a1[j] * v[j];
+				s2 += a2[j] * v[j];
+				s3 += a3[j] * v[j];
+			}
+			h_VecW[i0] = s0;
+			h_VecW[i0+1] = s1;
+			h_VecW[i0+2] = s2;
+			h_VecW[i0+3] = s3;
+		}
+		else
+		{
+			for (int i = i0; i < N; i++)
+			{
+				const float* a = h_MatA + (size_t)i * N;
+				float s = 0;
+				#pragma omp simd reduction(+:s)
+				for (int j = 0; j < N; j++)
+					s += a[j] * v[j];
+				h_VecW[i] = s;
+			}
+		}
+	}
+}
+
+void CPU_NormalizeW_Parallel()
+{
+	int N = GlobalSize;
+	float normW=0;
+
+	#pragma omp parallel for simd reduction(+:normW)
+	for(int i=0;i<N;i++)
+		normW += h_VecW[i] * h_VecW[i];
+
+	normW = sqrt(normW);
+	#pragma omp parallel for simd
+	for(int i=0;i<N;i++)
+		h_VecV[i] = h_VecW[i]/normW;
+}
+
+float CPU_ComputeLamda_Parallel()
+{
+	int N = GlobalSize;
+	float lamda =0;
+
+	#pragma omp parallel for simd reduction(+:lamda)
+	for(int i=0;i<N;i++)
+		lamda += h_VecV[i] * h_VecW[i];
+
+	return lamda;
+}
+
+void RunCPUPowerMethodParallel()
+{
+	printf("*************************************\n");
+#ifdef _OPENMP
+	printf("CPU threads: %d\n", omp_get_max_threads());
+#endif
+	float oldLamda =0;
+	float lamda=0;
+
+	CPU_AvProduct_Parallel();
+
+	for (int i=0;i<max_iteration;i++)
+	{
+		CPU_NormalizeW_Parallel();
+		CPU_AvProduct_Parallel();
+		lamda= CPU_ComputeLamda_Parallel();
+		printf("CPU (parallel) lamda at %d: %f \n", i, lamda);
+		if(fabs(oldLamda - lamda) < EPS)
+			break;
+		oldLamda = lamda;
+	}
+	printf("*************************************\n");
+}
+
 // Host code
 int main(int argc, char** argv)
 {
@@ -274,7 +652,7 @@ int main(int argc, char** argv)
     int N = GlobalSize;
     printf("Matrix size %d X %d \n", N, N);
     size_t vec_size = N * sizeof(float);
-    size_t mat_size = N * N * sizeof(float);
+    size_t mat_size = (size_t)N * N * sizeof(float);
     size_t norm_size = sizeof(float);
     size_t lambda_size = sizeof(float);
   
@@ -294,13 +672,28 @@ int main(int argc, char** argv)
     UploadArray(h_MatA, N);
     InitOne(h_VecV,N);
 
-    printf("Power method in CPU starts\n");	   
-    clock_gettime(CLOCK_REALTIME,&t_start);
-    RunCPUPowerMethod();   // the lamda is already solved here
-    clock_gettime(CLOCK_REALTIME,&t_end);
-    runtime = (t_end.tv_sec - t_start.tv_sec) + 1e-9*(t_end.tv_nsec - t_start.tv_nsec);
-    printf("CPU: run time = %f secs.\n",runtime);
-    printf("Power method in CPU is finished\n");
+    if (cpu_mode & 1)
+    {
+        printf("Power method in CPU starts\n");	   
+        clock_gettime(CLOCK_REALTIME,&t_start);
+        RunCPUPowerMethod();   // the lamda is already solved here
+        clock_gettime(CLOCK_REALTIME,&t_end);
+        runtime = (t_end.tv_sec - t_start.tv_sec) + 1e-9*(t_end.tv_nsec - t_start.tv_nsec);
+        printf("CPU: run time = %f secs.\n",runtime);
+        printf("Power method in CPU is finished\n");
+    }
+
+    if (cpu_mode & 2)
+    {
+        InitOne(h_VecV,N);
+        printf("Power method in parallel CPU starts\n");
+        clock_gettime(CLOCK_REALTIME,&t_start);
+        RunCPUPowerMethodParallel();
+        clock_gettime(CLOCK_REALTIME,&t_end);
+        runtime = (t_end.tv_sec - t_start.tv_sec) + 1e-9*(t_end.tv_nsec - t_start.tv_nsec);
+        printf("CPU (parallel): run time = %f secs.\n",runtime);
+        printf("Power method in parallel CPU is finished\n");
+    }
     
     
     /////////////////////////////////////////////////
@@ -318,26 +711,55 @@ int main(int argc, char** argv)
     int sharedMemSize = threadsPerBlock * threadsPerBlock * sizeof(float); // in per block, the memory is shared   
     int blocksPerGrid = (N + threadsPerBlock - 1) / threadsPerBlock;
 
+    ConvertMatrix(N);
+    if (gemv_warp || eigen_mode == EIGEN_LANCZOS)
+        SetupWarpGEMV(N);
+
+    if (num_gpus > 1)
+    {
+        RunGPUMultiDevice();
+        clock_gettime(CLOCK_REALTIME,&t_end);
+        runtime = (t_end.tv_sec - t_start.tv_sec) + 1e-9*(t_end.tv_nsec - t_start.tv_nsec);
+        printf("GPU: run time = %f secs.\n",runtime);
+        Cleanup();
+        return 0;
+    }
+
     // Allocate matrix and vectors in device memory
-    cudaMalloc((void**)&d_MatA, mat_size); 
+    if (out_of_core)
+        SetupOutOfCore(N);
+    else
+    {
+        cudaMalloc((void**)&d_MatA, (size_t)N * N * mat_elem);
+        cudaMemcpy(d_MatA, h_MatStore, (size_t)N * N * mat_elem, cudaMemcpyHostToDevice);
+    }
     cudaMalloc((void**)&d_VecV, vec_size); 
     cudaMalloc((void**)&d_VecW, vec_size); // This vector is only used by the device
     cudaMalloc((void**)&d_NormW, norm_size); 
     cudaMalloc((void**)&d_Lambda, lambda_size);
 
     //Copy from host memory to device memory
-    cudaMemcpy(d_MatA, h_MatA, mat_size, cudaMemcpyHostToDevice);
     cudaMemcpy(d_VecV, h_VecV, vec_size, cudaMemcpyHostToDevice);
 	// cutilCheckError(cutStopTimer(timer_mem));
   
     clock_gettime(CLOCK_REALTIME,&t_end);
     runtime = (t_end.tv_sec - t_start.tv_sec) + 1e-9*(t_end.tv_nsec - t_start.tv_nsec);
     printf("GPU: memcpy run time = %f secs.\n",runtime);
+
+    if (eigen_mode == EIGEN_LANCZOS)
+    {
+        RunGPULanczos();
+        clock_gettime(CLOCK_REALTIME,&t_end);
+        runtime = (t_end.tv_sec - t_start.tv_sec) + 1e-9*(t_end.tv_nsec - t_start.tv_nsec);
+        printf("GPU: run time = %f secs.\n",runtime);
+        Cleanup();
+        return 0;
+    }
 	  
    //Power method loops
     float OldLambda = 0;
     
-    Av_Product<<<blocksPerGrid, threadsPerBlock, sharedMemSize>>>(d_MatA, d_VecV, d_VecW, N);
+    GPU_AvProduct(0);
     cudaThreadSynchronize(); //Needed, kind of barrier to sychronize all threads
 	
     // This part is the main code of the iteration process for the Power Method in GPU. 
@@ -356,7 +778,7 @@ int main(int argc, char** argv)
     
     /*
     Copied here for quick reference.
-    __global__ void Av_Product(float* g_MatA, float* g_VecV, float* g_VecW, int N);
+    __global__ void Av_Product(float* g_MatA, float* g_VecV, float* g_VecW, int rows, int N);
     __global__ void FindNormW(float* g_VecW, float* g_NormW, int N);
     __global__ void NormalizeW(float* g_VecW, float* g_NormW, float* g_VecV, int N);
     __global__ void ComputeLamda(float* g_VecV, float* g_VecW, float* g_Lamda, int N);
@@ -366,19 +788,16 @@ int main(int argc, char** argv)
     printf("*************************************\n");
   
     //power loop
-    for (int i = 0; i < max_iteration; i++)
+    for (int i = 0; i < max_iteration && !device_loop; i++)
     {
+      cudaMemset(d_NormW, 0, norm_size); // Set to zero.
       FindNormW<<<blocksPerGrid, threadsPerBlock, sharedMemSize>>>(d_VecW, d_NormW, N);
       cudaThreadSynchronize();
       
-      cudaMemcpy(h_NormW, d_NormW, norm_size, cudaMemcpyDeviceToHost); // Copy for next CPU operation.
-      *h_NormW = sqrt(*h_NormW);
-      cudaMemcpy(d_NormW, h_NormW, norm_size, cudaMemcpyHostToDevice); // Copy from previous CPU operation.
-      
       NormalizeW<<<blocksPerGrid, threadsPerBlock, sharedMemSize>>>(d_VecW, d_NormW, d_VecV, N);
       cudaThreadSynchronize();
       
-      Av_Product<<<blocksPerGrid, threadsPerBlock, sharedMemSize>>>(d_MatA, d_VecV, d_VecW, N);
+      GPU_AvProduct(0);
       cudaThreadSynchronize();
       
       ComputeLamda<<<blocksPerGrid, threadsPerBlock, sharedMemSize>>>(d_VecV, d_VecW, d_Lambda, N);
@@ -394,6 +813,8 @@ int main(int argc, char** argv)
       OldLambda = *h_Lambda;	
     
     }
+    if (device_loop)
+      RunGPUDeviceLoop(blocksPerGrid, threadsPerBlock, sharedMemSize);
     printf("*************************************\n");
 
     clock_gettime(CLOCK_REALTIME,&t_end);
@@ -402,6 +823,7 @@ int main(int argc, char** argv)
     // printf("Overall CPU Execution Time: %f (ms) \n", cutGetTimerValue(timer_CPU));
 
     Cleanup();
+    return 0;
 }
 
 void Cleanup(void)
@@ -417,6 +839,30 @@ void Cleanup(void)
 		    cudaFree(d_NormW);
     if (d_Lambda)
         cudaFree(d_Lambda);
+    if (d_OldLambda)
+        cudaFree(d_OldLambda);
+    if (d_Done)
+        cudaFree(d_Done);
+    if (d_Iter)
+        cudaFree(d_Iter);
+    if (d_Basis)
+        cudaFree(d_Basis);
+    if (d_Block)
+        cudaFree(d_Block);
+    if (d_Ritz)
+        cudaFree(d_Ritz);
+    if (d_Proj)
+        cudaFree(d_Proj);
+    for (int p = 0; p < 2; p++)
+        if (d_Panel[p])
+        {
+            cudaFree(d_Panel[p]);
+            cudaStreamDestroy(panelStream[p]);
+        }
+    if (out_of_core && h_MatStore)
+        cudaHostUnregister(h_MatStore);
+    if (h_MatStore && h_MatStore != h_MatA)
+        free(h_MatStore);
 		
     // Free host memory
     if (h_MatA)
@@ -429,8 +875,6 @@ void Cleanup(void)
         free(h_NormW);
     if (h_Lambda)
         free(h_Lambda);
-    
-    exit(0);
 }
 
 // Allocates an array with zero value.
@@ -443,14 +887,20 @@ void InitOne(float* data, int n)
 
 void UploadArray(float* data, int n)
 {
-   int total = n*n;
+   size_t total = (size_t)n*n;
    int value=1;
-    for (int i = 0; i < total; i++)
+    for (size_t i = 0; i < total; i++)
     {
     	data[i] = (int) (rand() % (int)(101));//1;//value;
 	    value ++; if(value>n) value =1;
       // data[i] = 1;
     }
+
+    // --symmetric: the lower triangle mirrors the upper one
+    if (symmetric)
+        for (int i = 1; i < n; i++)
+            for (int j = 0; j < i; j++)
+                data[(size_t)i*n + j] = data[(size_t)j*n + i];
 }
 
 // Obtain program arguments
@@ -468,9 +918,1016 @@ void Arguments(int argc, char** argv)
             max_iteration = atoi(argv[i+1]);
 		    i = i + 1;
         }
+        if (strcmp(argv[i], "--device_loop") == 0 || strcmp(argv[i], "-device_loop") == 0)
+            device_loop = 1;
+        if (strcmp(argv[i], "--graph") == 0 || strcmp(argv[i], "-graph") == 0)
+            device_loop = use_graph = 1;
+        if (strcmp(argv[i], "--check_interval") == 0 || strcmp(argv[i], "-check_interval") == 0)
+        {
+            check_interval = atoi(argv[i+1]);
+            if (check_interval < 1)
+                check_interval = 1;
+		    i = i + 1;
+        }
+        if (strcmp(argv[i], "--gemv") == 0 || strcmp(argv[i], "-gemv") == 0)
+        {
+            if (strcmp(argv[i+1], "warp") == 0)
+                gemv_warp = 1;
+            else if (strcmp(argv[i+1], "tiled") == 0)
+                gemv_warp = 0;
+            else
+            {
+                fprintf(stderr, "Unknown gemv kernel '%s', use tiled or warp.\n", argv[i+1]);
+                exit(1);
+            }
+		    i = i + 1;
+        }
+        if (strcmp(argv[i], "--gpus") == 0 || strcmp(argv[i], "-gpus") == 0)
+        {
+            num_gpus = atoi(argv[i+1]);
+            if (num_gpus < 1)
+                num_gpus = 1;
+            if (num_gpus > MAX_GPUS)
+                num_gpus = MAX_GPUS;
+		    i = i + 1;
+        }
+        if (strcmp(argv[i], "--matrix") == 0 || strcmp(argv[i], "-matrix") == 0)
+        {
+            if (strcmp(argv[i+1], "fp32") == 0)
+                matrix_type = MAT_FP32;
+            else if (strcmp(argv[i+1], "fp16") == 0)
+                matrix_type = MAT_FP16;
+#if CUDART_VERSION >= 11000
+            else if (strcmp(argv[i+1], "bf16") == 0)
+                matrix_type = MAT_BF16;
+#endif
+            else if (strcmp(argv[i+1], "int8") == 0)
+                matrix_type = MAT_INT8;
+            else
+            {
+                fprintf(stderr, "Unknown matrix storage '%s', use fp32, fp16, bf16 (CUDA 11+) or int8.\n", argv[i+1]);
+                exit(1);
+            }
+		    i = i + 1;
+        }
+        if (strcmp(argv[i], "--cpu") == 0 || strcmp(argv[i], "-cpu") == 0)
+        {
+            if (strcmp(argv[i+1], "serial") == 0)
+                cpu_mode = 1;
+            else if (strcmp(argv[i+1], "parallel") == 0)
+                cpu_mode = 2;
+            else if (strcmp(argv[i+1], "both") == 0)
+                cpu_mode = 3;
+            else if (strcmp(argv[i+1], "none") == 0)
+                cpu_mode = 0;
+            else
+            {
+                fprintf(stderr, "Unknown cpu mode '%s', use serial, parallel, both or none.\n", argv[i+1]);
+                exit(1);
+            }
+		    i = i + 1;
+        }
+        if (strcmp(argv[i], "--out_of_core") == 0 || strcmp(argv[i], "-out_of_core") == 0)
+            out_of_core = 1;
+        if (strcmp(argv[i], "--panel_rows") == 0 || strcmp(argv[i], "-panel_rows") == 0)
+        {
+            out_of_core = 1;
+            panel_rows = atoi(argv[i+1]);
+		    i = i + 1;
+        }
+        if (strcmp(argv[i], "--eigen") == 0 || strcmp(argv[i], "-eigen") == 0)
+        {
+            if (strcmp(argv[i+1], "power") == 0)
+                eigen_mode = EIGEN_POWER;
+            else if (strcmp(argv[i+1], "lanczos") == 0)
+                eigen_mode = EIGEN_LANCZOS;
+            else
+            {
+                fprintf(stderr, "Unknown eigen solver '%s', use power or lanczos.\n", argv[i+1]);
+                exit(1);
+            }
+		    i = i + 1;
+        }
+        if (strcmp(argv[i], "--nev") == 0 || strcmp(argv[i], "-nev") == 0)
+        {
+            num_eigen = atoi(argv[i+1]);
+            if (num_eigen < 1)
+                num_eigen = 1;
+            if (num_eigen > MAX_BLOCK)
+                num_eigen = MAX_BLOCK;
+		    i = i + 1;
+        }
+        if (strcmp(argv[i], "--block") == 0 || strcmp(argv[i], "-block") == 0)
+        {
+            block_vectors = atoi(argv[i+1]);
+            if (block_vectors < 1)
+                block_vectors = 1;
+            if (block_vectors > MAX_BLOCK)
+                block_vectors = MAX_BLOCK;
+		    i = i + 1;
+        }
+        if (strcmp(argv[i], "--symmetric") == 0 || strcmp(argv[i], "-symmetric") == 0)
+            symmetric = 1;
+    }
+    if (eigen_mode == EIGEN_LANCZOS)
+    {
+        if (!symmetric)
+        {
+            printf("Lanczos needs a symmetric A, using --symmetric.\n");
+            symmetric = 1;
+        }
+        if (num_gpus > 1 || out_of_core)
+        {
+            printf("Lanczos needs A resident on one GPU, using one GPU in core.\n");
+            num_gpus = 1;
+            out_of_core = 0;
+        }
+        device_loop = use_graph = 0;
+    }
+    if (num_gpus > 1 && out_of_core)
+    {
+        fprintf(stderr, "--gpus and --out_of_core cannot be combined.\n");
+        exit(1);
+    }
+    if (matrix_type != MAT_FP32 && !gemv_warp)
+    {
+        printf("Reduced storage of A needs the warp GEMV, using --gemv warp.\n");
+        gemv_warp = 1;
+    }
+    if ((num_gpus > 1 || out_of_core) && device_loop)
+    {
+        printf("The device loop needs A resident on one GPU, using the host loop.\n");
+        device_loop = use_graph = 0;
+    }
+}
+
+
+/*****************************************************************************
+Builds h_MatStore, the copy of A that is uploaded, in the --matrix type.
+fp16 holds integers up to 2048 exactly and bf16 up to 256, so the
+0..100 matrices of UploadArray lose nothing. int8 stores integer
+matrices within -127..127 as they are, anything else is rounded to
+multiples of matrix_scale = max|a| / 127.
+*****************************************************************************/
+void ConvertMatrix(int N)
+{
+    size_t total = (size_t)N * N;
+    float maxAbs = 0;
+    int integral = 1;
+
+    if (matrix_type == MAT_FP32)
+    {
+        h_MatStore = h_MatA;
+        mat_elem = sizeof(float);
+        return;
+    }
+
+    mat_elem = matrix_type == MAT_INT8 ? sizeof(signed char) : sizeof(__half);
+    h_MatStore = malloc(total * mat_elem);
+    if (!h_MatStore)
+    {
+        fprintf(stderr, "Could not allocate the converted matrix.\n");
+        exit(1);
+    }
+
+    switch (matrix_type)
+    {
+    case MAT_FP16:
+        for (size_t i = 0; i < total; i++)
+            ((__half*)h_MatStore)[i] = __float2half(h_MatA[i]);
+        break;
+#if CUDART_VERSION >= 11000
+    case MAT_BF16:
+        for (size_t i = 0; i < total; i++)
+            ((__nv_bfloat16*)h_MatStore)[i] = __float2bfloat16(h_MatA[i]);
+        break;
+#endif
+    case MAT_INT8:
+        for (size_t i = 0; i < total; i++)
+        {
+            if (fabsf(h_MatA[i]) > maxAbs)
+                maxAbs = fabsf(h_MatA[i]);
+            if (h_MatA[i] != floorf(h_MatA[i]))
+                integral = 0;
+        }
+        matrix_scale = (integral && maxAbs <= 127) || maxAbs == 0 ? 1 : maxAbs / 127;
+        for (size_t i = 0; i < total; i++)
+            ((signed char*)h_MatStore)[i] = (signed char)lrintf(h_MatA[i] / matrix_scale);
+        break;
+    }
+    printf("Matrix stored in %d bytes per element, scale %g\n", (int)mat_elem, matrix_scale);
+}
+
+/*****************************************************************************
+Picks the Av_Product_Warp launch: the block size that gives the highest
+occupancy, and enough blocks to fill the device but no more than there
+are rows for.
+*****************************************************************************/
+void SetupWarpGEMV(int N)
+{
+    int minGridSize, maxBlocks;
+
+    switch (matrix_type)
+    {
+    case MAT_FP16:
+        cudaOccupancyMaxPotentialBlockSize(&minGridSize, &gemvThreads, Av_Product_Warp<__half>, 0, 0);
+        break;
+#if CUDART_VERSION >= 11000
+    case MAT_BF16:
+        cudaOccupancyMaxPotentialBlockSize(&minGridSize, &gemvThreads, Av_Product_Warp<__nv_bfloat16>, 0, 0);
+        break;
+#endif
+    case MAT_INT8:
+        cudaOccupancyMaxPotentialBlockSize(&minGridSize, &gemvThreads, Av_Product_Warp<signed char>, 0, 0);
+        break;
+    default:
+        cudaOccupancyMaxPotentialBlockSize(&minGridSize, &gemvThreads, Av_Product_Warp<float>, 0, 0);
+    }
+    gemvThreads -= gemvThreads % 32;
+    if (gemvThreads < 32)
+        gemvThreads = 32;
+    maxBlocks = (N + gemvThreads / 32 - 1) / (gemvThreads / 32);
+    gemvBlocks = minGridSize < maxBlocks ? minGridSize : maxBlocks;
+    printf("GEMV: warp per row, %d blocks of %d threads\n", gemvBlocks, gemvThreads);
+}
+
+// Queues W = A V on 'stream' for 'rows' rows of A, with the kernel chosen by --gemv
+void LaunchAvProduct(cudaStream_t stream, const void* A, float* V, float* W, int rows)
+{
+    int N = GlobalSize;
+
+    if (gemv_warp)
+    {
+        int warpsPerBlock = gemvThreads / 32;
+        int blocks = (rows + warpsPerBlock - 1) / warpsPerBlock;
+        if (blocks > gemvBlocks)
+            blocks = gemvBlocks;
+        switch (matrix_type)
+        {
+        case MAT_FP16:
+            Av_Product_Warp<<<blocks, gemvThreads, 0, stream>>>((const __half*)A, V, W, rows, N, 1.0f);
+            break;
+#if CUDART_VERSION >= 11000
+        case MAT_BF16:
+            Av_Product_Warp<<<blocks, gemvThreads, 0, stream>>>((const __nv_bfloat16*)A, V, W, rows, N, 1.0f);
+            break;
+#endif
+        case MAT_INT8:
+            Av_Product_Warp<<<blocks, gemvThreads, 0, stream>>>((const signed char*)A, V, W, rows, N, matrix_scale);
+            break;
+        default:
+            Av_Product_Warp<<<blocks, gemvThreads, 0, stream>>>((const float*)A, V, W, rows, N, 1.0f);
+        }
+    }
+    else
+    {
+        int threadsPerBlock = BlockSize;
+        int sharedMemSize = threadsPerBlock * threadsPerBlock * sizeof(float);
+        int blocksPerGrid = (rows + threadsPerBlock - 1) / threadsPerBlock;
+        Av_Product<<<blocksPerGrid, threadsPerBlock, sharedMemSize, stream>>>((float*)A, V, W, rows, N);
+    }
+}
+
+/*****************************************************************************
+d_VecW = A d_VecV on one GPU. With A resident this is a single launch on
+'stream'. Out of core, the row panels of A are copied from pinned host
+memory into two device buffers on two streams, so the copy of the next
+panel overlaps the product of the current one; a buffer is only refilled
+after the product queued before it on the same stream. Out of core the
+call returns with work still queued on the panel streams, the caller
+synchronises.
+*****************************************************************************/
+void GPU_AvProduct(cudaStream_t stream)
+{
+    int N = GlobalSize;
+
+    if (!out_of_core)
+    {
+        LaunchAvProduct(stream, d_MatA, d_VecV, d_VecW, N);
+        return;
+    }
+
+    for (int row = 0, p = 0; row < N; row += panel_rows, p ^= 1)
+    {
+        int rows = N - row < panel_rows ? N - row : panel_rows;
+        cudaMemcpyAsync(d_Panel[p], (char*)h_MatStore + (size_t)row * N * mat_elem, (size_t)rows * N * mat_elem,
+                        cudaMemcpyHostToDevice, panelStream[p]);
+        LaunchAvProduct(panelStream[p], d_Panel[p], d_VecV, d_VecW + row, rows);
+    }
+}
+
+/*****************************************************************************
+Prepares the out-of-core mode: pins h_MatStore so the panel copies are
+asynchronous, and allocates the two panel buffers. Without --panel_rows
+the buffers take half of the free device memory.
+*****************************************************************************/
+void SetupOutOfCore(int N)
+{
+    size_t freeMem, totalMem;
+    size_t rowBytes = (size_t)N * mat_elem;
+
+    if (panel_rows <= 0)
+    {
+        cudaMemGetInfo(&freeMem, &totalMem);
+        size_t rows = freeMem / 4 / rowBytes;
+        panel_rows = rows < (size_t)N ? (int)rows : N;
+    }
+    if (panel_rows > N)
+        panel_rows = N;
+    if (panel_rows < 1)
+    {
+        fprintf(stderr, "Not enough device memory for one row panel.\n");
+        exit(1);
+    }
+
+    cudaHostRegister(h_MatStore, (size_t)N * rowBytes, cudaHostRegisterDefault);
+    for (int p = 0; p < 2; p++)
+    {
+        cudaMalloc((void**)&d_Panel[p], (size_t)panel_rows * rowBytes);
+        cudaStreamCreate(&panelStream[p]);
+    }
+    printf("Out of core: panels of %d rows\n", panel_rows);
+}
+
+/*****************************************************************************
+Power method with the rows of A split in contiguous blocks over num_gpus
+devices. Each device keeps its block of A, its part of W and a full copy
+of V. The partial norms and lambdas are summed on the host, and after
+normalisation each device's part of V is gathered in h_VecV and the whole
+vector is copied back to every device (allgather through the host).
+*****************************************************************************/
+void RunGPUMultiDevice(void)
+{
+    int N = GlobalSize;
+    int threadsPerBlock = BlockSize;
+    int sharedMemSize = threadsPerBlock * threadsPerBlock * sizeof(float);
+    int ndev = 0;
+    int row0[MAX_GPUS + 1];
+    void* m_MatA[MAX_GPUS];
+    float* m_VecV[MAX_GPUS];
+    float* m_VecW[MAX_GPUS];
+    float* m_NormW[MAX_GPUS];
+    float* m_Lambda[MAX_GPUS];
+    float partial[MAX_GPUS];
+    cudaStream_t stream[MAX_GPUS];
+    float OldLambda = 0, norm, lambda;
+
+    cudaGetDeviceCount(&ndev);
+    if (ndev < num_gpus)
+    {
+        fprintf(stderr, "Asked for %d GPUs, only %d present.\n", num_gpus, ndev);
+        exit(1);
+    }
+
+    for (int d = 0; d <= num_gpus; d++)
+        row0[d] = (int)((long)N * d / num_gpus);
+
+    cudaHostRegister(h_VecV, N * sizeof(float), cudaHostRegisterDefault);
+    for (int d = 0; d < num_gpus; d++)
+    {
+        int rows = row0[d+1] - row0[d];
+        cudaSetDevice(d);
+        cudaStreamCreate(&stream[d]);
+        cudaMalloc((void**)&m_MatA[d], (size_t)rows * N * mat_elem);
+        cudaMalloc((void**)&m_VecV[d], N * sizeof(float));
+        cudaMalloc((void**)&m_VecW[d], rows * sizeof(float));
+        cudaMalloc((void**)&m_NormW[d], sizeof(float));
+        cudaMalloc((void**)&m_Lambda[d], sizeof(float));
+        cudaMemcpyAsync(m_MatA[d], (char*)h_MatStore + (size_t)row0[d] * N * mat_elem, (size_t)rows * N * mat_elem,
+                        cudaMemcpyHostToDevice, stream[d]);
+        cudaMemcpyAsync(m_VecV[d], h_VecV, N * sizeof(float), cudaMemcpyHostToDevice, stream[d]);
+        LaunchAvProduct(stream[d], m_MatA[d], m_VecV[d], m_VecW[d], rows);
+    }
+
+    printf("*************************************\n");
+    for (int i = 0; i < max_iteration; i++)
+    {
+        // squared norm of W, summed over the devices
+        for (int d = 0; d < num_gpus; d++)
+        {
+            int rows = row0[d+1] - row0[d];
+            cudaSetDevice(d);
+            cudaMemsetAsync(m_NormW[d], 0, sizeof(float), stream[d]);
+            FindNormW<<<(rows + threadsPerBlock - 1) / threadsPerBlock, threadsPerBlock, sharedMemSize, stream[d]>>>(m_VecW[d], m_NormW[d], rows);
+            cudaMemcpyAsync(&partial[d], m_NormW[d], sizeof(float), cudaMemcpyDeviceToHost, stream[d]);
+        }
+        norm = 0;
+        for (int d = 0; d < num_gpus; d++)
+        {
+            cudaSetDevice(d);
+            cudaStreamSynchronize(stream[d]);
+            norm += partial[d];
+        }
+
+        // each device normalises its part of W into its part of V
+        for (int d = 0; d < num_gpus; d++)
+        {
+            int rows = row0[d+1] - row0[d];
+            cudaSetDevice(d);
+            cudaMemcpyAsync(m_NormW[d], &norm, sizeof(float), cudaMemcpyHostToDevice, stream[d]);
+            NormalizeW<<<(rows + threadsPerBlock - 1) / threadsPerBlock, threadsPerBlock, sharedMemSize, stream[d]>>>(m_VecW[d], m_NormW[d], m_VecV[d] + row0[d], rows);
+            cudaMemcpyAsync(h_VecV + row0[d], m_VecV[d] + row0[d], rows * sizeof(float), cudaMemcpyDeviceToHost, stream[d]);
+        }
+        for (int d = 0; d < num_gpus; d++)
+        {
+            cudaSetDevice(d);
+            cudaStreamSynchronize(stream[d]);
+        }
+
+        // allgather of V, then W = A V and the partial lambdas
+        for (int d = 0; d < num_gpus; d++)
+        {
+            int rows = row0[d+1] - row0[d];
+            cudaSetDevice(d);
+            cudaMemcpyAsync(m_VecV[d], h_VecV, N * sizeof(float), cudaMemcpyHostToDevice, stream[d]);
+            LaunchAvProduct(stream[d], m_MatA[d], m_VecV[d], m_VecW[d], rows);
+            cudaMemsetAsync(m_Lambda[d], 0, sizeof(float), stream[d]);
+            ComputeLamda<<<(rows + threadsPerBlock - 1) / threadsPerBlock, threadsPerBlock, sharedMemSize, stream[d]>>>(m_VecV[d] + row0[d], m_VecW[d], m_Lambda[d], rows);
+            cudaMemcpyAsync(&partial[d], m_Lambda[d], sizeof(float), cudaMemcpyDeviceToHost, stream[d]);
+        }
+        lambda = 0;
+        for (int d = 0; d < num_gpus; d++)
+        {
+            cudaSetDevice(d);
+            cudaStreamSynchronize(stream[d]);
+            lambda += partial[d];
+        }
+
+        printf("GPU lambda at %d: %f \n", i, lambda);
+
+        // If residual is less than epsilon break
+        if(fabs(OldLambda - lambda) < EPS)
+            break;
+        OldLambda = lambda;
+    }
+    printf("*************************************\n");
+
+    for (int d = 0; d < num_gpus; d++)
+    {
+        cudaSetDevice(d);
+        cudaFree(m_MatA[d]);
+        cudaFree(m_VecV[d]);
+        cudaFree(m_VecW[d]);
+        cudaFree(m_NormW[d]);
+        cudaFree(m_Lambda[d]);
+        cudaStreamDestroy(stream[d]);
+    }
+    cudaSetDevice(0);
+    cudaHostUnregister(h_VecV);
+}
+
+// Queues one iteration of the device loop on 'stream'
+void LaunchIteration(cudaStream_t stream, int blocksPerGrid, int threadsPerBlock, int sharedMemSize)
+{
+    int N = GlobalSize;
+
+    FindNormW<<<blocksPerGrid, threadsPerBlock, sharedMemSize, stream>>>(d_VecW, d_NormW, N);
+    NormalizeW<<<blocksPerGrid, threadsPerBlock, sharedMemSize, stream>>>(d_VecW, d_NormW, d_VecV, N);
+    GPU_AvProduct(stream);
+    ComputeLamda<<<blocksPerGrid, threadsPerBlock, sharedMemSize, stream>>>(d_VecV, d_VecW, d_Lambda, N);
+    CheckConvergence<<<1, 1, 0, stream>>>(d_NormW, d_Lambda, d_OldLambda, d_Done, d_Iter, EPS);
+}
+
+/*****************************************************************************
+Power loop without host synchronisation. The kernels of an iteration are
+queued on one stream, or replayed from a CUDA graph captured once, and
+the host only reads the convergence flag every check_interval iterations.
+Up to check_interval - 1 iterations past convergence are queued, these do
+not change the result.
+*****************************************************************************/
+void RunGPUDeviceLoop(int blocksPerGrid, int threadsPerBlock, int sharedMemSize)
+{
+    int h_Done = 0, h_Iter = 0;
+    cudaStream_t stream;
+    cudaGraph_t graph;
+    cudaGraphExec_t graphExec;
+
+    cudaMalloc((void**)&d_OldLambda, sizeof(float));
+    cudaMalloc((void**)&d_Done, sizeof(int));
+    cudaMalloc((void**)&d_Iter, sizeof(int));
+    cudaMemset(d_NormW, 0, sizeof(float));
+    cudaMemset(d_Lambda, 0, sizeof(float));
+    cudaMemset(d_OldLambda, 0, sizeof(float));
+    cudaMemset(d_Done, 0, sizeof(int));
+    cudaMemset(d_Iter, 0, sizeof(int));
+    cudaStreamCreate(&stream);
+
+    if (use_graph)
+    {
+#if CUDART_VERSION >= 10010
+        cudaStreamBeginCapture(stream, cudaStreamCaptureModeGlobal);
+#else
+        cudaStreamBeginCapture(stream);
+#endif
+        LaunchIteration(stream, blocksPerGrid, threadsPerBlock, sharedMemSize);
+        cudaStreamEndCapture(stream, &graph);
+#if CUDART_VERSION >= 12000
+        cudaGraphInstantiate(&graphExec, graph, 0);
+#else
+        cudaGraphInstantiate(&graphExec, graph, NULL, NULL, 0);
+#endif
+    }
+
+    for (int i = 0; i < max_iteration && !h_Done; )
+    {
+        for (int k = 0; k < check_interval && i < max_iteration; k++, i++)
+        {
+            if (use_graph)
+                cudaGraphLaunch(graphExec, stream);
+            else
+                LaunchIteration(stream, blocksPerGrid, threadsPerBlock, sharedMemSize);
+        }
+        cudaMemcpyAsync(&h_Done, d_Done, sizeof(int), cudaMemcpyDeviceToHost, stream);
+        cudaStreamSynchronize(stream);
+    }
+
+    cudaMemcpy(&h_Iter, d_Iter, sizeof(int), cudaMemcpyDeviceToHost);
+    cudaMemcpy(h_Lambda, d_OldLambda, sizeof(float), cudaMemcpyDeviceToHost);
+    printf("GPU lambda after %d iterations: %f \n", h_Iter, *h_Lambda);
+
+    if (use_graph)
+    {
+        cudaGraphExecDestroy(graphExec);
+        cudaGraphDestroy(graph);
+    }
+    cudaStreamDestroy(stream);
+}
+
+/*****************************************************************************
+Block Lanczos for the num_eigen eigenpairs of largest magnitude of a
+symmetric A. Each step multiplies the newest block of nb = block_vectors
+orthonormal vectors by A in one pass over the matrix (Av_Product_Block,
+or the --gemv kernel of the power method for nb = 1), orthogonalises the
+product twice against the whole basis (in float the vectors lose their
+orthogonality otherwise) and takes its Cholesky QR as the next block.
+The inner products build T = V' A V, block tridiagonal, whose eigenpairs
+(the Ritz pairs) approximate those of A; the residual of a Ritz pair is
+|| R * last block of its eigenvector of T || with R the coupling to the
+next block, so the test needs no extra pass over A. Every check_interval
+steps the Ritz pairs are tested, and the run stops once the num_eigen
+largest have residual < EPS * |lambda|, or after max_iteration passes.
+The basis grows by nb vectors per pass, so wider blocks converge in
+fewer passes over the matrix.
+*****************************************************************************/
+void RunGPULanczos(void)
+{
+    int N = GlobalSize;
+    int nb = block_vectors;
+    int nev = num_eigen;
+    int steps = max_iteration < N / nb ? max_iteration : N / nb;
+    int nmax = (steps + 1) * nb;      // basis vectors, the last block only for R
+    int ncol = nev > nb ? nev : nb;
+    int threadsPerBlock = BlockSize;
+    int blocksPerGrid = (N + threadsPerBlock - 1) / threadsPerBlock;
+    int n = 0, j, converged = 0;
+    double R[MAX_BLOCK * MAX_BLOCK], res[MAX_BLOCK], worst;
+    double *h_T, *h_S, *theta;
+    float *h_Proj, *h_X, *h_AX;
+
+    if (steps < 1 || steps * nb < nev)
+    {
+        fprintf(stderr, "Lanczos: %d passes of %d vectors cannot give %d eigenpairs.\n", steps, nb, nev);
+        exit(1);
+    }
+
+    cudaMalloc((void**)&d_Basis, (size_t)nmax * N * sizeof(float));
+    cudaMalloc((void**)&d_Block, (size_t)ncol * N * sizeof(float));
+    cudaMalloc((void**)&d_Ritz, (size_t)nev * N * sizeof(float));
+    cudaMalloc((void**)&d_Proj, (size_t)nmax * ncol * sizeof(float));
+    h_T = (double*)calloc((size_t)nmax * nmax, sizeof(double));
+    h_S = (double*)malloc((size_t)nmax * nmax * sizeof(double));
+    theta = (double*)malloc(nmax * sizeof(double));
+    h_Proj = (float*)malloc((size_t)nmax * ncol * sizeof(float));
+    h_X = (float*)malloc((size_t)ncol * N * sizeof(float));
+    h_AX = (float*)malloc((size_t)nev * N * sizeof(float));
+    if (!h_T || !h_S || !theta || !h_Proj || !h_X || !h_AX)
+    {
+        fprintf(stderr, "Lanczos: could not allocate the host arrays.\n");
+        exit(1);
+    }
+
+    // first block: V of InitOne for one vector, random vectors for more
+    if (nb == 1)
+        cudaMemcpy(d_Block, h_VecV, N * sizeof(float), cudaMemcpyHostToDevice);
+    else
+    {
+        for (size_t i = 0; i < (size_t)nb * N; i++)
+            h_X[i] = (rand() % 101 - 50) / 50.0f;
+        cudaMemcpy(d_Block, h_X, (size_t)nb * N * sizeof(float), cudaMemcpyHostToDevice);
+    }
+    BlockQR(d_Block, d_Basis, R, nb);
+
+    printf("*************************************\n");
+    for (j = 0; j < steps && !converged; j++)
+    {
+        int nvec = (j + 1) * nb;      // blocks 0 .. j of the basis
+
+        LaunchAvBlock(0, d_Basis + (size_t)j * nb * N, d_Block, nb);
+
+        // classical Gram-Schmidt against the whole basis, twice
+        for (int pass = 0; pass < 2; pass++)
+        {
+            Project<<<nvec * nb, PROJ_THREADS, PROJ_THREADS * sizeof(float)>>>(d_Basis, d_Block, d_Proj, nb, N);
+            cudaMemcpy(h_Proj, d_Proj, (size_t)nvec * nb * sizeof(float), cudaMemcpyDeviceToHost);
+            for (int p = 0; p < nvec; p++)
+                for (int c = 0; c < nb; c++)
+                    h_T[(size_t)p * nmax + j * nb + c] += h_Proj[p * nb + c];
+            Orthogonalize<<<blocksPerGrid, threadsPerBlock>>>(d_Basis, d_Block, d_Proj, nvec, nb, N);
+        }
+
+        // the next block, and its coupling R below the diagonal of T
+        BlockQR(d_Block, d_Basis + (size_t)nvec * N, R, nb);
+        for (int r = 0; r < nb; r++)
+            for (int c = 0; c < nb; c++)
+                h_T[(size_t)(nvec + r) * nmax + j * nb + c] = R[r * nb + c];
+        n = nvec;
+
+        if (((j + 1) % check_interval == 0 || j + 1 == steps) && n >= nev)
+        {
+            worst = RitzPairs(h_T, nmax, n, nb, h_S, theta, res, n - nb);
+            converged = worst < EPS;
+            printf("GPU Lanczos at %d: lambda %f, largest relative residual %g \n", j + 1, theta[0], worst);
+        }
+    }
+    printf("*************************************\n");
+
+    // eigenvectors X = V S, checked with one more pass: |A x - lambda x|
+    RitzPairs(h_T, nmax, n, nb, h_S, theta, res, 0);
+    for (int k = 0; k < n; k++)
+        for (int c = 0; c < nev; c++)
+            h_Proj[k * nev + c] = (float)h_S[(size_t)k * n + c];
+    cudaMemcpy(d_Proj, h_Proj, (size_t)n * nev * sizeof(float), cudaMemcpyHostToDevice);
+    Combine<<<blocksPerGrid, threadsPerBlock>>>(d_Basis, d_Ritz, d_Proj, n, nev, N);
+    LaunchAvBlock(0, d_Ritz, d_Block, nev);
+    cudaMemcpy(h_X, d_Ritz, (size_t)nev * N * sizeof(float), cudaMemcpyDeviceToHost);
+    cudaMemcpy(h_AX, d_Block, (size_t)nev * N * sizeof(float), cudaMemcpyDeviceToHost);
+
+    for (int c = 0; c < nev; c++)
+    {
+        double e = 0, d;
+        for (int i = 0; i < N; i++)
+        {
+            d = h_AX[(size_t)c * N + i] - theta[c] * h_X[(size_t)c * N + i];
+            e += d * d;
+        }
+        printf("GPU eigenvalue %d: %f, |Ax - lambda x| = %g \n", c, theta[c], sqrt(e));
+    }
+    printf("GPU Lanczos: %d passes over A with %d vectors each%s\n", j, nb, converged ? "" : ", not converged");
+
+    free(h_T);
+    free(h_S);
+    free(theta);
+    free(h_Proj);
+    free(h_X);
+    free(h_AX);
+}
+
+// Queues W = A V on 'stream' for nb vectors (vector c at c*N) of the resident A,
+// one vector with the --gemv kernel of LaunchAvProduct, more with Av_Product_Block
+void LaunchAvBlock(cudaStream_t stream, float* V, float* W, int nb)
+{
+    int N = GlobalSize;
+    int warpsPerBlock = gemvThreads / 32;
+    int blocks = (N + warpsPerBlock - 1) / warpsPerBlock;
+
+    if (nb == 1)
+    {
+        LaunchAvProduct(stream, d_MatA, V, W, N);
+        return;
+    }
+    if (blocks > gemvBlocks)
+        blocks = gemvBlocks;
+    switch (matrix_type)
+    {
+    case MAT_FP16:
+        Av_Product_Block<<<blocks, gemvThreads, 0, stream>>>((const __half*)d_MatA, V, W, N, N, nb, 1.0f);
+        break;
+#if CUDART_VERSION >= 11000
+    case MAT_BF16:
+        Av_Product_Block<<<blocks, gemvThreads, 0, stream>>>((const __nv_bfloat16*)d_MatA, V, W, N, N, nb, 1.0f);
+        break;
+#endif
+    case MAT_INT8:
+        Av_Product_Block<<<blocks, gemvThreads, 0, stream>>>((const signed char*)d_MatA, V, W, N, N, nb, matrix_scale);
+        break;
+    default:
+        Av_Product_Block<<<blocks, gemvThreads, 0, stream>>>((const float*)d_MatA, V, W, N, N, nb, 1.0f);
     }
 }
 
+/*****************************************************************************
+Cholesky QR of the nb vectors in d_X: G = X'X = L L', Q = X L^-T, so
+that X = Q R with R = L'. A second pass over Q (CholQR2) makes Q
+orthonormal to float precision. Q goes to d_Q, d_X is overwritten and R
+is nb x nb, row major. A vector in the span of the ones before it comes
+out as zero, with a zero row in R.
+*****************************************************************************/
+void BlockQR(float* d_X, float* d_Q, double* R, int nb)
+{
+    int N = GlobalSize;
+    int threadsPerBlock = BlockSize;
+    int blocksPerGrid = (N + threadsPerBlock - 1) / threadsPerBlock;
+    float G[MAX_BLOCK * MAX_BLOCK], M[MAX_BLOCK * MAX_BLOCK];
+    double L[MAX_BLOCK * MAX_BLOCK], Minv[MAX_BLOCK * MAX_BLOCK], Rnew[MAX_BLOCK * MAX_BLOCK];
+
+    for (int i = 0; i < nb * nb; i++)
+        R[i] = i % (nb + 1) == 0;
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        float* in = pass == 0 ? d_X : d_Q;
+        float* out = pass == 0 ? d_Q : d_X;
+
+        Project<<<nb * nb, PROJ_THREADS, PROJ_THREADS * sizeof(float)>>>(in, in, d_Proj, nb, N);
+        cudaMemcpy(G, d_Proj, nb * nb * sizeof(float), cudaMemcpyDeviceToHost);
+
+        // G = L L', L lower triangular
+        for (int p = 0; p < nb; p++)
+            for (int q = 0; q < nb; q++)
+            {
+                double s = G[p * nb + q];
+                if (q > p)
+                {
+                    L[p * nb + q] = 0;
+                    continue;
+                }
+                for (int k = 0; k < q; k++)
+                    s -= L[p * nb + k] * L[q * nb + k];
+                if (p == q)
+                    L[p * nb + p] = s > 0 ? sqrt(s) : 0;
+                else
+                    L[p * nb + q] = L[q * nb + q] > 0 ? s / L[q * nb + q] : 0;
+            }
+
+        // L' Minv = I, Minv upper triangular
+        for (int c = 0; c < nb; c++)
+            for (int i = nb - 1; i >= 0; i--)
+            {
+                double s = i == c;
+                for (int k = i + 1; k < nb; k++)
+                    s -= L[k * nb + i] * Minv[k * nb + c];
+                Minv[i * nb + c] = L[i * nb + i] > 0 ? s / L[i * nb + i] : 0;
+            }
+        for (int i = 0; i < nb * nb; i++)
+            M[i] = (float)Minv[i];
+        cudaMemcpy(d_Proj, M, nb * nb * sizeof(float), cudaMemcpyHostToDevice);
+        Combine<<<blocksPerGrid, threadsPerBlock>>>(in, out, d_Proj, nb, nb, N);
+
+        // R = L' R
+        for (int p = 0; p < nb; p++)
+            for (int c = 0; c < nb; c++)
+            {
+                double s = 0;
+                for (int k = p; k < nb; k++)
+                    s += L[k * nb + p] * R[k * nb + c];
+                Rnew[p * nb + c] = s;
+            }
+        memcpy(R, Rnew, nb * nb * sizeof(double));
+    }
+    cudaMemcpy(d_Q, d_X, (size_t)nb * N * sizeof(float), cudaMemcpyDeviceToDevice);
+}
+
+/*****************************************************************************
+Ritz pairs of a Lanczos basis of n vectors in blocks of nb: S and theta
+become the eigenvectors (columns) and eigenvalues of the symmetrised
+leading n x n part of T, leading dimension ld, and res[i] the residual
+of pair i < num_eigen. Only the eigenvector rows from 'first' on are
+needed for the residuals, the final call takes all of them. Returns the
+largest residual relative to |theta|.
+*****************************************************************************/
+double RitzPairs(const double* T, int ld, int n, int nb, double* S, double* theta, double* res, int first)
+{
+    double worst = 0;
+
+    for (int i = 0; i < n; i++)
+        for (int k = 0; k < n; k++)
+            S[(size_t)i * n + k] = 0.5 * (T[(size_t)i * ld + k] + T[(size_t)k * ld + i]);
+    SymEigen(S, theta, n, first);
+
+    for (int i = 0; i < num_eigen; i++)
+    {
+        double e = 0;
+        for (int r = 0; r < nb; r++)
+        {
+            double s = 0;
+            for (int c = 0; c < nb; c++)
+                s += T[(size_t)(n + r) * ld + n - nb + c] * S[(size_t)(n - nb + c) * n + i];
+            e += s * s;
+        }
+        res[i] = sqrt(e);
+        if (res[i] > worst * fabs(theta[i]))
+            worst = fabs(theta[i]) > 0 ? res[i] / fabs(theta[i]) : res[i];
+    }
+    return worst;
+}
+
+/*****************************************************************************
+Eigenvalues and eigenvectors of the symmetric n x n matrix H (row
+major): Householder reduction to tridiagonal form and the implicit QL
+method (tred2 and tql2 of EISPACK). H is overwritten by the eigenvectors
+as columns, with theta sorted by decreasing magnitude. The rotations of
+the QL steps, most of the work, are only applied to the rows from
+'first' on; the rows before are then left incomplete.
+*****************************************************************************/
+void SymEigen(double* H, double* theta, int n, int first)
+{
+    double* e = (double*)malloc(n * sizeof(double));
+    double* d = theta;
+    double f, g, h, hh, scale, p, r, c, c2, c3, s, s2, dl1, el1, tst1 = 0;
+    const double eps = 2.220446049250313e-16;
+    #define V(i, j) H[(size_t)(i) * n + (j)]
+
+    if (!e)
+    {
+        fprintf(stderr, "SymEigen: could not allocate %d values.\n", n);
+        exit(1);
+    }
+
+    // Householder reduction to tridiagonal form (tred2)
+    for (int j = 0; j < n; j++)
+        d[j] = V(n-1, j);
+    for (int i = n-1; i > 0; i--)
+    {
+        scale = 0;
+        h = 0;
+        for (int k = 0; k < i; k++)
+            scale += fabs(d[k]);
+        if (scale == 0)
+        {
+            e[i] = d[i-1];
+            for (int j = 0; j < i; j++)
+            {
+                d[j] = V(i-1, j);
+                V(i, j) = 0;
+                V(j, i) = 0;
+            }
+        }
+        else
+        {
+            for (int k = 0; k < i; k++)
+            {
+                d[k] /= scale;
+                h += d[k] * d[k];
+            }
+            f = d[i-1];
+            g = sqrt(h);
+            if (f > 0)
+                g = -g;
+            e[i] = scale * g;
+            h = h - f * g;
+            d[i-1] = f - g;
+            for (int j = 0; j < i; j++)
+                e[j] = 0;
+            for (int j = 0; j < i; j++)
+            {
+                f = d[j];
+                V(j, i) = f;
+                g = e[j] + V(j, j) * f;
+                for (int k = j+1; k <= i-1; k++)
+                {
+                    g += V(k, j) * d[k];
+                    e[k] += V(k, j) * f;
+                }
+                e[j] = g;
+            }
+            f = 0;
+            for (int j = 0; j < i; j++)
+            {
+                e[j] /= h;
+                f += e[j] * d[j];
+            }
+            hh = f / (h + h);
+            for (int j = 0; j < i; j++)
+                e[j] -= hh * d[j];
+            for (int j = 0; j < i; j++)
+            {
+                f = d[j];
+                g = e[j];
+                for (int k = j; k <= i-1; k++)
+                    V(k, j) -= (f * e[k] + g * d[k]);
+                d[j] = V(i-1, j);
+                V(i, j) = 0;
+            }
+        }
+        d[i] = h;
+    }
+    for (int i = 0; i < n-1; i++)
+    {
+        V(n-1, i) = V(i, i);
+        V(i, i) = 1;
+        h = d[i+1];
+        if (h != 0)
+        {
+            for (int k = 0; k <= i; k++)
+                d[k] = V(k, i+1) / h;
+            for (int j = 0; j <= i; j++)
+            {
+                g = 0;
+                for (int k = 0; k <= i; k++)
+                    g += V(k, i+1) * V(k, j);
+                for (int k = 0; k <= i; k++)
+                    V(k, j) -= g * d[k];
+            }
+        }
+        for (int k = 0; k <= i; k++)
+            V(k, i+1) = 0;
+    }
+    for (int j = 0; j < n; j++)
+    {
+        d[j] = V(n-1, j);
+        V(n-1, j) = 0;
+    }
+    V(n-1, n-1) = 1;
+
+    // implicit QL on the tridiagonal matrix (tql2)
+    for (int i = 1; i < n; i++)
+        e[i-1] = e[i];
+    e[n-1] = 0;
+    f = 0;
+    for (int l = 0; l < n; l++)
+    {
+        int m = l;
+
+        tst1 = fmax(tst1, fabs(d[l]) + fabs(e[l]));
+        while (m < n-1 && fabs(e[m]) > eps * tst1)
+            m++;
+        if (m > l)
+        {
+            do
+            {
+                g = d[l];
+                p = (d[l+1] - g) / (2 * e[l]);
+                r = hypot(p, 1.0);
+                if (p < 0)
+                    r = -r;
+                d[l] = e[l] / (p + r);
+                d[l+1] = e[l] * (p + r);
+                dl1 = d[l+1];
+                h = g - d[l];
+                for (int i = l+2; i < n; i++)
+                    d[i] -= h;
+                f += h;
+
+                p = d[m];
+                c = 1;
+                c2 = c;
+                c3 = c;
+                el1 = e[l+1];
+                s = 0;
+                s2 = 0;
+                for (int i = m-1; i >= l; i--)
+                {
+                    c3 = c2;
+                    c2 = c;
+                    s2 = s;
+                    g = c * e[i];
+                    h = c * p;
+                    r = hypot(p, e[i]);
+                    e[i+1] = s * r;
+                    s = e[i] / r;
+                    c = p / r;
+                    p = c * d[i] - s * g;
+                    d[i+1] = h + s * (c * g + s * d[i]);
+                    for (int k = first; k < n; k++)
+                    {
+                        h = V(k, i+1);
+                        V(k, i+1) = s * V(k, i) + c * h;
+                        V(k, i) = c * V(k, i) - s * h;
+                    }
+                }
+                p = -s * s2 * c3 * el1 * e[l] / dl1;
+                e[l] = s * p;
+                d[l] = c * p;
+            }
+            while (fabs(e[l]) > eps * tst1);
+        }
+        d[l] = d[l] + f;
+        e[l] = 0;
+    }
+
+    // the largest magnitudes first
+    for (int i = 0; i < n-1; i++)
+    {
+        int k = i;
+        for (int j = i+1; j < n; j++)
+            if (fabs(d[j]) > fabs(d[k]))
+                k = j;
+        if (k != i)
+        {
+            p = d[k];
+            d[k] = d[i];
+            d[i] = p;
+            for (int j = 0; j < n; j++)
+            {
+                p = V(j, i);
+                V(j, i) = V(j, k);
+                V(j, k) = p;
+            }
+        }
+    }
+    #undef V
+    free(e);
+}
 
 void checkCardVersion()
 {
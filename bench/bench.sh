@@ -0,0 +1,267 @@
+#!/bin/sh
+#
+# bench.sh
+# Strong and weak scaling study of the SOR and CG Poisson solvers (1/),
+# the FEM CG solver (2/) and the GPU power method (3/)
+#
+# usage: bench/bench.sh [-s solvers] [-n sizes] [-p grids] [-g sizes]
+#                       [-m strong|weak|both] [-i iterations]
+#                       [-w warmups] [-r repetitions] [-o directory]
+#
+#   -s  solvers to run, out of "sor cg fem gpu"         (default "sor cg fem")
+#   -n  grid sizes; the global nx = ny for strong scaling,
+#       points per process and direction for weak scaling (default "200")
+#   -p  process grids PxxPy                     (default "1x1 2x1 2x2")
+#   -g  GPU matrix sizes N                      (default "2000 5000")
+#   -m  which tables to make                    (default both)
+#   -i  iterations per run, the precision goal is 1e-300 so every run
+#       does exactly this many                  (default 200)
+#   -w  warm-up runs per point, not recorded    (default 1)
+#   -r  recorded runs per point                 (default 3)
+#   -o  results directory                       (default bench/results)
+#
+# MPIRUN is the launcher the process count is appended to, e.g.
+# MPIRUN="srun -n" on the cluster (default "mpirun -np").
+# OMP_NUM_THREADS is passed on unchanged; set BUILD_FLAGS="-O2 -fopenmp"
+# for hybrid runs.
+#
+# The solvers build with make (1/, 2/) or nvcc (3/), GridDist partitions
+# are made on demand under <directory>/parts and reused.  Every run goes
+# with "profile: none" so rank 0 prints the profile table; the kernel
+# time is the slowest rank's compute phase, the solve time follows from
+# the printed iterations per second.  All runs are in <directory>/runs.csv,
+# the tables (fastest of the recorded runs) in strong.txt and weak.txt.
+#
+# GFLOP/s and GB/s follow from a fixed count per grid point (per matrix
+# element for the GPU) and iteration, see Kernel_Counts below; they are
+# a model of the minimal work and traffic, not hardware counter values.
+#
+
+R=$(cd "$(dirname "$0")/.." && pwd)
+MPIRUN=${MPIRUN:-mpirun -np}
+BUILD_FLAGS=${BUILD_FLAGS:--O2}
+
+solvers="sor cg fem"
+sizes="200"
+grids="1x1 2x1 2x2"
+gpu_sizes="2000 5000"
+mode=both
+iters=200
+warmups=1
+reps=3
+out=$R/bench/results
+
+while getopts s:n:p:g:m:i:w:r:o: opt
+do
+  case $opt in
+    s) solvers=$OPTARG ;;
+    n) sizes=$OPTARG ;;
+    p) grids=$OPTARG ;;
+    g) gpu_sizes=$OPTARG ;;
+    m) mode=$OPTARG ;;
+    i) iters=$OPTARG ;;
+    w) warmups=$OPTARG ;;
+    r) reps=$OPTARG ;;
+    o) out=$OPTARG ;;
+    *) sed -n '7,21p' "$0"; exit 1 ;;
+  esac
+done
+
+case $mode in
+  strong) scalings=strong ;;
+  weak) scalings=weak ;;
+  both) scalings="strong weak" ;;
+  *) echo "bench.sh : unknown mode '$mode', use strong, weak or both"; exit 1 ;;
+esac
+
+mkdir -p "$out/parts" "$out/work" || exit 1
+runs=$out/runs.csv
+echo "scaling,solver,px,py,nx,ny,rep,iterations,kernel_s,solve_s,flops,bytes" > "$runs"
+
+# Kernel_Counts solver
+# flops and bytes per grid point (matrix element for gpu) per iteration:
+#   sor  red-black update and error:  sum of 4 neighbours, scale, relax,
+#        |change| -> 9 flops; phi read + write, source mask -> 24 B
+#   cg   5-point A*p 6, two dots 4, three axpys 6 -> 16 flops;
+#        A*p with p'v 16 B, x and r updates with r'r 48, p update 24 -> 88 B
+#   fem  CSR row of 7 (12 B each) + x + y -> 14 flops, 100 B;
+#        vector work as cg -> 10 flops, 72 B
+#   gpu  fp32 GEMV -> 2 flops, 4 B (vectors stay in cache)
+Kernel_Counts()
+{
+  case $1 in
+    sor) echo "9 24" ;;
+    cg)  echo "16 88" ;;
+    fem) echo "24 172" ;;
+    gpu) echo "2 4" ;;
+  esac
+}
+
+Build()
+{
+  for s in $solvers
+  do
+    case $s in
+      sor|cg) make -s -C "$R/1" MP_FLAGS="$BUILD_FLAGS" MPI_Poisson MPI_Poisson_SOR || exit 1 ;;
+      fem) make -s -C "$R/2" FP_FLAGS="$BUILD_FLAGS" GD_FLAGS="$BUILD_FLAGS" || exit 1 ;;
+      gpu)
+        if command -v nvcc > /dev/null
+        then
+          nvcc -O3 -Xcompiler "-fopenmp -O3 -march=native" -o "$R/3/power_gpu" "$R/3/power_gpu.cu" || exit 1
+        else
+          echo "bench.sh : nvcc not found, skipping gpu"
+          solvers=$(echo $solvers | sed 's/gpu//')
+        fi ;;
+      *) echo "bench.sh : unknown solver '$s', use sor, cg, fem or gpu"; exit 1 ;;
+    esac
+  done
+}
+
+# Write_Input solver nx ny
+Write_Input()
+{
+  case $1 in
+    sor|cg)
+      printf "nx: %i\nny: %i\nprecision goal: 1e-300\nmax iterations: %i\n" $2 $3 $iters
+      grep "^source:" "$R/1/input.dat"
+      echo "output format: binary" ;;
+    fem)
+      printf "precision goal: 1e-300\nmax iterations: %i\n" $iters
+      echo "output format: binary" ;;
+  esac
+}
+
+# Partition px py nx ny : prints the directory holding the GridDist files
+Partition()
+{
+  d=$out/parts/$1x$2-$3x$4
+  if [ ! -f "$d/input$(($1 * $2))-0.dat" ]
+  then
+    mkdir -p "$d"
+    cp "$R/2/sources.dat" "$d"
+    (cd "$d" && "$R/2/GridDist" $1 $2 $3 $4 > /dev/null) || exit 1
+  fi
+  echo "$d"
+}
+
+# Run solver px py nx ny : prints "iterations kernel_s solve_s", nothing on failure
+Run()
+{
+  w=$out/work
+  rm -f "$w"/*
+  case $1 in
+    sor) cmd="$R/1/MPI_Poisson_SOR $2 $3" ;;
+    cg)  cmd="$R/1/MPI_Poisson $2 $3" ;;
+    fem) cp "$(Partition $2 $3 $4 $5)"/*.dat "$w"; cmd="$R/2/MPI_Fempois" ;;
+  esac
+  Write_Input $1 $4 $5 > "$w/input.dat"
+  (cd "$w" && $MPIRUN $(($2 * $3)) $cmd 2>&1) |
+    awk '$1 == "Profile" && $4 == "iterations," { it = $3; rate = $5 }
+         $1 == "Profile" && $3 == "compute" { kernel = $8 }
+         END { if (rate > 0) printf "%i %.9f %.9f\n", it, kernel, it / rate }'
+}
+
+# Run_GPU n : prints "iterations kernel_s solve_s"
+Run_GPU()
+{
+  "$R/3/power_gpu" --size $1 --max_iteration $iters --cpu none 2>&1 |
+    awk '/^GPU lambda at/ { it++ }
+         /^GPU: memcpy run time/ { setup = $(NF - 1) }
+         /^GPU: run time/ { total = $(NF - 1) }
+         END { if (it > 0) printf "%i %.9f %.9f\n", it, total - setup, total - setup }'
+}
+
+# Measure solver px py nx ny : appends the recorded runs to runs.csv
+Measure()
+{
+  rep=0
+  while [ $rep -lt $(($warmups + $reps)) ]
+  do
+    if [ $1 = gpu ]
+    then
+      res=$(Run_GPU $4)
+    else
+      res=$(Run $1 $2 $3 $4 $5)
+    fi
+    if [ -z "$res" ]
+    then
+      echo "bench.sh : $1 on $2x$3, grid $4x$5 failed"
+      return
+    fi
+    if [ $rep -ge $warmups ]
+    then
+      echo "$scaling,$1,$2,$3,$4,$5,$(($rep - $warmups)),$(echo $res | tr ' ' ','),$(Kernel_Counts $1 | tr ' ' ',')" >> "$runs"
+    fi
+    rep=$(($rep + 1))
+  done
+}
+
+# Table scaling : fastest recorded run per point, relative to the first
+# process grid of the same solver and size
+Table()
+{
+  awk -F, -v scaling=$1 '
+    $1 == scaling {
+      key = $2 "," $3 "," $4 "," $5 "," $6
+      t = $10 / $8
+      if (!(key in best) || t < best[key]) {
+        best[key] = t; it[key] = $8; kern[key] = $9 / $8; fl[key] = $11; by[key] = $12
+      }
+      if (!(key in seen)) { seen[key] = 1; order[n++] = key }
+    }
+    END {
+      printf "%-6s %5s %11s %6s %12s %12s %8s %6s %8s %8s\n", "solver", "PxPy",
+        "grid", "iters", "s/iter", "kernel s/it", "speedup", "eff", "GFLOP/s", "GB/s"
+      for (i = 0; i < n; i++) {
+        split(order[i], k, ",")
+        base = (scaling == "weak" ? k[1] : k[1] "," k[4] "," k[5])
+        np = k[2] * k[3]
+        if (!(base in t0)) { t0[base] = best[order[i]]; p0[base] = np }
+        pts = (k[1] == "gpu" ? k[4] * k[4] : k[4] * k[5])
+        s = t0[base] / best[order[i]]
+        e = (scaling == "weak" ? s : s * p0[base] / np)
+        printf "%-6s %5s %11s %6i %12.3e %12.3e %8.2f %6.2f %8.2f %8.2f\n",
+          k[1], k[2] "x" k[3], k[4] "x" k[5], it[order[i]],
+          best[order[i]], kern[order[i]], s, e,
+          fl[order[i]] * pts / kern[order[i]] * 1e-9,
+          by[order[i]] * pts / kern[order[i]] * 1e-9
+      }
+    }' "$runs"
+}
+
+Build
+
+for scaling in $scalings
+do
+  for s in $solvers
+  do
+    for n in $sizes
+    do
+      if [ $s = gpu ]
+      then
+        continue
+      fi
+      for g in $grids
+      do
+        px=${g%x*}
+        py=${g#*x}
+        if [ $scaling = weak ]
+        then
+          Measure $s $px $py $(($n * $px)) $(($n * $py))
+        else
+          Measure $s $px $py $n $n
+        fi
+      done
+    done
+    if [ $s = gpu ] && [ $scaling = strong ]
+    then
+      for n in $gpu_sizes
+      do
+        Measure gpu 1 1 $n $n
+      done
+    fi
+  done
+  Table $scaling | tee "$out/$scaling.txt"
+done
+
+rm -rf "$out/work"